@@ -71,16 +71,20 @@ unsigned long hash(const char *name)
 conf_opt_t *get_confopt(config_t *conf, const char *name)
 {
     unsigned long h = hash(name);
-    uint32_t optidx = conf->cf_bucket[h % conf->cf_noptions].val;
+    struct bucket *bucket = &conf->cf_bucket[h % conf->cf_noptions];
 
-    while (strcmp(name, conf->cf_table[optidx].o_name) != 0) {
-        if (optidx == (conf->cf_noptions - 1))
-            break;
-        optidx = conf->cf_chain[optidx];
-        h = conf->cf_chain[optidx];
-    }
+    if (!bucket->filled)
+        return NULL;
+
+    // the options with the same hash are chained by cf_chain, the last one
+    // points to itself
+    for (uint32_t optidx = bucket->val; ; optidx = conf->cf_chain[optidx]) {
+        if (strcmp(name, conf->cf_table[optidx].o_name) == 0)
+            return &conf->cf_table[optidx];
 
-    return &conf->cf_table[optidx];
+        if (conf->cf_chain[optidx] == optidx)
+            return NULL;
+    }
 }
 
 //
@@ -112,12 +116,14 @@ void conf_end(config_t *conf)
     for (size_t i = 0; i < conf->cf_noptions; i++) {
         h = hash(conf->cf_table[i].o_name);
 
-        if (!conf->cf_bucket[h % conf->cf_noptions].filled) {
-            conf->cf_bucket[h % conf->cf_noptions].val= i;
-            conf->cf_bucket[h % conf->cf_noptions].filled = 1;
-        }
+        // push it in front of the chain
+        if (conf->cf_bucket[h % conf->cf_noptions].filled)
+            conf->cf_chain[i] = conf->cf_bucket[h % conf->cf_noptions].val;
+        else
+            conf->cf_chain[i] = i;
 
-        conf->cf_chain[conf->cf_bucket[h % conf->cf_noptions].val] = i;
+        conf->cf_bucket[h % conf->cf_noptions].val = i;
+        conf->cf_bucket[h % conf->cf_noptions].filled = 1;
     }
 }
 
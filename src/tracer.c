@@ -68,6 +68,21 @@ void tracer_stop(cpu_state_t *tracer)
     xfree(tracer->backtrace);
 }
 
+void tracer_copy(cpu_state_t *dest, const cpu_state_t *src)
+{
+    if (!dest || !src)
+        return;
+
+    if (dest->backtracesz < src->backtracesz) {
+        dest->backtrace = xreallocarray(dest->backtrace, src->backtracesz, sizeof(*dest->backtrace));
+        dest->backtracesz = src->backtracesz;
+    }
+
+    memcpy(dest->backtrace, src->backtrace, src->backtracesz * sizeof(*src->backtrace));
+    dest->backtraceptr = src->backtraceptr;
+    dest->registers = src->registers;
+}
+
 //
 // set/get the actual trace data
 //
@@ -168,11 +183,18 @@ inline static void add_to_cache(cpu_state_t *tracer, struct symbol_lookup_record
 void tracer_push(cpu_state_t *tracer, moffset32_t vaddr, moffset32_t returnvaddr, reg32_t stackframe)
 {
     size_t st_ptr = 0;
+    struct symbol_lookup_record lookup;
     struct symbol_lookup_record *symbol = NULL;
 
     if (!tracer)
         return;
 
+    // registers are only copied in on demand, so remember where the caller was
+    if (tracer->backtrace[0].st_start && returnvaddr) {
+        backtrace_record_t *caller = &tracer->backtrace[tracer->backtraceptr];
+        caller->st_rel = returnvaddr - caller->st_start;
+    }
+
     // only increment starting at 1
     if (tracer->backtrace[0].st_start)
         st_ptr = ++tracer->backtraceptr;
@@ -197,7 +219,7 @@ void tracer_push(cpu_state_t *tracer, moffset32_t vaddr, moffset32_t returnvaddr
     }
 
     if (!symbol) {
-        struct symbol_lookup_record lookup = sr_lookup(tracer->resolver, vaddr);
+        lookup = sr_lookup(tracer->resolver, vaddr);
 
         if (lookup.sl_start)
             add_to_cache(tracer, lookup);
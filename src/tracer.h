@@ -68,6 +68,8 @@ typedef struct {
 
 void tracer_start(cpu_state_t *, sym_resolver_t *);
 void tracer_stop(cpu_state_t *);
+// make the first tracer a copy of the second, the backtrace is copied too
+void tracer_copy(cpu_state_t *, const cpu_state_t *);
 
 enum TracerVariables {
     TRACE_VAR_EAX,
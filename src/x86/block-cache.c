@@ -0,0 +1,572 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  straight-line runs of decoded instructions (basic blocks) that are
+ *  executed one block at a time instead of one instruction at a time.
+ */
+
+#include <string.h>
+
+#include "../memory.h"
+
+#include "block-cache.h"
+#include "cpu.h"
+#include "disassembler.h"
+#include "fusion.h"
+#include "jit.h"
+#include "specialize.h"
+
+static _Bool ends_block(d_x86_instruction_handler);
+static uint8_t inline_kind(struct block_op *);
+static x86Block *translate_block(x86CPU *, moffset32_t);
+static _Bool block_current(x86MMU *, x86Block *);
+static void drop_block(x86BlockCache *, x86Block *);
+static x86Block *lookup_modified(x86CPU *, moffset32_t);
+static void thread_block(x86Block *, const void *const *);
+
+#define bucket(vaddr) (    ((vaddr) ^ ((vaddr) >> 12)) & (BCACHE_BUCKETS - 1)    )
+
+//
+// Initialization/cleanup
+//
+
+void bcache_init(x86BlockCache *cache)
+{
+    if (!cache)
+        return;
+
+    cache->bc_buckets = xcalloc(BCACHE_BUCKETS, sizeof(*cache->bc_buckets));
+    cache->bc_fuse = 1;
+    cache->bc_profile = 0;
+}
+
+void bcache_free(x86BlockCache *cache)
+{
+    if (!cache)
+        return;
+
+    bcache_flush(cache);
+    xfree(cache->bc_buckets);
+    cache->bc_buckets = NULL;
+}
+
+void bcache_flush(x86BlockCache *cache)
+{
+    if (!cache || !cache->bc_buckets)
+        return;
+
+    for (size_t i = 0; i < BCACHE_BUCKETS; i++) {
+        x86Block *block = cache->bc_buckets[i];
+
+        while (block) {
+            x86Block *next = block->b_next;
+            xfree(block);
+            block = next;
+        }
+
+        cache->bc_buckets[i] = NULL;
+    }
+}
+
+// free a block that went stale, nothing may jump to it anymore
+static void drop_block(x86BlockCache *cache, x86Block *block)
+{
+    x86Block **link = &cache->bc_buckets[bucket(block->b_start)];
+
+    while (*link != block)
+        link = &(*link)->b_next;
+    *link = block->b_next;
+
+    for (size_t i = 0; i < BCACHE_BUCKETS; i++) {
+        for (x86Block *other = cache->bc_buckets[i]; other; other = other->b_next) {
+            if (other->b_taken == block)
+                other->b_taken = NULL;
+            if (other->b_fallthrough == block)
+                other->b_fallthrough = NULL;
+        }
+    }
+
+    xfree(block);
+}
+
+//
+// Translation
+//
+
+inline static _Bool ends_block(d_x86_instruction_handler handler)
+{
+    return handler == x86_mm_jcc || handler == x86_mm_jmp || handler == x86_mm_call
+        || handler == x86_mm_ret || handler == x86_loopcc || handler == x86_iret
+        || handler == x86_int || handler == x86_int0 || handler == x86_int1
+        || handler == x86_int3 || handler == x86_hlt || handler == x86_syscall
+        || handler == x86_sysenter || handler == x86_sysexit || handler == x86_sysret
+        || handler == x86_ud0 || handler == x86_ud1 || handler == x86_ud2;
+}
+
+#define simm8(imm) (    (uint32_t)(int8_t)lsb(imm)    )
+
+// the kind of the operations x86_block_run() does itself, BOP_EXEC for the rest
+static uint8_t inline_kind(struct block_op *op)
+{
+    d_x86_instruction_handler handler = op->bo_handler;
+    struct exec_data *data = &op->bo_data;
+
+    if (handler == x86_sp_mov_r32_r32) return BOP_MOV_RR;
+    if (handler == x86_sp_mov_r32_m32) return BOP_MOV_RM;
+    if (handler == x86_sp_mov_m32_r32) return BOP_MOV_MR;
+    if (handler == x86_sp_lea_r32_m) return BOP_LEA;
+    if (handler == x86_sp_push_r32) return BOP_PUSH;
+    if (handler == x86_sp_pop_r32) return BOP_POP;
+    if (handler == x86_sp_add_r32_r32) return BOP_ADD_RR;
+    if (handler == x86_sp_sub_r32_r32) return BOP_SUB_RR;
+    if (handler == x86_sp_and_r32_r32) return BOP_AND_RR;
+    if (handler == x86_sp_xor_r32_r32) return BOP_XOR_RR;
+    if (handler == x86_sp_cmp_r32_r32) return BOP_CMP_RR;
+    if (handler == x86_sp_test_r32_r32) return BOP_TEST_RR;
+    if (handler == x86_fu_xor_zero_r32) return BOP_XOR_ZERO;
+    if (handler == x86_fu_cmp_r32_r32_jcc) return BOP_CMP_RR_JCC;
+    if (handler == x86_fu_cmp_r32_imm32_jcc) return BOP_CMP_RI_JCC;
+    if (handler == x86_fu_test_r32_r32_jcc) return BOP_TEST_RR_JCC;
+    if (handler == x86_fu_test_r32_imm32_jcc) return BOP_TEST_RI_JCC;
+
+    if (handler == x86_sp_mov_r32_imm32) {
+        data->imm2 = data->imm1;
+        return BOP_MOV_RI;
+    }
+
+    if (handler == x86_sp_add_r32_imm32 || handler == x86_sp_add_r32_imm8) {
+        data->imm2 = handler == x86_sp_add_r32_imm8 ? simm8(data->imm1) : data->imm1;
+        return BOP_ADD_RI;
+    }
+
+    if (handler == x86_sp_sub_r32_imm32 || handler == x86_sp_sub_r32_imm8) {
+        data->imm2 = handler == x86_sp_sub_r32_imm8 ? simm8(data->imm1) : data->imm1;
+        return BOP_SUB_RI;
+    }
+
+    if (handler == x86_sp_and_r32_imm32 || handler == x86_sp_and_r32_imm8) {
+        data->imm2 = handler == x86_sp_and_r32_imm8 ? simm8(data->imm1) : data->imm1;
+        return BOP_AND_RI;
+    }
+
+    if (handler == x86_sp_xor_r32_imm32 || handler == x86_sp_xor_r32_imm8) {
+        data->imm2 = handler == x86_sp_xor_r32_imm8 ? simm8(data->imm1) : data->imm1;
+        return BOP_XOR_RI;
+    }
+
+    if (handler == x86_sp_cmp_r32_imm32 || handler == x86_sp_cmp_r32_imm8) {
+        data->imm2 = handler == x86_sp_cmp_r32_imm8 ? simm8(data->imm1) : data->imm1;
+        return BOP_CMP_RI;
+    }
+
+    if (handler == x86_sp_test_r32_imm32) {
+        data->imm2 = data->imm1;
+        return BOP_TEST_RI;
+    }
+
+    return BOP_EXEC;
+}
+
+static x86Block *translate_block(x86CPU *cpu, moffset32_t start)
+{
+    struct block_op ops[BLOCK_MAX_INSTRUCTIONS];
+    struct instruction ins;
+    x86BlockCache *cache = &cpu->bcache;
+    const char *previous = NULL;
+    moffset32_t eip = start;
+    size_t nops = 0;
+    uint32_t codegen = mmu_codegen(x86_mmu(cpu));
+    x86Block *block;
+
+    while (nops < BLOCK_MAX_INSTRUCTIONS) {
+        // leave unmapped memory to be reported when (and if) we get there
+        if (nops && !x86_getptr(cpu, eip))
+            break;
+
+        ins = x86_decode(cpu, eip);
+
+        if (mmu_error(x86_mmu(cpu)))
+            x86_raise_exception_d(cpu, INT_PF, eip, mmu_errstr(x86_mmu(cpu)));
+
+        if (ins.fail_to_fetch) {
+            // the instructions before it still have to run
+            if (nops)
+                break;
+            x86_raise_exception(cpu, INT_UD);
+        }
+
+        ops[nops].bo_kind = BOP_EXEC;
+        ops[nops].bo_label = NULL;
+        ops[nops].bo_handler = ins.handler;
+        ops[nops].bo_data = ins.data;
+        ops[nops].bo_size = ins.size;
+
+        if (cache->bc_profile && previous) {
+            ops[nops].bo_kind = BOP_PROFILE;
+            ops[nops].bo_pair = fusion_profile_pair(previous, ins.name);
+        }
+
+        previous = ins.name;
+        nops++;
+
+        mmu_mark_code(x86_mmu(cpu), eip);
+        mmu_mark_code(x86_mmu(cpu), eip + ins.size - 1);
+        eip += ins.size;
+
+        if (ends_block(ins.handler))
+            break;
+    }
+
+    // the profile is about the instructions as they are in the program
+    if (cache->bc_fuse && !cache->bc_profile)
+        nops = x86_fuse_ops(ops, nops);
+
+    for (size_t i = 0; i < nops; i++) {
+        if (ops[i].bo_kind == BOP_EXEC)
+            ops[i].bo_kind = inline_kind(&ops[i]);
+    }
+
+    block = xcalloc(1, sizeof(*block) + (nops + 1) * sizeof(*block->b_ops));
+    block->b_start = start;
+    block->b_end = eip;
+    block->b_codegen = codegen;
+    block->b_nops = nops;
+    memcpy(block->b_ops, ops, nops * sizeof(*block->b_ops));
+    block->b_ops[nops].bo_kind = BOP_END;
+
+    block->b_next = cache->bc_buckets[bucket(start)];
+    cache->bc_buckets[bucket(start)] = block;
+
+    return block;
+}
+
+// returns 0 if the code the block was decoded from was written to
+inline static _Bool block_current(x86MMU *mmu, x86Block *block)
+{
+    if (block->b_codegen == mmu_codegen(mmu))
+        return 1;
+
+    // code was written to, but maybe not this one
+    if (mmu_code_changed(mmu, block->b_start, block->b_end, block->b_codegen))
+        return 0;
+
+    block->b_codegen = mmu_codegen(mmu);
+    return 1;
+}
+
+x86Block *x86_block_lookup(void *cpu, moffset32_t vaddr)
+{
+    x86BlockCache *cache;
+
+    if (!cpu)
+        return NULL;
+
+    cache = &((x86CPU *)cpu)->bcache;
+
+    for (x86Block *block = cache->bc_buckets[bucket(vaddr)]; block; block = block->b_next) {
+        if (block->b_start != vaddr)
+            continue;
+
+        if (block_current(x86_mmu(cpu), block))
+            return block;
+
+        drop_block(cache, block);
+        break;
+    }
+
+    return translate_block(cpu, vaddr);
+}
+
+// the last block wrote to code, the caller must not use it anymore
+static x86Block *lookup_modified(x86CPU *cpu, moffset32_t vaddr)
+{
+    // the host code of the blocks that went stale is still in the arena,
+    // start over once it is full of them
+    if (jit_full(&cpu->jit)) {
+        bcache_flush(&cpu->bcache);
+        jit_reset(&cpu->jit);
+    }
+
+    return x86_block_lookup(cpu, vaddr);
+}
+
+//
+// Execution
+//
+
+// labels can only be taken inside x86_block_run(), so the operations get them
+// there, the first time the block runs
+static void thread_block(x86Block *block, const void *const *labels)
+{
+    for (size_t i = 0; i <= block->b_nops; i++)
+        block->b_ops[i].bo_label = labels[block->b_ops[i].bo_kind];
+}
+
+// threaded dispatch: each operation ends with its own indirect jump to the
+// code of the next one (labels as values, a GCC extension), so every one of
+// them is a separate branch to be predicted. The common operations are done
+// right here, only the rest goes through the handler, from a single site.
+#define DISPATCH() goto *op->bo_label
+#define NEXT() do { op++; DISPATCH(); } while (0)
+
+#define DEST (    c->gpr[op->bo_data.reg1]    )
+#define SRC (    c->gpr[op->bo_data.reg2]    )
+#define ea32() x86_effectiveaddress32(c, op->bo_data.modrm, op->bo_data.sib, op->bo_data.moffset, op->bo_data.segovr)
+
+// dest = dest op src, with the flags of the operation
+#define ALU_OP(b_label, b_lf, b_op, b_src)                                      \
+    b_label: {                                                                  \
+        uint32_t a = DEST, b = (b_src);                                         \
+                                                                                \
+        c->EIP += op->bo_size;                                                  \
+        DEST = a b_op b;                                                        \
+        if ((b_lf) == LF_LOGIC)                                                 \
+            x86_lazyflags(c, LF_LOGIC, 32, 0, 0, DEST);                         \
+        else                                                                    \
+            x86_lazyflags(c, (b_lf), 32, a, b, DEST);                           \
+        NEXT();                                                                 \
+    }
+
+// cmp/test, only the flags are written
+#define FLAGS_OP(b_label, b_lf, b_op, b_src)                                    \
+    b_label: {                                                                  \
+        uint32_t a = DEST, b = (b_src);                                         \
+                                                                                \
+        c->EIP += op->bo_size;                                                  \
+        if ((b_lf) == LF_LOGIC)                                                 \
+            x86_lazyflags(c, LF_LOGIC, 32, 0, 0, a b_op b);                     \
+        else                                                                    \
+            x86_lazyflags(c, (b_lf), 32, a, b, a b_op b);                       \
+        NEXT();                                                                 \
+    }
+
+// a fused cmp/test and jcc, the jcc always ends the block
+#define FLAGS_JCC_OP(b_label, b_lf, b_op, b_src)                                \
+    b_label: {                                                                  \
+        uint32_t a = DEST, b = (b_src);                                         \
+        _Bool taken;                                                            \
+                                                                                \
+        c->EIP += op->bo_size;                                                  \
+        if ((b_lf) == LF_LOGIC) {                                               \
+            x86_lazyflags(c, LF_LOGIC, 32, 0, 0, a b_op b);                     \
+            taken = fusion_cc_logic(op->bo_data.ext, a b_op b);                 \
+        } else {                                                                \
+            x86_lazyflags(c, (b_lf), 32, a, b, a b_op b);                       \
+            taken = fusion_cc_sub(op->bo_data.ext, a, b);                       \
+        }                                                                       \
+        if (taken)                                                              \
+            c->EIP += op->bo_data.imm1;                                         \
+        goto op_end;                                                            \
+    }
+
+void x86_block_run(void *cpu, x86Block *block)
+{
+    static const void *const labels[BOP_NKINDS] = {
+        [BOP_EXEC] = &&op_exec,
+        [BOP_PROFILE] = &&op_profile,
+        [BOP_END] = &&op_end,
+        [BOP_MOV_RR] = &&op_mov_rr,
+        [BOP_MOV_RI] = &&op_mov_ri,
+        [BOP_MOV_RM] = &&op_mov_rm,
+        [BOP_MOV_MR] = &&op_mov_mr,
+        [BOP_LEA] = &&op_lea,
+        [BOP_PUSH] = &&op_push,
+        [BOP_POP] = &&op_pop,
+        [BOP_ADD_RR] = &&op_add_rr,
+        [BOP_ADD_RI] = &&op_add_ri,
+        [BOP_SUB_RR] = &&op_sub_rr,
+        [BOP_SUB_RI] = &&op_sub_ri,
+        [BOP_AND_RR] = &&op_and_rr,
+        [BOP_AND_RI] = &&op_and_ri,
+        [BOP_XOR_RR] = &&op_xor_rr,
+        [BOP_XOR_RI] = &&op_xor_ri,
+        [BOP_XOR_ZERO] = &&op_xor_zero,
+        [BOP_CMP_RR] = &&op_cmp_rr,
+        [BOP_CMP_RI] = &&op_cmp_ri,
+        [BOP_TEST_RR] = &&op_test_rr,
+        [BOP_TEST_RI] = &&op_test_ri,
+        [BOP_CMP_RR_JCC] = &&op_cmp_rr_jcc,
+        [BOP_CMP_RI_JCC] = &&op_cmp_ri_jcc,
+        [BOP_TEST_RR_JCC] = &&op_test_rr_jcc,
+        [BOP_TEST_RI_JCC] = &&op_test_ri_jcc
+    };
+    x86CPU *c = cpu;
+    x86MMU *mmu;
+    struct block_op *op;
+    uint32_t codegen;
+    moffset32_t eip;
+    x86Block *next;
+
+    if (!cpu || !block)
+        return;
+
+    mmu = x86_mmu(cpu);
+
+enter_block:
+    codegen = mmu_codegen(mmu);
+
+    if (block->b_native) {
+        // the block wrote to code
+        if (block->b_native(cpu)) {
+            block = lookup_modified(cpu, x86_readR32(cpu, EIP));
+            goto enter_block;
+        }
+
+        goto op_end;
+    }
+
+    if (++block->b_runs == JIT_THRESHOLD) {
+        block->b_native = x86_jit_compile(cpu, block);
+        if (block->b_native)
+            goto enter_block;
+
+        // no room left in the arena. Nothing translated is running right
+        // now, so start over and let the blocks that are still hot get
+        // translated again.
+        if (jit_full(&c->jit)) {
+            eip = block->b_start;
+            bcache_flush(&c->bcache);
+            jit_reset(&c->jit);
+            block = x86_block_lookup(cpu, eip);
+            goto enter_block;
+        }
+    }
+
+    if (!block->b_ops[0].bo_label)
+        thread_block(block, labels);
+
+    op = block->b_ops;
+    DISPATCH();
+
+op_profile:
+    fusion_profile_count(op->bo_pair);
+
+op_exec:
+    eip = x86_readR32(cpu, EIP) + op->bo_size;
+    x86_increment_eip(cpu, op->bo_size);
+
+    op->bo_handler(cpu, op->bo_data);
+
+    // the instruction wrote to code, this block itself might be stale
+    if (mmu_codegen(mmu) != codegen) {
+        block = lookup_modified(cpu, x86_readR32(cpu, EIP));
+        goto enter_block;
+    }
+
+    // something other than the last instruction changed the control flow
+    if (x86_readR32(cpu, EIP) != eip)
+        goto op_end;
+
+    NEXT();
+
+op_mov_rr:
+    c->EIP += op->bo_size;
+    DEST = SRC;
+    NEXT();
+
+op_mov_ri:
+    c->EIP += op->bo_size;
+    DEST = op->bo_data.imm2;
+    NEXT();
+
+op_mov_rm:
+    c->EIP += op->bo_size;
+    DEST = x86_readM32(c, ea32());
+    NEXT();
+
+op_lea:
+    c->EIP += op->bo_size;
+    DEST = ea32();
+    NEXT();
+
+op_pop:
+    c->EIP += op->bo_size;
+    DEST = x86_readM32(c, c->ESP);
+    c->ESP += 4;
+    NEXT();
+
+    // the writes might hit the code of this block
+op_mov_mr:
+    c->EIP += op->bo_size;
+    x86_writeM32(c, ea32(), SRC);
+    if (mmu_codegen(mmu) != codegen)
+        goto op_modified;
+    NEXT();
+
+op_push:
+    c->EIP += op->bo_size;
+    x86_writeM32(c, c->ESP - 4, DEST);
+    c->ESP -= 4;
+    if (mmu_codegen(mmu) != codegen)
+        goto op_modified;
+    NEXT();
+
+op_xor_zero:
+    c->EIP += op->bo_size;
+    DEST = 0;
+    x86_lazyflags(c, LF_LOGIC, 32, 0, 0, 0);
+    NEXT();
+
+    ALU_OP(op_add_rr, LF_ADD, +, SRC)
+    ALU_OP(op_add_ri, LF_ADD, +, op->bo_data.imm2)
+    ALU_OP(op_sub_rr, LF_SUB, -, SRC)
+    ALU_OP(op_sub_ri, LF_SUB, -, op->bo_data.imm2)
+    ALU_OP(op_and_rr, LF_LOGIC, &, SRC)
+    ALU_OP(op_and_ri, LF_LOGIC, &, op->bo_data.imm2)
+    ALU_OP(op_xor_rr, LF_LOGIC, ^, SRC)
+    ALU_OP(op_xor_ri, LF_LOGIC, ^, op->bo_data.imm2)
+    FLAGS_OP(op_cmp_rr, LF_SUB, -, SRC)
+    FLAGS_OP(op_cmp_ri, LF_SUB, -, op->bo_data.imm2)
+    FLAGS_OP(op_test_rr, LF_LOGIC, &, SRC)
+    FLAGS_OP(op_test_ri, LF_LOGIC, &, op->bo_data.imm2)
+    FLAGS_JCC_OP(op_cmp_rr_jcc, LF_SUB, -, SRC)
+    FLAGS_JCC_OP(op_cmp_ri_jcc, LF_SUB, -, op->bo_data.imm2)
+    FLAGS_JCC_OP(op_test_rr_jcc, LF_LOGIC, &, SRC)
+    FLAGS_JCC_OP(op_test_ri_jcc, LF_LOGIC, &, op->bo_data.imm2)
+
+op_modified:
+    block = lookup_modified(cpu, x86_readR32(cpu, EIP));
+    goto enter_block;
+
+op_end:
+    eip = x86_readR32(cpu, EIP);
+
+    if (block->b_taken && block->b_taken->b_start == eip && block_current(mmu, block->b_taken)) {
+        block = block->b_taken;
+        goto enter_block;
+    }
+
+    if (block->b_fallthrough && block->b_fallthrough->b_start == eip
+            && block_current(mmu, block->b_fallthrough)) {
+        block = block->b_fallthrough;
+        goto enter_block;
+    }
+
+    next = x86_block_lookup(cpu, eip);
+
+    if (eip == block->b_end)
+        block->b_fallthrough = next;
+    else
+        block->b_taken = next;
+
+    block = next;
+    goto enter_block;
+}
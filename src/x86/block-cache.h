@@ -0,0 +1,126 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  straight-line runs of decoded instructions (basic blocks) that are
+ *  executed one block at a time instead of one instruction at a time.
+ */
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+
+#include "../types.h"
+#include "instructions.h"
+
+// must be a power of two
+#define BCACHE_BUCKETS 4096
+#define BLOCK_MAX_INSTRUCTIONS 64
+
+enum BlockOpKinds {
+    BOP_EXEC,   // run the handler
+    BOP_PROFILE,    // count the pair bo_pair then run the handler
+    BOP_END,    // leave the block
+
+    // done by x86_block_run() itself, the handler is only kept for the JIT.
+    // The immediate of the _RI forms is in data.imm2, already sign extended.
+    BOP_MOV_RR,
+    BOP_MOV_RI,
+    BOP_MOV_RM,
+    BOP_MOV_MR,
+    BOP_LEA,
+    BOP_PUSH,
+    BOP_POP,
+    BOP_ADD_RR,
+    BOP_ADD_RI,
+    BOP_SUB_RR,
+    BOP_SUB_RI,
+    BOP_AND_RR,
+    BOP_AND_RI,
+    BOP_XOR_RR,
+    BOP_XOR_RI,
+    BOP_XOR_ZERO,
+    BOP_CMP_RR,
+    BOP_CMP_RI,
+    BOP_TEST_RR,
+    BOP_TEST_RI,
+    BOP_CMP_RR_JCC,
+    BOP_CMP_RI_JCC,
+    BOP_TEST_RR_JCC,
+    BOP_TEST_RI_JCC,
+    BOP_NKINDS
+};
+
+struct block_op {
+    uint8_t bo_kind;
+    // the code in x86_block_run() for bo_kind, set the first time the block runs
+    const void *bo_label;
+    d_x86_instruction_handler bo_handler;
+    struct exec_data bo_data;
+    uint8_t bo_size;
+
+    // the pair formed with the previous operation in the profile, see fusion.h
+    uint32_t bo_pair;
+};
+
+typedef struct x86Block {
+    moffset32_t b_start;
+    moffset32_t b_end;      // address right after the last instruction
+
+    // the blocks executed after this one, filled the first time we leave it.
+    // b_taken is whatever the last instruction jumped to (for a ret or a
+    // indirect jmp it is just the last target seen)
+    struct x86Block *b_taken;
+    struct x86Block *b_fallthrough;
+
+    struct x86Block *b_next;    // next block in the same bucket
+
+    // the MMU code generation the block was last known to be current in
+    uint32_t b_codegen;
+
+    // the host code for this block, see jit.c
+    int (*b_native)(void *);
+    uint32_t b_runs;
+
+    size_t b_nops;
+    struct block_op b_ops[];    // b_nops operations followed by a BOP_END
+} x86Block;
+
+typedef struct {
+    x86Block **bc_buckets;
+
+    _Bool bc_fuse;      // fuse instruction pairs, see fusion.h
+    _Bool bc_profile;   // count the instruction pairs executed instead
+} x86BlockCache;
+
+void bcache_init(x86BlockCache *);
+void bcache_free(x86BlockCache *);
+
+// free every block
+void bcache_flush(x86BlockCache *);
+
+// find the block starting at the address, decoding it if needed
+x86Block *x86_block_lookup(void *, moffset32_t);
+// execute starting at the block, jumping from one block to the next.
+// Only returns to the caller when the program stops.
+void x86_block_run(void *, x86Block *);
+
+#endif /* BLOCK_CACHE_H */
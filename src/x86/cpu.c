@@ -27,6 +27,17 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <linux/sched.h>     // CLONE_*
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
 
 #include "../memory.h"
 #include "../system.h"
@@ -34,12 +45,46 @@
 #include "cpu.h"
 #include "dbg.h"
 #include "disassembler.h"
+#include "fusion.h"
+#include "snapshot.h"
+#include "syscalls.h"
+#include "vdso.h"
 
 static const char *dl_platform = "uemu_x86";
 
 static uint32_t readMx(x86CPU *cpu, moffset32_t vaddr, int size, _Bool);
 static void writeMx(x86CPU *cpu, moffset32_t vaddr, uint64_t src, int size);
-static void build_environment(x86CPU *, int, char **, char **);
+static void build_environment(x86CPU *, int, char **, char **, moffset32_t, moffset32_t);
+static void flat_fault_handler(int, siginfo_t *, void *);
+static void print_stats(x86CPU *);
+static void *atomic_ptr(x86CPU *, moffset32_t, int);
+static uint64_t atomic_fallback(x86CPU *, moffset32_t, int, int, uint64_t, uint64_t);
+static void cpu_run(x86CPU *);
+static void snapshot_start(x86CPU *);
+static _Bool stdin_pending(void);
+static void *thread_main(void *);
+
+// the configuration option with the host backing policy of every MC_* class
+static const char *backing_options[MC_NCLASSES] = {
+    [MC_TEXT] = "mmu.text",
+    [MC_DATA] = "mmu.data",
+    [MC_HEAP] = "mmu.heap",
+    [MC_STACK] = "mmu.stack"
+};
+
+// resource usage when we started loading the program and when it started running
+static struct rusage load_usage, run_usage;
+
+// the guest threads still running, the process ends with the last one
+static int nthreads = 1;
+
+// the state saved with --snapshot-at and the thread it was taken on. The
+// program starts over from it at snapshot_restart every time it ends.
+static x86Snapshot *snapshot = NULL;
+static x86CPU *snapshot_cpu = NULL;
+static jmp_buf snapshot_restart;
+static unsigned long snapshot_runs = 0;
+static size_t snapshot_copied = 0;     // pages copied back by all the restores
 
 //
 // initialization
@@ -50,7 +95,11 @@ void x86_startcpu(x86CPU *cpu)
         return;
 
     x86_init_opcode_table();
-    mmu_init(&cpu->mmu);
+    cpu->mmu = xcalloc(1, sizeof(*cpu->mmu));
+    mmu_init(cpu->mmu);
+    dcache_init(&cpu->dcache);
+    bcache_init(&cpu->bcache);
+    jit_init(&cpu->jit);
     tracer_start(&cpu->tracer, &cpu->resolver);
 
     cpu->EAX = 0; cpu->ECX = 0; cpu->EDX = 0; cpu->EBX = 0; cpu->ESI = 0;
@@ -63,6 +112,7 @@ void x86_startcpu(x86CPU *cpu)
     cpu->eflags.DF = 0; cpu->eflags.IF = 0; cpu->eflags.TF = 0;
     cpu->eflags.SF = 0; cpu->eflags.ZF = 0; cpu->eflags.AF = 0;
     cpu->eflags.PF = 0; cpu->eflags.CF = 0;
+    cpu->lazyflags.lf_op = LF_NONE;
 
     cpu->eflags_ptr_ = &cpu->eflags;
 
@@ -70,10 +120,26 @@ void x86_startcpu(x86CPU *cpu)
     cpu->sreg_table_[DS] = &cpu->DS; cpu->sreg_table_[ES] = &cpu->ES;
     cpu->sreg_table_[FS] = &cpu->FS; cpu->sreg_table_[GS] = &cpu->GS;
 
+    cpu->clear_child_tid = 0;
+    memset(cpu->tls, 0, sizeof(cpu->tls));
+
     conf_start(x86_conf(cpu));
     conf_add(x86_conf(cpu), "executable", "executable", 0, CONF_TP_STRING, CONF_REQUIRED, CONF_NO_ARG, NULL, 0);
     conf_add(x86_conf(cpu), "dbg.breakpoint", "--break", 0, CONF_TP_HEX, CONF_OPTIONAL, CONF_ARG_REQUIRED, NULL, 0);
     conf_add(x86_conf(cpu), "dbg.singlestep", "--singlestep", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "dbg.trace", "--trace", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "cpu.nojit", "--no-jit", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "mmu.flat", "--flat-mm", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "cpu.nofusion", "--no-fusion", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "cpu.profilepairs", "--profile-pairs", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "cpu.writebehind", "--write-behind", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "cpu.novdso", "--no-vdso", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "cpu.stats", "--stats", 0, CONF_TP_BOOL, CONF_OPTIONAL, CONF_NO_ARG, NULL, 0);
+    conf_add(x86_conf(cpu), "cpu.snapshotat", "--snapshot-at", 0, CONF_TP_HEX, CONF_OPTIONAL, CONF_ARG_REQUIRED, NULL, 0);
+    conf_add(x86_conf(cpu), "mmu.text", "--mm-text", 0, CONF_TP_STRING, CONF_OPTIONAL, CONF_ARG_REQUIRED, NULL, 0);
+    conf_add(x86_conf(cpu), "mmu.data", "--mm-data", 0, CONF_TP_STRING, CONF_OPTIONAL, CONF_ARG_REQUIRED, NULL, 0);
+    conf_add(x86_conf(cpu), "mmu.heap", "--mm-heap", 0, CONF_TP_STRING, CONF_OPTIONAL, CONF_ARG_REQUIRED, NULL, 0);
+    conf_add(x86_conf(cpu), "mmu.stack", "--mm-stack", 0, CONF_TP_STRING, CONF_OPTIONAL, CONF_ARG_REQUIRED, NULL, 0);
     conf_end(x86_conf(cpu));
 }
 
@@ -83,18 +149,64 @@ void x86_stopcpu(x86CPU *cpu)
     if (!cpu)
         return;
 
+    // exit() and the fatal exceptions all end here
+    x86_syscall_flush();
+
+    if (conf_getval(x86_conf(cpu), "cpu.stats"))
+        print_stats(cpu);
+
+    // the other threads run until exit(), leave them what they use
+    if (__atomic_load_n(&nthreads, __ATOMIC_ACQUIRE) > 1)
+        return;
+
+    x86_snapshot_free(cpu, snapshot);
+    snapshot = NULL;
+
     x86_free_opcode_table();
     sr_closecache(x86_resolver(cpu));
     tracer_stop(x86_tracer(cpu));
     conf_freetables(x86_conf(cpu));
     elf_unload(x86_elf(cpu));
     mmu_unloadall(x86_mmu(cpu));
+    xfree(cpu->mmu);
+    dcache_free(&cpu->dcache);
+    bcache_free(&cpu->bcache);
+    jit_free(&cpu->jit);
     xfree(cpu);
 }
 
+// the host backing of every class of mapping and the page faults it led to
+static void print_stats(x86CPU *cpu)
+{
+    struct rusage usage;
+    char policy[64];
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(stderr, "\nhost memory backing:\n");
+
+    for (int i = 0; i < MC_NCLASSES; i++) {
+        mmu_backing_str(x86_mmu(cpu)->mm_backing[i], policy, sizeof(policy));
+        fprintf(stderr, "%14s  %s\n", backing_options[i] + strlen("mmu."), policy);
+    }
+
+    fprintf(stderr, "host page faults:\n");
+    fprintf(stderr, "%14s  %ld minor, %ld major\n", "loading",
+            run_usage.ru_minflt - load_usage.ru_minflt, run_usage.ru_majflt - load_usage.ru_majflt);
+    fprintf(stderr, "%14s  %ld minor, %ld major\n", "running",
+            usage.ru_minflt - run_usage.ru_minflt, usage.ru_majflt - run_usage.ru_majflt);
+
+    if (!snapshot)
+        return;
+
+    fprintf(stderr, "snapshot:\n");
+    fprintf(stderr, "%14s  %lu\n", "runs", snapshot_runs);
+    fprintf(stderr, "%14s  %zu saved, %zu copied back\n", "pages", snapshot->sn_mmu.ms_npages, snapshot_copied);
+}
+
 // exception handling
-static moffset32_t faulty_addr = 0;
-static const char *errstr = NULL;
+static _Thread_local moffset32_t faulty_addr = 0;
+static _Thread_local const char *errstr = NULL;
 
 void x86_raise_exception(x86CPU *cpu, int exct)
 {
@@ -137,6 +249,28 @@ void x86_raise_exception_d(x86CPU *cpu, int exct, moffset32_t fault_addr, const
     x86_raise_exception(cpu, exct);
 }
 
+// in flat mode guest accesses aren't checked, the host tells us when they
+// fault. The signal is delivered to the thread that faulted.
+static _Thread_local x86CPU *flat_cpu = NULL;
+
+static void flat_fault_handler(int sig, siginfo_t *info, void *context)
+{
+    moffset32_t vaddr;
+
+    (void)context;
+
+    if (flat_cpu && mmu_flat_fault(x86_mmu(flat_cpu), info->si_addr, &vaddr)) {
+        // the stack grew, returning retries the access
+        if (!mmu_error(x86_mmu(flat_cpu)))
+            return;
+
+        x86_raise_exception_d(flat_cpu, INT_PF, vaddr, mmu_errstr(x86_mmu(flat_cpu)));
+    }
+
+    // not a guest access, this one is on us
+    signal(sig, SIG_DFL);
+}
+
 ///////////////
 
 
@@ -148,22 +282,26 @@ static uint32_t readMx(x86CPU *cpu, moffset32_t vaddr, int size, _Bool tryread)
     if (!cpu)
         return 0;
 
+    // in flat mode reading unmapped memory faults in the host
+    if (tryread && mmu_isflat(cpu->mmu) && !mmu_getptr(cpu->mmu, vaddr))
+        return 0;
+
     switch (size) {
         case 8:
-            bytes = mmu_read8(&cpu->mmu, vaddr);
+            bytes = mmu_read8(cpu->mmu, vaddr);
             break;
         case 16:
-            bytes = mmu_read16(&cpu->mmu, vaddr);
+            bytes = mmu_read16(cpu->mmu, vaddr);
             break;
         case 32:
-            bytes = mmu_read32(&cpu->mmu, vaddr);
+            bytes = mmu_read32(cpu->mmu, vaddr);
             break;
     }
 
-    if (!tryread && mmu_error(&cpu->mmu))
-        x86_raise_exception_d(cpu, INT_PF, vaddr, mmu_errstr(&cpu->mmu));
+    if (!tryread && mmu_error(cpu->mmu))
+        x86_raise_exception_d(cpu, INT_PF, vaddr, mmu_errstr(cpu->mmu));
 
-    mmu_clrerror(&cpu->mmu);
+    mmu_clrerror(cpu->mmu);
 
     return bytes;
 }
@@ -175,21 +313,21 @@ static void writeMx(x86CPU *cpu, moffset32_t vaddr, uint64_t src, int size)
 
     switch (size) {
         case 8:
-            mmu_write8(&cpu->mmu, src, vaddr);
+            mmu_write8(cpu->mmu, src, vaddr);
             break;
         case 16:
-            mmu_write16(&cpu->mmu, src, vaddr);
+            mmu_write16(cpu->mmu, src, vaddr);
             break;
         case 32:
-            mmu_write32(&cpu->mmu, src, vaddr);
+            mmu_write32(cpu->mmu, src, vaddr);
             break;
         case 64:
-            mmu_write64(&cpu->mmu, src, vaddr);
+            mmu_write64(cpu->mmu, src, vaddr);
             break;
     }
 
-    if (mmu_error(&cpu->mmu))
-        x86_raise_exception_d(cpu, INT_PF, vaddr, mmu_errstr(&cpu->mmu));
+    if (mmu_error(cpu->mmu))
+        x86_raise_exception_d(cpu, INT_PF, vaddr, mmu_errstr(cpu->mmu));
 }
 
 //
@@ -250,7 +388,8 @@ void x86_writeM64(x86CPU * cpu, moffset32_t vaddr, uint64_t bytes)
     writeMx(cpu, vaddr, bytes, 64);
 }
 
-// the atomic versions will be left to be worked on when we start to support processes and threads
+// an aligned plain access is already atomic on the host, like it is on x86.
+// The read-modify-writes are the ones that need the host atomics.
 uint8_t x86_atomic_readM8(x86CPU *cpu, moffset32_t vaddr)
 {
     return readMx(cpu, vaddr, 8, 0);
@@ -281,199 +420,237 @@ void x86_atomic_writeM32(x86CPU * cpu, moffset32_t vaddr, uint32_t bytes)
     writeMx(cpu, vaddr, bytes, 32);
 }
 
-void x86_wrseq(x86CPU *cpu, moffset32_t vaddr, const uint8_t *buffer, size_t size)
+enum AtomicOperations {
+    AT_XCHG,
+    AT_XADD,
+    AT_CMPXCHG
+};
+
+// serializes the locked accesses the host can't do atomically
+static pthread_mutex_t atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the host address of a locked access of size bits, the page fault is raised
+// if the guest can't write there. NULL if the access crosses into a page that
+// isn't next to it in the host.
+static void *atomic_ptr(x86CPU *cpu, moffset32_t vaddr, int size)
 {
-    if (!cpu)
-        return;
+    uint8_t *host = mmu_hostrange(cpu->mmu, vaddr, size / 8, PG_WRITE);
 
-    for (size_t i = 0; i < size; i++) {
-        x86_writeM8(cpu, vaddr, buffer[i]);
-        vaddr++;
-    }
+    if (mmu_error(cpu->mmu))
+        x86_raise_exception_d(cpu, INT_PF, vaddr, mmu_errstr(cpu->mmu));
+
+    return host;
 }
 
-void x86_rrseq(x86CPU *cpu, moffset32_t vaddr, uint8_t *dest, size_t size)
+// the locked access atomic_ptr() had no address for, it's only atomic with
+// respect to the other locked accesses
+static uint64_t atomic_fallback(x86CPU *cpu, moffset32_t vaddr, int size, int op, uint64_t value, uint64_t expected)
 {
-    if (!cpu)
-        return;
+    uint64_t old = 0;
 
-    for (size_t i = 0; i < size; i++) {
-        dest[i] = x86_readM8(cpu, vaddr);
-        vaddr++;
-    }
+    pthread_mutex_lock(&atomic_lock);
+
+    mmu_read(cpu->mmu, vaddr, &old, size / 8);
+
+    if (op == AT_XADD)
+        value += old;
+    else if (op == AT_CMPXCHG && old != expected)
+        value = old;
+
+    mmu_write(cpu->mmu, vaddr, &value, size / 8);
+
+    pthread_mutex_unlock(&atomic_lock);
+
+    return old;
 }
 
+#define ATOMIC_XCHG(b_bits)                                                         \
+    uint##b_bits##_t x86_atomic_xchgM##b_bits(x86CPU *cpu, moffset32_t vaddr, uint##b_bits##_t value) \
+    {                                                                               \
+        uint##b_bits##_t *host = atomic_ptr(cpu, vaddr, b_bits);                    \
+        uint##b_bits##_t old;                                                       \
+                                                                                    \
+        if (!host)                                                                  \
+            return atomic_fallback(cpu, vaddr, b_bits, AT_XCHG, value, 0);          \
+                                                                                    \
+        old = __atomic_exchange_n(host, value, __ATOMIC_SEQ_CST);                   \
+        mmu_host_written(cpu->mmu, vaddr, b_bits / 8);                              \
+        return old;                                                                 \
+    }
+
+#define ATOMIC_XADD(b_bits)                                                         \
+    uint##b_bits##_t x86_atomic_xaddM##b_bits(x86CPU *cpu, moffset32_t vaddr, uint##b_bits##_t value) \
+    {                                                                               \
+        uint##b_bits##_t *host = atomic_ptr(cpu, vaddr, b_bits);                    \
+        uint##b_bits##_t old;                                                       \
+                                                                                    \
+        if (!host)                                                                  \
+            return atomic_fallback(cpu, vaddr, b_bits, AT_XADD, value, 0);          \
+                                                                                    \
+        old = __atomic_fetch_add(host, value, __ATOMIC_SEQ_CST);                    \
+        mmu_host_written(cpu->mmu, vaddr, b_bits / 8);                              \
+        return old;                                                                 \
+    }
+
+#define ATOMIC_CMPXCHG(b_bits)                                                      \
+    uint##b_bits##_t x86_atomic_cmpxchgM##b_bits(x86CPU *cpu, moffset32_t vaddr,    \
+                                                uint##b_bits##_t expected, uint##b_bits##_t value) \
+    {                                                                               \
+        uint##b_bits##_t *host = atomic_ptr(cpu, vaddr, b_bits);                    \
+                                                                                    \
+        if (!host)                                                                  \
+            return atomic_fallback(cpu, vaddr, b_bits, AT_CMPXCHG, value, expected); \
+                                                                                    \
+        if (__atomic_compare_exchange_n(host, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) \
+            mmu_host_written(cpu->mmu, vaddr, b_bits / 8);                          \
+                                                                                    \
+        return expected;                                                            \
+    }
+
+ATOMIC_XCHG(8)
+ATOMIC_XCHG(16)
+ATOMIC_XCHG(32)
+
+ATOMIC_XADD(8)
+ATOMIC_XADD(16)
+ATOMIC_XADD(32)
+
+ATOMIC_CMPXCHG(8)
+ATOMIC_CMPXCHG(16)
+ATOMIC_CMPXCHG(32)
+ATOMIC_CMPXCHG(64)
+
 //
-// Deal with registers
+// sequences of bytes, they're copied a page at a time
 //
 
-void x86_increment_eip(x86CPU *cpu, moffset16_t offset)
+void x86_wrseq(x86CPU *cpu, moffset32_t vaddr, const uint8_t *buffer, size_t size)
 {
-    x86_update_eip_absolute(cpu, cpu->EIP + offset);
-}
+    size_t done;
 
-void x86_update_eip_absolute(x86CPU *cpu, moffset32_t vaddr)
-{
     if (!cpu)
         return;
 
-    cpu->EIP = vaddr;
-    tracer_set(&cpu->tracer, TRACE_VAR_EIP, cpu->EIP);
+    done = mmu_write(cpu->mmu, vaddr, buffer, size);
+
+    if (mmu_error(cpu->mmu))
+        x86_raise_exception_d(cpu, INT_PF, vaddr + done, mmu_errstr(cpu->mmu));
 }
 
-// write to registers
-void x86_writeR8(x86CPU *cpu, uint8_t register8, uint8_t value)
+void x86_rdseq(x86CPU *cpu, moffset32_t vaddr, uint8_t *dest, size_t size)
 {
+    size_t done;
 
     if (!cpu)
         return;
 
-    switch (register8) {
-        case AL: 
-            cpu->EAX = (cpu->EAX & 0xffffff00) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_EAX, cpu->EAX);
-            break;
-        case AH:
-            cpu->EAX = (cpu->EAX & 0xffff00ff) | (value << 4);
-            tracer_set(&cpu->tracer, TRACE_VAR_EAX, cpu->EAX);
-            break;
-        case BL: 
-            cpu->EBX = (cpu->EBX & 0xffffff00) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_EBX, cpu->EBX);
-            break;
-        case BH:
-            cpu->EBX = (cpu->EBX & 0xffff00ff) | (value << 4);
-            tracer_set(&cpu->tracer, TRACE_VAR_EBX, cpu->EBX);
-            break;
-        case CL:
-            cpu->ECX = (cpu->ECX & 0xffffff00) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_ECX, cpu->ECX);
-            break;
-        case CH:
-            cpu->ECX = (cpu->ECX & 0xffff00ff) | (value << 4);
-            tracer_set(&cpu->tracer, TRACE_VAR_ECX, cpu->ECX);
-            break;
-        case DL:
-            cpu->EDX = (cpu->EDX & 0xffffff00) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_EDX, cpu->EDX);
-            break;
-        case DH:
-            cpu->EDX = (cpu->EDX & 0xffff00ff) | (value << 4);
-            tracer_set(&cpu->tracer, TRACE_VAR_EDX, cpu->EDX);
-            break;
-    }
+    done = mmu_read(cpu->mmu, vaddr, dest, size);
+
+    if (mmu_error(cpu->mmu))
+        x86_raise_exception_d(cpu, INT_PF, vaddr + done, mmu_errstr(cpu->mmu));
+
+    mmu_clrerror(cpu->mmu);
 }
 
-void x86_writeR16(x86CPU *cpu, uint8_t register16, uint16_t value)
+size_t x86_rdseq2(x86CPU *cpu, moffset32_t vaddr, uint8_t *dest, size_t size, uint8_t stop)
 {
+    size_t done;
 
     if (!cpu)
-        return;
+        return 0;
 
-    switch (register16) {
-        case AX:
-            cpu->EAX = (cpu->EAX & 0xffff0000) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_EAX, cpu->EAX);
-            break;
-        case BX:
-            cpu->EBX = (cpu->EBX & 0xffff0000) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_EBX, cpu->EBX);
-            break;
-        case CX:
-            cpu->ECX = (cpu->ECX & 0xffff0000) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_ECX, cpu->ECX);
-            break;
-        case DX:
-            cpu->EDX = (cpu->EDX & 0xffff0000) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_EDX, cpu->EDX);
-            break;
-        case SP:
-            cpu->ESP = (cpu->ESP & 0xffff0000) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_ESP, cpu->ESP);
-            break;
-        case BP:
-            cpu->EBP = (cpu->EBP & 0xffff0000) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_EBP, cpu->EBP);
-            break;
-        case DI:
-            cpu->EDI = (cpu->EDI & 0xffff0000) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_EDI, cpu->EDI);
-            break;
-        case SI:
-            cpu->ESI = (cpu->ESI & 0xffff0000) | value;
-            tracer_set(&cpu->tracer, TRACE_VAR_ESI, cpu->ESI);
-            break;
-    }
+    done = mmu_read_until(cpu->mmu, vaddr, dest, size, stop);
+
+    if (mmu_error(cpu->mmu))
+        x86_raise_exception_d(cpu, INT_PF, vaddr + done, mmu_errstr(cpu->mmu));
+
+    mmu_clrerror(cpu->mmu);
+
+    return done;
 }
 
-void x86_writeR32(x86CPU *cpu, uint8_t register32, uint32_t value)
+size_t x86_try_rdseq2(x86CPU *cpu, moffset32_t vaddr, uint8_t *dest, size_t size, uint8_t stop)
 {
+    size_t done;
+
     if (!cpu)
-        return;
+        return 0;
 
-    switch (register32) {
-        case EIP: x86_update_eip_absolute(cpu, value); break;
-        case EAX: cpu->EAX = value; tracer_set(&cpu->tracer, TRACE_VAR_EAX, cpu->EAX); break;
-        case EBX: cpu->EBX = value; tracer_set(&cpu->tracer, TRACE_VAR_EBX, cpu->EBX); break;
-        case ECX: cpu->ECX = value; tracer_set(&cpu->tracer, TRACE_VAR_ECX, cpu->ECX); break;
-        case EDX: cpu->EDX = value; tracer_set(&cpu->tracer, TRACE_VAR_EDX, cpu->EDX); break;
-        case ESP: cpu->ESP = value; tracer_set(&cpu->tracer, TRACE_VAR_ESP, cpu->ESP); break;
-        case EBP: cpu->EBP = value; tracer_set(&cpu->tracer, TRACE_VAR_EBP, cpu->EBP); break;
-        case EDI: cpu->EDI = value; tracer_set(&cpu->tracer, TRACE_VAR_EDI, cpu->EDI); break;
-        case ESI: cpu->ESI = value; tracer_set(&cpu->tracer, TRACE_VAR_ESI, cpu->ESI); break;
-    }
+    done = mmu_read_until(cpu->mmu, vaddr, dest, size, stop);
+    mmu_clrerror(cpu->mmu);
+
+    return done;
 }
 
-// read from registers
-uint8_t x86_readR8(x86CPU *cpu, uint8_t register8)
+void x86_fillseq(x86CPU *cpu, moffset32_t vaddr, uint8_t byte, size_t size)
 {
+    size_t done;
+
     if (!cpu)
-        return 0;
+        return;
 
-    switch (register8) {
-        case AL: return cpu ->EAX & 0x000000ff;
-        case AH: return (cpu ->EAX & 0x0000ff00) >> 4;
-        case BL: return cpu ->EBX & 0x000000ff;
-        case BH: return (cpu ->EBX & 0x0000ff00) >> 4;
-        case CL: return cpu ->ECX & 0x000000ff;
-        case CH: return (cpu ->ECX & 0x0000ff00) >> 4;
-        case DL: return cpu ->EDX & 0x000000ff;
-        case DH: return (cpu ->EDX & 0x0000ff00) >> 4;
-    }
+    done = mmu_fill(cpu->mmu, vaddr, byte, size);
 
-    return 0;
+    if (mmu_error(cpu->mmu))
+        x86_raise_exception_d(cpu, INT_PF, vaddr + done, mmu_errstr(cpu->mmu));
 }
 
-uint16_t x86_readR16(x86CPU *cpu, uint8_t register16)
+size_t x86_strnlen(x86CPU *cpu, moffset32_t vaddr, size_t size)
 {
+    size_t len;
+
     if (!cpu)
         return 0;
 
-    return x86_readR32(cpu, register16) & 0x0000ffff;
+    len = mmu_strnlen(cpu->mmu, vaddr, size);
+
+    if (mmu_error(cpu->mmu))
+        x86_raise_exception_d(cpu, INT_PF, vaddr + len, mmu_errstr(cpu->mmu));
+
+    mmu_clrerror(cpu->mmu);
+
+    return len;
 }
 
-uint32_t x86_readR32(x86CPU *cpu, uint8_t register32)
+//
+// Deal with registers
+//
+
+// byte offset of each 8-bit register inside x86CPU.gpr (little-endian host).
+// 0-7 follow the encoding used by the reg/rm fields so they can be used directly.
+const uint8_t x86_reg8_offset_[BH + 1] = {
+    [0] = EAX * 4, [1] = ECX * 4, [2] = EDX * 4, [3] = EBX * 4,
+    [4] = EAX * 4 + 1, [5] = ECX * 4 + 1, [6] = EDX * 4 + 1, [7] = EBX * 4 + 1,
+    [EIP] = EIP * 4,
+    [AL] = EAX * 4, [AH] = EAX * 4 + 1,
+    [CL] = ECX * 4, [CH] = ECX * 4 + 1,
+    [DL] = EDX * 4, [DH] = EDX * 4 + 1,
+    [BL] = EBX * 4, [BH] = EBX * 4 + 1,
+};
+
+void x86_snapshot_registers(x86CPU *cpu)
 {
     if (!cpu)
-        return 0;
-
-    switch (register32) {
-        case EIP: return cpu->EIP;
-        case EAX: return cpu ->EAX;
-        case EBX: return cpu ->EBX;
-        case ECX: return cpu ->ECX;
-        case EDX: return cpu ->EDX;
-        case ESP: return cpu ->ESP;
-        case EBP: return cpu ->EBP;
-        case EDI: return cpu ->EDI;
-        case ESI: return cpu ->ESI;
-    }
+        return;
 
-    return 0;
+    x86_materialize_flags(cpu);
+
+    tracer_set(x86_tracer(cpu), TRACE_VAR_EAX, cpu->EAX);
+    tracer_set(x86_tracer(cpu), TRACE_VAR_EBX, cpu->EBX);
+    tracer_set(x86_tracer(cpu), TRACE_VAR_ECX, cpu->ECX);
+    tracer_set(x86_tracer(cpu), TRACE_VAR_EDX, cpu->EDX);
+    tracer_set(x86_tracer(cpu), TRACE_VAR_ESP, cpu->ESP);
+    tracer_set(x86_tracer(cpu), TRACE_VAR_EBP, cpu->EBP);
+    tracer_set(x86_tracer(cpu), TRACE_VAR_EDI, cpu->EDI);
+    tracer_set(x86_tracer(cpu), TRACE_VAR_ESI, cpu->ESI);
+    tracer_set(x86_tracer(cpu), TRACE_VAR_EIP, cpu->EIP);
+    tracer_setptr(x86_tracer(cpu), TRACE_VARPTR_EFLAGS, &cpu->eflags);
 }
 
 void x86_setflag(x86CPU *cpu, uint8_t flag)
 {
+    x86_materialize_flags(cpu);
+
     switch (flag) {
         case ID: cpu->eflags.ID = 1; break;
         case VIP: cpu->eflags.VIP = 1; break;
@@ -483,6 +660,7 @@ void x86_setflag(x86CPU *cpu, uint8_t flag)
         case RF: cpu->eflags.RF = 1; break;
         case NT: cpu->eflags.NT = 1; break;
         case IOPL: cpu->eflags.IOPL = 1; break;
+        case OF: cpu->eflags.OF = 1; break;
         case DF: cpu->eflags.DF = 1; break;
         case IF: cpu->eflags.IF = 1; break;
         case TF: cpu->eflags.TF = 1; break;
@@ -493,12 +671,12 @@ void x86_setflag(x86CPU *cpu, uint8_t flag)
         case CF: cpu->eflags.CF = 1; break;
             break;
     }
-
-    tracer_setptr(x86_tracer(cpu), TRACE_VARPTR_EFLAGS, &cpu->eflags);
 }
 
 void x86_clearflag(x86CPU *cpu, uint8_t flag)
 {
+    x86_materialize_flags(cpu);
+
     switch (flag) {
         case ID: cpu->eflags.ID = 0; break;
         case VIP: cpu->eflags.VIP = 0; break;
@@ -508,6 +686,7 @@ void x86_clearflag(x86CPU *cpu, uint8_t flag)
         case RF: cpu->eflags.RF = 0; break;
         case NT: cpu->eflags.NT = 0; break;
         case IOPL: cpu->eflags.IOPL = 0; break;
+        case OF: cpu->eflags.OF = 0; break;
         case DF: cpu->eflags.DF = 0; break;
         case IF: cpu->eflags.IF = 0; break;
         case TF: cpu->eflags.TF = 0; break;
@@ -518,8 +697,6 @@ void x86_clearflag(x86CPU *cpu, uint8_t flag)
         case CF: cpu->eflags.CF = 0; break;
         break;
     }
-
-    tracer_setptr(x86_tracer(cpu), TRACE_VARPTR_EFLAGS, &cpu->eflags);
 }
 
 _Bool x86_flag_on(x86CPU *cpu, uint8_t flag)
@@ -529,6 +706,8 @@ _Bool x86_flag_on(x86CPU *cpu, uint8_t flag)
 
 _Bool x86_flag_off(x86CPU *cpu, uint8_t flag)
 {
+    x86_materialize_flags(cpu);
+
     switch (flag) {
         case ID: return  cpu->eflags.ID == 0; break;
         case VIP: return  cpu->eflags.VIP == 0; break;
@@ -538,6 +717,7 @@ _Bool x86_flag_off(x86CPU *cpu, uint8_t flag)
         case RF: return  cpu->eflags.RF == 0; break;
         case NT: return  cpu->eflags.NT == 0; break;
         case IOPL: return  cpu->eflags.IOPL == 0; break;
+        case OF: return  cpu->eflags.OF == 0; break;
         case DF: return  cpu->eflags.DF == 0; break;
         case IF: return  cpu->eflags.IF == 0; break;
         case TF: return  cpu->eflags.TF == 0; break;
@@ -552,6 +732,58 @@ _Bool x86_flag_off(x86CPU *cpu, uint8_t flag)
     return 0;
 }
 
+void x86_materialize_flags(x86CPU *cpu)
+{
+    struct LazyFlags *lf = &cpu->lazyflags;
+    uint32_t mask;
+    uint32_t sign;
+    uint32_t op1;
+    uint32_t op2;
+    uint32_t result;
+
+    if (lf->lf_op == LF_NONE)
+        return;
+
+    if (lf->lf_size == 8) {
+        mask = 0xff;
+        sign = 0x80;
+    } else if (lf->lf_size == 16) {
+        mask = 0xffff;
+        sign = 0x8000;
+    } else {
+        mask = 0xffffffff;
+        sign = 0x80000000;
+    }
+
+    op1 = lf->lf_op1 & mask;
+    op2 = lf->lf_op2 & mask;
+    result = lf->lf_result & mask;
+
+    cpu->eflags.SF = (result & sign) != 0;
+    cpu->eflags.ZF = result == 0;
+    cpu->eflags.PF = parity_even(result);
+
+    switch (lf->lf_op) {
+        case LF_ADD:
+            cpu->eflags.CF = result < op1;
+            cpu->eflags.OF = ((op1 ^ result) & (op2 ^ result) & sign) != 0;
+            cpu->eflags.AF = ((op1 ^ op2 ^ result) & 0x10) != 0;
+            break;
+        case LF_SUB:
+            cpu->eflags.CF = op1 < op2;
+            cpu->eflags.OF = ((op1 ^ op2) & (op1 ^ result) & sign) != 0;
+            cpu->eflags.AF = ((op1 ^ op2 ^ result) & 0x10) != 0;
+            break;
+        case LF_LOGIC:
+            cpu->eflags.CF = 0;
+            cpu->eflags.OF = 0;
+            cpu->eflags.AF = 0;
+            break;
+    }
+
+    lf->lf_op = LF_NONE;
+}
+
 const uint8_t *x86_getptr(x86CPU *cpu, moffset32_t vaddr)
 {
     if (!cpu)
@@ -588,7 +820,9 @@ int x86_ptrtype(x86CPU *cpu, moffset32_t vaddr)
         x86_writeM32(cpu, x86_readR32(cpu, ESP), id);   \
     } while (0)
 
-static void build_environment(x86CPU *cpu, int argc, char *argv[], char **envp)
+// vdso and vsyscall are the addresses for AT_SYSINFO_EHDR and AT_SYSINFO, 0
+// if there is no vDSO
+static void build_environment(x86CPU *cpu, int argc, char *argv[], char **envp, moffset32_t vdso, moffset32_t vsyscall)
 {
     size_t environsz = 0;
     moffset32_t *environ_;
@@ -648,23 +882,22 @@ static void build_environment(x86CPU *cpu, int argc, char *argv[], char **envp)
     NEW_AUXV(cpu, AT_PAGESZ, (unsigned long) sysconf(_SC_PAGESIZE));
     NEW_AUXV(cpu, AT_PAGESZ, (unsigned long) sysconf(_SC_PAGESIZE));
     NEW_AUXV(cpu, AT_PLATFORM, (unsigned long)&dl_platform);
+    if (vdso) {
+        NEW_AUXV(cpu, AT_SYSINFO, vsyscall);
+        NEW_AUXV(cpu, AT_SYSINFO_EHDR, vdso);
+    }
 
     // the NULL ptr at the end of envp
     environ_[environsz] = 0;
 
-    for (int i = environsz; i >= 0; i--) {
-        x86_writeR32(cpu, ESP, x86_readR32(cpu, ESP) - 4);
-
-        x86_writeM32(cpu, cpu->ESP, environ_[i]);
-    }
+    x86_writeR32(cpu, ESP, x86_readR32(cpu, ESP) - (environsz + 1) * 4);
+    x86_wrseq(cpu, cpu->ESP, (uint8_t *)environ_, (environsz + 1) * 4);
 
     // the NULL ptr at the end of argv
     argv_[argc] = 0;
 
-    for (int i = argc; i >= 0; i--) {
-        x86_writeR32(cpu, ESP, x86_readR32(cpu, ESP) - 4);
-        x86_writeM32(cpu, cpu->ESP, argv_[i]);
-    }
+    x86_writeR32(cpu, ESP, x86_readR32(cpu, ESP) - (argc + 1) * 4);
+    x86_wrseq(cpu, cpu->ESP, (uint8_t *)argv_, (argc + 1) * 4);
 
 
     x86_writeR32(cpu, ESP, x86_readR32(cpu, ESP) - 4);
@@ -684,14 +917,9 @@ static void build_environment(x86CPU *cpu, int argc, char *argv[], char **envp)
 void x86_cpu_exec(char *executable, int argc, char *argv[], char **envp)
 {
     x86CPU *cpu;
-    struct instruction instr;
     int start_argv;
-    moffset32_t breakpoint;
-    _Bool singlestep = 0;
-
-    instr.name = NULL;
-    instr.size = 0;
-    instr.handler = NULL;
+    moffset32_t vdso = 0;
+    moffset32_t vsyscall = 0;
 
     int stack_flags = 0;
 
@@ -706,6 +934,42 @@ void x86_cpu_exec(char *executable, int argc, char *argv[], char **envp)
 
     argv[start_argv] = conf_getptr(x86_conf(cpu), "executable");
 
+    getrusage(RUSAGE_SELF, &load_usage);
+    run_usage = load_usage;
+
+    for (int i = 0; i < MC_NCLASSES; i++) {
+        const char *policy = conf_getptr(x86_conf(cpu), backing_options[i]);
+
+        if (!policy)
+            continue;
+
+        cpu->mmu->mm_backing[i] = mmu_backing_parse(policy);
+        if (cpu->mmu->mm_backing[i] == -1) {
+            x86_stopcpu(cpu);
+            s_error(1, "emulator: invalid host memory backing '%s'", policy);
+        }
+    }
+
+    if (conf_getval(x86_conf(cpu), "mmu.flat")) {
+        struct sigaction sa;
+
+        mmu_flat_reserve(cpu->mmu);
+
+        if (mmu_error(cpu->mmu)) {
+            s_info("emulator: %s, using the segmented memory model", mmu_errstr(cpu->mmu));
+            mmu_clrerror(cpu->mmu);
+        } else {
+            flat_cpu = cpu;
+
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_sigaction = flat_fault_handler;
+            sa.sa_flags = SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGSEGV, &sa, NULL);
+            sigaction(SIGBUS, &sa, NULL);
+        }
+    }
+
     // map the executable segments to memory.
     // no shared library is loaded just yet.
     elf_load(&cpu->executable, executable);
@@ -715,10 +979,10 @@ void x86_cpu_exec(char *executable, int argc, char *argv[], char **envp)
     }
 
     // actually map the segments
-    mmu_mmap_loadable(&cpu->mmu, &cpu->executable);
-    if (mmu_error(&cpu->mmu)) {
+    mmu_mmap_loadable(cpu->mmu, &cpu->executable);
+    if (mmu_error(cpu->mmu)) {
         x86_stopcpu(cpu);
-        s_error(1, "%s", mmu_errstr(&cpu->mmu));
+        s_error(1, "%s", mmu_errstr(cpu->mmu));
     }
 
     sr_loadcache(x86_resolver(cpu), executable);
@@ -730,40 +994,331 @@ void x86_cpu_exec(char *executable, int argc, char *argv[], char **envp)
     if (elf_execstack(&cpu->executable))
         stack_flags |= B_STACKEXEC;
 
-    x86_writeR32(cpu, ESP, mmu_create_stack(&cpu->mmu, stack_flags));
+    x86_writeR32(cpu, ESP, mmu_create_stack(cpu->mmu, stack_flags));
     x86_writeR32(cpu, EIP, elf_entrypoint(&cpu->executable));
 
-    build_environment(cpu, argc, &argv[start_argv], envp);
+    if (!conf_getval(x86_conf(cpu), "cpu.novdso")) {
+        vdso = x86_vdso_map(cpu->mmu, &vsyscall);
+        if (mmu_error(cpu->mmu)) {
+            x86_stopcpu(cpu);
+            s_error(1, "%s", mmu_errstr(cpu->mmu));
+        }
+    }
+
+    build_environment(cpu, argc, &argv[start_argv], envp, vdso, vsyscall);
 
     tracer_push(&cpu->tracer, cpu->EIP, 0, cpu->ESP);
 
-    breakpoint = conf_getval(x86_conf(cpu), "dbg.breakpoint");
-    singlestep = conf_getval(x86_conf(cpu), "dbg.singlestep");
+    if (conf_getval(x86_conf(cpu), "cpu.nojit"))
+        cpu->jit.jit_enabled = 0;
+
+    if (conf_getval(x86_conf(cpu), "cpu.nofusion"))
+        cpu->bcache.bc_fuse = 0;
+
+    if (conf_getval(x86_conf(cpu), "cpu.writebehind"))
+        x86_syscall_writebehind(1);
+
+    // native code wouldn't count anything
+    if (conf_getval(x86_conf(cpu), "cpu.profilepairs")) {
+        cpu->bcache.bc_profile = 1;
+        cpu->jit.jit_enabled = 0;
+        atexit(fusion_report);
+    }
+
+    // the clock starts now
+    getrusage(RUSAGE_SELF, &run_usage);
+
+    // the program starts over from here after going back to the snapshot
+    setjmp(snapshot_restart);
+
+    cpu_run(cpu);
+
+    x86_stopcpu(cpu);
+    exit(0);
+}
+
+// run the guest thread of cpu, it only ends through an exception or exit
+static void cpu_run(x86CPU *cpu)
+{
+    const struct instruction *instr;
+    moffset32_t breakpoint = conf_getval(x86_conf(cpu), "dbg.breakpoint");
+    _Bool singlestep = conf_getval(x86_conf(cpu), "dbg.singlestep");
+    _Bool trace = conf_getval(x86_conf(cpu), "dbg.trace");
+    _Bool watched = trace || singlestep || breakpoint;
+    // only the first run takes it, the others start from it
+    moffset32_t snapshot_at = snapshot ? 0 : conf_getval(x86_conf(cpu), "cpu.snapshotat");
+
+    // nobody is watching, run a whole block at a time
+    if (!watched && !snapshot_at)
+        x86_block_run(cpu, x86_block_lookup(cpu, cpu->EIP));
+
     while (1) {
 
-        x86dbg_print_state(cpu);
+        if (snapshot_at && x86_readR32(cpu, EIP) == snapshot_at) {
+            snapshot_start(cpu);
+            snapshot_at = 0;
+
+            if (!watched)
+                x86_block_run(cpu, x86_block_lookup(cpu, cpu->EIP));
+        }
+
+        if (watched)
+            x86dbg_print_state(cpu);
 
         if (x86_readR32(cpu, EIP) == breakpoint)
             getchar();
         if (singlestep)
             getchar();
 
-        instr = x86_decode(cpu, cpu->EIP);
+        instr = x86_decode_cached(cpu, cpu->EIP);
 
-        if (mmu_error(&cpu->mmu))
-            x86_raise_exception_d(cpu, INT_PF, cpu->EIP, mmu_errstr(&cpu->mmu));
+        if (mmu_error(cpu->mmu))
+            x86_raise_exception_d(cpu, INT_PF, cpu->EIP, mmu_errstr(cpu->mmu));
 
-        if (instr.fail_to_fetch)
+        if (instr->fail_to_fetch)
             x86_raise_exception(cpu, INT_UD);
 
-        x86_increment_eip(cpu, instr.size);
+        x86_increment_eip(cpu, instr->size);
 
-        instr.handler(cpu, instr.data);
+        instr->handler(cpu, instr->data);
 
         // TODO: handle exceptions? I think it would be cool to imitate a real x86 cpu
         // handling of exceptions
     }
+}
 
-    x86_stopcpu(cpu);
-    exit(0);
+// the instructions until --snapshot-at are run one at a time to stop right there
+static void snapshot_start(x86CPU *cpu)
+{
+    if (!(snapshot = x86_snapshot(cpu)))
+        s_error(1, "snapshot: %s", mmu_errstr(cpu->mmu));
+
+    snapshot_cpu = cpu;
+    snapshot_runs = 1;
+}
+
+// wait until there is something for the next run to read or stdin ends
+static _Bool stdin_pending(void)
+{
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    int avail = 0;
+
+    while (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR)
+            return 0;
+    }
+
+    // regular files too, it's what is left to read
+    if (ioctl(STDIN_FILENO, FIONREAD, &avail) == -1)
+        return 0;
+
+    return avail > 0;
+}
+
+/*
+ * the restore only copies back the pages written during the run, see
+ * snapshot.h. The files opened and the position in stdin are the host's and
+ * stay as they are, that is how each run gets new input.
+ */
+void x86_cpu_rerun(x86CPU *cpu)
+{
+    if (!snapshot || cpu != snapshot_cpu)
+        return;
+
+    // the other threads aren't in the snapshot
+    if (__atomic_load_n(&nthreads, __ATOMIC_ACQUIRE) > 1)
+        return;
+
+    // what this run wrote goes out before the next one starts
+    x86_syscall_flush();
+
+    if (!stdin_pending())
+        return;
+
+    x86_restore(cpu, snapshot);
+    if (mmu_error(cpu->mmu))
+        s_error(1, "snapshot: %s", mmu_errstr(cpu->mmu));
+
+    snapshot_runs++;
+    snapshot_copied += snapshot->sn_mmu.ms_copied;
+
+    longjmp(snapshot_restart, 1);
+}
+
+struct thread_start {
+    x86CPU *ts_cpu;
+    uint32_t ts_flags;
+    moffset32_t ts_ptid;
+    moffset32_t ts_ctid;
+    pid_t ts_tid;
+    sem_t ts_started;
+};
+
+static void *thread_main(void *arg)
+{
+    struct thread_start *start = arg;
+    x86CPU *cpu = start->ts_cpu;
+    uint32_t tid = syscall(SYS_gettid);
+
+    // the tid has to be there before either thread gets to run guest code
+    if (start->ts_flags & CLONE_PARENT_SETTID)
+        mmu_write(cpu->mmu, start->ts_ptid, &tid, sizeof(tid));
+    if (start->ts_flags & CLONE_CHILD_SETTID)
+        mmu_write(cpu->mmu, start->ts_ctid, &tid, sizeof(tid));
+    mmu_clrerror(cpu->mmu);
+
+    start->ts_tid = tid;
+    sem_post(&start->ts_started);
+
+    if (mmu_isflat(cpu->mmu))
+        flat_cpu = cpu;
+
+    cpu_run(cpu);
+    x86_cpu_exit(cpu, 0);
+}
+
+/*
+ * start a guest thread as a copy of cpu, on its own host thread. Only threads
+ * sharing the address space are supported, each gets its own registers and
+ * caches over the one MMU. The thread id or -errno is returned.
+ */
+int32_t x86_cpu_clone(x86CPU *cpu, uint32_t flags, moffset32_t stack, moffset32_t ptid, moffset32_t tls, moffset32_t ctid)
+{
+    struct thread_start start;
+    pthread_attr_t attr;
+    pthread_t thread;
+    x86CPU *child;
+    int err;
+
+    if ((flags & (CLONE_VM | CLONE_VFORK)) != CLONE_VM)
+        return -ENOSYS;
+
+    child = xmalloc(sizeof(*child));
+    memcpy(child, cpu, sizeof(*child));
+
+    // the TLS entries are copied, the descriptor replaces one of them
+    if ((flags & CLONE_SETTLS) && (err = x86_set_thread_area(child, tls, 0))) {
+        xfree(child);
+        return err;
+    }
+
+    dcache_init(&child->dcache);
+    bcache_init(&child->bcache);
+    jit_init(&child->jit);
+    child->bcache.bc_fuse = cpu->bcache.bc_fuse;
+    child->bcache.bc_profile = cpu->bcache.bc_profile;
+    child->jit.jit_enabled = cpu->jit.jit_enabled;
+    tracer_start(&child->tracer, &child->resolver);
+    tracer_push(&child->tracer, child->EIP, 0, stack ? stack : child->ESP);
+
+    child->eflags_ptr_ = &child->eflags;
+    child->sreg_table_[CS] = &child->CS; child->sreg_table_[SS] = &child->SS;
+    child->sreg_table_[DS] = &child->DS; child->sreg_table_[ES] = &child->ES;
+    child->sreg_table_[FS] = &child->FS; child->sreg_table_[GS] = &child->GS;
+
+    child->EAX = 0;
+    if (stack)
+        child->ESP = stack;
+    child->clear_child_tid = (flags & CLONE_CHILD_CLEARTID) ? ctid : 0;
+
+    // from now on the other threads can see our changes to the page table
+    mmu_share(cpu->mmu);
+    __atomic_add_fetch(&nthreads, 1, __ATOMIC_ACQ_REL);
+
+    start.ts_cpu = child;
+    start.ts_flags = flags;
+    start.ts_ptid = ptid;
+    start.ts_ctid = ctid;
+    sem_init(&start.ts_started, 0, 0);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &attr, thread_main, &start);
+    pthread_attr_destroy(&attr);
+
+    if (err) {
+        __atomic_sub_fetch(&nthreads, 1, __ATOMIC_ACQ_REL);
+        sem_destroy(&start.ts_started);
+        tracer_stop(&child->tracer);
+        dcache_free(&child->dcache);
+        bcache_free(&child->bcache);
+        jit_free(&child->jit);
+        xfree(child);
+        return -err;
+    }
+
+    while (sem_wait(&start.ts_started) == -1 && errno == EINTR)
+        ;
+    sem_destroy(&start.ts_started);
+
+    return start.ts_tid;
+}
+
+// the flags of struct user_desc, a segment not present frees the entry
+#define USER_DESC_NOT_PRESENT (1 << 5)
+
+int32_t x86_set_thread_area(x86CPU *cpu, moffset32_t uinfo, _Bool allocate)
+{
+    uint32_t desc[4];   // entry_number, base_addr, limit, flags
+    struct x86TLSEntry *entry;
+
+    if (mmu_read(cpu->mmu, uinfo, desc, sizeof(desc)) != sizeof(desc)) {
+        mmu_clrerror(cpu->mmu);
+        return -EFAULT;
+    }
+
+    if (desc[0] == (uint32_t)-1 && allocate) {
+        for (desc[0] = X86_TLS_FIRST; desc[0] < X86_TLS_FIRST + X86_TLS_ENTRIES; desc[0]++) {
+            if (!cpu->tls[desc[0] - X86_TLS_FIRST].te_used)
+                break;
+        }
+
+        if (desc[0] == X86_TLS_FIRST + X86_TLS_ENTRIES)
+            return -ESRCH;
+
+        if (mmu_write(cpu->mmu, uinfo, &desc[0], sizeof(desc[0])) != sizeof(desc[0])) {
+            mmu_clrerror(cpu->mmu);
+            return -EFAULT;
+        }
+    }
+
+    if (desc[0] < X86_TLS_FIRST || desc[0] >= X86_TLS_FIRST + X86_TLS_ENTRIES)
+        return -EINVAL;
+
+    // the limit and the rest of the flags aren't checked on access
+    entry = &cpu->tls[desc[0] - X86_TLS_FIRST];
+    entry->te_used = !(desc[3] & USER_DESC_NOT_PRESENT);
+    entry->te_base = entry->te_used ? desc[1] : 0;
+
+    return 0;
+}
+
+// end the guest thread of cpu, the last one to leave takes the process with it
+_Noreturn void x86_cpu_exit(x86CPU *cpu, int status)
+{
+    if (cpu->clear_child_tid) {
+        uint32_t *host = (uint32_t *)mmu_hostrange(cpu->mmu, cpu->clear_child_tid, sizeof(*host), PG_WRITE);
+
+        if (host) {
+            __atomic_store_n(host, 0, __ATOMIC_SEQ_CST);
+            mmu_host_written(cpu->mmu, cpu->clear_child_tid, sizeof(*host));
+            syscall(SYS_futex, host, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
+        mmu_clrerror(cpu->mmu);
+    }
+
+    x86_cpu_rerun(cpu);
+
+    if (__atomic_sub_fetch(&nthreads, 1, __ATOMIC_ACQ_REL) == 0) {
+        x86_stopcpu(cpu);
+        exit(status);
+    }
+
+    tracer_stop(&cpu->tracer);
+    dcache_free(&cpu->dcache);
+    bcache_free(&cpu->bcache);
+    jit_free(&cpu->jit);
+    xfree(cpu);
+
+    pthread_exit(NULL);
 }
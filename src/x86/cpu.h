@@ -36,23 +36,64 @@
 #include "x86-mmu.h"
 #include "x86-utils.h"
 #include "instructions.h"
+#include "decode-cache.h"
+#include "block-cache.h"
+#include "jit.h"
+
+// the kind of the last flag-setting operation
+enum LazyFlagsOperations {
+    LF_NONE,        // eflags is up to date
+    LF_ADD,
+    LF_SUB,         // also cmp
+    LF_LOGIC,       // and, or, xor, test
+};
+
+// the TLS entries of the GDT that set_thread_area(2) sets, numbered like Linux
+#define X86_TLS_FIRST 6
+#define X86_TLS_ENTRIES 3
+
+struct x86TLSEntry {
+    moffset32_t te_base;
+    _Bool te_used;
+};
+
+// arithmetic flags are not computed when the instruction executes, instead we
+// record the operation and compute them only when someone actually reads them.
+struct LazyFlags {
+    uint8_t lf_op;
+    uint8_t lf_size;
+    uint32_t lf_op1;
+    uint32_t lf_op2;
+    uint32_t lf_result;
+};
 
 typedef struct {
-    x86MMU mmu;
+    // shared by every thread of the guest, the rest is per thread except
+    // for what the executable, the resolver and the configuration point to
+    x86MMU *mmu;
     GenericELF executable;
     sym_resolver_t resolver;
     cpu_state_t tracer;
     config_t configuration;
+    x86DecodeCache dcache;
+    x86BlockCache bcache;
+    x86JIT jit;
 
-    reg32_t EAX;
-    reg32_t EBX;
-    reg32_t ECX;
-    reg32_t EDX;
-    reg32_t EBP;
-    reg32_t ESP;
-    reg32_t EDI;
-    reg32_t ESI;
-    reg32_t EIP;
+    // general-purpose registers and EIP, indexed by enum x86Registers
+    union {
+        reg32_t gpr[EIP + 1];
+        struct {
+            reg32_t EAX;
+            reg32_t ECX;
+            reg32_t EDX;
+            reg32_t EBX;
+            reg32_t ESP;
+            reg32_t EBP;
+            reg32_t ESI;
+            reg32_t EDI;
+            reg32_t EIP;
+        };
+    };
 
     reg16_t CS;
     reg16_t SS;
@@ -62,14 +103,22 @@ typedef struct {
     reg16_t GS;
 
     struct EFlags eflags;
+    struct LazyFlags lazyflags;
 
     struct EFlags *eflags_ptr_;
     reg16_t *sreg_table_[6];
+
+    // the base of FS and GS is the one of the entry their selector points to
+    struct x86TLSEntry tls[X86_TLS_ENTRIES];
+
+    // set_tid_address(2) and CLONE_CHILD_CLEARTID, zeroed and woken up when
+    // the thread exits
+    moffset32_t clear_child_tid;
 } x86CPU;
 
     // member access macros
 #define x86_tracer(cpu) (&((x86CPU *)(cpu))->tracer)
-#define x86_mmu(cpu) (&((x86CPU *)(cpu))->mmu)
+#define x86_mmu(cpu) (((x86CPU *)(cpu))->mmu)
 #define x86_elf(cpu) (&((x86CPU *)(cpu))->executable)
 #define x86_resolver(cpu) (&((x86CPU *)(cpu))->resolver)
 #define x86_conf(cpu) (&((x86CPU *)(cpu))->configuration)
@@ -85,6 +134,22 @@ void x86_stopcpu(x86CPU *);
 // the main loop
 void x86_cpu_exec(char *, int argc, char **, char **);
 
+// start a guest thread on a new host thread, sharing the MMU. It runs from
+// where the cpu is with EAX zeroed and on the stack given, if any. The
+// CLONE_* flags, the parent tid, TLS descriptor and child tid pointers are
+// those of clone(2). Returns the thread id or -errno.
+int32_t x86_cpu_clone(x86CPU *, uint32_t, moffset32_t, moffset32_t, moffset32_t, moffset32_t);
+// set the TLS entry from the struct user_desc in guest memory, like
+// set_thread_area(2). With an entry_number of -1 a free entry is picked and
+// its number written back, if allowed to. Returns 0 or -errno.
+int32_t x86_set_thread_area(x86CPU *, moffset32_t, _Bool);
+// end the guest thread running on the calling host thread, the process when
+// it is the last one
+_Noreturn void x86_cpu_exit(x86CPU *, int);
+// with --snapshot-at, take the program back to the snapshot instead of ending
+// it when there is more on stdin to run it with. Returns if it has to end.
+void x86_cpu_rerun(x86CPU *);
+
 void x86_raise_exception(x86CPU *, int);
 void x86_raise_exception_d(x86CPU *, int, moffset32_t, const char *);
 
@@ -111,12 +176,35 @@ void x86_atomic_writeM8(x86CPU *, moffset32_t, uint8_t);
 void x86_atomic_writeM16(x86CPU *, moffset32_t, uint16_t);
 void x86_atomic_writeM32(x86CPU *, moffset32_t, uint32_t);
 
+// the locked read-modify-writes, done by the host atomic instructions on the
+// host memory of the guest. They return the value the memory had before.
+uint8_t x86_atomic_xchgM8(x86CPU *, moffset32_t, uint8_t);
+uint16_t x86_atomic_xchgM16(x86CPU *, moffset32_t, uint16_t);
+uint32_t x86_atomic_xchgM32(x86CPU *, moffset32_t, uint32_t);
+
+uint8_t x86_atomic_xaddM8(x86CPU *, moffset32_t, uint8_t);
+uint16_t x86_atomic_xaddM16(x86CPU *, moffset32_t, uint16_t);
+uint32_t x86_atomic_xaddM32(x86CPU *, moffset32_t, uint32_t);
+
+// the new value is only written if the old one is the one expected
+uint8_t x86_atomic_cmpxchgM8(x86CPU *, moffset32_t, uint8_t, uint8_t);
+uint16_t x86_atomic_cmpxchgM16(x86CPU *, moffset32_t, uint16_t, uint16_t);
+uint32_t x86_atomic_cmpxchgM32(x86CPU *, moffset32_t, uint32_t, uint32_t);
+uint64_t x86_atomic_cmpxchgM64(x86CPU *, moffset32_t, uint64_t, uint64_t);
+
 // write a sequence of bytes
 void x86_wrseq(x86CPU *, moffset32_t, const uint8_t *, size_t);
 // read a sequence of bytes into the buffer
 void x86_rdseq(x86CPU *, moffset32_t, uint8_t *, size_t);
-// same as above but will stop if it reaches the stop byte
-void x86_rdseq2(x86CPU *, moffset32_t, uint8_t *, size_t, uint8_t);
+// same as above but will stop if it reaches the stop byte, returns how many
+// bytes were read including the stop byte
+size_t x86_rdseq2(x86CPU *, moffset32_t, uint8_t *, size_t, uint8_t);
+// same as above but it won't raise an exception
+size_t x86_try_rdseq2(x86CPU *, moffset32_t, uint8_t *, size_t, uint8_t);
+// fill a sequence of bytes with the same byte
+void x86_fillseq(x86CPU *, moffset32_t, uint8_t, size_t);
+// length of the string at the address, up to the size given
+size_t x86_strnlen(x86CPU *, moffset32_t, size_t);
 
 enum PointerTypes {
     NOT_A_PTR,
@@ -129,24 +217,73 @@ const uint8_t *x86_getptr(x86CPU *, moffset32_t);
 int x86_ptrtype(x86CPU *, moffset32_t);
 
 
-void x86_increment_eip(x86CPU *, moffset16_t);
-void x86_update_eip_absolute(x86CPU *, moffset32_t);
+// byte offset of AL..BH (or of a 3-bit 8-bit register encoding) inside x86CPU.gpr
+extern const uint8_t x86_reg8_offset_[];
+
+#define x86_gpr8(cpu, reg) (    ((uint8_t *)((x86CPU *)(cpu))->gpr)[x86_reg8_offset_[reg]]    )
+
+static inline void x86_increment_eip(x86CPU *cpu, moffset16_t offset)
+{
+    cpu->EIP += offset;
+}
+
+static inline void x86_update_eip_absolute(x86CPU *cpu, moffset32_t vaddr)
+{
+    cpu->EIP = vaddr;
+}
 
 // write to registers
-void x86_writeR8(x86CPU *, uint8_t, uint8_t);
-void x86_writeR16(x86CPU *, uint8_t, uint16_t);
-void x86_writeR32(x86CPU *, uint8_t, uint32_t);
+static inline void x86_writeR8(x86CPU *cpu, uint8_t register8, uint8_t value)
+{
+    x86_gpr8(cpu, register8) = value;
+}
+
+static inline void x86_writeR16(x86CPU *cpu, uint8_t register16, uint16_t value)
+{
+    cpu->gpr[register16] = (cpu->gpr[register16] & 0xffff0000) | value;
+}
+
+static inline void x86_writeR32(x86CPU *cpu, uint8_t register32, uint32_t value)
+{
+    cpu->gpr[register32] = value;
+}
 
 // read from registers
-uint8_t x86_readR8(x86CPU *, uint8_t);
-uint16_t x86_readR16(x86CPU *, uint8_t);
-uint32_t x86_readR32(x86CPU *, uint8_t);
+static inline uint8_t x86_readR8(x86CPU *cpu, uint8_t register8)
+{
+    return x86_gpr8(cpu, register8);
+}
+
+static inline uint16_t x86_readR16(x86CPU *cpu, uint8_t register16)
+{
+    return cpu->gpr[register16] & 0x0000ffff;
+}
+
+static inline uint32_t x86_readR32(x86CPU *cpu, uint8_t register32)
+{
+    return cpu->gpr[register32];
+}
+
+// copy the registers into the tracer, the tracer is not updated as we execute
+// so call this before reading its saved state
+void x86_snapshot_registers(x86CPU *);
 
 void x86_setflag(x86CPU *, uint8_t);
 void x86_clearflag(x86CPU *, uint8_t);
 _Bool x86_flag_on(x86CPU *, uint8_t);
 _Bool x86_flag_off(x86CPU *, uint8_t);
 
+// record the last arithmetic operation, OF, SF, ZF, AF, PF and CF are computed later
+#define x86_lazyflags(cpu, op, size, op1, op2, result) do {           \
+        struct LazyFlags *lf_ = &((x86CPU *)(cpu))->lazyflags;          \
+        lf_->lf_op = (op); lf_->lf_size = (size);                       \
+        lf_->lf_op1 = (op1); lf_->lf_op2 = (op2);                       \
+        lf_->lf_result = (result);                                      \
+    } while (0)
+
+// compute the pending arithmetic flags into eflags
+void x86_materialize_flags(x86CPU *);
+
 
 #define x86_rdsreg(cpu, reg) *(    ((x86CPU *)(cpu))->sreg_table_[reg]    )
 
@@ -33,7 +33,7 @@
 static _Bool branch_is_taken(struct exec_data, struct EFlags, reg32_t);
 
 static char *disassembleptr(x86CPU *, moffset32_t);
-static _Bool ptr_has_string(x86CPU *, moffset32_t);
+static _Bool ptr_has_string(x86CPU *, moffset32_t, char *, size_t);
 static char *getptrcontent(x86CPU *, moffset32_t);
 
 static void print_register(x86CPU *, const char *, reg32_t);
@@ -48,6 +48,7 @@ static const char *conf_x86dbg_arrow_right = "\033[0m ─▶ ";
 static const char *conf_x86dbg_arrow_left = "\033[0m ◀─ ";
 static uint8_t conf_x86dbg_max_stack_entries = 8;
 static uint8_t conf_x86dbg_disassemble_entries = 11;
+#define conf_x86dbg_max_string 128     // strings shown are cut after this many characters
 
 static moffset32_t p_start_disassemble_here = 0;
 
@@ -130,14 +131,22 @@ static _Bool branch_is_taken(struct exec_data data, struct EFlags eflags, reg32_
 }
 
 
-static _Bool ptr_has_string(x86CPU *cpu, moffset32_t vaddr)
+// the string is copied to the buffer, it's cut short if it doesn't fit
+static _Bool ptr_has_string(x86CPU *cpu, moffset32_t vaddr, char *buffer, size_t size)
 {
+    size_t len = x86_try_rdseq2(cpu, vaddr, (uint8_t *)buffer, size - 1, '\0');
+
+    buffer[len] = '\0';
+
     // TODO: internationalization! change this to check for utf-8
     // should be enough to determine if it points to a string
     // chances are pretty low that four random bytes will happen
     // to be all ascii
+    if (len < sizeof(moffset32_t))
+        return 0;
+
     for (size_t i = 0; i < sizeof(moffset32_t); i++) {
-        if (!isprint(x86_try_readM8(cpu, vaddr+i)))
+        if (!isprint(buffer[i]))
             return 0;
     }
 
@@ -195,6 +204,7 @@ static char *getptrcontent(x86CPU *cpu, moffset32_t vaddr)
     const char *stack_color = conf_x86dbg_stack_colorcode;
     const char *arrow_r = conf_x86dbg_arrow_right;
     const char *arrow_l = conf_x86dbg_arrow_left;
+    char str[conf_x86dbg_max_string + 1];
     int ptrtype;
 
     s = xstrdup("");
@@ -203,8 +213,7 @@ static char *getptrcontent(x86CPU *cpu, moffset32_t vaddr)
         ptrtype = x86_ptrtype(cpu, ptr);
 
         // try and see if there is a string
-        if ((ptrtype == STACK_PTR || ptrtype == DATA_PTR) && ptr_has_string(cpu, ptr)) {
-            const char *str = (const char *)x86_getptr(cpu, ptr);
+        if ((ptrtype == STACK_PTR || ptrtype == DATA_PTR) && ptr_has_string(cpu, ptr, str, sizeof(str))) {
             ptrstr = int2hexstr(ptr, 8);
             char *temp = s;
 
@@ -321,6 +330,7 @@ void x86dbg_print_state(x86CPU *cpu)
     if (!cpu)
         return;
 
+    x86_snapshot_registers(cpu);
     registers = tracer_get_savedstate(x86_tracer(cpu));
     // get the current function
     backtrace_size = tracer_get_backtrace_size(x86_tracer(cpu));
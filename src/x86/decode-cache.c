@@ -0,0 +1,99 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  cache of already decoded instructions indexed by their address.
+ *  Entries are decoded again once the MMU reports that the page they came
+ *  from was written to.
+ */
+
+#include <string.h>
+
+#include "../memory.h"
+
+#include "decode-cache.h"
+#include "disassembler.h"
+
+void dcache_init(x86DecodeCache *cache)
+{
+    if (!cache)
+        return;
+
+    cache->dc_entries = xcalloc(DCACHE_ENTRIES, sizeof(*cache->dc_entries));
+}
+
+void dcache_free(x86DecodeCache *cache)
+{
+    if (!cache)
+        return;
+
+    xfree(cache->dc_entries);
+    cache->dc_entries = NULL;
+}
+
+void dcache_flush(x86DecodeCache *cache)
+{
+    if (!cache || !cache->dc_entries)
+        return;
+
+    // only mark as invalid, a caller may still be holding an entry
+    for (size_t i = 0; i < DCACHE_ENTRIES; i++)
+        cache->dc_entries[i].dc_valid = 0;
+}
+
+const struct instruction *x86_decode_cached(x86CPU *cpu, moffset32_t eip)
+{
+    x86DecodeCache *cache;
+    dcache_entry_t *entry;
+    x86MMU *mmu;
+
+    if (!cpu)
+        return NULL;
+
+    cache = &cpu->dcache;
+    mmu = x86_mmu(cpu);
+
+    entry = &cache->dc_entries[eip & (DCACHE_ENTRIES - 1)];
+
+    if (entry->dc_valid && entry->dc_eip == eip) {
+        if (entry->dc_codegen == mmu_codegen(mmu))
+            return &entry->dc_instr;
+
+        // code was written to, but maybe not this one
+        if (!mmu_code_changed(mmu, eip, eip + entry->dc_instr.size, entry->dc_codegen)) {
+            entry->dc_codegen = mmu_codegen(mmu);
+            return &entry->dc_instr;
+        }
+    }
+
+    entry->dc_codegen = mmu_codegen(mmu);
+    entry->dc_instr = x86_decode(cpu, eip);
+    entry->dc_eip = eip;
+
+    // don't remember failures, let the decoder report them every time
+    entry->dc_valid = !entry->dc_instr.fail_to_fetch;
+
+    if (entry->dc_valid) {
+        mmu_mark_code(mmu, eip);
+        mmu_mark_code(mmu, eip + entry->dc_instr.size - 1);
+    }
+
+    return &entry->dc_instr;
+}
@@ -0,0 +1,55 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  cache of already decoded instructions indexed by their address.
+ */
+
+#ifndef DECODE_CACHE_H
+#define DECODE_CACHE_H
+
+#include <stdint.h>
+
+#include "../types.h"
+#include "instructions.h"
+
+// must be a power of two
+#define DCACHE_ENTRIES 4096
+
+typedef struct {
+    moffset32_t dc_eip;
+    _Bool dc_valid;
+    struct instruction dc_instr;
+
+    // the MMU code generation the entry was last known to be current in
+    uint32_t dc_codegen;
+} dcache_entry_t;
+
+typedef struct {
+    dcache_entry_t *dc_entries;
+} x86DecodeCache;
+
+void dcache_init(x86DecodeCache *);
+void dcache_free(x86DecodeCache *);
+
+// drop every entry
+void dcache_flush(x86DecodeCache *);
+
+#endif /* DECODE_CACHE_H */
@@ -31,6 +31,7 @@
 #include "../string-utils.h"
 
 #include "disassembler.h"
+#include "specialize.h"
 
 #include "x86-utils.h"
 
@@ -303,6 +304,7 @@ char *x86_disassemble(x86CPU *cpu, struct instruction ins)
             s = strcatall(4, mnemonic, num_color, immediate, "\033[0m");
             break;
         case imm8_AL:
+        case moffs32_AL:
             immediate = int2hexstr(ins.data.imm1, 0);
             s = strcatall(6, mnemonic, num_color,  immediate, ", ", operand_color, "al\033[0m");
             break;
@@ -316,6 +318,7 @@ char *x86_disassemble(x86CPU *cpu, struct instruction ins)
             s = strcatall(6, mnemonic, num_color, immediate, ", ", operand_color, "eax\033[0m");
             break;
         case AL_imm8:
+        case AL_moffs32:
             immediate = int2hexstr(ins.data.imm1, 0);
             s = strcatall(6, mnemonic, operand_color, "al\033[0m, ", num_color, immediate, "\033[0m");
             break;
@@ -650,7 +653,7 @@ struct instruction x86_decode(x86CPU *cpu, moffset32_t eip)
             if (data.adrsz_pfx)
                 dispsz = displacement16(data.modrm);
             else
-                dispsz = displacement32(data.modrm);
+                dispsz = displacement32(data.modrm, data.sib);
 
             if (dispsz == 8) {
                 data.moffset = x86_readM8(cpu, eip);
@@ -700,7 +703,7 @@ struct instruction x86_decode(x86CPU *cpu, moffset32_t eip)
             break;
         case rm32_imm32:
         case r32_rm32_imm32:
-            dispsz = displacement32(data.modrm);
+            dispsz = displacement32(data.modrm, data.sib);
 
             if (dispsz == 8) {
                 data.moffset = x86_readM8(cpu, eip);
@@ -713,6 +716,8 @@ struct instruction x86_decode(x86CPU *cpu, moffset32_t eip)
         case rela16_16:
         case ptr16_16:
         case eAX_imm32:
+        case AL_moffs32:
+        case moffs32_AL:
         case rela32:
         case imm32:
         case imm32_eAX:
@@ -815,7 +820,7 @@ struct instruction x86_decode(x86CPU *cpu, moffset32_t eip)
             if (data.adrsz_pfx)
                 dispsz = displacement16(data.modrm);
             else
-                dispsz = displacement32(data.modrm);
+                dispsz = displacement32(data.modrm, data.sib);
 
             if (dispsz == 8) {
                 data.moffset = x86_readM8(cpu, eip);
@@ -854,6 +859,8 @@ struct instruction x86_decode(x86CPU *cpu, moffset32_t eip)
     ins.encoding = encoding;
     ins.data.bytes = ins.size;
     ins.eip = old_eip;
+
+    x86_specialize(&ins);
     return ins;
 }
 
@@ -865,9 +872,9 @@ moffset32_t x86_findbranchtarget_relative(x86CPU *cpu, moffset32_t eip, struct e
         return 0;
 
     if (data.oprsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x77:  // JA rel8
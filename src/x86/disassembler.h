@@ -31,6 +31,8 @@ enum x86DecoderFlags {
 
 // decodes the bytes from the given buffer and returns a instruction ready for execution
 struct instruction x86_decode(x86CPU *, moffset32_t);
+// same as above but goes through the decode cache first (see decode-cache.c)
+const struct instruction *x86_decode_cached(x86CPU *, moffset32_t);
 // find the target address of a call
 moffset32_t x86_findbranchtarget_relative(x86CPU *, moffset32_t, struct exec_data);
 moffset32_t x86_findbranchtarget(x86CPU *, struct exec_data);
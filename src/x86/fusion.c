@@ -0,0 +1,290 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  fusion of frequent instruction pairs into a single block operation. The
+ *  fused handlers do the work of both instructions with one dispatch and,
+ *  for a compare followed by a conditional jump, decide the branch from the
+ *  operands instead of going through eflags.
+ *
+ *  Fusion only looks at handlers that x86_specialize() already picked, so
+ *  the operands are in data.reg1/reg2 and no prefix is involved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "fusion.h"
+
+#include "cpu.h"
+#include "general-purpose.h"
+#include "specialize.h"
+#include "x86-utils.h"
+
+static int fuse_pair(const struct block_op *, const struct block_op *, struct block_op *);
+static int fuse_single(const struct block_op *, struct block_op *);
+static int compare_pairs(const void *, const void *);
+
+#define simm8(imm) (    (uint32_t)(int8_t)lsb(imm)    )
+
+// jump relative to the end of the fused operation
+#define fused_branch(cpu, rel) x86_update_eip_absolute((cpu), x86_readR32((cpu), EIP) + (rel))
+
+//
+// Handlers
+//
+
+// cmp reg1, reg2; jcc rel (condition in data.ext, rel in data.imm1)
+void x86_fu_cmp_r32_r32_jcc(void *cpu, struct exec_data data)
+{
+    uint32_t a = x86_readR32(cpu, data.reg1);
+    uint32_t b = x86_readR32(cpu, data.reg2);
+
+    x86_lazyflags(cpu, LF_SUB, 32, a, b, a - b);
+
+    if (fusion_cc_sub(data.ext, a, b))
+        fused_branch(cpu, data.imm1);
+}
+
+// cmp reg1, imm2; jcc rel
+void x86_fu_cmp_r32_imm32_jcc(void *cpu, struct exec_data data)
+{
+    uint32_t a = x86_readR32(cpu, data.reg1);
+
+    x86_lazyflags(cpu, LF_SUB, 32, a, data.imm2, a - data.imm2);
+
+    if (fusion_cc_sub(data.ext, a, data.imm2))
+        fused_branch(cpu, data.imm1);
+}
+
+// test reg1, reg2; jcc rel
+void x86_fu_test_r32_r32_jcc(void *cpu, struct exec_data data)
+{
+    uint32_t result = x86_readR32(cpu, data.reg1) & x86_readR32(cpu, data.reg2);
+
+    x86_lazyflags(cpu, LF_LOGIC, 32, 0, 0, result);
+
+    if (fusion_cc_logic(data.ext, result))
+        fused_branch(cpu, data.imm1);
+}
+
+// test reg1, imm2; jcc rel
+void x86_fu_test_r32_imm32_jcc(void *cpu, struct exec_data data)
+{
+    uint32_t result = x86_readR32(cpu, data.reg1) & data.imm2;
+
+    x86_lazyflags(cpu, LF_LOGIC, 32, 0, 0, result);
+
+    if (fusion_cc_logic(data.ext, result))
+        fused_branch(cpu, data.imm1);
+}
+
+// the usual function prologue
+void x86_fu_push_ebp_mov_ebp_esp(void *cpu, struct exec_data data)
+{
+    (void)data;
+
+    x86__mm_r32_push(cpu, EBP);
+    x86_writeR32(cpu, EBP, x86_readR32(cpu, ESP));
+}
+
+// and its epilogue
+void x86_fu_leave_ret(void *cpu, struct exec_data data)
+{
+    (void)data;
+
+    x86_writeR32(cpu, ESP, x86_readR32(cpu, EBP));
+    x86__mm_r32_pop(cpu, EBP);
+    x86__mm_near_ret32(cpu);
+}
+
+// xor reg1, reg1
+void x86_fu_xor_zero_r32(void *cpu, struct exec_data data)
+{
+    x86_writeR32(cpu, data.reg1, 0);
+    x86_lazyflags(cpu, LF_LOGIC, 32, 0, 0, 0);
+}
+
+//
+// Fusion
+//
+
+int fusion_jcc_condition(const struct block_op *op)
+{
+    const struct exec_data *data = &op->bo_data;
+
+    if (op->bo_handler != x86_mm_jcc || data->oprsz_pfx || data->adrsz_pfx || data->lock)
+        return -1;
+
+    if (!data->is0f && (data->opc & 0xF0) == 0x70)
+        return data->opc & 0x0F;
+    if (data->is0f && (data->opc & 0xF0) == 0x80)
+        return data->opc & 0x0F;
+
+    return -1;
+}
+
+static int fuse_pair(const struct block_op *first, const struct block_op *second, struct block_op *fused)
+{
+    const struct exec_data *data1 = &first->bo_data;
+    const struct exec_data *data2 = &second->bo_data;
+    d_x86_instruction_handler handler = first->bo_handler;
+    int cc = fusion_jcc_condition(second);
+
+    *fused = *first;
+    fused->bo_size = first->bo_size + second->bo_size;
+
+    if (cc != -1) {
+        fused->bo_data.ext = cc;
+        fused->bo_data.imm1 = data2->is0f ? data2->imm1 : simm8(data2->imm1);
+
+        if (handler == x86_sp_cmp_r32_r32) {
+            fused->bo_handler = x86_fu_cmp_r32_r32_jcc;
+        } else if (handler == x86_sp_cmp_r32_imm32 || handler == x86_sp_cmp_r32_imm8) {
+            fused->bo_handler = x86_fu_cmp_r32_imm32_jcc;
+            fused->bo_data.imm2 = handler == x86_sp_cmp_r32_imm8 ? simm8(data1->imm1) : data1->imm1;
+        } else if (handler == x86_sp_test_r32_r32) {
+            fused->bo_handler = x86_fu_test_r32_r32_jcc;
+        } else if (handler == x86_sp_test_r32_imm32) {
+            fused->bo_handler = x86_fu_test_r32_imm32_jcc;
+            fused->bo_data.imm2 = data1->imm1;
+        } else {
+            return 0;
+        }
+
+        return 1;
+    }
+
+    if (handler == x86_sp_push_r32 && data1->reg1 == EBP && second->bo_handler == x86_sp_mov_r32_r32
+            && data2->reg1 == EBP && data2->reg2 == ESP) {
+        fused->bo_handler = x86_fu_push_ebp_mov_ebp_esp;
+        return 1;
+    }
+
+    if (handler == x86_leave && !data1->oprsz_pfx && !data1->lock && second->bo_handler == x86_mm_ret
+            && data2->opc == 0xC3 && !data2->oprsz_pfx && !data2->lock) {
+        fused->bo_handler = x86_fu_leave_ret;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int fuse_single(const struct block_op *op, struct block_op *fused)
+{
+    *fused = *op;
+
+    if (op->bo_handler == x86_sp_xor_r32_r32 && op->bo_data.reg1 == op->bo_data.reg2) {
+        fused->bo_handler = x86_fu_xor_zero_r32;
+        return 1;
+    }
+
+    return 0;
+}
+
+size_t x86_fuse_ops(struct block_op *ops, size_t nops)
+{
+    struct block_op fused;
+    size_t n = 0;
+
+    if (!ops)
+        return 0;
+
+    for (size_t i = 0; i < nops; i++) {
+        if (i + 1 < nops && fuse_pair(&ops[i], &ops[i + 1], &fused))
+            i++;
+        else
+            fuse_single(&ops[i], &fused);
+
+        ops[n++] = fused;
+    }
+
+    return n;
+}
+
+//
+// Profiling
+//
+
+// the last slot counts everything that didn't fit
+uint64_t fusion_profile_counts_[FUSION_PROFILE_PAIRS + 1];
+
+static struct {
+    const char *first;
+    const char *second;
+} profile_pairs[FUSION_PROFILE_PAIRS];
+
+uint32_t fusion_profile_pair(const char *first, const char *second)
+{
+    uint32_t index = (((uintptr_t)first >> 3) * 31 + ((uintptr_t)second >> 3)) & (FUSION_PROFILE_PAIRS - 1);
+
+    for (size_t i = 0; i < FUSION_PROFILE_PAIRS; i++) {
+        if (!profile_pairs[index].first) {
+            profile_pairs[index].first = first;
+            profile_pairs[index].second = second;
+            return index;
+        }
+
+        if (profile_pairs[index].first == first && profile_pairs[index].second == second)
+            return index;
+
+        index = (index + 1) & (FUSION_PROFILE_PAIRS - 1);
+    }
+
+    return FUSION_PROFILE_PAIRS;
+}
+
+static int compare_pairs(const void *a, const void *b)
+{
+    uint64_t count_a = fusion_profile_counts_[*(const uint32_t *)a];
+    uint64_t count_b = fusion_profile_counts_[*(const uint32_t *)b];
+
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+void fusion_report(void)
+{
+    static uint32_t order[FUSION_PROFILE_PAIRS];
+    uint64_t total = fusion_profile_counts_[FUSION_PROFILE_PAIRS];
+    size_t npairs = 0;
+
+    for (uint32_t i = 0; i < FUSION_PROFILE_PAIRS; i++) {
+        if (!profile_pairs[i].first)
+            continue;
+
+        order[npairs++] = i;
+        total += fusion_profile_counts_[i];
+    }
+
+    if (!total)
+        return;
+
+    qsort(order, npairs, sizeof(*order), compare_pairs);
+
+    fprintf(stderr, "\nhottest instruction pairs (%" PRIu64 " executed):\n", total);
+
+    for (size_t i = 0; i < npairs && i < FUSION_REPORT_PAIRS; i++) {
+        uint64_t count = fusion_profile_counts_[order[i]];
+
+        fprintf(stderr, "%14" PRIu64 "  %6.2f%%  %s; %s\n", count, 100.0 * count / total,
+                profile_pairs[order[i]].first, profile_pairs[order[i]].second);
+    }
+}
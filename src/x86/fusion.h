@@ -0,0 +1,107 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  fusion of frequent instruction pairs in a block into a single operation,
+ *  and a profiler of the pairs that are executed the most.
+ */
+
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "block-cache.h"
+#include "x86-utils.h"
+
+// size of the pair profile, pairs seen after it is full are not counted
+#define FUSION_PROFILE_PAIRS 4096
+
+// number of pairs printed by fusion_report()
+#define FUSION_REPORT_PAIRS 20
+
+// replace the known pairs (and single instruction idioms) in ops by fused
+// operations, returns the new number of operations
+size_t x86_fuse_ops(struct block_op *, size_t);
+
+// the condition code of a jcc with a rel8 or rel32 displacement, -1 for
+// anything else
+int fusion_jcc_condition(const struct block_op *);
+
+// the index of the pair "first; second" in the profile, mnemonics are used as
+// given, they must outlive the profile
+uint32_t fusion_profile_pair(const char *, const char *);
+
+#define fusion_profile_count(index) (fusion_profile_counts_[index]++)
+extern uint64_t fusion_profile_counts_[];
+
+// print the hottest pairs to stderr
+void fusion_report(void);
+
+// the condition codes are the low nibble of the jcc opcodes, in pairs where
+// the odd one is the negation of the even one:
+//   O, NO, B, AE, E, NE, BE, A, S, NS, P, NP, L, GE, LE, G
+
+// condition after a 32-bit cmp a, b
+static inline _Bool fusion_cc_sub(uint8_t cc, uint32_t a, uint32_t b)
+{
+    uint32_t result = a - b;
+    _Bool cond;
+
+    switch (cc >> 1) {
+        case 0: cond = ((a ^ b) & (a ^ result)) >> 31; break;
+        case 1: cond = a < b; break;
+        case 2: cond = a == b; break;
+        case 3: cond = a <= b; break;
+        case 4: cond = result >> 31; break;
+        case 5: cond = parity_even(result); break;
+        case 6: cond = (int32_t)a < (int32_t)b; break;
+        default: cond = (int32_t)a <= (int32_t)b; break;
+    }
+
+    return cond ^ (cc & 1);
+}
+
+// condition after a logic operation, CF and OF are always clear
+static inline _Bool fusion_cc_logic(uint8_t cc, uint32_t result)
+{
+    _Bool cond;
+
+    switch (cc >> 1) {
+        case 0: case 1: cond = 0; break;
+        case 2: case 3: cond = result == 0; break;
+        case 4: case 6: cond = result >> 31; break;
+        case 5: cond = parity_even(result); break;
+        default: cond = result == 0 || result >> 31; break;
+    }
+
+    return cond ^ (cc & 1);
+}
+
+void x86_fu_cmp_r32_r32_jcc(void *, struct exec_data);
+void x86_fu_cmp_r32_imm32_jcc(void *, struct exec_data);
+void x86_fu_test_r32_r32_jcc(void *, struct exec_data);
+void x86_fu_test_r32_imm32_jcc(void *, struct exec_data);
+void x86_fu_push_ebp_mov_ebp_esp(void *, struct exec_data);
+void x86_fu_leave_ret(void *, struct exec_data);
+void x86_fu_xor_zero_r32(void *, struct exec_data);
+
+#endif /* FUSION_H */
@@ -34,36 +34,19 @@ static uint32_t x86__mm_mX_immX_locked_xor(void *, moffset32_t, uint32_t, int);
 static uint32_t x86__mm_rX_immX_xor(void *cpu, uint8_t reg, uint32_t imm, int size)
 {
     uint32_t result = 0;
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, PF);
 
     if (size == 8) {
         result = x86_readR8(cpu, reg) ^ lsb(imm);
         x86_writeR8(cpu, reg, lsb(result));
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
     } else if (size == 16) {
         result = x86_readR16(cpu, reg) ^ low16(imm);
         x86_writeR16(cpu, reg, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
     } else {
         result = x86_readR32(cpu, reg) ^ imm;
         x86_writeR32(cpu, reg, result);
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
+    x86_lazyflags(cpu, LF_LOGIC, size, 0, 0, result);
 
     return result;
 }
@@ -72,78 +55,47 @@ static uint32_t x86__mm_mX_immX_xor(void *cpu, moffset32_t vaddr, uint32_t imm,
 {
     uint32_t result;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         result = x86_readM8(cpu, vaddr) ^ lsb(imm);
         x86_writeM8(cpu, vaddr, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
     } else if (size == 16) {
         result = x86_readM16(cpu, vaddr) ^ low16(imm);
         x86_writeM16(cpu, vaddr, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
     } else {
         result = x86_readM32(cpu, vaddr) ^ imm;
         x86_writeM32(cpu, vaddr, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
+    x86_lazyflags(cpu, LF_LOGIC, size, 0, 0, result);
 
     return result;
 }
 
+// there's no host instruction returning the old value, retry until nobody
+// wrote between our read and our write
 static uint32_t x86__mm_mX_immX_locked_xor(void *cpu, moffset32_t vaddr, uint32_t imm, int size)
 {
     uint32_t result;
-
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, PF);
+    uint32_t operand1;
 
     if (size == 8) {
-        result = x86_atomic_readM8(cpu, vaddr) ^ lsb(imm);
-        x86_atomic_writeM8(cpu, vaddr, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
+        do {
+            operand1 = x86_atomic_readM8(cpu, vaddr);
+            result = lsb(operand1 ^ imm);
+        } while (x86_atomic_cmpxchgM8(cpu, vaddr, operand1, result) != operand1);
     } else if (size == 16) {
-        result = x86_atomic_readM16(cpu, vaddr) ^ low16(imm);
-        x86_atomic_writeM16(cpu, vaddr, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
+        do {
+            operand1 = x86_atomic_readM16(cpu, vaddr);
+            result = low16(operand1 ^ imm);
+        } while (x86_atomic_cmpxchgM16(cpu, vaddr, operand1, result) != operand1);
     } else {
-        result = x86_atomic_readM32(cpu, vaddr) ^ imm;
-        x86_atomic_writeM32(cpu, vaddr, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
+        do {
+            operand1 = x86_atomic_readM32(cpu, vaddr);
+            result = operand1 ^ imm;
+        } while (x86_atomic_cmpxchgM32(cpu, vaddr, operand1, result) != operand1);
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
+    x86_lazyflags(cpu, LF_LOGIC, size, 0, 0, result);
 
     return result;
 }
@@ -389,39 +341,18 @@ static uint32_t x86__mm_rX_immX_and(void *cpu, uint8_t reg, uint32_t imm, int si
 {
     uint32_t result;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         result = x86_readR8(cpu, reg) & sign8to32(lsb(imm));
         x86_writeR8(cpu, reg, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
     } else if (size == 16) {
         result = x86_readR16(cpu, reg) & sign16to32(low16(imm));
         x86_writeR16(cpu, reg, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
     } else {
         result = x86_readR32(cpu, reg) & imm;
         x86_writeR32(cpu, reg, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
+    x86_lazyflags(cpu, LF_LOGIC, size, 0, 0, result);
 
     return result;
 }
@@ -430,40 +361,18 @@ static uint32_t x86__mm_mX_immX_and(void *cpu, moffset32_t vaddr, uint32_t imm,
 {
     uint32_t result;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         result = x86_readM8(cpu, vaddr) & sign8to32(lsb(imm));
         x86_writeM8(cpu, vaddr, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
     } else if (size == 16) {
         result = x86_readM16(cpu, vaddr) & sign16to32(low16(imm));
         x86_writeM16(cpu, vaddr, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
     } else {
         result = x86_readM32(cpu, vaddr) & imm;
         x86_writeM32(cpu, vaddr, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
+    x86_lazyflags(cpu, LF_LOGIC, size, 0, 0, result);
 
     return result;
 }
@@ -471,41 +380,26 @@ static uint32_t x86__mm_mX_immX_and(void *cpu, moffset32_t vaddr, uint32_t imm,
 static uint32_t x86__mm_mX_immX_locked_and(void *cpu, moffset32_t vaddr, uint32_t imm, int size)
 {
     uint32_t result;
-
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, PF);
+    uint32_t operand1;
 
     if (size == 8) {
-        result = x86_atomic_readM8(cpu, vaddr) & sign8to32(lsb(imm));
-        x86_atomic_writeM8(cpu, vaddr, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
+        do {
+            operand1 = x86_atomic_readM8(cpu, vaddr);
+            result = lsb(operand1 & imm);
+        } while (x86_atomic_cmpxchgM8(cpu, vaddr, operand1, result) != operand1);
     } else if (size == 16) {
-        result = x86_atomic_readM16(cpu, vaddr) & sign16to32(low16(imm));
-        x86_atomic_writeM16(cpu, vaddr, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
+        do {
+            operand1 = x86_atomic_readM16(cpu, vaddr);
+            result = low16(operand1 & imm);
+        } while (x86_atomic_cmpxchgM16(cpu, vaddr, operand1, result) != operand1);
     } else {
-        result = x86_atomic_readM32(cpu, vaddr) & imm;
-        x86_atomic_writeM32(cpu, vaddr, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
+        do {
+            operand1 = x86_atomic_readM32(cpu, vaddr);
+            result = operand1 & imm;
+        } while (x86_atomic_cmpxchgM32(cpu, vaddr, operand1, result) != operand1);
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
+    x86_lazyflags(cpu, LF_LOGIC, size, 0, 0, result);
 
     return result;
 }
@@ -767,12 +661,12 @@ void x86__mm_m8_imm8_mov(void *cpu, moffset32_t dest, uint8_t imm)
     x86_writeM8(cpu, dest, imm);
 }
 
-void x86__mm_m16_imm16_mov(void *cpu, moffset32_t dest, uint8_t imm)
+void x86__mm_m16_imm16_mov(void *cpu, moffset32_t dest, uint16_t imm)
 {
     x86_writeM16(cpu, dest, imm);
 }
 
-void x86__mm_m32_imm32_mov(void *cpu, moffset32_t dest, uint8_t imm)
+void x86__mm_m32_imm32_mov(void *cpu, moffset32_t dest, uint32_t imm)
 {
     x86_writeM32(cpu, dest, imm);
 }
@@ -847,61 +741,21 @@ static uint32_t x86__mm_mX_immX_add(void *cpu, moffset32_t vaddr, uint32_t imm,
     uint32_t result = 0;
     uint32_t operand1;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, AF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         operand1 = x86_readM8(cpu, vaddr);
         result = lsb(operand1) + lsb(imm);
         x86_writeM8(cpu, vaddr, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow8(lsb(operand1), lsb(imm), lsb(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else if (size == 16) {
         operand1 = x86_readM16(cpu, vaddr);
         result = low16(operand1) + low16(imm);
         x86_writeM16(cpu, vaddr, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow16(low16(operand1), low16(imm), low16(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else {
         operand1 = x86_readM32(cpu, vaddr);
         result = operand1 + imm;
         x86_writeM32(cpu, vaddr, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow32(operand1, imm, result)) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
-
-    if (auxcarry(operand1, imm))
-        x86_setflag(cpu, AF);
+    x86_lazyflags(cpu, LF_ADD, size, operand1, imm, result);
 
     return result;
 }
@@ -911,62 +765,18 @@ static uint32_t x86__mm_mX_immX_locked_add(void *cpu, moffset32_t vaddr, uint32_
     uint32_t result = 0;
     uint32_t operand1;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, AF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
-        operand1 = x86_atomic_readM8(cpu, vaddr);
+        operand1 = x86_atomic_xaddM8(cpu, vaddr, lsb(imm));
         result = lsb(operand1) + lsb(imm);
-
-        x86_atomic_writeM8(cpu, vaddr, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow8(lsb(operand1), lsb(imm), lsb(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else if (size == 16) {
-        operand1 = x86_atomic_readM16(cpu, vaddr);
+        operand1 = x86_atomic_xaddM16(cpu, vaddr, low16(imm));
         result = low16(operand1) + low16(imm);
-        x86_atomic_writeM16(cpu, vaddr, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow16(low16(operand1), low16(imm), low16(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else {
-        operand1 = x86_atomic_readM32(cpu, vaddr);
+        operand1 = x86_atomic_xaddM32(cpu, vaddr, imm);
         result = operand1 + imm;
-        x86_atomic_writeM32(cpu, vaddr, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow32(operand1, imm, result)) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
-
-    if (auxcarry(operand1, imm))
-        x86_setflag(cpu, AF);
+    x86_lazyflags(cpu, LF_ADD, size, operand1, imm, result);
 
     return result;
 }
@@ -976,62 +786,22 @@ static uint32_t x86__mm_rX_immX_add(void *cpu, uint8_t dest, uint32_t imm, size_
     uint32_t result = 0;
     uint32_t operand1;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, AF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         operand1 = x86_readR8(cpu, dest);
         result = lsb(operand1) + lsb(imm);
 
         x86_writeR8(cpu, dest, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow8(lsb(operand1), lsb(imm), lsb(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else if (size == 16) {
         operand1 = x86_readR16(cpu, dest);
         result = low16(operand1) + low16(imm);
         x86_writeR16(cpu, dest, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow16(low16(operand1), low16(imm), low16(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else {
         operand1 = x86_readR32(cpu, dest);
         result = operand1 + imm;
         x86_writeR32(cpu, dest, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow32(operand1, imm, result)) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
-
-    if (auxcarry(operand1, imm))
-        x86_setflag(cpu, AF);
+    x86_lazyflags(cpu, LF_ADD, size, operand1, imm, result);
 
     return result;
 }
@@ -1141,7 +911,7 @@ uint32_t x86__mm_r32_m32_add(void *cpu, uint8_t dest, moffset32_t vaddr, _Bool l
 {
     if (lock)
         return x86__mm_rX_immX_add(cpu, dest, x86_atomic_readM32(cpu, vaddr), 32);
-    return x86__mm_rX_immX_add(cpu, vaddr, x86_readM32(cpu, vaddr), 32);
+    return x86__mm_rX_immX_add(cpu, dest, x86_readM32(cpu, vaddr), 32);
 }
 
 
@@ -1170,61 +940,21 @@ static uint32_t x86__mm_mX_immX_sub(void *cpu, moffset32_t vaddr, uint32_t imm,
     uint32_t result = 0;
     uint32_t operand1;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, AF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         operand1 = x86_readM8(cpu, vaddr);
         result = lsb(operand1) - lsb(imm);
         x86_writeM8(cpu, vaddr, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow8(lsb(operand1), lsb(imm), lsb(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else if (size == 16) {
         operand1 = x86_readM16(cpu, vaddr);
         result = low16(operand1) - low16(imm);
         x86_writeM16(cpu, vaddr, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow16(low16(operand1), low16(imm), low16(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else {
         operand1 = x86_readM32(cpu, vaddr);
         result = operand1 - imm;
         x86_writeM32(cpu, vaddr, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow32(operand1, imm, result)) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
-
-    if (auxborrow(operand1, imm))
-        x86_setflag(cpu, AF);
+    x86_lazyflags(cpu, LF_SUB, size, operand1, imm, result);
 
     return result;
 }
@@ -1234,62 +964,18 @@ static uint32_t x86__mm_mX_immX_locked_sub(void *cpu, moffset32_t vaddr, uint32_
     uint32_t result = 0;
     uint32_t operand1;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, AF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
-        operand1 = x86_atomic_readM8(cpu, vaddr);
+        operand1 = x86_atomic_xaddM8(cpu, vaddr, -lsb(imm));
         result = lsb(operand1) - lsb(imm);
-
-        x86_atomic_writeM8(cpu, vaddr, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow8(lsb(operand1), lsb(imm), lsb(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else if (size == 16) {
-        operand1 = x86_atomic_readM16(cpu, vaddr);
+        operand1 = x86_atomic_xaddM16(cpu, vaddr, -low16(imm));
         result = low16(operand1) - low16(imm);
-        x86_atomic_writeM16(cpu, vaddr, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow16(low16(operand1), low16(imm), low16(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else {
-        operand1 = x86_atomic_readM32(cpu, vaddr);
+        operand1 = x86_atomic_xaddM32(cpu, vaddr, -imm);
         result = operand1 - imm;
-        x86_atomic_writeM32(cpu, vaddr, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow32(operand1, imm, result)) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
-
-    if (auxborrow(operand1, imm))
-        x86_setflag(cpu, AF);
+    x86_lazyflags(cpu, LF_SUB, size, operand1, imm, result);
 
     return result;
 }
@@ -1299,62 +985,22 @@ static uint32_t x86__mm_rX_immX_sub(void *cpu, uint8_t dest, uint32_t imm, size_
     uint32_t result = 0;
     uint32_t operand1;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, AF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         operand1 = x86_readR8(cpu, dest);
         result = lsb(operand1) - lsb(imm);
 
         x86_writeR8(cpu, dest, lsb(result));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow8(lsb(operand1), lsb(imm), lsb(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else if (size == 16) {
         operand1 = x86_readR16(cpu, dest);
         result = low16(operand1) - low16(imm);
         x86_writeR16(cpu, dest, low16(result));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow16(low16(operand1), low16(imm), low16(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else {
         operand1 = x86_readR32(cpu, dest);
         result = operand1 - imm;
         x86_writeR32(cpu, dest, result);
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow32(operand1, imm, result)) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
-
-    if (auxborrow(operand1, imm))
-        x86_setflag(cpu, AF);
+    x86_lazyflags(cpu, LF_SUB, size, operand1, imm, result);
 
     return result;
 }
@@ -1477,73 +1123,30 @@ static void x86__mm_rX_immX_test(void *cpu, uint8_t reg, uint32_t imm, int size)
 {
     uint32_t result;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         result = x86_readR8(cpu, reg) & sign8to32(lsb(imm));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
     } else if (size == 16) {
         result = x86_readR16(cpu, reg) & sign16to32(low16(imm));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
     } else {
         result = x86_readR32(cpu, reg) & imm;
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
+    x86_lazyflags(cpu, LF_LOGIC, size, 0, 0, result);
 }
 
 static void x86__mm_mX_immX_test(void *cpu, moffset32_t vaddr, uint32_t imm, int size)
 {
     uint32_t result;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         result = x86_readM8(cpu, vaddr) & sign8to32(lsb(imm));
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
     } else if (size == 16) {
         result = x86_readM16(cpu, vaddr) & sign16to32(low16(imm));
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
     } else {
         result = x86_readM32(cpu, vaddr) & imm;
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
+    x86_lazyflags(cpu, LF_LOGIC, size, 0, 0, result);
 }
 
 void x86__mm_al_imm8_test(void *cpu, uint8_t imm)
@@ -1619,7 +1222,7 @@ void x86__mm_m16_r16_test(void *cpu, moffset32_t vaddr, uint8_t reg)
 
 void x86__mm_m32_r32_test(void *cpu, moffset32_t vaddr, uint8_t reg)
 {
-    x86__mm_mX_immX_test(cpu, vaddr, x86_readR32(cpu, reg), 16);
+    x86__mm_mX_immX_test(cpu, vaddr, x86_readR32(cpu, reg), 32);
 }
 
 
@@ -1633,58 +1236,18 @@ static _Bool x86__mm_rX_immX_cmp(void *cpu, uint8_t src, uint32_t imm, uint8_t s
     uint32_t result = 0;
     uint32_t operand1;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, AF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         operand1 = x86_readR8(cpu, src);
         result = lsb(operand1) - lsb(imm);
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow8(lsb(operand1), lsb(imm), lsb(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else if (size == 16) {
         operand1 = x86_readR16(cpu, src);
         result = low16(operand1) - low16(imm);
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow16(low16(operand1), low16(imm), low16(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else {
         operand1 = x86_readR32(cpu, src);
         result = operand1 - imm;
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow32(operand1, imm, result)) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
-
-    if (auxborrow(operand1, imm))
-        x86_setflag(cpu, AF);
+    x86_lazyflags(cpu, LF_SUB, size, operand1, imm, result);
 
     return result;
 }
@@ -1694,58 +1257,18 @@ static _Bool x86__mm_mX_immX_cmp(void *cpu, moffset32_t src, uint32_t imm, uint8
     uint32_t result = 0;
     uint32_t operand1;
 
-    x86_clearflag(cpu, OF);
-    x86_clearflag(cpu, SF);
-    x86_clearflag(cpu, ZF);
-    x86_clearflag(cpu, AF);
-    x86_clearflag(cpu, CF);
-    x86_clearflag(cpu, PF);
-
     if (size == 8) {
         operand1 = x86_readM8(cpu, src);
         result = lsb(operand1) - lsb(imm);
-
-        if (signbit8(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow8(lsb(operand1), lsb(imm), lsb(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else if (size == 16) {
         operand1 = x86_readM16(cpu, src);
         result = low16(operand1) - low16(imm);
-
-        if (signbit16(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow16(low16(operand1), low16(imm), low16(result))) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
-
     } else {
         operand1 = x86_readM32(cpu, src);
         result = operand1 - imm;
-
-        if (signbit32(result))
-            x86_setflag(cpu, SF);
-
-        if (overflow32(operand1, imm, result)) {
-            x86_setflag(cpu, OF);
-            x86_setflag(cpu, CF);
-        }
     }
 
-    if (!result)
-        x86_setflag(cpu, ZF);
-
-    if (parity_even(result))
-        x86_setflag(cpu, PF);
-
-    if (auxborrow(operand1, imm))
-        x86_setflag(cpu, AF);
+    x86_lazyflags(cpu, LF_SUB, size, operand1, imm, result);
 
     return result;
 }
@@ -1922,3 +1445,340 @@ void x86__mm_far_absl_ptr32_jmp(void *cpu, uint16_t segment, moffset32_t offset)
     x86_writeR32(cpu, CS, segment);
     x86_update_eip_absolute(cpu, offset);
 }
+
+
+// XCHG
+
+static void x86__mm_rX_rX_xchg(void *, uint8_t, uint8_t, int);
+static void x86__mm_mX_rX_xchg(void *, moffset32_t, uint8_t, int);
+
+static void x86__mm_rX_rX_xchg(void *cpu, uint8_t dest, uint8_t src, int size)
+{
+    uint32_t tmp;
+
+    if (size == 8) {
+        tmp = x86_readR8(cpu, dest);
+        x86_writeR8(cpu, dest, x86_readR8(cpu, src));
+        x86_writeR8(cpu, src, tmp);
+    } else if (size == 16) {
+        tmp = x86_readR16(cpu, dest);
+        x86_writeR16(cpu, dest, x86_readR16(cpu, src));
+        x86_writeR16(cpu, src, tmp);
+    } else {
+        tmp = x86_readR32(cpu, dest);
+        x86_writeR32(cpu, dest, x86_readR32(cpu, src));
+        x86_writeR32(cpu, src, tmp);
+    }
+}
+
+// with a memory operand the processor locks the bus even without the prefix
+static void x86__mm_mX_rX_xchg(void *cpu, moffset32_t vaddr, uint8_t src, int size)
+{
+    if (size == 8)
+        x86_writeR8(cpu, src, x86_atomic_xchgM8(cpu, vaddr, x86_readR8(cpu, src)));
+    else if (size == 16)
+        x86_writeR16(cpu, src, x86_atomic_xchgM16(cpu, vaddr, x86_readR16(cpu, src)));
+    else
+        x86_writeR32(cpu, src, x86_atomic_xchgM32(cpu, vaddr, x86_readR32(cpu, src)));
+}
+
+void x86__mm_r8_r8_xchg(void *cpu, uint8_t dest, uint8_t src)
+{
+    x86__mm_rX_rX_xchg(cpu, dest, src, 8);
+}
+
+void x86__mm_r16_r16_xchg(void *cpu, uint8_t dest, uint8_t src)
+{
+    x86__mm_rX_rX_xchg(cpu, dest, src, 16);
+}
+
+void x86__mm_r32_r32_xchg(void *cpu, uint8_t dest, uint8_t src)
+{
+    x86__mm_rX_rX_xchg(cpu, dest, src, 32);
+}
+
+void x86__mm_m8_r8_xchg(void *cpu, moffset32_t vaddr, uint8_t src)
+{
+    x86__mm_mX_rX_xchg(cpu, vaddr, src, 8);
+}
+
+void x86__mm_m16_r16_xchg(void *cpu, moffset32_t vaddr, uint8_t src)
+{
+    x86__mm_mX_rX_xchg(cpu, vaddr, src, 16);
+}
+
+void x86__mm_m32_r32_xchg(void *cpu, moffset32_t vaddr, uint8_t src)
+{
+    x86__mm_mX_rX_xchg(cpu, vaddr, src, 32);
+}
+
+
+// CMPXCHG
+
+static _Bool x86__mm_rX_rX_cmpxchg(void *, uint8_t, uint8_t, int);
+static _Bool x86__mm_mX_rX_cmpxchg(void *, moffset32_t, uint8_t, int, _Bool);
+
+static _Bool x86__mm_rX_rX_cmpxchg(void *cpu, uint8_t dest, uint8_t src, int size)
+{
+    uint32_t accumulator;
+    uint32_t operand2;
+    uint32_t result;
+
+    if (size == 8) {
+        accumulator = x86_readR8(cpu, AL);
+        operand2 = x86_readR8(cpu, dest);
+        result = lsb(accumulator) - lsb(operand2);
+
+        if (accumulator == operand2)
+            x86_writeR8(cpu, dest, x86_readR8(cpu, src));
+        else
+            x86_writeR8(cpu, AL, operand2);
+    } else if (size == 16) {
+        accumulator = x86_readR16(cpu, AX);
+        operand2 = x86_readR16(cpu, dest);
+        result = low16(accumulator) - low16(operand2);
+
+        if (accumulator == operand2)
+            x86_writeR16(cpu, dest, x86_readR16(cpu, src));
+        else
+            x86_writeR16(cpu, AX, operand2);
+    } else {
+        accumulator = x86_readR32(cpu, EAX);
+        operand2 = x86_readR32(cpu, dest);
+        result = accumulator - operand2;
+
+        if (accumulator == operand2)
+            x86_writeR32(cpu, dest, x86_readR32(cpu, src));
+        else
+            x86_writeR32(cpu, EAX, operand2);
+    }
+
+    x86_lazyflags(cpu, LF_SUB, size, accumulator, operand2, result);
+
+    return accumulator == operand2;
+}
+
+static _Bool x86__mm_mX_rX_cmpxchg(void *cpu, moffset32_t vaddr, uint8_t src, int size, _Bool lock)
+{
+    uint32_t accumulator;
+    uint32_t operand2;
+    uint32_t result;
+
+    if (size == 8) {
+        accumulator = x86_readR8(cpu, AL);
+
+        if (lock) {
+            operand2 = x86_atomic_cmpxchgM8(cpu, vaddr, accumulator, x86_readR8(cpu, src));
+        } else {
+            operand2 = x86_readM8(cpu, vaddr);
+            if (operand2 == accumulator)
+                x86_writeM8(cpu, vaddr, x86_readR8(cpu, src));
+        }
+
+        if (operand2 != accumulator)
+            x86_writeR8(cpu, AL, operand2);
+        result = lsb(accumulator) - lsb(operand2);
+    } else if (size == 16) {
+        accumulator = x86_readR16(cpu, AX);
+
+        if (lock) {
+            operand2 = x86_atomic_cmpxchgM16(cpu, vaddr, accumulator, x86_readR16(cpu, src));
+        } else {
+            operand2 = x86_readM16(cpu, vaddr);
+            if (operand2 == accumulator)
+                x86_writeM16(cpu, vaddr, x86_readR16(cpu, src));
+        }
+
+        if (operand2 != accumulator)
+            x86_writeR16(cpu, AX, operand2);
+        result = low16(accumulator) - low16(operand2);
+    } else {
+        accumulator = x86_readR32(cpu, EAX);
+
+        if (lock) {
+            operand2 = x86_atomic_cmpxchgM32(cpu, vaddr, accumulator, x86_readR32(cpu, src));
+        } else {
+            operand2 = x86_readM32(cpu, vaddr);
+            if (operand2 == accumulator)
+                x86_writeM32(cpu, vaddr, x86_readR32(cpu, src));
+        }
+
+        if (operand2 != accumulator)
+            x86_writeR32(cpu, EAX, operand2);
+        result = accumulator - operand2;
+    }
+
+    x86_lazyflags(cpu, LF_SUB, size, accumulator, operand2, result);
+
+    return accumulator == operand2;
+}
+
+_Bool x86__mm_r8_r8_cmpxchg(void *cpu, uint8_t dest, uint8_t src)
+{
+    return x86__mm_rX_rX_cmpxchg(cpu, dest, src, 8);
+}
+
+_Bool x86__mm_r16_r16_cmpxchg(void *cpu, uint8_t dest, uint8_t src)
+{
+    return x86__mm_rX_rX_cmpxchg(cpu, dest, src, 16);
+}
+
+_Bool x86__mm_r32_r32_cmpxchg(void *cpu, uint8_t dest, uint8_t src)
+{
+    return x86__mm_rX_rX_cmpxchg(cpu, dest, src, 32);
+}
+
+_Bool x86__mm_m8_r8_cmpxchg(void *cpu, moffset32_t vaddr, uint8_t src, _Bool lock)
+{
+    return x86__mm_mX_rX_cmpxchg(cpu, vaddr, src, 8, lock);
+}
+
+_Bool x86__mm_m16_r16_cmpxchg(void *cpu, moffset32_t vaddr, uint8_t src, _Bool lock)
+{
+    return x86__mm_mX_rX_cmpxchg(cpu, vaddr, src, 16, lock);
+}
+
+_Bool x86__mm_m32_r32_cmpxchg(void *cpu, moffset32_t vaddr, uint8_t src, _Bool lock)
+{
+    return x86__mm_mX_rX_cmpxchg(cpu, vaddr, src, 32, lock);
+}
+
+// EDX:EAX is compared, ECX:EBX is stored. Only ZF is changed.
+_Bool x86__mm_m64_cmpxchg8b(void *cpu, moffset32_t vaddr, _Bool lock)
+{
+    uint64_t expected = ((uint64_t)x86_readR32(cpu, EDX) << 32) | x86_readR32(cpu, EAX);
+    uint64_t desired = ((uint64_t)x86_readR32(cpu, ECX) << 32) | x86_readR32(cpu, EBX);
+    uint64_t old;
+
+    if (lock) {
+        old = x86_atomic_cmpxchgM64(cpu, vaddr, expected, desired);
+    } else {
+        old = x86_readM32(cpu, vaddr) | ((uint64_t)x86_readM32(cpu, vaddr + 4) << 32);
+        if (old == expected)
+            x86_writeM64(cpu, vaddr, desired);
+    }
+
+    if (old == expected) {
+        x86_setflag(cpu, ZF);
+        return 1;
+    }
+
+    x86_writeR32(cpu, EAX, (uint32_t)old);
+    x86_writeR32(cpu, EDX, (uint32_t)(old >> 32));
+    x86_clearflag(cpu, ZF);
+
+    return 0;
+}
+
+
+// XADD
+
+static uint32_t x86__mm_rX_rX_xadd(void *, uint8_t, uint8_t, int);
+static uint32_t x86__mm_mX_rX_xadd(void *, moffset32_t, uint8_t, int, _Bool);
+
+static uint32_t x86__mm_rX_rX_xadd(void *cpu, uint8_t dest, uint8_t src, int size)
+{
+    uint32_t operand1;
+    uint32_t operand2;
+    uint32_t result;
+
+    if (size == 8) {
+        operand1 = x86_readR8(cpu, dest);
+        operand2 = x86_readR8(cpu, src);
+        result = lsb(operand1) + lsb(operand2);
+        x86_writeR8(cpu, src, operand1);
+        x86_writeR8(cpu, dest, lsb(result));
+    } else if (size == 16) {
+        operand1 = x86_readR16(cpu, dest);
+        operand2 = x86_readR16(cpu, src);
+        result = low16(operand1) + low16(operand2);
+        x86_writeR16(cpu, src, operand1);
+        x86_writeR16(cpu, dest, low16(result));
+    } else {
+        operand1 = x86_readR32(cpu, dest);
+        operand2 = x86_readR32(cpu, src);
+        result = operand1 + operand2;
+        x86_writeR32(cpu, src, operand1);
+        x86_writeR32(cpu, dest, result);
+    }
+
+    x86_lazyflags(cpu, LF_ADD, size, operand1, operand2, result);
+
+    return result;
+}
+
+static uint32_t x86__mm_mX_rX_xadd(void *cpu, moffset32_t vaddr, uint8_t src, int size, _Bool lock)
+{
+    uint32_t operand1;
+    uint32_t operand2;
+    uint32_t result;
+
+    if (size == 8) {
+        operand2 = x86_readR8(cpu, src);
+        if (lock) {
+            operand1 = x86_atomic_xaddM8(cpu, vaddr, operand2);
+            result = lsb(operand1) + lsb(operand2);
+        } else {
+            operand1 = x86_readM8(cpu, vaddr);
+            result = lsb(operand1) + lsb(operand2);
+            x86_writeM8(cpu, vaddr, lsb(result));
+        }
+        x86_writeR8(cpu, src, operand1);
+    } else if (size == 16) {
+        operand2 = x86_readR16(cpu, src);
+        if (lock) {
+            operand1 = x86_atomic_xaddM16(cpu, vaddr, operand2);
+            result = low16(operand1) + low16(operand2);
+        } else {
+            operand1 = x86_readM16(cpu, vaddr);
+            result = low16(operand1) + low16(operand2);
+            x86_writeM16(cpu, vaddr, low16(result));
+        }
+        x86_writeR16(cpu, src, operand1);
+    } else {
+        operand2 = x86_readR32(cpu, src);
+        if (lock) {
+            operand1 = x86_atomic_xaddM32(cpu, vaddr, operand2);
+            result = operand1 + operand2;
+        } else {
+            operand1 = x86_readM32(cpu, vaddr);
+            result = operand1 + operand2;
+            x86_writeM32(cpu, vaddr, result);
+        }
+        x86_writeR32(cpu, src, operand1);
+    }
+
+    x86_lazyflags(cpu, LF_ADD, size, operand1, operand2, result);
+
+    return result;
+}
+
+uint8_t x86__mm_r8_r8_xadd(void *cpu, uint8_t dest, uint8_t src)
+{
+    return (uint8_t)x86__mm_rX_rX_xadd(cpu, dest, src, 8);
+}
+
+uint16_t x86__mm_r16_r16_xadd(void *cpu, uint8_t dest, uint8_t src)
+{
+    return (uint16_t)x86__mm_rX_rX_xadd(cpu, dest, src, 16);
+}
+
+uint32_t x86__mm_r32_r32_xadd(void *cpu, uint8_t dest, uint8_t src)
+{
+    return x86__mm_rX_rX_xadd(cpu, dest, src, 32);
+}
+
+uint8_t x86__mm_m8_r8_xadd(void *cpu, moffset32_t vaddr, uint8_t src, _Bool lock)
+{
+    return (uint8_t)x86__mm_mX_rX_xadd(cpu, vaddr, src, 8, lock);
+}
+
+uint16_t x86__mm_m16_r16_xadd(void *cpu, moffset32_t vaddr, uint8_t src, _Bool lock)
+{
+    return (uint16_t)x86__mm_mX_rX_xadd(cpu, vaddr, src, 16, lock);
+}
+
+uint32_t x86__mm_m32_r32_xadd(void *cpu, moffset32_t vaddr, uint8_t src, _Bool lock)
+{
+    return x86__mm_mX_rX_xadd(cpu, vaddr, src, 32, lock);
+}
@@ -109,8 +109,8 @@ void x86__mm_r8_imm8_mov(void *, uint8_t, uint8_t);
 void x86__mm_r16_imm16_mov(void *, uint8_t, uint16_t);
 void x86__mm_r32_imm32_mov(void *, uint8_t, uint32_t);
 void x86__mm_m8_imm8_mov(void *, moffset32_t, uint8_t);
-void x86__mm_m16_imm16_mov(void *, moffset32_t, uint8_t);
-void x86__mm_m32_imm32_mov(void *, moffset32_t, uint8_t);
+void x86__mm_m16_imm16_mov(void *, moffset32_t, uint16_t);
+void x86__mm_m32_imm32_mov(void *, moffset32_t, uint32_t);
 
 
 // RET
@@ -237,4 +237,35 @@ void x86__mm_near_absl_m32_jmp(void *, moffset32_t);
 void x86__mm_far_absl_ptr16_jmp(void *, uint16_t, moffset16_t);
 void x86__mm_far_absl_ptr32_jmp(void *, uint16_t, moffset32_t);
 
+
+// XCHG
+
+void x86__mm_r8_r8_xchg(void *, uint8_t, uint8_t);
+void x86__mm_r16_r16_xchg(void *, uint8_t, uint8_t);
+void x86__mm_r32_r32_xchg(void *, uint8_t, uint8_t);
+void x86__mm_m8_r8_xchg(void *, moffset32_t, uint8_t);
+void x86__mm_m16_r16_xchg(void *, moffset32_t, uint8_t);
+void x86__mm_m32_r32_xchg(void *, moffset32_t, uint8_t);
+
+
+// CMPXCHG
+
+_Bool x86__mm_r8_r8_cmpxchg(void *, uint8_t, uint8_t);
+_Bool x86__mm_r16_r16_cmpxchg(void *, uint8_t, uint8_t);
+_Bool x86__mm_r32_r32_cmpxchg(void *, uint8_t, uint8_t);
+_Bool x86__mm_m8_r8_cmpxchg(void *, moffset32_t, uint8_t, _Bool);
+_Bool x86__mm_m16_r16_cmpxchg(void *, moffset32_t, uint8_t, _Bool);
+_Bool x86__mm_m32_r32_cmpxchg(void *, moffset32_t, uint8_t, _Bool);
+_Bool x86__mm_m64_cmpxchg8b(void *, moffset32_t, _Bool);
+
+
+// XADD
+
+uint8_t x86__mm_r8_r8_xadd(void *, uint8_t, uint8_t);
+uint16_t x86__mm_r16_r16_xadd(void *, uint8_t, uint8_t);
+uint32_t x86__mm_r32_r32_xadd(void *, uint8_t, uint8_t);
+uint8_t x86__mm_m8_r8_xadd(void *, moffset32_t, uint8_t, _Bool);
+uint16_t x86__mm_m16_r16_xadd(void *, moffset32_t, uint8_t, _Bool);
+uint32_t x86__mm_m32_r32_xadd(void *, moffset32_t, uint8_t, _Bool);
+
 #endif /* GENERAL_PURPOSE_H */
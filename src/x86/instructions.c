@@ -30,6 +30,8 @@
 #include "x86-utils.h"
 #include "disassembler.h"
 #include "general-purpose.h"
+#include "syscalls.h"
+#include "vdso.h"
 
 
 void x86_aaa(void *cpu, struct exec_data data)
@@ -57,9 +59,9 @@ void x86_mm_add(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, low16(data.moffset));
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x04:  // ADD AL, imm8
@@ -94,22 +96,22 @@ void x86_mm_add(void *cpu, struct exec_data data)
         case 0x83:  // ADD rm32, imm8   ADD rm16, imm8
             if (vaddr) {
                 if (data.oprsz_pfx)
-                    x86__mm_m16_imm16_add(cpu, vaddr, zeroxtnd8to16(data.imm1), data.lock);
+                    x86__mm_m16_imm16_add(cpu, vaddr, (uint16_t)sign8to32(lsb(data.imm1)), data.lock);
                 else
-                    x86__mm_m32_imm32_add(cpu, vaddr, zeroxtnd8(data.imm1), data.lock);
+                    x86__mm_m32_imm32_add(cpu, vaddr, sign8to32(lsb(data.imm1)), data.lock);
             } else {
                 if (data.oprsz_pfx)
-                    x86__mm_r16_imm16_add(cpu, effctvregister(data.modrm, 16), zeroxtnd8to16(data.imm1));
+                    x86__mm_r16_imm16_add(cpu, effctvregister(data.modrm, 16), (uint16_t)sign8to32(lsb(data.imm1)));
                 else
-                    x86__mm_r32_imm32_add(cpu, effctvregister(data.modrm, 32), zeroxtnd8(data.imm1));
+                    x86__mm_r32_imm32_add(cpu, effctvregister(data.modrm, 32), sign8to32(lsb(data.imm1)));
             }
             break;
 
         case 0x00:  // ADD rm8, r8
             if (vaddr)
-                x86__mm_m8_imm8_add(cpu, vaddr, reg(data.modrm), data.lock);
+                x86__mm_m8_r8_add(cpu, vaddr, reg(data.modrm), data.lock);
             else
-                x86__mm_r8_imm8_add(cpu, effctvregister(data.modrm, 8), reg(data.modrm));
+                x86__mm_r8_r8_add(cpu, effctvregister(data.modrm, 8), reg(data.modrm));
             break;
         case 0x01:  // ADD rm32, r32    ADD rm16, r16
             if (vaddr) {
@@ -322,9 +324,9 @@ void x86_mm_and(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x24:  // AND AL, imm8
@@ -359,12 +361,12 @@ void x86_mm_and(void *cpu, struct exec_data data)
         case 0x83:  // AND r/m32, imm8  AND r/m16, imm8
             if (vaddr) {
                 if (data.oprsz_pfx)
-                    x86__mm_m16_imm16_and(cpu, vaddr, sign8to16(lsb(data.imm1)), data.lock);
+                    x86__mm_m16_imm16_and(cpu, vaddr, (uint16_t)sign8to32(lsb(data.imm1)), data.lock);
                 else
                     x86__mm_m32_imm32_and(cpu, vaddr, sign8to32(lsb(data.imm1)), data.lock);
             } else {
                 if (data.oprsz_pfx)
-                    x86__mm_r16_imm16_and(cpu, effctvregister(data.modrm, 16), sign8to16(lsb(data.imm1)));
+                    x86__mm_r16_imm16_and(cpu, effctvregister(data.modrm, 16), (uint16_t)sign8to32(lsb(data.imm1)));
                 else
                     x86__mm_r32_imm32_and(cpu, effctvregister(data.modrm, 32), sign8to32(lsb(data.imm1)));
             }
@@ -657,12 +659,12 @@ void x86_mm_call(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
 
     switch (data.opc) {
@@ -789,12 +791,12 @@ void x86_mm_cmovcc(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x47:  // CMOVA
@@ -874,12 +876,12 @@ void x86_mm_cmp(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x3C:
@@ -1016,23 +1018,56 @@ void x86_cmpss(void *cpu, struct exec_data data)
 }
 
 
-void x86_cmpxchg(void *cpu, struct exec_data data)
+void x86_mm_cmpxchg(void *cpu, struct exec_data data)
 {
-    (void)cpu, (void)data;
+    moffset32_t vaddr;
 
-    
-    x86_stopcpu(cpu);
-    s_error(1, "emulator: Instruction %s not implemented", __FUNCTION__);
+    if (data.adrsz_pfx)
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
+    else
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
+
+    if (!vaddr && data.lock)
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
+
+    switch (data.opc) {
+        case 0xB0:  // r/m8, r8
+            if (vaddr)
+                x86__mm_m8_r8_cmpxchg(cpu, vaddr, reg(data.modrm), data.lock);
+            else
+                x86__mm_r8_r8_cmpxchg(cpu, effctvregister(data.modrm, 8), reg(data.modrm));
+            break;
+        case 0xB1:  // r/m32, r32   r/m16, r16
+            if (data.oprsz_pfx) {
+                if (vaddr)
+                    x86__mm_m16_r16_cmpxchg(cpu, vaddr, reg(data.modrm), data.lock);
+                else
+                    x86__mm_r16_r16_cmpxchg(cpu, effctvregister(data.modrm, 16), reg(data.modrm));
+            } else {
+                if (vaddr)
+                    x86__mm_m32_r32_cmpxchg(cpu, vaddr, reg(data.modrm), data.lock);
+                else
+                    x86__mm_r32_r32_cmpxchg(cpu, effctvregister(data.modrm, 32), reg(data.modrm));
+            }
+            break;
+    }
 }
 
 
-void x86_cmpxchg8b(void *cpu, struct exec_data data)
+void x86_mm_cmpxchg8b(void *cpu, struct exec_data data)
 {
-    (void)cpu, (void)data;
+    moffset32_t vaddr;
 
-    
-    x86_stopcpu(cpu);
-    s_error(1, "emulator: Instruction %s not implemented", __FUNCTION__);
+    if (data.adrsz_pfx)
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
+    else
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
+
+    // m64 only
+    if (!vaddr)
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "CMPXCHG8B with a register operand");
+
+    x86__mm_m64_cmpxchg8b(cpu, vaddr, data.lock);
 }
 
 
@@ -2424,11 +2459,16 @@ void x86_int3(void *cpu, struct exec_data data)
 
 void x86_int(void *cpu, struct exec_data data)
 {
-    (void)cpu, (void)data;
+    if (data.imm1 == 0x80) {
+        x86_linux_syscall(cpu);
+        return;
+    } else if (data.imm1 == VDSO_VECTOR) {
+        x86_vdso_call(cpu);
+        return;
+    }
 
-    
     x86_stopcpu(cpu);
-    s_error(1, "emulator: Instruction %s not implemented", __FUNCTION__);
+    s_error(1, "emulator: interrupt 0x%x not implemented", data.imm1);
 }
 
 
@@ -2487,7 +2527,7 @@ void x86_mm_jcc(void *cpu, struct exec_data data)
     _Bool condition_is_true = 0;
     reg32_t jump_target = x86_findbranchtarget_relative(cpu, x86_readR32(cpu, EIP) - data.bytes, data);
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     switch (data.opc) {
         case 0x87:  // JA rel32     rel16
@@ -2518,11 +2558,12 @@ void x86_mm_jcc(void *cpu, struct exec_data data)
             break;
         case 0x8F:  // JG rel32     rel16
         case 0x7F:  // JG rel7
-            condition_is_true = x86_flag_off(cpu, ZF) && x86_flag_off(cpu, SF);
+            condition_is_true = x86_flag_off(cpu, ZF) &&
+                                x86_flag_on(cpu, SF) == x86_flag_on(cpu, OF);
             break;
         case 0x8D:  // JGE rel32    rel16
         case 0x7D:  // JGE rel8
-            condition_is_true = x86_flag_off(cpu, SF);
+            condition_is_true = x86_flag_on(cpu, SF) == x86_flag_on(cpu, OF);
             break;
         case 0x8C:  // JL rel32     rel16
         case 0x7C:  // JL rel8
@@ -2575,12 +2616,12 @@ void x86_mm_jmp(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0xEB:
@@ -2715,27 +2756,32 @@ void x86_lgs(void *cpu, struct exec_data data)
 void x86_mm_lea(void *cpu, struct exec_data data)
 {
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
+    // only the offset, whatever the segment
     if (data.adrsz_pfx && data.oprsz_pfx) {
-        x86__mm_r16_m_lea(cpu, reg(data.modrm), x86_effectiveaddress16(cpu, data.modrm, data.moffset));
+        x86__mm_r16_m_lea(cpu, reg(data.modrm), x86_effectiveaddress16(cpu, data.modrm, data.moffset, SEG_DS));
     } else if (data.oprsz_pfx) {
-        x86__mm_r16_m_lea(cpu, reg(data.modrm), moffset16(x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset)));
+        x86__mm_r16_m_lea(cpu, reg(data.modrm), moffset16(x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, SEG_DS)));
     } else if (data.adrsz_pfx) {
-        x86__mm_r32_m_lea(cpu, reg(data.modrm), zeroxtnd16(x86_effectiveaddress16(cpu, data.modrm, data.moffset)));
+        x86__mm_r32_m_lea(cpu, reg(data.modrm), zeroxtnd16(x86_effectiveaddress16(cpu, data.modrm, data.moffset, SEG_DS)));
     } else {
-        x86__mm_r32_m_lea(cpu, reg(data.modrm), x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset));
+        x86__mm_r32_m_lea(cpu, reg(data.modrm), x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, SEG_DS));
     }
 }
 
 
 void x86_leave(void *cpu, struct exec_data data)
 {
-    (void)cpu, (void)data;
+    if (data.lock)
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
-    
-    x86_stopcpu(cpu);
-    s_error(1, "emulator: Instruction %s not implemented", __FUNCTION__);
+    x86_writeR32(cpu, ESP, x86_readR32(cpu, EBP));
+
+    if (data.oprsz_pfx)
+        x86__mm_r16_pop(cpu, BP);
+    else
+        x86__mm_r32_pop(cpu, EBP);
 }
 
 
@@ -2965,12 +3011,12 @@ void x86_mm_mov(void *cpu, struct exec_data data)
     int reg_dest = 0;
     _Bool r8imm8 = 0, rXimmX = 0;
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x88:  // MOV r/m8, r8
@@ -3024,42 +3070,42 @@ void x86_mm_mov(void *cpu, struct exec_data data)
                 x86__mm_sreg_r16_mov(cpu, reg(data.modrm), effctvregister(data.modrm, 16));
             break;
         case 0xA0: // MOV AL,moffs8
-            x86__mm_r8_imm8_mov(cpu, AL, x86_rdsreg(cpu, data.segovr) + lsb(data.imm1));
+            x86__mm_r8_m8_mov(cpu, AL, x86_segbase(cpu, data.segovr) + data.imm1);
             break;
         case 0xA1: //MOV EAX,moffs32    MOV AX,moffs16
             if (data.oprsz_pfx)
-                x86__mm_r16_imm16_mov(cpu, AX, x86_rdsreg(cpu, data.segovr) + low16(data.imm1));
+                x86__mm_r16_m16_mov(cpu, AX, x86_segbase(cpu, data.segovr) + data.imm1);
             else
-                x86__mm_r32_imm32_mov(cpu, EAX, x86_rdsreg(cpu, data.segovr) + data.imm1);
+                x86__mm_r32_m32_mov(cpu, EAX, x86_segbase(cpu, data.segovr) + data.imm1);
             break;
         case 0xA2:  // MOV moffs8,AL
-            x86__mm_m8_r8_mov(cpu, x86_rdsreg(cpu, data.segovr) + lsb(data.imm1), AL);
+            x86__mm_m8_r8_mov(cpu, x86_segbase(cpu, data.segovr) + data.imm1, AL);
             break;
         case 0xA3:  // MOV moffs32,EAX  MOV moffs16,AX
             if (data.oprsz_pfx)
-                x86__mm_m16_r16_mov(cpu, x86_rdsreg(cpu, data.segovr) + low16(data.imm1), AX);
+                x86__mm_m16_r16_mov(cpu, x86_segbase(cpu, data.segovr) + data.imm1, AX);
             else
-                x86__mm_m32_r32_mov(cpu, x86_rdsreg(cpu, data.segovr) + data.imm1, EAX);
+                x86__mm_m32_r32_mov(cpu, x86_segbase(cpu, data.segovr) + data.imm1, EAX);
             break;
-            //MOV r16/32, imm16/32
-        case 0xB0: reg_dest = EAX; rXimmX = 1; break;
-        case 0xB1: reg_dest = ECX; rXimmX = 1; break;
-        case 0xB2: reg_dest = EDX; rXimmX = 1; break;
-        case 0xB3: reg_dest = EBX; rXimmX = 1; break;
-        case 0xB4: reg_dest = ESP; rXimmX = 1; break;
-        case 0xB5: reg_dest = EBP; rXimmX = 1; break;
-        case 0xB6: reg_dest = ESI; rXimmX = 1; break;
-        case 0xB7: reg_dest = EDI; rXimmX = 1; break;
-
         // MOV r8, imm8
-        case 0xB8: reg_dest = EAX; r8imm8 = 1; break;
-        case 0xB9: reg_dest = ECX; r8imm8 = 1; break;
-        case 0xBA: reg_dest = EDX; r8imm8 = 1; break;
-        case 0xBB: reg_dest = EBX; r8imm8 = 1; break;
-        case 0xBC: reg_dest = ESP; r8imm8 = 1; break;
-        case 0xBD: reg_dest = EBP; r8imm8 = 1; break;
-        case 0xBE: reg_dest = ESI; r8imm8 = 1; break;
-        case 0xBF: reg_dest = EDI; r8imm8 = 1; break;
+        case 0xB0: reg_dest = AL; r8imm8 = 1; break;
+        case 0xB1: reg_dest = CL; r8imm8 = 1; break;
+        case 0xB2: reg_dest = DL; r8imm8 = 1; break;
+        case 0xB3: reg_dest = BL; r8imm8 = 1; break;
+        case 0xB4: reg_dest = AH; r8imm8 = 1; break;
+        case 0xB5: reg_dest = CH; r8imm8 = 1; break;
+        case 0xB6: reg_dest = DH; r8imm8 = 1; break;
+        case 0xB7: reg_dest = BH; r8imm8 = 1; break;
+
+            //MOV r16/32, imm16/32
+        case 0xB8: reg_dest = EAX; rXimmX = 1; break;
+        case 0xB9: reg_dest = ECX; rXimmX = 1; break;
+        case 0xBA: reg_dest = EDX; rXimmX = 1; break;
+        case 0xBB: reg_dest = EBX; rXimmX = 1; break;
+        case 0xBC: reg_dest = ESP; rXimmX = 1; break;
+        case 0xBD: reg_dest = EBP; rXimmX = 1; break;
+        case 0xBE: reg_dest = ESI; rXimmX = 1; break;
+        case 0xBF: reg_dest = EDI; rXimmX = 1; break;
 
         case 0xC6:  // MOV r/m8, imm8
             if (vaddr)
@@ -3411,12 +3457,12 @@ void x86_mm_movzx(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0xB6:
@@ -3525,7 +3571,7 @@ void x86_neg(void *cpu, struct exec_data data)
 void x86_mm_nop(void *cpu, struct exec_data data)
 {
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 }
 
 
@@ -4326,14 +4372,14 @@ void x86_mm_pop(void *cpu, struct exec_data data)
     _Bool is_sreg = 0;
 
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     switch (data.opc) {
         case 0x8F:
             if (data.adrsz_pfx)
-                vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+                vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
             else
-                vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+                vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
             if (!vaddr)
                 reg_dest = effctvregister(data.modrm, 32);
@@ -4757,13 +4803,13 @@ void x86_mm_push(void *cpu, struct exec_data data)
     _Bool  is_sreg = 0, is_reg = 0;
 
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0xFF: // PUSH r/m32    PUSH r/m16
@@ -5134,7 +5180,7 @@ void x86_scas(void *cpu, struct exec_data data)
 void x86_mm_setcc(void *cpu, struct exec_data data)
 {
     _Bool  condition_is_true = 0;
-    moffset32_t vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+    moffset32_t vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x97:  // SETA
@@ -5153,7 +5199,8 @@ void x86_mm_setcc(void *cpu, struct exec_data data)
             condition_is_true = x86_flag_on(cpu, ZF);
             break;
         case 0x9F:  // SETG
-            condition_is_true = x86_flag_off(cpu, ZF) && x86_flag_off(cpu, SF);
+            condition_is_true = x86_flag_off(cpu, ZF) &&
+                                x86_flag_on(cpu, SF) == x86_flag_on(cpu, OF);
             break;
         case 0x9D:  // SETGE
             condition_is_true = x86_flag_off(cpu, SF);
@@ -5454,9 +5501,9 @@ void x86_mm_sub(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, low16(data.moffset));
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x2C:  // SUB AL, imm8
@@ -5491,22 +5538,22 @@ void x86_mm_sub(void *cpu, struct exec_data data)
         case 0x83:  // SUB rm32, imm8   SUB rm16, imm8
             if (vaddr) {
                 if (data.oprsz_pfx)
-                    x86__mm_m16_imm16_sub(cpu, vaddr, sign8to16(data.imm1), data.lock);
+                    x86__mm_m16_imm16_sub(cpu, vaddr, (uint16_t)sign8to32(lsb(data.imm1)), data.lock);
                 else
-                    x86__mm_m32_imm32_sub(cpu, vaddr, sign8to32(data.imm1), data.lock);
+                    x86__mm_m32_imm32_sub(cpu, vaddr, sign8to32(lsb(data.imm1)), data.lock);
             } else {
                 if (data.oprsz_pfx)
-                    x86__mm_r16_imm16_sub(cpu, effctvregister(data.modrm, 16), sign8to16(data.imm1));
+                    x86__mm_r16_imm16_sub(cpu, effctvregister(data.modrm, 16), (uint16_t)sign8to32(lsb(data.imm1)));
                 else
-                    x86__mm_r32_imm32_sub(cpu, effctvregister(data.modrm, 32), sign8to32(data.imm1));
+                    x86__mm_r32_imm32_sub(cpu, effctvregister(data.modrm, 32), sign8to32(lsb(data.imm1)));
             }
             break;
 
         case 0x28:  // SUB rm8, r8
             if (vaddr)
-                x86__mm_m8_imm8_sub(cpu, vaddr, reg(data.modrm), data.lock);
+                x86__mm_m8_r8_sub(cpu, vaddr, reg(data.modrm), data.lock);
             else
-                x86__mm_r8_imm8_sub(cpu, effctvregister(data.modrm, 8), reg(data.modrm));
+                x86__mm_r8_r8_sub(cpu, effctvregister(data.modrm, 8), reg(data.modrm));
             break;
         case 0x29:  // SUB rm32, r32    SUB rm16, r16
             if (vaddr) {
@@ -5637,14 +5684,14 @@ void x86_sysret(void *cpu, struct exec_data data)
 void x86_mm_test(void *cpu, struct exec_data data)
 {
     if (data.lock)
-        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
     moffset32_t vaddr;
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0xA8:  // TEST AL, imm8
@@ -5870,13 +5917,39 @@ void x86_xabort(void *cpu, struct exec_data data)
 }
 
 
-void x86_xadd(void *cpu, struct exec_data data)
+void x86_mm_xadd(void *cpu, struct exec_data data)
 {
-    (void)cpu, (void)data;
+    moffset32_t vaddr;
 
-    
-    x86_stopcpu(cpu);
-    s_error(1, "emulator: Instruction %s not implemented", __FUNCTION__);
+    if (data.adrsz_pfx)
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
+    else
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
+
+    if (!vaddr && data.lock)
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
+
+    switch (data.opc) {
+        case 0xC0:  // r/m8, r8
+            if (vaddr)
+                x86__mm_m8_r8_xadd(cpu, vaddr, reg(data.modrm), data.lock);
+            else
+                x86__mm_r8_r8_xadd(cpu, effctvregister(data.modrm, 8), reg(data.modrm));
+            break;
+        case 0xC1:  // r/m32, r32   r/m16, r16
+            if (data.oprsz_pfx) {
+                if (vaddr)
+                    x86__mm_m16_r16_xadd(cpu, vaddr, reg(data.modrm), data.lock);
+                else
+                    x86__mm_r16_r16_xadd(cpu, effctvregister(data.modrm, 16), reg(data.modrm));
+            } else {
+                if (vaddr)
+                    x86__mm_m32_r32_xadd(cpu, vaddr, reg(data.modrm), data.lock);
+                else
+                    x86__mm_r32_r32_xadd(cpu, effctvregister(data.modrm, 32), reg(data.modrm));
+            }
+            break;
+    }
 }
 
 
@@ -5890,13 +5963,51 @@ void x86_xbegin(void *cpu, struct exec_data data)
 }
 
 
-void x86_xchg(void *cpu, struct exec_data data)
+void x86_mm_xchg(void *cpu, struct exec_data data)
 {
-    (void)cpu, (void)data;
+    moffset32_t vaddr;
 
-    
-    x86_stopcpu(cpu);
-    s_error(1, "emulator: Instruction %s not implemented", __FUNCTION__);
+    // the register is in the opcode, exchanged with the accumulator
+    if (data.opc >= 0x91 && data.opc <= 0x97) {
+        if (data.lock)
+            x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
+
+        if (data.oprsz_pfx)
+            x86__mm_r16_r16_xchg(cpu, AX, data.opc - 0x90);
+        else
+            x86__mm_r32_r32_xchg(cpu, EAX, data.opc - 0x90);
+        return;
+    }
+
+    if (data.adrsz_pfx)
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
+    else
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
+
+    if (!vaddr && data.lock)
+        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
+
+    switch (data.opc) {
+        case 0x86:  // r/m8, r8
+            if (vaddr)
+                x86__mm_m8_r8_xchg(cpu, vaddr, reg(data.modrm));
+            else
+                x86__mm_r8_r8_xchg(cpu, effctvregister(data.modrm, 8), reg(data.modrm));
+            break;
+        case 0x87:  // r/m32, r32   r/m16, r16
+            if (data.oprsz_pfx) {
+                if (vaddr)
+                    x86__mm_m16_r16_xchg(cpu, vaddr, reg(data.modrm));
+                else
+                    x86__mm_r16_r16_xchg(cpu, effctvregister(data.modrm, 16), reg(data.modrm));
+            } else {
+                if (vaddr)
+                    x86__mm_m32_r32_xchg(cpu, vaddr, reg(data.modrm));
+                else
+                    x86__mm_r32_r32_xchg(cpu, effctvregister(data.modrm, 32), reg(data.modrm));
+            }
+            break;
+    }
 }
 
 
@@ -5934,15 +6045,15 @@ void x86_mm_xor(void *cpu, struct exec_data data)
     moffset32_t vaddr;
 
     if (data.adrsz_pfx)
-        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset));
+        vaddr = x86_effectiveaddress16(cpu, data.modrm, low16(data.moffset), data.segovr);
     else
-        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset);
+        vaddr = x86_effectiveaddress32(cpu, data.modrm, data.sib, data.moffset, data.segovr);
 
     switch (data.opc) {
         case 0x30:  // r/m8, r8
             if (!vaddr) {
                 if (data.lock)
-                    x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+                    x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
                 x86__mm_r8_r8_xor(cpu, effctvregister(data.modrm, 8), reg(data.modrm));
             } else {
                 x86__mm_m8_r8_xor(cpu, vaddr, reg(data.modrm), data.lock);
@@ -5952,7 +6063,7 @@ void x86_mm_xor(void *cpu, struct exec_data data)
             if (data.oprsz_pfx) {
                 if (!vaddr) {
                     if (data.lock)
-                        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+                        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
                     x86__mm_r16_r16_xor(cpu, effctvregister(data.modrm, 16), reg(data.modrm));
                 } else {
@@ -5961,7 +6072,7 @@ void x86_mm_xor(void *cpu, struct exec_data data)
             } else {
                 if (!vaddr) {
                     if (data.lock)
-                        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+                        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
                     x86__mm_r32_r32_xor(cpu, effctvregister(data.modrm, 32), reg(data.modrm));
                 } else {
@@ -5973,7 +6084,7 @@ void x86_mm_xor(void *cpu, struct exec_data data)
         case 0x32: // r8, r/m8
             if (!vaddr) {
                 if (data.lock)
-                    x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+                    x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
                 x86__mm_r8_r8_xor(cpu, reg(data.modrm), effctvregister(data.modrm, 8));
             } else {
@@ -5985,7 +6096,7 @@ void x86_mm_xor(void *cpu, struct exec_data data)
             if (data.oprsz_pfx) {
                 if (!vaddr) {
                     if (data.lock)
-                        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+                        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
                     x86__mm_r16_r16_xor(cpu, reg(data.modrm), effctvregister(data.modrm, 16));
                 } else {
@@ -5994,7 +6105,7 @@ void x86_mm_xor(void *cpu, struct exec_data data)
             } else {
                 if (!vaddr) {
                     if (data.lock)
-                        x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+                        x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
                     x86__mm_r32_r32_xor(cpu, reg(data.modrm), effctvregister(data.modrm, 32));
                 } else {
@@ -6005,13 +6116,13 @@ void x86_mm_xor(void *cpu, struct exec_data data)
             break;
         case 0x34: // AL, imm8
             if (data.lock)
-                x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+                x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
             x86__mm_al_imm8_xor(cpu, lsb(data.imm1));
             break;
         case 0x35: // eAX, imm32    AX, imm16
             if (data.lock)
-                x86_raise_exception_d(cpu, INT_UD, tracer_get(x86_tracer(cpu), TRACE_VAR_EIP), "Invalid LOCK prefix");
+                x86_raise_exception_d(cpu, INT_UD, x86_readR32(cpu, EIP), "Invalid LOCK prefix");
 
             if (data.oprsz_pfx)
                 x86__mm_ax_imm16_xor(cpu, low16(data.imm1));
@@ -6041,14 +6152,14 @@ void x86_mm_xor(void *cpu, struct exec_data data)
         case 0x83: // r/m32, imm8   r/m16, imm8
             if (!vaddr) {
                 if (data.oprsz_pfx)
-                    x86__mm_r16_imm16_xor(cpu, effctvregister(data.modrm, 16), zeroxtnd8to16(data.imm1));
+                    x86__mm_r16_imm16_xor(cpu, effctvregister(data.modrm, 16), (uint16_t)sign8to32(lsb(data.imm1)));
                 else
-                    x86__mm_r32_imm32_xor(cpu, effctvregister(data.modrm, 32), zeroxtnd8(data.imm1));
+                    x86__mm_r32_imm32_xor(cpu, effctvregister(data.modrm, 32), sign8to32(lsb(data.imm1)));
             } else {
                 if (data.oprsz_pfx)
-                    x86__mm_m16_imm16_xor(cpu, vaddr, zeroxtnd8to16(data.imm1), data.lock);
+                    x86__mm_m16_imm16_xor(cpu, vaddr, (uint16_t)sign8to32(lsb(data.imm1)), data.lock);
                 else
-                    x86__mm_m32_imm32_xor(cpu, vaddr, zeroxtnd8(data.imm1), data.lock);
+                    x86__mm_m32_imm32_xor(cpu, vaddr, sign8to32(lsb(data.imm1)), data.lock);
             }
             break;
     }
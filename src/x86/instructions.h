@@ -37,6 +37,7 @@ struct exec_data {
     uint8_t modrm;
     uint8_t sib;
     uint8_t is0f;
+    uint8_t reg1;   // register operands, only filled for specialized handlers
 
     uint32_t moffset;
     uint32_t imm1;
@@ -48,6 +49,7 @@ struct exec_data {
     uint8_t repnz : 1;
     uint8_t rep : 1;
     uint8_t segovr : 3;     // segment override
+    uint8_t reg2;
 };
 
 typedef void (*d_x86_instruction_handler)(void *, struct exec_data);
@@ -103,8 +105,8 @@ enum {
     SEG_GS,
 };
 
-struct opcode x86_opcode_table[0xFF + 1];
-struct opcode x86_opcode_0f_table[0xFF + 1];
+extern struct opcode x86_opcode_table[0xFF + 1];
+extern struct opcode x86_opcode_0f_table[0xFF + 1];
 
 enum x86CPUIDFeatureFlags {
     NONE,
@@ -132,6 +134,7 @@ enum x86CPUIDFeatureFlags {
 enum x86OpcodeEncoding {
     no_encoding,
     AL_imm8,
+    AL_moffs32,
     AX_imm8,
     AX_imm16,
     AX_r16,
@@ -173,6 +176,7 @@ enum x86OpcodeEncoding {
     mm1_mm2m32,
     mm1_mm2m64,
     mm1_mm2m64_imm8,
+    moffs32_AL,
     rm8_imm8,
     rm8,
     rm8_1,
@@ -338,8 +342,8 @@ void x86_cmpps(void *, struct exec_data);
 void x86_cmps(void *, struct exec_data);
 void x86_cmpsd(void *, struct exec_data);
 void x86_cmpss(void *, struct exec_data);
-void x86_cmpxchg(void *, struct exec_data);
-void x86_cmpxchg8b(void *, struct exec_data);
+void x86_mm_cmpxchg(void *, struct exec_data);
+void x86_mm_cmpxchg8b(void *, struct exec_data);
 void x86_comisd(void *, struct exec_data);
 void x86_comiss(void *, struct exec_data);
 void x86_cpuid(void *, struct exec_data);
@@ -764,9 +768,9 @@ void x86_wbinvd(void *, struct exec_data);
 void x86_wrmsr(void *, struct exec_data);
 void x86_wrpkru(void *, struct exec_data);
 void x86_xabort(void *, struct exec_data);
-void x86_xadd(void *, struct exec_data);
+void x86_mm_xadd(void *, struct exec_data);
 void x86_xbegin(void *, struct exec_data);
-void x86_xchg(void *, struct exec_data);
+void x86_mm_xchg(void *, struct exec_data);
 void x86_xend(void *, struct exec_data);
 void x86_xgetbv(void *, struct exec_data);
 void x86_xlat(void *, struct exec_data);
@@ -0,0 +1,987 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  translate hot blocks into host (x86-64) machine code.
+ *
+ *  The address of the x86CPU struct lives in RBX for the whole block. The
+ *  guest registers the block uses the most are kept in the callee-saved RBP
+ *  and R12-R15 while it runs, the rest stay in the x86CPU struct. The EIP of
+ *  every instruction is known at translation time so it is only stored when
+ *  someone could look at it.
+ *
+ *  The operations the block cache does inline (see BOP_* in block-cache.h)
+ *  are translated directly: 32-bit memory accesses look the soft TLB up
+ *  inline and only call the MMU on a miss, the ALU operations store the lazy
+ *  flags unless a later one overwrites them anyway and a jcc right after
+ *  them branches on the host flags. Everything else calls the very same
+ *  handler the interpreter would, with the pinned registers stored around
+ *  the call and the exec_data built on the stack from immediates.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "cpu.h"
+#include "fusion.h"
+#include "specialize.h"
+#include "x86-utils.h"
+
+#define JIT_ARENA_SIZE (16 * 1024 * 1024)
+// the most a single operation takes, its slow path included
+#define JIT_MAX_OP_SIZE 384
+#define JIT_MAX_BLOCK_SIZE (BLOCK_MAX_INSTRUCTIONS * JIT_MAX_OP_SIZE + 256)
+
+// stack space used to pass the exec_data by value
+#define JIT_ARGS_SIZE 32
+// where the code generation at the block entry is kept
+#define JIT_CODEGEN_SLOT JIT_ARGS_SIZE
+// with the six registers pushed, keeps the stack aligned for the calls
+#define JIT_FRAME_SIZE (JIT_ARGS_SIZE + 8)
+
+// guest registers kept in host registers, the callee-saved ones but RBX
+#define JIT_NPINNED 5
+
+enum HostRegisters {
+    H_NONE = -1,
+    H_RAX, H_RCX, H_RDX, H_RBX, H_RSP, H_RBP, H_RSI, H_RDI,
+    H_R8, H_R9, H_R10, H_R11, H_R12, H_R13, H_R14, H_R15
+};
+
+enum JitAccesses {
+    JIT_READ,   // [esi] into eax
+    JIT_WRITE   // r10d into [esi]
+};
+
+struct jit_buffer {
+    uint8_t code[JIT_MAX_BLOCK_SIZE];
+    size_t len;
+};
+
+// the call to the MMU when the inline access can't be done
+struct jit_stub {
+    uint8_t st_access;
+    moffset32_t st_eip;     // EIP after the instruction
+    size_t st_from[4];      // the rel32 of the jumps to the stub
+    size_t st_nfrom;
+    size_t st_resume;       // where the inline access ends
+};
+
+// the state of a block being translated
+struct jit_block {
+    struct jit_buffer *jb_buf;
+    x86MMU *jb_mmu;
+
+    // the host register of each guest register, H_NONE if it's in x86CPU
+    int8_t jb_host[EDI + 1];
+    // the pinned registers written since they were last stored to x86CPU
+    uint8_t jb_dirty;
+    // the host flags are the ones of the last guest operation
+    _Bool jb_hostflags;
+
+    // the rel32 of the jumps to the exits
+    size_t jb_exits[BLOCK_MAX_INSTRUCTIONS * 2 + 2];
+    size_t jb_nexits;
+    size_t jb_modified[BLOCK_MAX_INSTRUCTIONS * 2];
+    size_t jb_nmodified;
+
+    struct jit_stub jb_stubs[BLOCK_MAX_INSTRUCTIONS];
+    size_t jb_nstubs;
+};
+
+static void emit8(struct jit_buffer *, uint8_t);
+static void emit32(struct jit_buffer *, uint32_t);
+static void emit64(struct jit_buffer *, uint64_t);
+static void patch_rel32(struct jit_buffer *, size_t, size_t);
+static void emit_rex(struct jit_buffer *, _Bool, int, int, int);
+static void emit_rr(struct jit_buffer *, _Bool, uint8_t, int, int);
+static void emit_rm(struct jit_buffer *, _Bool, uint8_t, int, int, int, int, uint32_t);
+static void emit_mov_imm32(struct jit_buffer *, int, uint32_t);
+static void emit_movabs(struct jit_buffer *, int, uint64_t);
+static void emit_jcc(struct jit_buffer *, uint8_t, size_t *, size_t *);
+static void emit_jmp(struct jit_buffer *, size_t *, size_t *);
+
+static void pin_registers(struct jit_block *, const x86Block *);
+static void load_guest(struct jit_block *, int, uint8_t);
+static void store_guest(struct jit_block *, uint8_t, int);
+static void spill(struct jit_block *, _Bool);
+static void reload(struct jit_block *);
+static void check_codegen(struct jit_block *, uint32_t *);
+
+static void gen_ea(struct jit_block *, const struct exec_data *);
+static void gen_access(struct jit_block *, int, moffset32_t);
+static void gen_stubs(struct jit_block *, uint32_t *);
+static void gen_alu(struct jit_block *, const struct block_op *, _Bool);
+static void gen_branch(struct jit_block *, uint8_t, moffset32_t, moffset32_t);
+static _Bool gen_native(struct jit_block *, const struct block_op *, moffset32_t, _Bool);
+static void gen_handler_call(struct jit_block *, const struct block_op *);
+
+static size_t conf_jit_arena_size = JIT_ARENA_SIZE;
+
+static const int8_t pinnable[JIT_NPINNED] = { H_RBP, H_R12, H_R13, H_R14, H_R15 };
+
+#define reg_offset(reg) (    offsetof(x86CPU, gpr) + (reg) * sizeof(reg32_t)    )
+#define lf_offset(field) (    offsetof(x86CPU, lazyflags) + offsetof(struct LazyFlags, field)    )
+
+#define simm8(imm) (    (uint32_t)(int8_t)lsb(imm)    )
+
+#define is_native(op) (    (op)->bo_kind >= BOP_MOV_RR && (op)->bo_kind < BOP_NKINDS    )
+#define writes_flags(op) (    (op)->bo_kind >= BOP_ADD_RR && (op)->bo_kind < BOP_NKINDS    )
+#define is_memory(op) (    (op)->bo_kind == BOP_MOV_RM || (op)->bo_kind == BOP_MOV_MR || (op)->bo_kind == BOP_LEA    )
+#define has_src(op) (    (op)->bo_kind == BOP_MOV_RR || (op)->bo_kind == BOP_MOV_MR || (op)->bo_kind == BOP_ADD_RR  \
+                      || (op)->bo_kind == BOP_SUB_RR || (op)->bo_kind == BOP_AND_RR || (op)->bo_kind == BOP_XOR_RR  \
+                      || (op)->bo_kind == BOP_CMP_RR || (op)->bo_kind == BOP_TEST_RR                                \
+                      || (op)->bo_kind == BOP_CMP_RR_JCC || (op)->bo_kind == BOP_TEST_RR_JCC    )
+
+//
+// Initialization/cleanup
+//
+
+void jit_init(x86JIT *jit)
+{
+    if (!jit)
+        return;
+
+    // the arena is only mapped when the first block gets hot
+    jit->jit_arena = NULL;
+    jit->jit_size = 0;
+    jit->jit_used = 0;
+    jit->jit_enabled = 1;
+}
+
+void jit_free(x86JIT *jit)
+{
+    if (!jit)
+        return;
+
+    if (jit->jit_arena)
+        munmap(jit->jit_arena, jit->jit_size);
+
+    jit->jit_arena = NULL;
+    jit->jit_size = 0;
+    jit->jit_used = 0;
+}
+
+void jit_reset(x86JIT *jit)
+{
+    if (!jit)
+        return;
+
+    jit->jit_used = 0;
+}
+
+_Bool jit_full(x86JIT *jit)
+{
+    if (!jit || !jit->jit_arena)
+        return 0;
+
+    return jit->jit_used + JIT_MAX_BLOCK_SIZE > jit->jit_size;
+}
+
+//
+// Code emission
+//
+
+inline static void emit8(struct jit_buffer *buf, uint8_t byte)
+{
+    buf->code[buf->len++] = byte;
+}
+
+inline static void emit32(struct jit_buffer *buf, uint32_t bytes)
+{
+    memcpy(&buf->code[buf->len], &bytes, sizeof(bytes));
+    buf->len += sizeof(bytes);
+}
+
+inline static void emit64(struct jit_buffer *buf, uint64_t bytes)
+{
+    memcpy(&buf->code[buf->len], &bytes, sizeof(bytes));
+    buf->len += sizeof(bytes);
+}
+
+// point the rel32 at 'where' to 'target'
+inline static void patch_rel32(struct jit_buffer *buf, size_t where, size_t target)
+{
+    uint32_t rel = target - (where + 4);
+    memcpy(&buf->code[where], &rel, sizeof(rel));
+}
+
+// only emitted when needed, H_NONE counts as a low register
+static void emit_rex(struct jit_buffer *buf, _Bool w, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | w << 3 | (reg > 7) << 2 | (index > 7) << 1 | (base > 7);
+
+    if (rex != 0x40)
+        emit8(buf, rex);
+}
+
+// opc reg, rm with both registers, for the /digit forms reg is the digit
+static void emit_rr(struct jit_buffer *buf, _Bool w, uint8_t opc, int reg, int rm)
+{
+    emit_rex(buf, w, reg, H_NONE, rm);
+    emit8(buf, opc);
+    emit8(buf, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// opc reg, [base + index * scale + disp], base and index can be H_NONE. There
+// is always a SIB and a 32-bit displacement, so RSP, RBP, R12 and R13 need no
+// special case.
+static void emit_rm(struct jit_buffer *buf, _Bool w, uint8_t opc, int reg, int base, int index, int scale,
+                    uint32_t disp)
+{
+    emit_rex(buf, w, reg, index, base);
+    emit8(buf, opc);
+    emit8(buf, (base == H_NONE ? 0x00 : 0x80) | (reg & 7) << 3 | 0x04);
+    emit8(buf, __builtin_ctz(scale) << 6 | (index == H_NONE ? 4 : index & 7) << 3 | (base == H_NONE ? 5 : base & 7));
+    emit32(buf, disp);
+}
+
+// mov reg32, imm32
+static void emit_mov_imm32(struct jit_buffer *buf, int reg, uint32_t imm)
+{
+    emit_rex(buf, 0, H_NONE, H_NONE, reg);
+    emit8(buf, 0xB8 | (reg & 7));
+    emit32(buf, imm);
+}
+
+// movabs reg, imm64
+static void emit_movabs(struct jit_buffer *buf, int reg, uint64_t imm)
+{
+    emit_rex(buf, 1, H_NONE, H_NONE, reg);
+    emit8(buf, 0xB8 | (reg & 7));
+    emit64(buf, imm);
+}
+
+// jcc rel32 with the rel32 left to be patched, its offset is added to the list
+static void emit_jcc(struct jit_buffer *buf, uint8_t cc, size_t *list, size_t *n)
+{
+    emit8(buf, 0x0F); emit8(buf, 0x80 | cc);
+    list[(*n)++] = buf->len;
+    emit32(buf, 0);
+}
+
+static void emit_jmp(struct jit_buffer *buf, size_t *list, size_t *n)
+{
+    emit8(buf, 0xE9);
+    list[(*n)++] = buf->len;
+    emit32(buf, 0);
+}
+
+// mov dword [rbx + disp32], imm32
+#define emit_store_imm32(buf, off, imm) \
+    (emit8((buf), 0xC7), emit8((buf), 0x83), emit32((buf), (off)), emit32((buf), (imm)))
+
+// mov byte [rbx + disp32], imm8
+#define emit_store_imm8(buf, off, imm) \
+    (emit8((buf), 0xC6), emit8((buf), 0x83), emit32((buf), (off)), emit8((buf), (imm)))
+
+// the host condition codes
+#define CC_NE 0x5
+#define CC_A 0x7
+
+//
+// Guest registers
+//
+
+// the registers the native operations of the block use at least twice
+static void pin_registers(struct jit_block *jb, const x86Block *block)
+{
+    unsigned uses[EDI + 1] = {0};
+
+    for (size_t i = 0; i < block->b_nops; i++) {
+        const struct block_op *op = &block->b_ops[i];
+        const struct exec_data *data = &op->bo_data;
+
+        if (!is_native(op))
+            continue;
+
+        if (op->bo_kind == BOP_PUSH || op->bo_kind == BOP_POP)
+            uses[ESP]++;
+        if (op->bo_kind != BOP_MOV_MR)
+            uses[data->reg1]++;
+        if (has_src(op))
+            uses[data->reg2]++;
+
+        if (is_memory(op) && rm(data->modrm) != 4 && !(mod(data->modrm) == 0 && rm(data->modrm) == 5)) {
+            uses[rm(data->modrm)]++;
+        } else if (is_memory(op) && rm(data->modrm) == 4) {
+            if (sibbase(data->sib) != EBP || mod(data->modrm))
+                uses[sibbase(data->sib)]++;
+            if (sibindex(data->sib) != 4)
+                uses[sibindex(data->sib)]++;
+        }
+    }
+
+    for (size_t reg = 0; reg <= EDI; reg++)
+        jb->jb_host[reg] = H_NONE;
+
+    for (size_t pinned = 0; pinned < JIT_NPINNED; pinned++) {
+        int best = -1;
+
+        for (int reg = 0; reg <= EDI; reg++) {
+            if (jb->jb_host[reg] == H_NONE && uses[reg] >= 2 && (best == -1 || uses[reg] > uses[best]))
+                best = reg;
+        }
+
+        if (best == -1)
+            break;
+
+        jb->jb_host[best] = pinnable[pinned];
+    }
+}
+
+// host = guest
+static void load_guest(struct jit_block *jb, int host, uint8_t guest)
+{
+    if (jb->jb_host[guest] == host)
+        return;
+
+    if (jb->jb_host[guest] != H_NONE)
+        emit_rr(jb->jb_buf, 0, 0x8B, host, jb->jb_host[guest]);
+    else
+        emit_rm(jb->jb_buf, 0, 0x8B, host, H_RBX, H_NONE, 1, reg_offset(guest));
+}
+
+// guest = host
+static void store_guest(struct jit_block *jb, uint8_t guest, int host)
+{
+    if (jb->jb_host[guest] == H_NONE) {
+        emit_rm(jb->jb_buf, 0, 0x89, host, H_RBX, H_NONE, 1, reg_offset(guest));
+        return;
+    }
+
+    if (jb->jb_host[guest] != host)
+        emit_rr(jb->jb_buf, 0, 0x89, host, jb->jb_host[guest]);
+    jb->jb_dirty |= 1 << guest;
+}
+
+// store the pinned registers to x86CPU, only the written ones unless 'all'
+static void spill(struct jit_block *jb, _Bool all)
+{
+    for (int reg = 0; reg <= EDI; reg++) {
+        if (jb->jb_host[reg] != H_NONE && (all || jb->jb_dirty & (1 << reg)))
+            emit_rm(jb->jb_buf, 0, 0x89, jb->jb_host[reg], H_RBX, H_NONE, 1, reg_offset(reg));
+    }
+
+    jb->jb_dirty = 0;
+}
+
+static void reload(struct jit_block *jb)
+{
+    for (int reg = 0; reg <= EDI; reg++) {
+        if (jb->jb_host[reg] != H_NONE)
+            emit_rm(jb->jb_buf, 0, 0x8B, jb->jb_host[reg], H_RBX, H_NONE, 1, reg_offset(reg));
+    }
+}
+
+// leave through the modified exit if code was written since the block entry
+static void check_codegen(struct jit_block *jb, uint32_t *codegen)
+{
+    struct jit_buffer *buf = jb->jb_buf;
+
+    emit_movabs(buf, H_RAX, (uint64_t)(uintptr_t)codegen);
+    // mov eax, [rax]; cmp eax, [rsp + JIT_CODEGEN_SLOT]
+    emit8(buf, 0x8B); emit8(buf, 0x00);
+    emit_rm(buf, 0, 0x3B, H_RAX, H_RSP, H_NONE, 1, JIT_CODEGEN_SLOT);
+    emit_jcc(buf, CC_NE, jb->jb_modified, &jb->jb_nmodified);
+}
+
+//
+// Memory
+//
+
+// the guest address of the memory operand into esi, the same as
+// x86_effectiveaddress32() computes. Might use eax and ecx.
+static void gen_ea(struct jit_block *jb, const struct exec_data *data)
+{
+    uint8_t mod = mod(data->modrm);
+    uint8_t rm = rm(data->modrm);
+    int base = H_NONE, index = H_NONE, scale = 1;
+    uint32_t disp = 0;
+
+    if (mod == 1)
+        disp = simm8(data->moffset);
+    else if (mod == 2)
+        disp = data->moffset;
+
+    if (rm != 4) {
+        if (mod == 0 && rm == 5)
+            disp = data->moffset;
+        else
+            base = rm;
+    } else {
+        if (sibbase(data->sib) != EBP || mod)
+            base = sibbase(data->sib);
+        else
+            disp = data->moffset;
+
+        if (sibindex(data->sib) != 4) {
+            index = sibindex(data->sib);
+            scale = 1 << sibss(data->sib);
+        }
+    }
+
+    if (base != H_NONE) {
+        if (jb->jb_host[base] == H_NONE)
+            load_guest(jb, H_RAX, base);
+        base = jb->jb_host[base] == H_NONE ? H_RAX : jb->jb_host[base];
+    }
+
+    if (index != H_NONE) {
+        if (jb->jb_host[index] == H_NONE)
+            load_guest(jb, H_RCX, index);
+        index = jb->jb_host[index] == H_NONE ? H_RCX : jb->jb_host[index];
+    }
+
+    // lea esi, [base + index * scale + disp], the upper halves are clear and
+    // the 32-bit result wraps around like the guest address does
+    emit_rm(jb->jb_buf, 0, 0x8D, H_RSI, base, index, scale, disp);
+}
+
+// a 32-bit access to [esi], see enum JitAccesses. Uses eax, ecx, edx and r8.
+// The address is left in esi.
+static void gen_access(struct jit_block *jb, int access, moffset32_t eip)
+{
+    struct jit_buffer *buf = jb->jb_buf;
+    struct jit_stub *stub = &jb->jb_stubs[jb->jb_nstubs++];
+    x86MMU *mmu = jb->jb_mmu;
+
+    stub->st_access = access;
+    stub->st_eip = eip;
+    stub->st_nfrom = 0;
+
+    // crossing into the next page is left to the MMU
+    // mov ecx, esi; and ecx, MMU_PAGE_SIZE - 1; cmp ecx, MMU_PAGE_SIZE - 4; ja slow
+    emit_rr(buf, 0, 0x89, H_RSI, H_RCX);
+    emit_rr(buf, 0, 0x81, 4, H_RCX); emit32(buf, MMU_PAGE_SIZE - 1);
+    emit_rr(buf, 0, 0x81, 7, H_RCX); emit32(buf, MMU_PAGE_SIZE - 4);
+    emit_jcc(buf, CC_A, stub->st_from, &stub->st_nfrom);
+
+    if (mmu_isflat(mmu)) {
+        if (access == JIT_WRITE) {
+            // the page holds code, the MMU has to know about the write
+            // mov eax, esi; shr eax, MMU_PAGE_SHIFT + MMU_TABLE_SHIFT; mov rdx, mm_pagedir[rax]
+            emit_rr(buf, 0, 0x89, H_RSI, H_RAX);
+            emit_rr(buf, 0, 0xC1, 5, H_RAX); emit8(buf, MMU_PAGE_SHIFT + MMU_TABLE_SHIFT);
+            emit_movabs(buf, H_RDX, (uint64_t)(uintptr_t)mmu->mm_pagedir);
+            emit_rm(buf, 1, 0x8B, H_RDX, H_RDX, H_RAX, 8, 0);
+            // mov eax, esi; shr eax, MMU_PAGE_SHIFT; and eax, MMU_TABLE_ENTRIES - 1
+            emit_rr(buf, 0, 0x89, H_RSI, H_RAX);
+            emit_rr(buf, 0, 0xC1, 5, H_RAX); emit8(buf, MMU_PAGE_SHIFT);
+            emit_rr(buf, 0, 0x81, 4, H_RAX); emit32(buf, MMU_TABLE_ENTRIES - 1);
+            // imul eax, eax, sizeof(page_entry_t); test dword [rdx + rax + pg_flags], PG_CODE; jnz slow
+            emit_rr(buf, 0, 0x69, H_RAX, H_RAX); emit32(buf, sizeof(page_entry_t));
+            emit_rm(buf, 0, 0xF7, 0, H_RDX, H_RAX, 1, offsetof(page_entry_t, pg_flags)); emit32(buf, PG_CODE);
+            emit_jcc(buf, CC_NE, stub->st_from, &stub->st_nfrom);
+        }
+
+        // the host protection catches everything else
+        emit_movabs(buf, H_RAX, (uint64_t)(uintptr_t)mmu->mm_flat_base);
+        if (access == JIT_READ)
+            emit_rm(buf, 0, 0x8B, H_RAX, H_RAX, H_RSI, 1, 0);
+        else
+            emit_rm(buf, 0, 0x89, H_R10, H_RAX, H_RSI, 1, 0);
+
+        stub->st_resume = buf->len;
+        return;
+    }
+
+    // mov ecx, esi; shr ecx, MMU_PAGE_SHIFT; mov edx, ecx; and edx, MMU_TLB_ENTRIES - 1
+    emit_rr(buf, 0, 0x89, H_RSI, H_RCX);
+    emit_rr(buf, 0, 0xC1, 5, H_RCX); emit8(buf, MMU_PAGE_SHIFT);
+    emit_rr(buf, 0, 0x89, H_RCX, H_RDX);
+    emit_rr(buf, 0, 0x81, 4, H_RDX); emit32(buf, MMU_TLB_ENTRIES - 1);
+    // imul edx, edx, sizeof(tlb_entry_t); the TLBs are per thread, so is the code
+    emit_rr(buf, 0, 0x69, H_RDX, H_RDX); emit32(buf, sizeof(tlb_entry_t));
+    emit_movabs(buf, H_RAX, (uint64_t)(uintptr_t)(access == JIT_READ ? mmu_local.ml_tlb_read : mmu_local.ml_tlb_write));
+    // cmp [rax + rdx + tlb_tag], ecx; jne slow
+    emit_rm(buf, 0, 0x39, H_RCX, H_RAX, H_RDX, 1, offsetof(tlb_entry_t, tlb_tag));
+    emit_jcc(buf, CC_NE, stub->st_from, &stub->st_nfrom);
+
+    if (access == JIT_WRITE) {
+        // test dword [rax + rdx + tlb_flags], TLB_CODE; jnz slow
+        emit_rm(buf, 0, 0xF7, 0, H_RAX, H_RDX, 1, offsetof(tlb_entry_t, tlb_flags)); emit32(buf, TLB_CODE);
+        emit_jcc(buf, CC_NE, stub->st_from, &stub->st_nfrom);
+    }
+
+    // the TLBs were flushed: mov ecx, [ml_tlbgen]; cmp ecx, [mm_tlbgen]; jne slow.
+    // An aligned mov is already a relaxed atomic load on the host.
+    emit_movabs(buf, H_R8, (uint64_t)(uintptr_t)&mmu_local.ml_tlbgen);
+    emit_rm(buf, 0, 0x8B, H_RCX, H_R8, H_NONE, 1, 0);
+    emit_movabs(buf, H_R8, (uint64_t)(uintptr_t)&mmu->mm_tlbgen);
+    emit_rm(buf, 0, 0x3B, H_RCX, H_R8, H_NONE, 1, 0);
+    emit_jcc(buf, CC_NE, stub->st_from, &stub->st_nfrom);
+
+    // mov rax, [rax + rdx + tlb_host]; mov ecx, esi; and ecx, MMU_PAGE_SIZE - 1
+    emit_rm(buf, 1, 0x8B, H_RAX, H_RAX, H_RDX, 1, offsetof(tlb_entry_t, tlb_host));
+    emit_rr(buf, 0, 0x89, H_RSI, H_RCX);
+    emit_rr(buf, 0, 0x81, 4, H_RCX); emit32(buf, MMU_PAGE_SIZE - 1);
+
+    if (access == JIT_READ)
+        emit_rm(buf, 0, 0x8B, H_RAX, H_RAX, H_RCX, 1, 0);
+    else
+        emit_rm(buf, 0, 0x89, H_R10, H_RAX, H_RCX, 1, 0);
+
+    stub->st_resume = buf->len;
+}
+
+// the slow paths of the accesses, out of the way of the inline ones. The MMU
+// doesn't touch the guest registers and the pinned ones are callee-saved, so
+// nothing has to be stored, but EIP, for the exception.
+static void gen_stubs(struct jit_block *jb, uint32_t *codegen)
+{
+    struct jit_buffer *buf = jb->jb_buf;
+
+    for (size_t i = 0; i < jb->jb_nstubs; i++) {
+        struct jit_stub *stub = &jb->jb_stubs[i];
+
+        for (size_t j = 0; j < stub->st_nfrom; j++)
+            patch_rel32(buf, stub->st_from[j], buf->len);
+
+        emit_store_imm32(buf, reg_offset(EIP), stub->st_eip);
+        // mov rdi, rbx, the address is already in esi
+        emit8(buf, 0x48); emit8(buf, 0x89); emit8(buf, 0xDF);
+
+        if (stub->st_access == JIT_READ) {
+            emit_movabs(buf, H_RAX, (uint64_t)(uintptr_t)x86_readM32);
+            emit8(buf, 0xFF); emit8(buf, 0xD0);
+        } else {
+            // mov edx, r10d
+            emit_rr(buf, 0, 0x89, H_R10, H_RDX);
+            emit_movabs(buf, H_RAX, (uint64_t)(uintptr_t)x86_writeM32);
+            emit8(buf, 0xFF); emit8(buf, 0xD0);
+
+            // it might have been code
+            check_codegen(jb, codegen);
+        }
+
+        // jmp resume
+        emit8(buf, 0xE9);
+        emit32(buf, 0);
+        patch_rel32(buf, buf->len - 4, stub->st_resume);
+    }
+}
+
+//
+// Operations
+//
+
+// add/sub/and/xor/cmp/test reg1, reg2 or imm2. The lazy flags are only
+// stored if they might be read, the host flags are always the guest ones.
+static void gen_alu(struct jit_block *jb, const struct block_op *op, _Bool store_flags)
+{
+    struct jit_buffer *buf = jb->jb_buf;
+    const struct exec_data *data = &op->bo_data;
+    uint8_t opc, ext, lf;
+    _Bool writes = 1, imm = !has_src(op);
+    int dest;
+
+    switch (op->bo_kind) {
+        case BOP_ADD_RR: case BOP_ADD_RI:
+            opc = 0x01, ext = 0, lf = LF_ADD;
+            break;
+        case BOP_SUB_RR: case BOP_SUB_RI:
+            opc = 0x29, ext = 5, lf = LF_SUB;
+            break;
+        case BOP_AND_RR: case BOP_AND_RI:
+            opc = 0x21, ext = 4, lf = LF_LOGIC;
+            break;
+        case BOP_XOR_RR: case BOP_XOR_RI:
+            opc = 0x31, ext = 6, lf = LF_LOGIC;
+            break;
+        case BOP_CMP_RR: case BOP_CMP_RI: case BOP_CMP_RR_JCC: case BOP_CMP_RI_JCC:
+            opc = 0x39, ext = 7, lf = LF_SUB, writes = 0;
+            break;
+        default:    // test
+            opc = 0x85, ext = 0, lf = LF_LOGIC, writes = 0;
+            break;
+    }
+
+    if (!store_flags) {
+        // straight on the destination
+        dest = jb->jb_host[data->reg1];
+        if (dest == H_NONE) {
+            dest = H_RAX;
+            load_guest(jb, H_RAX, data->reg1);
+        }
+
+        if (imm && opc == 0x85) {
+            // test dest, imm32
+            emit_rr(buf, 0, 0xF7, 0, dest); emit32(buf, data->imm2);
+        } else if (imm) {
+            emit_rr(buf, 0, 0x81, ext, dest); emit32(buf, data->imm2);
+        } else if (jb->jb_host[data->reg2] != H_NONE) {
+            emit_rr(buf, 0, opc, jb->jb_host[data->reg2], dest);
+        } else {
+            // the "op r32, r/m32" form, test is the same both ways
+            emit_rm(buf, 0, opc == 0x85 ? opc : opc + 2, dest, H_RBX, H_NONE, 1, reg_offset(data->reg2));
+        }
+
+        if (writes)
+            store_guest(jb, data->reg1, dest);
+
+        jb->jb_hostflags = 1;
+        return;
+    }
+
+    // eax = reg1, edx = reg1, ecx = reg2 or imm2, then eax op= ecx. cmp and
+    // test become sub and and, their flags are the same.
+    load_guest(jb, H_RAX, data->reg1);
+    emit_rr(buf, 0, 0x89, H_RAX, H_RDX);
+    if (imm)
+        emit_mov_imm32(buf, H_RCX, data->imm2);
+    else
+        load_guest(jb, H_RCX, data->reg2);
+
+    if (opc == 0x39)
+        emit_rr(buf, 0, 0x29, H_RCX, H_RAX);
+    else if (opc == 0x85)
+        emit_rr(buf, 0, 0x21, H_RCX, H_RAX);
+    else
+        emit_rr(buf, 0, opc, H_RCX, H_RAX);
+
+    if (writes)
+        store_guest(jb, data->reg1, H_RAX);
+
+    // the same as x86_lazyflags(), MOVs keep the host flags
+    emit_store_imm8(buf, lf_offset(lf_op), lf);
+    emit_store_imm8(buf, lf_offset(lf_size), 32);
+    if (lf == LF_LOGIC) {
+        emit_store_imm32(buf, lf_offset(lf_op1), 0);
+        emit_store_imm32(buf, lf_offset(lf_op2), 0);
+    } else {
+        emit_rm(buf, 0, 0x89, H_RDX, H_RBX, H_NONE, 1, lf_offset(lf_op1));
+        emit_rm(buf, 0, 0x89, H_RCX, H_RBX, H_NONE, 1, lf_offset(lf_op2));
+    }
+    emit_rm(buf, 0, 0x89, H_RAX, H_RBX, H_NONE, 1, lf_offset(lf_result));
+
+    jb->jb_hostflags = 1;
+}
+
+// leave the block to 'target' if the guest condition holds on the host
+// flags, to 'fallthrough' otherwise
+static void gen_branch(struct jit_block *jb, uint8_t cc, moffset32_t target, moffset32_t fallthrough)
+{
+    struct jit_buffer *buf = jb->jb_buf;
+    size_t taken;
+
+    // the guest condition codes are the host ones
+    emit8(buf, 0x0F); emit8(buf, 0x80 | cc);
+    taken = buf->len;
+    emit32(buf, 0);
+
+    emit_store_imm32(buf, reg_offset(EIP), fallthrough);
+    emit_jmp(buf, jb->jb_exits, &jb->jb_nexits);
+
+    patch_rel32(buf, taken, buf->len);
+    emit_store_imm32(buf, reg_offset(EIP), target);
+    emit_jmp(buf, jb->jb_exits, &jb->jb_nexits);
+}
+
+// try to translate the instruction directly, eip is the one after it
+static _Bool gen_native(struct jit_block *jb, const struct block_op *op, moffset32_t eip, _Bool store_flags)
+{
+    struct jit_buffer *buf = jb->jb_buf;
+    const struct exec_data *data = &op->bo_data;
+    _Bool hostflags = jb->jb_hostflags;
+    int cc;
+
+    jb->jb_hostflags = 0;
+
+    switch (op->bo_kind) {
+        case BOP_MOV_RR:
+            if (jb->jb_host[data->reg1] != H_NONE) {
+                load_guest(jb, jb->jb_host[data->reg1], data->reg2);
+                jb->jb_dirty |= 1 << data->reg1;
+            } else {
+                load_guest(jb, H_RAX, data->reg2);
+                store_guest(jb, data->reg1, H_RAX);
+            }
+            return 1;
+
+        case BOP_MOV_RI:
+            if (jb->jb_host[data->reg1] != H_NONE) {
+                emit_mov_imm32(buf, jb->jb_host[data->reg1], data->imm2);
+                jb->jb_dirty |= 1 << data->reg1;
+            } else {
+                emit_store_imm32(buf, reg_offset(data->reg1), data->imm2);
+            }
+            return 1;
+
+        case BOP_LEA:
+            gen_ea(jb, data);
+            store_guest(jb, data->reg1, H_RSI);
+            return 1;
+
+        case BOP_MOV_RM:
+            gen_ea(jb, data);
+            gen_access(jb, JIT_READ, eip);
+            store_guest(jb, data->reg1, H_RAX);
+            return 1;
+
+        case BOP_MOV_MR:
+            gen_ea(jb, data);
+            load_guest(jb, H_R10, data->reg2);
+            gen_access(jb, JIT_WRITE, eip);
+            return 1;
+
+        case BOP_PUSH:
+            // r10d = reg1; lea esi, [esp - 4]; [esi] = r10d; sub esp, 4
+            load_guest(jb, H_R10, data->reg1);
+            load_guest(jb, H_RSI, ESP);
+            emit_rm(buf, 0, 0x8D, H_RSI, H_RSI, H_NONE, 1, -4);
+            gen_access(jb, JIT_WRITE, eip);
+            load_guest(jb, H_RAX, ESP);
+            emit_rr(buf, 0, 0x81, 5, H_RAX); emit32(buf, 4);
+            store_guest(jb, ESP, H_RAX);
+            return 1;
+
+        case BOP_POP:
+            // the same order as x86__mm_r32_pop()
+            load_guest(jb, H_RSI, ESP);
+            gen_access(jb, JIT_READ, eip);
+            store_guest(jb, data->reg1, H_RAX);
+            load_guest(jb, H_RAX, ESP);
+            emit_rr(buf, 0, 0x81, 0, H_RAX); emit32(buf, 4);
+            store_guest(jb, ESP, H_RAX);
+            return 1;
+
+        case BOP_XOR_ZERO:
+            // xor eax, eax
+            emit_rr(buf, 0, 0x31, H_RAX, H_RAX);
+            store_guest(jb, data->reg1, H_RAX);
+            if (store_flags) {
+                emit_store_imm8(buf, lf_offset(lf_op), LF_LOGIC);
+                emit_store_imm8(buf, lf_offset(lf_size), 32);
+                emit_store_imm32(buf, lf_offset(lf_op1), 0);
+                emit_store_imm32(buf, lf_offset(lf_op2), 0);
+                emit_store_imm32(buf, lf_offset(lf_result), 0);
+            }
+            jb->jb_hostflags = 1;
+            return 1;
+
+        case BOP_CMP_RR_JCC: case BOP_CMP_RI_JCC: case BOP_TEST_RR_JCC: case BOP_TEST_RI_JCC:
+            gen_alu(jb, op, 1);
+            gen_branch(jb, data->ext, eip + data->imm1, eip);
+            return 1;
+
+        case BOP_ADD_RR: case BOP_ADD_RI: case BOP_SUB_RR: case BOP_SUB_RI:
+        case BOP_AND_RR: case BOP_AND_RI: case BOP_XOR_RR: case BOP_XOR_RI:
+        case BOP_CMP_RR: case BOP_CMP_RI: case BOP_TEST_RR: case BOP_TEST_RI:
+            gen_alu(jb, op, store_flags);
+            return 1;
+    }
+
+    // a jcc right after the operation that set its flags
+    cc = fusion_jcc_condition(op);
+    if (cc != -1 && hostflags) {
+        gen_branch(jb, cc, eip + (data->is0f ? data->imm1 : simm8(data->imm1)), eip);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void gen_handler_call(struct jit_block *jb, const struct block_op *op)
+{
+    struct jit_buffer *buf = jb->jb_buf;
+    uint8_t args[JIT_ARGS_SIZE] = {0};
+
+    memcpy(args, &op->bo_data, sizeof(op->bo_data));
+
+    // the handler works on x86CPU
+    spill(jb, 0);
+
+    // build the exec_data on the stack, 8 bytes at a time
+    for (size_t i = 0; i < sizeof(op->bo_data); i += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, &args[i], sizeof(chunk));
+
+        // movabs rax, imm64
+        emit8(buf, 0x48); emit8(buf, 0xB8); emit64(buf, chunk);
+        // mov [rsp + i], rax
+        emit8(buf, 0x48); emit8(buf, 0x89); emit8(buf, 0x44); emit8(buf, 0x24); emit8(buf, i);
+    }
+
+    // mov rdi, rbx
+    emit8(buf, 0x48); emit8(buf, 0x89); emit8(buf, 0xDF);
+    // movabs rax, handler
+    emit8(buf, 0x48); emit8(buf, 0xB8); emit64(buf, (uint64_t)(uintptr_t)op->bo_handler);
+    // call rax
+    emit8(buf, 0xFF); emit8(buf, 0xD0);
+
+    reload(jb);
+    jb->jb_hostflags = 0;
+}
+
+jit_func_t x86_jit_compile(void *cpu, x86Block *block)
+{
+#if defined(__x86_64__)
+    static _Thread_local struct jit_buffer buf;
+    static _Thread_local struct jit_block jb;
+    _Bool store_flags[BLOCK_MAX_INSTRUCTIONS];
+    _Bool overwritten = 0, last_native = 0, branched = 0;
+    x86JIT *jit;
+    moffset32_t eip;
+    uint32_t *codegen;
+    size_t exit, modified;
+    void *code;
+
+    if (!cpu || !block || sizeof(struct exec_data) > JIT_ARGS_SIZE)
+        return NULL;
+
+    jit = &((x86CPU *)cpu)->jit;
+    if (!jit->jit_enabled)
+        return NULL;
+
+    if (!jit->jit_arena) {
+        jit->jit_arena = mmap(NULL, conf_jit_arena_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        // W^X enforced by the host, stay in the interpreter
+        if (jit->jit_arena == MAP_FAILED) {
+            jit->jit_arena = NULL;
+            jit->jit_enabled = 0;
+            return NULL;
+        }
+
+        jit->jit_size = conf_jit_arena_size;
+        jit->jit_used = 0;
+    }
+
+    codegen = &x86_mmu(cpu)->mm_codegen;
+    eip = block->b_start;
+    buf.len = 0;
+
+    jb.jb_buf = &buf;
+    jb.jb_mmu = x86_mmu(cpu);
+    jb.jb_dirty = 0;
+    jb.jb_hostflags = 0;
+    jb.jb_nexits = jb.jb_nmodified = jb.jb_nstubs = 0;
+    pin_registers(&jb, block);
+
+    // the lazy flags of an operation are dead if a later one sets them before
+    // anything that isn't translated runs
+    for (size_t i = block->b_nops; i-- > 0;) {
+        const struct block_op *op = &block->b_ops[i];
+
+        store_flags[i] = !overwritten;
+        if (!is_native(op))
+            overwritten = 0;
+        else if (writes_flags(op))
+            overwritten = 1;
+    }
+
+    // push rbx; push rbp; push r12; push r13; push r14; push r15
+    emit8(&buf, 0x53);
+    emit8(&buf, 0x55);
+    emit8(&buf, 0x41); emit8(&buf, 0x54);
+    emit8(&buf, 0x41); emit8(&buf, 0x55);
+    emit8(&buf, 0x41); emit8(&buf, 0x56);
+    emit8(&buf, 0x41); emit8(&buf, 0x57);
+    // mov rbx, rdi
+    emit8(&buf, 0x48); emit8(&buf, 0x89); emit8(&buf, 0xFB);
+    // sub rsp, JIT_FRAME_SIZE
+    emit8(&buf, 0x48); emit8(&buf, 0x83); emit8(&buf, 0xEC); emit8(&buf, JIT_FRAME_SIZE);
+    // the generation when the block was entered, code changing anywhere else
+    // before that doesn't matter to us.
+    // movabs rax, &codegen; mov eax, [rax]; mov [rsp + JIT_CODEGEN_SLOT], eax
+    emit_movabs(&buf, H_RAX, (uint64_t)(uintptr_t)codegen);
+    emit8(&buf, 0x8B); emit8(&buf, 0x00);
+    emit_rm(&buf, 0, 0x89, H_RAX, H_RSP, H_NONE, 1, JIT_CODEGEN_SLOT);
+    reload(&jb);
+
+    for (size_t i = 0; i < block->b_nops; i++) {
+        const struct block_op *op = &block->b_ops[i];
+
+        eip += op->bo_size;
+
+        last_native = gen_native(&jb, op, eip, store_flags[i]);
+        if (last_native) {
+            // a jcc, always the last one
+            branched = !is_native(op) || op->bo_kind >= BOP_CMP_RR_JCC;
+            continue;
+        }
+
+        // the handler expects EIP to be already pointing to the next instruction
+        emit_store_imm32(&buf, reg_offset(EIP), eip);
+        gen_handler_call(&jb, op);
+        check_codegen(&jb, codegen);
+
+        if (i == block->b_nops - 1)
+            break;
+
+        // cmp dword [rbx + EIP], imm32
+        emit8(&buf, 0x81); emit8(&buf, 0xBB); emit32(&buf, reg_offset(EIP)); emit32(&buf, eip);
+        // jne exit
+        emit_jcc(&buf, CC_NE, jb.jb_exits, &jb.jb_nexits);
+    }
+
+    // ran off the end of the block
+    if (last_native && !branched)
+        emit_store_imm32(&buf, reg_offset(EIP), block->b_end);
+
+    // exit: xor eax, eax; jmp epilogue
+    exit = buf.len;
+    emit8(&buf, 0x31); emit8(&buf, 0xC0);
+    emit8(&buf, 0xEB); emit8(&buf, 0x05);
+
+    // modified: mov eax, 1
+    modified = buf.len;
+    emit8(&buf, 0xB8); emit32(&buf, 1);
+
+    // epilogue: the pinned registers go back to x86CPU on every way out
+    spill(&jb, 1);
+    // add rsp, JIT_FRAME_SIZE; pop r15; pop r14; pop r13; pop r12; pop rbp; pop rbx; ret
+    emit8(&buf, 0x48); emit8(&buf, 0x83); emit8(&buf, 0xC4); emit8(&buf, JIT_FRAME_SIZE);
+    emit8(&buf, 0x41); emit8(&buf, 0x5F);
+    emit8(&buf, 0x41); emit8(&buf, 0x5E);
+    emit8(&buf, 0x41); emit8(&buf, 0x5D);
+    emit8(&buf, 0x41); emit8(&buf, 0x5C);
+    emit8(&buf, 0x5D);
+    emit8(&buf, 0x5B);
+    emit8(&buf, 0xC3);
+
+    // the slow paths jump back into the body or to the modified exit
+    gen_stubs(&jb, codegen);
+
+    for (size_t i = 0; i < jb.jb_nexits; i++)
+        patch_rel32(&buf, jb.jb_exits[i], exit);
+    for (size_t i = 0; i < jb.jb_nmodified; i++)
+        patch_rel32(&buf, jb.jb_modified[i], modified);
+
+    // the arena is full, keep interpreting until the next reset
+    if (jit->jit_used + buf.len > jit->jit_size)
+        return NULL;
+
+    code = jit->jit_arena + jit->jit_used;
+    memcpy(code, buf.code, buf.len);
+
+    // keep every block aligned
+    jit->jit_used = (jit->jit_used + buf.len + 15) & ~(size_t)15;
+
+    return (jit_func_t)code;
+#else
+    (void)cpu, (void)block;
+    return NULL;
+#endif
+}
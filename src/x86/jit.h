@@ -0,0 +1,58 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  translate hot blocks into host (x86-64) machine code.
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "block-cache.h"
+
+// returns non-zero if the code it ran through was modified
+typedef int (*jit_func_t)(void *);
+
+typedef struct {
+    uint8_t *jit_arena;
+    size_t jit_size;
+    size_t jit_used;
+
+    _Bool jit_enabled;
+} x86JIT;
+
+// number of times a block runs in the interpreter before being translated
+#define JIT_THRESHOLD 32
+
+void jit_init(x86JIT *);
+void jit_free(x86JIT *);
+
+// forget everything that was translated
+void jit_reset(x86JIT *);
+// returns 1 if a block might not fit in the arena anymore
+_Bool jit_full(x86JIT *);
+
+// returns NULL if the block can't be translated
+jit_func_t x86_jit_compile(void *, x86Block *);
+
+#endif /* JIT_H */
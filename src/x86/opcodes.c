@@ -35,6 +35,9 @@ static size_t alloc_counter = 0;
 static size_t alloc_tableend = 10;
 static void **alloc_table = NULL;
 
+struct opcode x86_opcode_table[0xFF + 1];
+struct opcode x86_opcode_0f_table[0xFF + 1];
+
 uint8_t x86_prefix_table[] = { PFX_LOCK, PFX_REPNZ, PFX_REP, PFX_BND, PFX_CS, PFX_SS, PFX_DS,
                                PFX_ES, PFX_FS, PFX_GS, PFX_OPRSZ, PFX_ADDRSZ };
 
@@ -345,10 +348,10 @@ void x86_init_opcode_table(void)
     register_op(0x05, "ADD", NONE, eAX_imm32, AX_imm16, NO_RM, INSTR, x86_mm_add);
     register_op(0x06, "PUSH", NONE, OP, OP, NO_RM, INSTR, x86_mm_push);
     register_op(0x07, "POP", NONE, OP, OP, NO_RM, INSTR, x86_mm_pop);
-    register_op(0x08, "OR", NONE, rm8_r8, rm8_r8, NO_RM, INSTR, x86_or);
-    register_op(0x09, "OR", NONE, rm32_r32, rm16_r16, NO_RM, INSTR, x86_or);
-    register_op(0x0A, "OR", NONE, r8_rm8, r8_rm8, NO_RM, INSTR, x86_or);
-    register_op(0x0B, "OR", NONE, r32_rm32, r16_rm16, NO_RM, INSTR, x86_or);
+    register_op(0x08, "OR", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_or);
+    register_op(0x09, "OR", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_or);
+    register_op(0x0A, "OR", NONE, r8_rm8, r8_rm8, USE_RM, INSTR, x86_or);
+    register_op(0x0B, "OR", NONE, r32_rm32, r16_rm16, USE_RM, INSTR, x86_or);
     register_op(0x0C, "OR", NONE, AL_imm8, AL_imm8, NO_RM, INSTR, x86_or);
     register_op(0x0D, "OR", NONE, eAX_imm32, AX_imm16, NO_RM, INSTR, x86_or);
     register_op(0x0E, "PUSH", NONE, OP, OP, NO_RM, INSTR, x86_mm_push);
@@ -377,10 +380,10 @@ void x86_init_opcode_table(void)
     register_op(0x25, "AND", NONE, eAX_imm32, AX_imm16, NO_RM, INSTR, x86_mm_and);
 
     register_op(0x27, "DAA", NONE, OP, OP, NO_RM, INSTR, x86_daa);
-    register_op(0x28, "SUB", NONE, rm8_r8, rm8_r8, NO_RM, INSTR, x86_mm_sub);
-    register_op(0x29, "SUB", NONE, rm32_r32, rm16_r16, NO_RM, INSTR, x86_mm_sub);
-    register_op(0x2A, "SUB", NONE, r8_rm8, r8_rm8, NO_RM, INSTR, x86_mm_sub);
-    register_op(0x2B, "SUB", NONE, r32_rm32, r16_rm16, NO_RM, INSTR, x86_mm_sub);
+    register_op(0x28, "SUB", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_mm_sub);
+    register_op(0x29, "SUB", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_mm_sub);
+    register_op(0x2A, "SUB", NONE, r8_rm8, r8_rm8, USE_RM, INSTR, x86_mm_sub);
+    register_op(0x2B, "SUB", NONE, r32_rm32, r16_rm16, USE_RM, INSTR, x86_mm_sub);
     register_op(0x2C, "SUB", NONE, AL_imm8, AL_imm8, NO_RM, INSTR, x86_mm_sub);
     register_op(0x2D, "SUB", NONE, eAX_imm32, AX_imm16, NO_RM, INSTR, x86_mm_sub);
 
@@ -476,8 +479,8 @@ void x86_init_opcode_table(void)
     register_op_ext(0x83, 7, "CMP", NONE, rm32_imm8, rm16_imm8, USE_RM, INSTR, x86_mm_cmp);
     register_op(0x84, "TEST", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_mm_test);
     register_op(0x85, "TEST", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_mm_test);
-    register_op(0x86, "XCHG", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_xchg);
-    register_op(0x87, "XCHG", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_xchg);
+    register_op(0x86, "XCHG", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_mm_xchg);
+    register_op(0x87, "XCHG", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_mm_xchg);
     register_op(0x88, "MOV", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_mm_mov);
     register_op(0x89, "MOV", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_mm_mov);
     register_op(0x8A, "MOV", NONE, r8_rm8, r8_rm8, USE_RM, INSTR, x86_mm_mov);
@@ -487,8 +490,8 @@ void x86_init_opcode_table(void)
     register_op(0x8E, "MOV", NONE, sreg_rm16, sreg_rm16, USE_RM, INSTR, x86_mm_mov);
     register_op_ext(0x8F, 0, "POP", NONE, rm32, rm16, USE_RM, INSTR, x86_mm_pop);
     register_op(0x90, "NOP", NONE, OP, OP, NO_RM, INSTR, x86_mm_nop);
-    for (size_t i = 0; i < 8; i++)
-        register_op(0x90 + i, "XCHG", NONE, eAX_r32, AX_r16, NO_RM, INSTR, x86_xchg);
+    for (size_t i = 1; i < 8; i++)
+        register_op(0x90 + i, "XCHG", NONE, eAX_r32, AX_r16, NO_RM, INSTR, x86_mm_xchg);
     register_op(0x98, "CBW", NONE, OP, OP, NO_RM, INSTR, x86_cbw);
     register_op(0x99, "CWQ", NONE, OP, OP, NO_RM, INSTR, x86_cwq);
     register_op(0x9A, "CALL", NONE, rela16_32, rela16_16, NO_RM, INSTR, x86_mm_call);
@@ -497,10 +500,10 @@ void x86_init_opcode_table(void)
     register_op(0x9D, "POPF", NONE, OP, OP, NO_RM, INSTR, x86_popf);
     register_op(0x9E, "SAHF", NONE, OP, OP, NO_RM, INSTR, x86_sahf);
     register_op(0x9F, "LAHF", NONE, OP, OP, NO_RM, INSTR, x86_lahf);
-    register_op(0xA0, "MOV", NONE, AL_imm8, AL_imm8, NO_RM, INSTR, x86_mm_mov);
-    register_op(0xA1, "MOV", NONE, eAX_imm32, AX_imm16, NO_RM, INSTR, x86_mm_mov);
-    register_op(0xA2, "MOV", NONE, imm8_AL, imm8_AL, NO_RM, INSTR, x86_mm_mov);
-    register_op(0xA3, "MOV", NONE, imm16_AX, imm32_eAX, NO_RM, INSTR, x86_mm_mov);
+    register_op(0xA0, "MOV", NONE, AL_moffs32, AL_moffs32, NO_RM, INSTR, x86_mm_mov);
+    register_op(0xA1, "MOV", NONE, eAX_imm32, eAX_imm32, NO_RM, INSTR, x86_mm_mov);
+    register_op(0xA2, "MOV", NONE, moffs32_AL, moffs32_AL, NO_RM, INSTR, x86_mm_mov);
+    register_op(0xA3, "MOV", NONE, imm32_eAX, imm32_eAX, NO_RM, INSTR, x86_mm_mov);
     register_op(0xA4, "MOVS", NONE, OP, OP, NO_RM, INSTR, x86_movs);
     register_op(0xA5, "MOVS", NONE, OP, OP, NO_RM, INSTR, x86_movs);
     register_op(0xA6, "CMPS", NONE, OP, OP, NO_RM, INSTR, x86_cmps);
@@ -1236,8 +1239,8 @@ void x86_init_opcode_table(void)
     register_0f_op_sec(0xAE, 0xF0, "MFENCE", SSE, OP, OP, NO_RM, INSTR, x86_mfence);
     register_0f_op_sec(0xAE, 0xF8, "SFENCE", NONE, OP, OP, NO_RM, INSTR, x86_sfence);
     register_0f_op(0xAF, "IMUL", NONE, r32_rm32, r16_rm16, USE_RM, INSTR, x86_imul);
-    register_0f_op(0xB0, "CMPXCHG", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_cmpxchg);
-    register_0f_op(0xB1, "CMPXCHG", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_cmpxchg);
+    register_0f_op(0xB0, "CMPXCHG", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_mm_cmpxchg);
+    register_0f_op(0xB1, "CMPXCHG", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_mm_cmpxchg);
     register_0f_op(0xB2, "LSS", NONE, r32_m16_32, r16_m16_16, USE_RM, INSTR, x86_lss);
     register_0f_op(0xB3, "BTR", NONE, rm32_r32, rm16_r16, USE_RM, INSTR, x86_btr);
     register_0f_op(0xB4, "LFS", NONE, r32_m16_32, r16_m16_16, USE_RM, INSTR, x86_lfs);
@@ -1257,8 +1260,8 @@ void x86_init_opcode_table(void)
     register_0f_op_prefix(0xF3, 0xBD, "LZCNT", LZCNT, r32_rm32, r16_rm16, USE_RM, INSTR, x86_lzcnt);
     register_0f_op(0xBE, "MOVSX", NONE, r32_rm8, r16_rm8, USE_RM, INSTR, x86_movsx);
     register_0f_op(0xBF, "MOVSX", NONE, r32_rm16, r32_rm16, USE_RM, INSTR, x86_movsx);
-    register_0f_op(0xC0, "XADD", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_xadd);
-    register_0f_op(0xC1, "XADD", NONE, rm32_r32, rm32_r32, USE_RM, INSTR, x86_xadd);
+    register_0f_op(0xC0, "XADD", NONE, rm8_r8, rm8_r8, USE_RM, INSTR, x86_mm_xadd);
+    register_0f_op(0xC1, "XADD", NONE, rm32_r32, rm32_r32, USE_RM, INSTR, x86_mm_xadd);
     register_0f_op(0xC2, "CMPPS", SSE, xmm1_xmm2m128_imm8, xmm1_xmm2m128, USE_RM, INSTR, x86_cmpps);
     register_0f_op_prefix(0x66, 0xC2, "CMPPD", SSE2, xmm1_xmm2m128_imm8, xmm1_xmm2m128_imm8, USE_RM, INSTR, x86_cmppd);
     register_0f_op_prefix(0xF2, 0xC2, "CMPSD", SSE2, xmm1_xmm2m64_imm8, xmm1_xmm2m64_imm8, USE_RM, INSTR, x86_cmpsd);
@@ -1270,7 +1273,7 @@ void x86_init_opcode_table(void)
     register_0f_op_prefix(0x66, 0xC5, "PEXTRW", SSE2, r32_xmm_imm8, r32_xmm_imm8, USE_RM, INSTR, x86_pextrw);
     register_0f_op(0xC6, "SHUFPS", SSE, xmm1_xmm2m128_imm8, xmm1_xmm2m128_imm8, USE_RM, INSTR, x86_shufpd);
     register_0f_op_prefix(0x66, 0xC6, "SHUFPD", SSE2, xmm1_xmm2m128_imm8, xmm1_xmm2m128_imm8, USE_RM, INSTR, x86_shufpd);
-    register_0f_op_ext(0xC7, 1, "CMPXCHG8B", NONE, m64, m64, USE_RM, INSTR, x86_cmpxchg8b);
+    register_0f_op_ext(0xC7, 1, "CMPXCHG8B", NONE, m64, m64, USE_RM, INSTR, x86_mm_cmpxchg8b);
     for (size_t i = 0; i < 8; i++)
         register_0f_op(0xC8 + i, "BSWAP", NONE, OP, OP, NO_RM, INSTR, x86_bswap);
     register_0f_op_prefix(0x66, 0xD0, "ADDSUBPD", SSE3, xmm1_xmm2m128, xmm1_xmm2m128, USE_RM, INSTR, x86_addsubpd);
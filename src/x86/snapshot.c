@@ -0,0 +1,88 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  in-process checkpoints of the whole guest state.
+ *
+ *  The MMU saves every page when the snapshot is taken and keeps track of
+ *  the pages written to since, so restoring only copies those back. The
+ *  caches don't need to be dropped: the pages with code that are copied back
+ *  get a new code generation like any other write.
+ */
+
+#include "../memory.h"
+
+#include "snapshot.h"
+
+x86Snapshot *x86_snapshot(x86CPU *cpu)
+{
+    x86Snapshot *snap;
+
+    if (!cpu)
+        return NULL;
+
+    snap = xcalloc(1, sizeof(*snap));
+
+    memcpy(snap->sn_gpr, cpu->gpr, sizeof(snap->sn_gpr));
+    for (int i = 0; i < 6; i++)
+        snap->sn_sreg[i] = x86_rdsreg(cpu, i);
+    memcpy(snap->sn_tls, cpu->tls, sizeof(snap->sn_tls));
+    snap->sn_eflags = cpu->eflags;
+    snap->sn_lazyflags = cpu->lazyflags;
+
+    tracer_copy(&snap->sn_tracer, x86_tracer(cpu));
+
+    mmu_snapshot(x86_mmu(cpu), &snap->sn_mmu);
+    if (mmu_error(x86_mmu(cpu))) {
+        x86_snapshot_free(cpu, snap);
+        return NULL;
+    }
+
+    return snap;
+}
+
+void x86_restore(x86CPU *cpu, x86Snapshot *snap)
+{
+    if (!cpu || !snap)
+        return;
+
+    mmu_restore(x86_mmu(cpu), &snap->sn_mmu);
+    if (mmu_error(x86_mmu(cpu)))
+        return;
+
+    memcpy(cpu->gpr, snap->sn_gpr, sizeof(snap->sn_gpr));
+    for (int i = 0; i < 6; i++)
+        x86_wrsreg(cpu, i, snap->sn_sreg[i]);
+    memcpy(cpu->tls, snap->sn_tls, sizeof(cpu->tls));
+    cpu->eflags = snap->sn_eflags;
+    cpu->lazyflags = snap->sn_lazyflags;
+
+    tracer_copy(x86_tracer(cpu), &snap->sn_tracer);
+}
+
+void x86_snapshot_free(x86CPU *cpu, x86Snapshot *snap)
+{
+    if (!snap)
+        return;
+
+    mmu_snapshot_free(cpu ? x86_mmu(cpu) : NULL, &snap->sn_mmu);
+    tracer_stop(&snap->sn_tracer);
+    xfree(snap);
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  in-process checkpoints of the whole guest state.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "../tracer.h"
+
+#include "cpu.h"
+#include "x86-mmu.h"
+
+typedef struct {
+    reg32_t sn_gpr[EIP + 1];
+    reg16_t sn_sreg[6];
+    struct x86TLSEntry sn_tls[X86_TLS_ENTRIES];
+    struct EFlags sn_eflags;
+    struct LazyFlags sn_lazyflags;
+
+    cpu_state_t sn_tracer;
+    x86MMUSnapshot sn_mmu;
+} x86Snapshot;
+
+// save the registers, the memory and the backtrace. Returns NULL and leaves
+// the MMU error set on failure.
+x86Snapshot *x86_snapshot(x86CPU *);
+// go back to the state saved, any number of times. Only the memory written to
+// since the last snapshot or restore is copied, unless the mappings changed.
+void x86_restore(x86CPU *, x86Snapshot *);
+void x86_snapshot_free(x86CPU *, x86Snapshot *);
+
+#endif /* SNAPSHOT_H */
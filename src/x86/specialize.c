@@ -0,0 +1,276 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. *
+ * DESCRIPTION:
+ *  handlers specialized for a single operand form. The generic handlers in
+ *  instructions.c find out the operand form (register or memory, 8/16/32-bit,
+ *  sign-extended immediate...) every time they run, these are picked once when
+ *  the instruction is decoded and go straight to the worker.
+ *
+ *  Only the 32-bit forms without prefixes are covered, everything else keeps
+ *  the generic handler.
+ */
+
+#include "specialize.h"
+
+#include "cpu.h"
+#include "general-purpose.h"
+#include "x86-utils.h"
+
+static d_x86_instruction_handler specialize_alu(const struct instruction *, uint8_t);
+
+#define ea32(cpu, data) x86_effectiveaddress32((cpu), (data).modrm, (data).sib, (data).moffset, (data).segovr)
+#define simm8(imm) (    (uint32_t)(int8_t)lsb(imm)    )
+
+//
+// Handlers
+//
+
+#define SP_ALU_DEFINE(op)                                                                   \
+    void x86_sp_##op##_r32_r32(void *cpu, struct exec_data data)                            \
+    {                                                                                       \
+        x86__mm_r32_r32_##op(cpu, data.reg1, data.reg2);                                    \
+    }                                                                                       \
+    void x86_sp_##op##_r32_imm32(void *cpu, struct exec_data data)                          \
+    {                                                                                       \
+        x86__mm_r32_imm32_##op(cpu, data.reg1, data.imm1);                                  \
+    }                                                                                       \
+    void x86_sp_##op##_r32_imm8(void *cpu, struct exec_data data)                           \
+    {                                                                                       \
+        x86__mm_r32_imm32_##op(cpu, data.reg1, simm8(data.imm1));                           \
+    }                                                                                       \
+    void x86_sp_##op##_m32_r32(void *cpu, struct exec_data data)                            \
+    {                                                                                       \
+        x86__mm_m32_r32_##op(cpu, ea32(cpu, data), data.reg2 SP_LOCK_ARG_##op);             \
+    }                                                                                       \
+    void x86_sp_##op##_r32_m32(void *cpu, struct exec_data data)                            \
+    {                                                                                       \
+        x86__mm_r32_m32_##op(cpu, data.reg1, ea32(cpu, data) SP_LOCK_ARG_##op);             \
+    }                                                                                       \
+    void x86_sp_##op##_m32_imm32(void *cpu, struct exec_data data)                          \
+    {                                                                                       \
+        x86__mm_m32_imm32_##op(cpu, ea32(cpu, data), data.imm1 SP_LOCK_ARG_##op);           \
+    }                                                                                       \
+    void x86_sp_##op##_m32_imm8(void *cpu, struct exec_data data)                           \
+    {                                                                                       \
+        x86__mm_m32_imm32_##op(cpu, ea32(cpu, data), simm8(data.imm1) SP_LOCK_ARG_##op);    \
+    }
+
+// cmp doesn't write its destination so it takes no lock argument
+#define SP_LOCK_ARG_add , 0
+#define SP_LOCK_ARG_sub , 0
+#define SP_LOCK_ARG_and , 0
+#define SP_LOCK_ARG_xor , 0
+#define SP_LOCK_ARG_cmp
+
+SP_ALU_DEFINE(add)
+SP_ALU_DEFINE(sub)
+SP_ALU_DEFINE(and)
+SP_ALU_DEFINE(xor)
+SP_ALU_DEFINE(cmp)
+
+void x86_sp_test_r32_r32(void *cpu, struct exec_data data)
+{
+    x86__mm_r32_r32_test(cpu, data.reg1, data.reg2);
+}
+
+void x86_sp_test_r32_imm32(void *cpu, struct exec_data data)
+{
+    x86__mm_r32_imm32_test(cpu, data.reg1, data.imm1);
+}
+
+void x86_sp_test_m32_r32(void *cpu, struct exec_data data)
+{
+    x86__mm_m32_r32_test(cpu, ea32(cpu, data), data.reg2);
+}
+
+void x86_sp_mov_r32_r32(void *cpu, struct exec_data data)
+{
+    x86__mm_r32_r32_mov(cpu, data.reg1, data.reg2);
+}
+
+void x86_sp_mov_r32_imm32(void *cpu, struct exec_data data)
+{
+    x86__mm_r32_imm32_mov(cpu, data.reg1, data.imm1);
+}
+
+void x86_sp_mov_m32_r32(void *cpu, struct exec_data data)
+{
+    x86__mm_m32_r32_mov(cpu, ea32(cpu, data), data.reg2);
+}
+
+void x86_sp_mov_r32_m32(void *cpu, struct exec_data data)
+{
+    x86__mm_r32_m32_mov(cpu, data.reg1, ea32(cpu, data));
+}
+
+void x86_sp_lea_r32_m(void *cpu, struct exec_data data)
+{
+    x86__mm_r32_m_lea(cpu, data.reg1, ea32(cpu, data));
+}
+
+void x86_sp_push_r32(void *cpu, struct exec_data data)
+{
+    x86__mm_r32_push(cpu, data.reg1);
+}
+
+void x86_sp_pop_r32(void *cpu, struct exec_data data)
+{
+    x86__mm_r32_pop(cpu, data.reg1);
+}
+
+//
+// Selection
+//
+
+#define SP_ALU_TABLE(op) {                                                          \
+        x86_sp_##op##_r32_r32, x86_sp_##op##_r32_imm32, x86_sp_##op##_r32_imm8,     \
+        x86_sp_##op##_m32_r32, x86_sp_##op##_r32_m32,                               \
+        x86_sp_##op##_m32_imm32, x86_sp_##op##_m32_imm8                             \
+    }
+
+enum SpecializedALUForms {
+    SP_R32_R32,
+    SP_R32_IMM32,
+    SP_R32_IMM8,
+    SP_M32_R32,
+    SP_R32_M32,
+    SP_M32_IMM32,
+    SP_M32_IMM8,
+    SP_NFORMS
+};
+
+enum SpecializedALUOps {
+    SP_ADD,
+    SP_SUB,
+    SP_AND,
+    SP_XOR,
+    SP_CMP,
+    SP_NOPS
+};
+
+static const d_x86_instruction_handler alu_handlers[SP_NOPS][SP_NFORMS] = {
+    [SP_ADD] = SP_ALU_TABLE(add),
+    [SP_SUB] = SP_ALU_TABLE(sub),
+    [SP_AND] = SP_ALU_TABLE(and),
+    [SP_XOR] = SP_ALU_TABLE(xor),
+    [SP_CMP] = SP_ALU_TABLE(cmp),
+};
+
+static d_x86_instruction_handler specialize_alu(const struct instruction *ins, uint8_t op)
+{
+    const struct exec_data *data = &ins->data;
+    _Bool is_reg = mod(data->modrm) == 3;
+
+    switch (data->opc) {
+        case 0x81: return alu_handlers[op][is_reg ? SP_R32_IMM32 : SP_M32_IMM32];
+        case 0x83: return alu_handlers[op][is_reg ? SP_R32_IMM8 : SP_M32_IMM8];
+    }
+
+    // the low 3 bits of the opcode tell the form, the same for every ALU op
+    switch (data->opc & 0x07) {
+        case 0x01: return alu_handlers[op][is_reg ? SP_R32_R32 : SP_M32_R32];   // op r/m32, r32
+        case 0x03: return alu_handlers[op][is_reg ? SP_R32_R32 : SP_R32_M32];   // op r32, r/m32
+        case 0x05: return alu_handlers[op][SP_R32_IMM32];                       // op eAX, imm32
+    }
+
+    return NULL;
+}
+
+void x86_specialize(struct instruction *ins)
+{
+    struct exec_data *data;
+    d_x86_instruction_handler handler = NULL;
+    _Bool is_reg;
+
+    if (!ins || ins->fail_to_fetch)
+        return;
+
+    data = &ins->data;
+
+    if (data->is0f || data->oprsz_pfx || data->adrsz_pfx || data->lock)
+        return;
+
+    // FS and GS have a base to add, the JIT and the inline operations don't
+    if (data->segovr == SEG_FS || data->segovr == SEG_GS)
+        return;
+
+    is_reg = mod(data->modrm) == 3;
+
+    // the operands, as in "op reg1, reg2"
+    switch (data->opc) {
+        case 0x01: case 0x21: case 0x29: case 0x31: case 0x39: case 0x85: case 0x89:
+            data->reg1 = rm(data->modrm);
+            data->reg2 = reg(data->modrm);
+            break;
+        case 0x03: case 0x23: case 0x2B: case 0x33: case 0x3B: case 0x8B: case 0x8D:
+            data->reg1 = reg(data->modrm);
+            data->reg2 = rm(data->modrm);
+            break;
+        case 0x05: case 0x25: case 0x2D: case 0x35: case 0x3D: case 0xA9:
+            data->reg1 = EAX;
+            break;
+        case 0x81: case 0x83:
+            data->reg1 = rm(data->modrm);
+            break;
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB: case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+        case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57:
+        case 0x58: case 0x59: case 0x5A: case 0x5B: case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+            data->reg1 = data->opc & 0x07;
+            break;
+        default:
+            return;
+    }
+
+    if (ins->handler == x86_mm_add) {
+        handler = specialize_alu(ins, SP_ADD);
+    } else if (ins->handler == x86_mm_sub) {
+        handler = specialize_alu(ins, SP_SUB);
+    } else if (ins->handler == x86_mm_and) {
+        handler = specialize_alu(ins, SP_AND);
+    } else if (ins->handler == x86_mm_xor) {
+        handler = specialize_alu(ins, SP_XOR);
+    } else if (ins->handler == x86_mm_cmp) {
+        handler = specialize_alu(ins, SP_CMP);
+    } else if (ins->handler == x86_mm_test) {
+        if (data->opc == 0x85)
+            handler = is_reg ? x86_sp_test_r32_r32 : x86_sp_test_m32_r32;
+        else if (data->opc == 0xA9)
+            handler = x86_sp_test_r32_imm32;
+    } else if (ins->handler == x86_mm_mov) {
+        if (data->opc == 0x89)
+            handler = is_reg ? x86_sp_mov_r32_r32 : x86_sp_mov_m32_r32;
+        else if (data->opc == 0x8B)
+            handler = is_reg ? x86_sp_mov_r32_r32 : x86_sp_mov_r32_m32;
+        else if (data->opc >= 0xB8 && data->opc <= 0xBF)
+            handler = x86_sp_mov_r32_imm32;
+    } else if (ins->handler == x86_mm_lea) {
+        if (data->opc == 0x8D && !is_reg)
+            handler = x86_sp_lea_r32_m;
+    } else if (ins->handler == x86_mm_push) {
+        if (data->opc >= 0x50 && data->opc <= 0x57)
+            handler = x86_sp_push_r32;
+    } else if (ins->handler == x86_mm_pop) {
+        if (data->opc >= 0x58 && data->opc <= 0x5F)
+            handler = x86_sp_pop_r32;
+    }
+
+    if (handler)
+        ins->handler = handler;
+}
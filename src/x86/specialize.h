@@ -0,0 +1,62 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. *
+ * DESCRIPTION:
+ *  handlers specialized for a single operand form, selected by the decoder.
+ */
+
+#ifndef SPECIALIZE_H
+#define SPECIALIZE_H
+
+#include "instructions.h"
+
+// replace the generic handler of a decoded instruction by one that only deals
+// with its operand form. The register operands are stored in data.reg1/reg2.
+void x86_specialize(struct instruction *);
+
+#define SP_ALU_DECLARE(op)                                          \
+    void x86_sp_##op##_r32_r32(void *, struct exec_data);           \
+    void x86_sp_##op##_r32_imm32(void *, struct exec_data);         \
+    void x86_sp_##op##_r32_imm8(void *, struct exec_data);          \
+    void x86_sp_##op##_m32_r32(void *, struct exec_data);           \
+    void x86_sp_##op##_r32_m32(void *, struct exec_data);           \
+    void x86_sp_##op##_m32_imm32(void *, struct exec_data);         \
+    void x86_sp_##op##_m32_imm8(void *, struct exec_data)
+
+SP_ALU_DECLARE(add);
+SP_ALU_DECLARE(sub);
+SP_ALU_DECLARE(and);
+SP_ALU_DECLARE(xor);
+SP_ALU_DECLARE(cmp);
+
+void x86_sp_test_r32_r32(void *, struct exec_data);
+void x86_sp_test_r32_imm32(void *, struct exec_data);
+void x86_sp_test_m32_r32(void *, struct exec_data);
+
+void x86_sp_mov_r32_r32(void *, struct exec_data);
+void x86_sp_mov_r32_imm32(void *, struct exec_data);
+void x86_sp_mov_m32_r32(void *, struct exec_data);
+void x86_sp_mov_r32_m32(void *, struct exec_data);
+
+void x86_sp_lea_r32_m(void *, struct exec_data);
+
+void x86_sp_push_r32(void *, struct exec_data);
+void x86_sp_pop_r32(void *, struct exec_data);
+
+#endif /* SPECIALIZE_H */
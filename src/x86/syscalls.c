@@ -0,0 +1,1065 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  the Linux i386 system calls, reached through int 0x80.
+ *
+ *  The calls are looked up by number in a table. Most take the same
+ *  arguments on the host, so the entry only describes how each one gets
+ *  there: values are extended to the host width and each buffer is translated
+ *  once to a host pointer, then the host call is made with them. Only buffers
+ *  that are not contiguous in the host are copied. The calls with structures
+ *  of a different layout on the host or that touch the guest memory map have
+ *  a handler instead.
+ *
+ *  With write-behind on, the writes to some files are held in a buffer per
+ *  file instead. The writes to a file reach the host in the order they were
+ *  made, through any descriptor. Every buffer is written out before any call
+ *  that isn't marked pure runs. Errors of the writes held back are lost, the
+ *  guest was already told they succeeded.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+
+#include "../memory.h"
+
+#include "syscalls.h"
+#include "x86-mmu.h"
+
+// a buffer of a call, either a host pointer into the guest memory or a copy
+struct sc_buffer {
+    moffset32_t sb_vaddr;
+    size_t sb_len;
+    uint8_t *sb_copy;
+    _Bool sb_out;
+};
+
+struct guest_timeval {
+    int32_t tv_sec;
+    int32_t tv_usec;
+};
+
+struct guest_timespec {
+    int32_t tv_sec;
+    int32_t tv_nsec;
+};
+
+struct guest_iovec {
+    uint32_t iov_base;
+    uint32_t iov_len;
+};
+
+// struct stat64 as the i386 kernel lays it out, 64-bit fields are 4-aligned
+struct guest_stat64 {
+    uint64_t gs_dev;
+    uint32_t gs_pad0;
+    uint32_t gs_ino32;
+    uint32_t gs_mode;
+    uint32_t gs_nlink;
+    uint32_t gs_uid;
+    uint32_t gs_gid;
+    uint64_t gs_rdev;
+    uint32_t gs_pad3;
+    int64_t gs_size;
+    uint32_t gs_blksize;
+    uint64_t gs_blocks;
+    uint32_t gs_atime;
+    uint32_t gs_atime_nsec;
+    uint32_t gs_mtime;
+    uint32_t gs_mtime_nsec;
+    uint32_t gs_ctime;
+    uint32_t gs_ctime_nsec;
+    uint64_t gs_ino;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct guest_stat64) == 96, "struct guest_stat64 doesn't match the i386 layout");
+
+// descriptors from this one up are never held back
+#define WB_MAXFD 1024
+// how many files can have writes held back at once
+#define WB_SLOTS 4
+
+enum WriteBehindClasses {
+    WB_UNKNOWN,
+    WB_DIRECT,
+    WB_HELD
+};
+
+struct wb_file {
+    dev_t wf_dev;
+    ino_t wf_ino;
+};
+
+// the writes held back for a file, all made through the same descriptor
+struct wb_slot {
+    struct wb_file ws_file;
+    int ws_fd;
+    size_t ws_len;
+    uint8_t *ws_data;
+};
+
+static struct {
+    _Bool wb_enabled;
+    // the guest threads share the buffers
+    pthread_mutex_t wb_lock;
+    struct wb_slot wb_slots[WB_SLOTS];
+    // the slot given to the next file when none is free
+    int wb_next;
+    // looked up on the first write, forgotten when descriptors come and go
+    uint8_t wb_class[WB_MAXFD];
+    struct wb_file wb_files[WB_MAXFD];
+} writebehind = { .wb_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void flush_all(void);
+static void flush_slot(struct wb_slot *);
+static struct wb_slot *find_slot(int);
+static _Bool write_held(int);
+static int32_t hold_write(x86CPU *, const x86Syscall *, const uint32_t *);
+static int32_t passthrough(x86CPU *, const x86Syscall *, const uint32_t *);
+static int32_t read_string(x86MMU *, moffset32_t, char *);
+static int32_t map_buffer(x86MMU *, struct sc_buffer *, moffset32_t, size_t, _Bool, void **);
+static void unmap_buffer(x86MMU *, struct sc_buffer *);
+static int32_t copy_out(x86MMU *, moffset32_t, const void *, size_t);
+static int32_t host_result(long);
+static int32_t mmu_result(x86MMU *, moffset32_t);
+static int32_t stat_out(x86MMU *, moffset32_t, const struct stat *);
+static int32_t vector_io(x86CPU *, const uint32_t *, _Bool);
+static int32_t futex_word(x86MMU *, moffset32_t, int, uint32_t **);
+
+static int32_t sys_exit(x86CPU *, const uint32_t *);
+static int32_t sys_exit_group(x86CPU *, const uint32_t *);
+static int32_t sys_clone(x86CPU *, const uint32_t *);
+static int32_t sys_set_tid_address(x86CPU *, const uint32_t *);
+static int32_t sys_set_thread_area(x86CPU *, const uint32_t *);
+static int32_t sys_brk(x86CPU *, const uint32_t *);
+static int32_t sys_mmap(x86CPU *, const uint32_t *);
+static int32_t sys_mmap2(x86CPU *, const uint32_t *);
+static int32_t sys_munmap(x86CPU *, const uint32_t *);
+static int32_t sys_mprotect(x86CPU *, const uint32_t *);
+static int32_t sys_mremap(x86CPU *, const uint32_t *);
+static int32_t sys_lseek(x86CPU *, const uint32_t *);
+static int32_t sys_llseek(x86CPU *, const uint32_t *);
+static int32_t sys_readv(x86CPU *, const uint32_t *);
+static int32_t sys_writev(x86CPU *, const uint32_t *);
+static int32_t sys_ioctl(x86CPU *, const uint32_t *);
+static int32_t sys_uname(x86CPU *, const uint32_t *);
+static int32_t sys_time(x86CPU *, const uint32_t *);
+static int32_t sys_gettimeofday(x86CPU *, const uint32_t *);
+static int32_t sys_clock_gettime(x86CPU *, const uint32_t *);
+static int32_t sys_clock_getres(x86CPU *, const uint32_t *);
+static int32_t sys_nanosleep(x86CPU *, const uint32_t *);
+static int32_t sys_futex(x86CPU *, const uint32_t *);
+static int32_t sys_stat64(x86CPU *, const uint32_t *);
+static int32_t sys_lstat64(x86CPU *, const uint32_t *);
+static int32_t sys_fstat64(x86CPU *, const uint32_t *);
+static int32_t sys_fstatat64(x86CPU *, const uint32_t *);
+
+#define A_UINT { SA_UINT, 0, 0 }
+#define A_INT { SA_INT, 0, 0 }
+#define A_STR { SA_STR, 0, 0 }
+#define A_IN(b_sizearg) { SA_IN, b_sizearg, 0 }
+#define A_OUT(b_sizearg) { SA_OUT, b_sizearg, 0 }
+#define A_OUTSZ(b_size) { SA_OUT, 0, b_size }
+
+#define PASS(b_name, b_flags, b_nargs, ...) { #b_name, SYS_##b_name, NULL, b_flags, b_nargs, { __VA_ARGS__ } }
+#define PASS_AS(b_name, b_host, b_flags, b_nargs, ...) { #b_name, SYS_##b_host, NULL, b_flags, b_nargs, { __VA_ARGS__ } }
+#define EMUL(b_name, b_flags, b_handler) { #b_name, -1, b_handler, b_flags, 0, { A_UINT } }
+
+// indexed by the i386 call number, the ones left out fail with ENOSYS
+static const x86Syscall syscall_table[X86_NSYSCALLS + 1] = {
+    [1] = EMUL(exit, 0, sys_exit),
+    [3] = PASS(read, 0, 3, A_INT, A_OUT(2), A_UINT),
+    [4] = PASS(write, SC_WRITE, 3, A_INT, A_IN(2), A_UINT),
+    [5] = PASS(open, SC_FDTABLE, 3, A_STR, A_UINT, A_UINT),
+    [6] = PASS(close, SC_FDTABLE, 1, A_INT),
+    [10] = PASS(unlink, 0, 1, A_STR),
+    [12] = PASS(chdir, 0, 1, A_STR),
+    [13] = EMUL(time, SC_PURE, sys_time),
+    [15] = PASS(chmod, 0, 2, A_STR, A_UINT),
+    [19] = EMUL(lseek, 0, sys_lseek),
+    [20] = PASS(getpid, SC_PURE, 0, A_UINT),
+    [24] = PASS(getuid, SC_PURE, 0, A_UINT),
+    [33] = PASS(access, 0, 2, A_STR, A_UINT),
+    [36] = PASS(sync, 0, 0, A_UINT),
+    [37] = PASS(kill, 0, 2, A_INT, A_INT),
+    [38] = PASS(rename, 0, 2, A_STR, A_STR),
+    [39] = PASS(mkdir, 0, 2, A_STR, A_UINT),
+    [40] = PASS(rmdir, 0, 1, A_STR),
+    [41] = PASS(dup, SC_FDTABLE, 1, A_INT),
+    [42] = PASS(pipe, SC_FDTABLE, 1, A_OUTSZ(2 * sizeof(int))),
+    [45] = EMUL(brk, SC_PURE, sys_brk),
+    [47] = PASS(getgid, SC_PURE, 0, A_UINT),
+    [49] = PASS(geteuid, SC_PURE, 0, A_UINT),
+    [50] = PASS(getegid, SC_PURE, 0, A_UINT),
+    [54] = EMUL(ioctl, 0, sys_ioctl),
+    [57] = PASS(setpgid, 0, 2, A_INT, A_INT),
+    [60] = PASS(umask, SC_PURE, 1, A_UINT),
+    [63] = PASS(dup2, SC_FDTABLE, 2, A_INT, A_INT),
+    [64] = PASS(getppid, SC_PURE, 0, A_UINT),
+    [65] = PASS(getpgrp, SC_PURE, 0, A_UINT),
+    [66] = PASS(setsid, 0, 0, A_UINT),
+    [78] = EMUL(gettimeofday, SC_PURE, sys_gettimeofday),
+    [83] = PASS(symlink, 0, 2, A_STR, A_STR),
+    [85] = PASS(readlink, 0, 3, A_STR, A_OUT(2), A_UINT),
+    [90] = EMUL(mmap, 0, sys_mmap),
+    [91] = EMUL(munmap, SC_PURE, sys_munmap),
+    [93] = PASS(ftruncate, 0, 2, A_INT, A_INT),
+    [94] = PASS(fchmod, 0, 2, A_INT, A_UINT),
+    [118] = PASS(fsync, 0, 1, A_INT),
+    [120] = EMUL(clone, 0, sys_clone),
+    [122] = EMUL(uname, SC_PURE, sys_uname),
+    [125] = EMUL(mprotect, SC_PURE, sys_mprotect),
+    [133] = PASS(fchdir, 0, 1, A_INT),
+    [140] = EMUL(_llseek, 0, sys_llseek),
+    [145] = EMUL(readv, 0, sys_readv),
+    [146] = EMUL(writev, SC_WRITE, sys_writev),
+    [148] = PASS(fdatasync, 0, 1, A_INT),
+    [162] = EMUL(nanosleep, 0, sys_nanosleep),
+    [163] = EMUL(mremap, 0, sys_mremap),
+    [183] = PASS(getcwd, 0, 2, A_OUT(1), A_UINT),
+    [192] = EMUL(mmap2, 0, sys_mmap2),
+    [195] = EMUL(stat64, 0, sys_stat64),
+    [196] = EMUL(lstat64, 0, sys_lstat64),
+    [197] = EMUL(fstat64, 0, sys_fstat64),
+    [199] = PASS_AS(getuid32, getuid, SC_PURE, 0, A_UINT),
+    [200] = PASS_AS(getgid32, getgid, SC_PURE, 0, A_UINT),
+    [201] = PASS_AS(geteuid32, geteuid, SC_PURE, 0, A_UINT),
+    [202] = PASS_AS(getegid32, getegid, SC_PURE, 0, A_UINT),
+    [224] = PASS(gettid, SC_PURE, 0, A_UINT),
+    [252] = EMUL(exit_group, 0, sys_exit_group),
+    // waking and waiting don't touch files, threads hand off locks with it
+    [240] = EMUL(futex, SC_PURE, sys_futex),
+    [243] = EMUL(set_thread_area, SC_PURE, sys_set_thread_area),
+    [258] = EMUL(set_tid_address, SC_PURE, sys_set_tid_address),
+    [265] = EMUL(clock_gettime, SC_PURE, sys_clock_gettime),
+    [266] = EMUL(clock_getres, SC_PURE, sys_clock_getres),
+    [295] = PASS(openat, SC_FDTABLE, 4, A_INT, A_STR, A_UINT, A_UINT),
+    [296] = PASS(mkdirat, 0, 3, A_INT, A_STR, A_UINT),
+    [300] = EMUL(fstatat64, 0, sys_fstatat64),
+    [301] = PASS(unlinkat, 0, 3, A_INT, A_STR, A_UINT),
+    [305] = PASS(readlinkat, 0, 4, A_INT, A_STR, A_OUT(3), A_UINT),
+    [307] = PASS(faccessat, 0, 3, A_INT, A_STR, A_UINT),
+    [330] = PASS(dup3, SC_FDTABLE, 3, A_INT, A_INT, A_UINT),
+    [331] = PASS(pipe2, SC_FDTABLE, 2, A_OUTSZ(2 * sizeof(int)), A_UINT),
+};
+
+// the ioctls passed through, with the size of what the argument points to
+static const struct {
+    uint32_t io_request;
+    uint16_t io_size;
+    _Bool io_out;
+} ioctl_table[] = {
+    { TCGETS, 36, 1 },          // struct termios of the kernel, same on i386
+    { TCSETS, 36, 0 },
+    { TCSETSW, 36, 0 },
+    { TCSETSF, 36, 0 },
+    { TIOCGWINSZ, sizeof(struct winsize), 1 },
+    { TIOCSWINSZ, sizeof(struct winsize), 0 },
+    { TIOCGPGRP, sizeof(int), 1 },
+    { TIOCSPGRP, sizeof(int), 0 },
+    { FIONREAD, sizeof(int), 1 },
+    { FIONBIO, sizeof(int), 0 },
+};
+
+void x86_linux_syscall(x86CPU *cpu)
+{
+    uint32_t args[6] = { cpu->EBX, cpu->ECX, cpu->EDX, cpu->ESI, cpu->EDI, cpu->EBP };
+
+    cpu->EAX = x86_syscall_run(cpu, cpu->EAX, args);
+}
+
+int32_t x86_syscall_run(x86CPU *cpu, uint32_t nr, const uint32_t *args)
+{
+    const x86Syscall *sc;
+    int32_t ret;
+
+    if (nr > X86_NSYSCALLS || !(sc = &syscall_table[nr])->sc_name)
+        return -ENOSYS;
+
+    if (writebehind.wb_enabled) {
+        pthread_mutex_lock(&writebehind.wb_lock);
+
+        if ((sc->sc_flags & SC_WRITE) && write_held((int32_t)args[0])) {
+            ret = hold_write(cpu, sc, args);
+            pthread_mutex_unlock(&writebehind.wb_lock);
+            return ret;
+        }
+
+        if (!(sc->sc_flags & SC_PURE))
+            flush_all();
+
+        if (sc->sc_flags & SC_FDTABLE)
+            memset(writebehind.wb_class, WB_UNKNOWN, sizeof(writebehind.wb_class));
+
+        pthread_mutex_unlock(&writebehind.wb_lock);
+    }
+
+    if (sc->sc_handler)
+        return sc->sc_handler(cpu, args);
+
+    return passthrough(cpu, sc, args);
+}
+
+void x86_syscall_writebehind(_Bool enable)
+{
+    for (int i = 0; i < WB_SLOTS; i++) {
+        struct wb_slot *slot = &writebehind.wb_slots[i];
+
+        if (enable && !slot->ws_data) {
+            slot->ws_data = xmalloc(WB_BUFFER_SIZE);
+            slot->ws_fd = -1;
+        } else if (!enable && slot->ws_data) {
+            flush_slot(slot);
+            xfree(slot->ws_data);
+            slot->ws_data = NULL;
+        }
+    }
+
+    writebehind.wb_enabled = enable;
+}
+
+void x86_syscall_flush(void)
+{
+    pthread_mutex_lock(&writebehind.wb_lock);
+    flush_all();
+    pthread_mutex_unlock(&writebehind.wb_lock);
+}
+
+static void flush_all(void)
+{
+    for (int i = 0; i < WB_SLOTS; i++)
+        flush_slot(&writebehind.wb_slots[i]);
+}
+
+static void flush_slot(struct wb_slot *slot)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < slot->ws_len) {
+        ret = write(slot->ws_fd, slot->ws_data + done, slot->ws_len - done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    slot->ws_len = 0;
+}
+
+// regular files are, stdout and stderr also when they go to a pipe or a file
+static _Bool write_held(int fd)
+{
+    struct stat st;
+    int flags;
+
+    if (fd < 0 || fd >= WB_MAXFD)
+        return 0;
+
+    if (writebehind.wb_class[fd] == WB_UNKNOWN) {
+        writebehind.wb_class[fd] = WB_DIRECT;
+
+        if (fstat(fd, &st) == -1 || (flags = fcntl(fd, F_GETFL)) == -1 || (flags & (O_SYNC | O_DSYNC)))
+            return 0;
+
+        if (S_ISREG(st.st_mode) || ((fd == STDOUT_FILENO || fd == STDERR_FILENO) && !isatty(fd))) {
+            writebehind.wb_class[fd] = WB_HELD;
+            writebehind.wb_files[fd].wf_dev = st.st_dev;
+            writebehind.wb_files[fd].wf_ino = st.st_ino;
+        }
+    }
+
+    return writebehind.wb_class[fd] == WB_HELD;
+}
+
+// the slot for the file of the descriptor. The writes another descriptor
+// left there are written out first so they stay in order, as are the ones of
+// the file that loses its slot.
+static struct wb_slot *find_slot(int fd)
+{
+    struct wb_file *file = &writebehind.wb_files[fd];
+    struct wb_slot *slot;
+    struct wb_slot *unused = NULL;
+
+    for (int i = 0; i < WB_SLOTS; i++) {
+        slot = &writebehind.wb_slots[i];
+
+        if (!slot->ws_len) {
+            if (!unused)
+                unused = slot;
+            continue;
+        }
+
+        if (slot->ws_file.wf_dev == file->wf_dev && slot->ws_file.wf_ino == file->wf_ino) {
+            if (slot->ws_fd != fd)
+                flush_slot(slot);
+            slot->ws_fd = fd;
+            return slot;
+        }
+    }
+
+    if (!(slot = unused)) {
+        slot = &writebehind.wb_slots[writebehind.wb_next];
+        writebehind.wb_next = (writebehind.wb_next + 1) % WB_SLOTS;
+        flush_slot(slot);
+    }
+
+    slot->ws_file = *file;
+    slot->ws_fd = fd;
+    return slot;
+}
+
+// copies a write() or writev() to the slot of the file, the ones that don't
+// fit in a slot are made right away
+static int32_t hold_write(x86CPU *cpu, const x86Syscall *sc, const uint32_t *args)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    struct guest_iovec guest_iov[UIO_MAXIOV];
+    struct wb_slot *slot;
+    int fd = (int32_t)args[0];
+    int count = 1;
+    size_t total = 0;
+    size_t start;
+
+    if (sc->sc_handler == sys_writev) {
+        count = (int32_t)args[2];
+        if (count < 0 || count > UIO_MAXIOV)
+            return -EINVAL;
+
+        if (mmu_read(mmu, args[1], guest_iov, count * sizeof(*guest_iov)) != count * sizeof(*guest_iov)) {
+            mmu_clrerror(mmu);
+            return -EFAULT;
+        }
+    } else {
+        guest_iov[0].iov_base = args[1];
+        guest_iov[0].iov_len = args[2];
+    }
+
+    for (int i = 0; i < count; i++)
+        total += guest_iov[i].iov_len;
+
+    slot = find_slot(fd);
+    if (total > WB_BUFFER_SIZE - slot->ws_len)
+        flush_slot(slot);
+
+    if (total >= WB_BUFFER_SIZE)
+        return sc->sc_handler ? sc->sc_handler(cpu, args) : passthrough(cpu, sc, args);
+
+    start = slot->ws_len;
+    for (int i = 0; i < count; i++) {
+        if (mmu_read(mmu, guest_iov[i].iov_base, slot->ws_data + slot->ws_len,
+                     guest_iov[i].iov_len) != guest_iov[i].iov_len) {
+            mmu_clrerror(mmu);
+            slot->ws_len = start;
+            return -EFAULT;
+        }
+        slot->ws_len += guest_iov[i].iov_len;
+    }
+
+    return total;
+}
+
+static int32_t passthrough(x86CPU *cpu, const x86Syscall *sc, const uint32_t *args)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    char strings[2][PATH_MAX];
+    struct sc_buffer buffers[6];
+    long host[6] = { 0 };
+    int nstrings = 0;
+    int nbuffers = 0;
+    int32_t ret = 0;
+    void *ptr;
+
+    for (int i = 0; i < sc->sc_nargs && !ret; i++) {
+        const struct syscall_arg *arg = &sc->sc_args[i];
+
+        switch (arg->sa_kind) {
+        case SA_UINT:
+            host[i] = args[i];
+            break;
+        case SA_INT:
+            host[i] = (int32_t)args[i];
+            break;
+        case SA_STR:
+            if (!args[i])
+                break;
+            ret = read_string(mmu, args[i], strings[nstrings]);
+            host[i] = (long)strings[nstrings++];
+            break;
+        case SA_IN:
+        case SA_OUT:
+            ret = map_buffer(mmu, &buffers[nbuffers], args[i],
+                             arg->sa_size ? arg->sa_size : args[arg->sa_sizearg],
+                             arg->sa_kind == SA_OUT, &ptr);
+            if (!ret)
+                nbuffers++;
+            host[i] = (long)ptr;
+            break;
+        }
+    }
+
+    if (!ret)
+        ret = host_result(syscall(sc->sc_host, host[0], host[1], host[2], host[3], host[4], host[5]));
+
+    while (nbuffers--)
+        unmap_buffer(mmu, &buffers[nbuffers]);
+
+    return ret;
+}
+
+// copies the string to dest, which has room for PATH_MAX bytes
+static int32_t read_string(x86MMU *mmu, moffset32_t virtaddr, char *dest)
+{
+    size_t len = mmu_read_until(mmu, virtaddr, dest, PATH_MAX, '\0');
+
+    if (mmu_error(mmu)) {
+        mmu_clrerror(mmu);
+        return -EFAULT;
+    }
+
+    return len && !dest[len - 1] ? 0 : -ENAMETOOLONG;
+}
+
+// the host pointer for the buffer is stored in the last argument
+static int32_t map_buffer(x86MMU *mmu, struct sc_buffer *buf, moffset32_t virtaddr, size_t len, _Bool out, void **host)
+{
+    buf->sb_vaddr = virtaddr;
+    buf->sb_len = len;
+    buf->sb_copy = NULL;
+    buf->sb_out = out;
+
+    if ((*host = mmu_hostrange(mmu, virtaddr, len, out ? PG_WRITE : PG_READ)) || !len)
+        return 0;
+
+    if (mmu_error(mmu)) {
+        mmu_clrerror(mmu);
+        return -EFAULT;
+    }
+
+    // every page is there, they are just apart on the host. The whole buffer
+    // is copied in so the bytes the call doesn't write are kept.
+    buf->sb_copy = xmalloc(len);
+    mmu_read(mmu, virtaddr, buf->sb_copy, len);
+    *host = buf->sb_copy;
+
+    return 0;
+}
+
+static void unmap_buffer(x86MMU *mmu, struct sc_buffer *buf)
+{
+    if (buf->sb_copy) {
+        if (buf->sb_out)
+            mmu_write(mmu, buf->sb_vaddr, buf->sb_copy, buf->sb_len);
+        xfree(buf->sb_copy);
+    } else if (buf->sb_out) {
+        mmu_host_written(mmu, buf->sb_vaddr, buf->sb_len);
+    }
+}
+
+static int32_t copy_out(x86MMU *mmu, moffset32_t virtaddr, const void *src, size_t len)
+{
+    if (mmu_write(mmu, virtaddr, src, len) != len) {
+        mmu_clrerror(mmu);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static int32_t host_result(long ret)
+{
+    return ret == -1 ? -errno : ret;
+}
+
+static int32_t mmu_result(x86MMU *mmu, moffset32_t ret)
+{
+    int err = mmu_error(mmu);
+
+    if (err) {
+        mmu_clrerror(mmu);
+        return -err;
+    }
+
+    return ret;
+}
+
+// the host address of the futex word at virtaddr, which the guest must be
+// allowed to access
+static int32_t futex_word(x86MMU *mmu, moffset32_t virtaddr, int access, uint32_t **host)
+{
+    if (virtaddr % sizeof(**host))
+        return -EINVAL;
+
+    *host = (uint32_t *)mmu_hostrange(mmu, virtaddr, sizeof(**host), access);
+    if (!*host) {
+        mmu_clrerror(mmu);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static int32_t stat_out(x86MMU *mmu, moffset32_t virtaddr, const struct stat *st)
+{
+    struct guest_stat64 gst = {
+        .gs_dev = st->st_dev,
+        .gs_ino32 = st->st_ino,
+        .gs_mode = st->st_mode,
+        .gs_nlink = st->st_nlink,
+        .gs_uid = st->st_uid,
+        .gs_gid = st->st_gid,
+        .gs_rdev = st->st_rdev,
+        .gs_size = st->st_size,
+        .gs_blksize = st->st_blksize,
+        .gs_blocks = st->st_blocks,
+        .gs_atime = st->st_atim.tv_sec,
+        .gs_atime_nsec = st->st_atim.tv_nsec,
+        .gs_mtime = st->st_mtim.tv_sec,
+        .gs_mtime_nsec = st->st_mtim.tv_nsec,
+        .gs_ctime = st->st_ctim.tv_sec,
+        .gs_ctime_nsec = st->st_ctim.tv_nsec,
+        .gs_ino = st->st_ino,
+    };
+
+    return copy_out(mmu, virtaddr, &gst, sizeof(gst));
+}
+
+// readv() and writev(), out is set when the call writes to the buffers
+static int32_t vector_io(x86CPU *cpu, const uint32_t *args, _Bool out)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    struct guest_iovec guest_iov[UIO_MAXIOV];
+    struct iovec iov[UIO_MAXIOV];
+    struct sc_buffer buffers[UIO_MAXIOV];
+    int count = (int32_t)args[2];
+    int mapped = 0;
+    int32_t ret = 0;
+
+    if (count < 0 || count > UIO_MAXIOV)
+        return -EINVAL;
+
+    if (mmu_read(mmu, args[1], guest_iov, count * sizeof(*guest_iov)) != count * sizeof(*guest_iov)) {
+        mmu_clrerror(mmu);
+        return -EFAULT;
+    }
+
+    for (; mapped < count; mapped++) {
+        ret = map_buffer(mmu, &buffers[mapped], guest_iov[mapped].iov_base,
+                         guest_iov[mapped].iov_len, out, &iov[mapped].iov_base);
+        if (ret)
+            break;
+        iov[mapped].iov_len = guest_iov[mapped].iov_len;
+    }
+
+    if (!ret)
+        ret = host_result(out ? readv((int32_t)args[0], iov, count) : writev((int32_t)args[0], iov, count));
+
+    while (mapped--)
+        unmap_buffer(mmu, &buffers[mapped]);
+
+    return ret;
+}
+
+//
+// Handlers
+//
+
+// only the calling thread ends, the process ends with the last one
+static int32_t sys_exit(x86CPU *cpu, const uint32_t *args)
+{
+    x86_cpu_exit(cpu, args[0] & 0xff);
+}
+
+static int32_t sys_exit_group(x86CPU *cpu, const uint32_t *args)
+{
+    x86_cpu_rerun(cpu);
+    x86_stopcpu(cpu);
+    exit(args[0] & 0xff);
+}
+
+// the i386 order: flags, stack, parent tid, tls, child tid
+static int32_t sys_clone(x86CPU *cpu, const uint32_t *args)
+{
+    return x86_cpu_clone(cpu, args[0], args[1], args[2], args[3], args[4]);
+}
+
+static int32_t sys_set_thread_area(x86CPU *cpu, const uint32_t *args)
+{
+    return x86_set_thread_area(cpu, args[0], 1);
+}
+
+static int32_t sys_set_tid_address(x86CPU *cpu, const uint32_t *args)
+{
+    cpu->clear_child_tid = args[0];
+    return syscall(SYS_gettid);
+}
+
+static int32_t sys_brk(x86CPU *cpu, const uint32_t *args)
+{
+    moffset32_t brk = mmu_brk(x86_mmu(cpu), args[0]);
+
+    // a break that can't move is not an error
+    mmu_clrerror(x86_mmu(cpu));
+    return brk;
+}
+
+// the old mmap() takes its arguments from a structure
+static int32_t sys_mmap(x86CPU *cpu, const uint32_t *args)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    uint32_t margs[6];
+    moffset32_t addr;
+
+    if (mmu_read(mmu, args[0], margs, sizeof(margs)) != sizeof(margs)) {
+        mmu_clrerror(mmu);
+        return -EFAULT;
+    }
+
+    if (margs[5] & (MMU_PAGE_SIZE - 1))
+        return -EINVAL;
+
+    addr = mmu_mmap(mmu, margs[0], margs[1], margs[2], margs[3], margs[4], margs[5]);
+    return mmu_result(mmu, addr);
+}
+
+// the offset is in pages
+static int32_t sys_mmap2(x86CPU *cpu, const uint32_t *args)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    moffset32_t addr;
+
+    addr = mmu_mmap(mmu, args[0], args[1], args[2], args[3], args[4], (off_t)args[5] << MMU_PAGE_SHIFT);
+    return mmu_result(mmu, addr);
+}
+
+static int32_t sys_munmap(x86CPU *cpu, const uint32_t *args)
+{
+    mmu_munmap(x86_mmu(cpu), args[0], args[1]);
+    return mmu_result(x86_mmu(cpu), 0);
+}
+
+static int32_t sys_mprotect(x86CPU *cpu, const uint32_t *args)
+{
+    mmu_mprotect(x86_mmu(cpu), args[0], args[1], args[2]);
+    return mmu_result(x86_mmu(cpu), 0);
+}
+
+static int32_t sys_mremap(x86CPU *cpu, const uint32_t *args)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    moffset32_t addr;
+
+    addr = mmu_mremap(mmu, args[0], args[1], args[2], args[3], args[4]);
+    return mmu_result(mmu, addr);
+}
+
+// the guest off_t is 32 bits, a position past it can't be returned
+static int32_t sys_lseek(x86CPU *cpu, const uint32_t *args)
+{
+    off_t offset;
+
+    (void)cpu;
+
+    if ((offset = lseek((int32_t)args[0], (int32_t)args[1], args[2])) == -1)
+        return -errno;
+
+    if (offset > INT32_MAX)
+        return -EOVERFLOW;
+
+    return offset;
+}
+
+// the 64-bit offset comes in two halves and the result goes to memory
+static int32_t sys_llseek(x86CPU *cpu, const uint32_t *args)
+{
+    off_t offset = ((off_t)args[1] << 32) | args[2];
+    uint64_t result;
+
+    if ((offset = lseek((int32_t)args[0], offset, args[4])) == -1)
+        return -errno;
+
+    result = offset;
+    return copy_out(x86_mmu(cpu), args[3], &result, sizeof(result));
+}
+
+static int32_t sys_readv(x86CPU *cpu, const uint32_t *args)
+{
+    return vector_io(cpu, args, 1);
+}
+
+static int32_t sys_writev(x86CPU *cpu, const uint32_t *args)
+{
+    return vector_io(cpu, args, 0);
+}
+
+static int32_t sys_ioctl(x86CPU *cpu, const uint32_t *args)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    struct sc_buffer buf;
+    int32_t ret;
+    void *ptr;
+
+    for (size_t i = 0; i < sizeof(ioctl_table) / sizeof(*ioctl_table); i++) {
+        if (ioctl_table[i].io_request != args[1])
+            continue;
+
+        if ((ret = map_buffer(mmu, &buf, args[2], ioctl_table[i].io_size, ioctl_table[i].io_out, &ptr)))
+            return ret;
+
+        ret = host_result(ioctl((int32_t)args[0], args[1], ptr));
+        unmap_buffer(mmu, &buf);
+        return ret;
+    }
+
+    return -ENOTTY;
+}
+
+static int32_t sys_uname(x86CPU *cpu, const uint32_t *args)
+{
+    struct utsname name;
+
+    if (uname(&name) == -1)
+        return -errno;
+
+    strcpy(name.machine, "i686");
+    return copy_out(x86_mmu(cpu), args[0], &name, sizeof(name));
+}
+
+static int32_t sys_time(x86CPU *cpu, const uint32_t *args)
+{
+    int32_t now = time(NULL);
+
+    if (args[0] && copy_out(x86_mmu(cpu), args[0], &now, sizeof(now)))
+        return -EFAULT;
+
+    return now;
+}
+
+static int32_t sys_gettimeofday(x86CPU *cpu, const uint32_t *args)
+{
+    struct timeval tv;
+    struct timezone tz;
+    struct guest_timeval gtv;
+
+    if (gettimeofday(&tv, &tz) == -1)
+        return -errno;
+
+    gtv.tv_sec = tv.tv_sec;
+    gtv.tv_usec = tv.tv_usec;
+
+    if (args[0] && copy_out(x86_mmu(cpu), args[0], &gtv, sizeof(gtv)))
+        return -EFAULT;
+    // struct timezone is two ints on both
+    if (args[1] && copy_out(x86_mmu(cpu), args[1], &tz, sizeof(tz)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int32_t sys_clock_gettime(x86CPU *cpu, const uint32_t *args)
+{
+    struct timespec ts;
+    struct guest_timespec gts;
+
+    if (clock_gettime((int32_t)args[0], &ts) == -1)
+        return -errno;
+
+    gts.tv_sec = ts.tv_sec;
+    gts.tv_nsec = ts.tv_nsec;
+    return copy_out(x86_mmu(cpu), args[1], &gts, sizeof(gts));
+}
+
+static int32_t sys_clock_getres(x86CPU *cpu, const uint32_t *args)
+{
+    struct timespec ts;
+    struct guest_timespec gts;
+
+    if (clock_getres((int32_t)args[0], &ts) == -1)
+        return -errno;
+
+    if (!args[1])
+        return 0;
+
+    gts.tv_sec = ts.tv_sec;
+    gts.tv_nsec = ts.tv_nsec;
+    return copy_out(x86_mmu(cpu), args[1], &gts, sizeof(gts));
+}
+
+static int32_t sys_nanosleep(x86CPU *cpu, const uint32_t *args)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    struct guest_timespec gts;
+    struct timespec req;
+    struct timespec rem;
+
+    if (mmu_read(mmu, args[0], &gts, sizeof(gts)) != sizeof(gts)) {
+        mmu_clrerror(mmu);
+        return -EFAULT;
+    }
+
+    req.tv_sec = gts.tv_sec;
+    req.tv_nsec = gts.tv_nsec;
+
+    if (nanosleep(&req, &rem) == 0)
+        return 0;
+
+    if (errno == EINTR && args[1]) {
+        gts.tv_sec = rem.tv_sec;
+        gts.tv_nsec = rem.tv_nsec;
+        if (copy_out(mmu, args[1], &gts, sizeof(gts)))
+            return -EFAULT;
+        errno = EINTR;
+    }
+
+    return -errno;
+}
+
+/*
+ * the threads of the guest are threads of the emulator, so a guest futex is
+ * the host futex of the host address the guest word lives at. The waiters
+ * sleep in the host kernel and are woken from there, the private flag and the
+ * clock of the timeout are passed through as they are.
+ */
+static int32_t sys_futex(x86CPU *cpu, const uint32_t *args)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    struct guest_timespec gts;
+    struct timespec timeout;
+    struct timespec *ptimeout = NULL;
+    uint32_t *uaddr;
+    uint32_t *uaddr2 = NULL;
+    int op = (int32_t)args[1];
+    int32_t err;
+
+    switch (op & FUTEX_CMD_MASK) {
+        case FUTEX_WAIT:
+        case FUTEX_WAIT_BITSET:
+            if ((err = futex_word(mmu, args[0], PG_READ, &uaddr)))
+                return err;
+
+            // relative for FUTEX_WAIT, absolute for FUTEX_WAIT_BITSET
+            if (args[3]) {
+                if (mmu_read(mmu, args[3], &gts, sizeof(gts)) != sizeof(gts)) {
+                    mmu_clrerror(mmu);
+                    return -EFAULT;
+                }
+
+                timeout.tv_sec = gts.tv_sec;
+                timeout.tv_nsec = gts.tv_nsec;
+                ptimeout = &timeout;
+            }
+
+            return host_result(syscall(SYS_futex, uaddr, op, args[2], ptimeout, NULL, args[5]));
+        case FUTEX_WAKE:
+        case FUTEX_WAKE_BITSET:
+            if ((err = futex_word(mmu, args[0], PG_READ, &uaddr)))
+                return err;
+
+            return host_result(syscall(SYS_futex, uaddr, op, args[2], NULL, NULL, args[5]));
+        case FUTEX_WAKE_OP:
+            // the operation is done on the second word by the host kernel
+            if ((err = futex_word(mmu, args[0], PG_READ, &uaddr))
+                || (err = futex_word(mmu, args[4], PG_WRITE, &uaddr2)))
+                return err;
+
+            err = host_result(syscall(SYS_futex, uaddr, op, args[2], (unsigned long)args[3], uaddr2, args[5]));
+            mmu_host_written(mmu, args[4], sizeof(*uaddr2));
+            return err;
+        case FUTEX_REQUEUE:
+        case FUTEX_CMP_REQUEUE:
+            // the timeout argument is how many waiters are moved
+            if ((err = futex_word(mmu, args[0], PG_READ, &uaddr))
+                || (err = futex_word(mmu, args[4], PG_READ, &uaddr2)))
+                return err;
+
+            return host_result(syscall(SYS_futex, uaddr, op, args[2], (unsigned long)args[3], uaddr2, args[5]));
+        default:
+            // the priority inheritance ops store host thread ids, left out
+            return -ENOSYS;
+    }
+}
+
+static int32_t sys_stat64(x86CPU *cpu, const uint32_t *args)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int32_t ret;
+
+    if ((ret = read_string(x86_mmu(cpu), args[0], path)))
+        return ret;
+    if (stat(path, &st) == -1)
+        return -errno;
+
+    return stat_out(x86_mmu(cpu), args[1], &st);
+}
+
+static int32_t sys_lstat64(x86CPU *cpu, const uint32_t *args)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int32_t ret;
+
+    if ((ret = read_string(x86_mmu(cpu), args[0], path)))
+        return ret;
+    if (lstat(path, &st) == -1)
+        return -errno;
+
+    return stat_out(x86_mmu(cpu), args[1], &st);
+}
+
+static int32_t sys_fstat64(x86CPU *cpu, const uint32_t *args)
+{
+    struct stat st;
+
+    if (fstat((int32_t)args[0], &st) == -1)
+        return -errno;
+
+    return stat_out(x86_mmu(cpu), args[1], &st);
+}
+
+static int32_t sys_fstatat64(x86CPU *cpu, const uint32_t *args)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int32_t ret;
+
+    if ((ret = read_string(x86_mmu(cpu), args[1], path)))
+        return ret;
+    if (fstatat((int32_t)args[0], path, &st, args[3]) == -1)
+        return -errno;
+
+    return stat_out(x86_mmu(cpu), args[2], &st);
+}
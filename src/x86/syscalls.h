@@ -0,0 +1,89 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  the Linux i386 system calls, reached through int 0x80.
+ */
+
+#ifndef SYSCALLS_H
+#define SYSCALLS_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+// the highest i386 system call number known
+#define X86_NSYSCALLS 386
+
+// how an argument gets to the host call
+enum SyscallArgKinds {
+    SA_UINT,    // zero-extended value (sizes, flags, modes, addresses)
+    SA_INT,     // sign-extended value (fds, pids, offsets)
+    SA_STR,     // NUL-terminated string, NULL stays NULL
+    SA_IN,      // buffer the call reads from
+    SA_OUT      // buffer the call writes to
+};
+
+struct syscall_arg {
+    uint8_t sa_kind;
+    // the buffer length is sa_size if set, otherwise the argument at sa_sizearg
+    uint8_t sa_sizearg;
+    uint16_t sa_size;
+};
+
+enum SyscallFlags {
+    SC_PURE = 1,        // doesn't touch files, pending writes can wait
+    SC_WRITE = 2,       // write()/writev(), can be held back
+    SC_FDTABLE = 4      // opens or closes descriptors
+};
+
+// the arguments are the six registers of the call, the result is the value
+// for EAX: the return value or -errno
+typedef int32_t (*syscall_handler_t)(x86CPU *, const uint32_t *);
+
+typedef struct {
+    const char *sc_name;
+    // the host call the arguments are passed to, if sc_handler is NULL
+    long sc_host;
+    syscall_handler_t sc_handler;
+    uint8_t sc_flags;
+    uint8_t sc_nargs;
+    struct syscall_arg sc_args[6];
+} x86Syscall;
+
+// run the call in EAX with the arguments in EBX, ECX, EDX, ESI, EDI and EBP,
+// the result goes to EAX
+void x86_linux_syscall(x86CPU *);
+// the call with the number and the six arguments given, returns the value
+// for EAX
+int32_t x86_syscall_run(x86CPU *, uint32_t, const uint32_t *);
+
+// the size of the buffers guest writes are held back in
+#define WB_BUFFER_SIZE (64 * 1024)
+
+// hold back the writes to regular files, and to stdout and stderr when they
+// aren't a terminal, so they reach the host in large writes. Any call that
+// could see them (fsync, close, read, lseek, ...) writes them out first, so
+// does stopping the CPU.
+void x86_syscall_writebehind(_Bool);
+// write out what was held back
+void x86_syscall_flush(void);
+
+#endif /* SYSCALLS_H */
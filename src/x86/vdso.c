@@ -0,0 +1,209 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  the vDSO given to the guest, its calls are served by the emulator.
+ *
+ *  The image is a small ELF shared object built at startup: a hash table,
+ *  the dynamic symbols and a stub for each entry point. A stub loads the
+ *  number of the system call it stands for and traps into the emulator with
+ *  VDSO_VECTOR. The emulator takes the C arguments from the stack and runs the
+ *  same handler int 0x80 would, which reads the host clocks through the host
+ *  vDSO, so a timestamp costs no system call on either side.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "syscalls.h"
+#include "vdso.h"
+
+// each stub starts at a multiple of this
+#define VDSO_STUB_ALIGN 16
+
+// the entry points and the i386 system calls they stand for
+static const struct {
+    const char *vs_name;
+    uint32_t vs_syscall;
+} vdso_symbols[] = {
+    { "__kernel_vsyscall", 0 },
+    { "__vdso_clock_gettime", 265 },
+    { "__vdso_gettimeofday", 78 },
+    { "__vdso_time", 13 },
+};
+
+#define VDSO_NSYMBOLS (sizeof(vdso_symbols) / sizeof(*vdso_symbols))
+
+static const char vdso_soname[] = "linux-gate.so.1";
+
+static size_t build_image(uint8_t *, moffset32_t *);
+static size_t emit_stub(uint8_t *, uint32_t);
+
+moffset32_t x86_vdso_map(x86MMU *mmu, moffset32_t *vsyscall)
+{
+    uint8_t image[MMU_PAGE_SIZE];
+    moffset32_t entry;
+    moffset32_t base;
+    size_t len;
+
+    memset(image, 0, sizeof(image));
+    len = build_image(image, &entry);
+
+    base = mmu_mmap(mmu, 0, sizeof(image), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mmu_error(mmu))
+        return 0;
+
+    mmu_write(mmu, base, image, len);
+    mmu_mprotect(mmu, base, sizeof(image), PROT_READ | PROT_EXEC);
+    if (mmu_error(mmu))
+        return 0;
+
+    *vsyscall = base + entry;
+    return base;
+}
+
+void x86_vdso_call(x86CPU *cpu)
+{
+    x86MMU *mmu = x86_mmu(cpu);
+    uint32_t args[6] = { 0 };
+
+    // none of the calls takes more than two, above the return address
+    if (mmu_read(mmu, cpu->ESP + 4, args, 2 * sizeof(*args)) != 2 * sizeof(*args)) {
+        mmu_clrerror(mmu);
+        cpu->EAX = -EFAULT;
+        return;
+    }
+
+    cpu->EAX = x86_syscall_run(cpu, cpu->EAX, args);
+}
+
+// lays the image out from address 0, the loader relocates it as a whole.
+// Returns its size, the offset of __kernel_vsyscall is stored in entry.
+static size_t build_image(uint8_t *image, moffset32_t *entry)
+{
+    Elf32_Ehdr *ehdr = (Elf32_Ehdr *)image;
+    Elf32_Phdr *phdr = (Elf32_Phdr *)(image + sizeof(*ehdr));
+    uint32_t *hash;
+    Elf32_Sym *symtab;
+    char *strtab;
+    Elf32_Dyn *dynamic;
+    size_t offset = sizeof(*ehdr) + 2 * sizeof(*phdr);
+    size_t hash_off, symtab_off, strtab_off, strtab_len, dynamic_off, text_off;
+
+    // a single bucket, the chain goes through every symbol
+    hash_off = offset;
+    hash = (uint32_t *)(image + hash_off);
+    hash[0] = 1;
+    hash[1] = VDSO_NSYMBOLS + 1;
+    hash[2] = 1;
+    for (size_t i = 1; i <= VDSO_NSYMBOLS; i++)
+        hash[3 + i] = i < VDSO_NSYMBOLS ? i + 1 : STN_UNDEF;
+    offset += (3 + VDSO_NSYMBOLS + 1) * sizeof(*hash);
+
+    symtab_off = offset;
+    symtab = (Elf32_Sym *)(image + symtab_off);
+    offset += (VDSO_NSYMBOLS + 1) * sizeof(*symtab);
+
+    // the soname, then the symbol names
+    strtab_off = offset;
+    strtab = (char *)(image + strtab_off);
+    strtab_len = 1;
+    memcpy(strtab + strtab_len, vdso_soname, sizeof(vdso_soname));
+    strtab_len += sizeof(vdso_soname);
+    for (size_t i = 0; i < VDSO_NSYMBOLS; i++) {
+        symtab[i + 1].st_name = strtab_len;
+        memcpy(strtab + strtab_len, vdso_symbols[i].vs_name, strlen(vdso_symbols[i].vs_name) + 1);
+        strtab_len += strlen(vdso_symbols[i].vs_name) + 1;
+    }
+    offset += strtab_len;
+
+    dynamic_off = (offset + 3) & ~3;
+    dynamic = (Elf32_Dyn *)(image + dynamic_off);
+    dynamic[0] = (Elf32_Dyn){ DT_SONAME, { 1 } };
+    dynamic[1] = (Elf32_Dyn){ DT_HASH, { hash_off } };
+    dynamic[2] = (Elf32_Dyn){ DT_SYMTAB, { symtab_off } };
+    dynamic[3] = (Elf32_Dyn){ DT_STRTAB, { strtab_off } };
+    dynamic[4] = (Elf32_Dyn){ DT_STRSZ, { strtab_len } };
+    dynamic[5] = (Elf32_Dyn){ DT_SYMENT, { sizeof(*symtab) } };
+    dynamic[6] = (Elf32_Dyn){ DT_NULL, { 0 } };
+    offset = dynamic_off + 7 * sizeof(*dynamic);
+
+    text_off = (offset + VDSO_STUB_ALIGN - 1) & ~(VDSO_STUB_ALIGN - 1);
+    offset = text_off;
+    for (size_t i = 0; i < VDSO_NSYMBOLS; i++) {
+        symtab[i + 1].st_value = offset;
+        symtab[i + 1].st_size = emit_stub(image + offset, vdso_symbols[i].vs_syscall);
+        symtab[i + 1].st_info = ELF32_ST_INFO(STB_GLOBAL, STT_FUNC);
+        // any defined section, there are no section headers
+        symtab[i + 1].st_shndx = 1;
+
+        if (!vdso_symbols[i].vs_syscall)
+            *entry = offset;
+
+        offset += VDSO_STUB_ALIGN;
+    }
+
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS32;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr->e_type = ET_DYN;
+    ehdr->e_machine = EM_386;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_entry = *entry;
+    ehdr->e_phoff = sizeof(*ehdr);
+    ehdr->e_ehsize = sizeof(*ehdr);
+    ehdr->e_phentsize = sizeof(*phdr);
+    ehdr->e_phnum = 2;
+
+    phdr[0].p_type = PT_LOAD;
+    phdr[0].p_filesz = phdr[0].p_memsz = offset;
+    phdr[0].p_flags = PF_R | PF_X;
+    phdr[0].p_align = MMU_PAGE_SIZE;
+
+    phdr[1].p_type = PT_DYNAMIC;
+    phdr[1].p_offset = phdr[1].p_vaddr = phdr[1].p_paddr = dynamic_off;
+    phdr[1].p_filesz = phdr[1].p_memsz = 7 * sizeof(*dynamic);
+    phdr[1].p_flags = PF_R;
+    phdr[1].p_align = 4;
+
+    return offset;
+}
+
+// __kernel_vsyscall is a plain int 0x80, the others trap with VDSO_VECTOR
+static size_t emit_stub(uint8_t *code, uint32_t syscall)
+{
+    size_t len = 0;
+
+    if (syscall) {
+        code[len++] = 0xB8;                     // mov eax, imm32
+        memcpy(code + len, &syscall, 4);
+        len += 4;
+    }
+
+    code[len++] = 0xCD;                         // int imm8
+    code[len++] = syscall ? VDSO_VECTOR : 0x80;
+    code[len++] = 0xC3;                         // ret
+
+    return len;
+}
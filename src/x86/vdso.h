@@ -0,0 +1,45 @@
+/* Copyright (c) 2020 Gabriel Manoel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * DESCRIPTION:
+ *  the vDSO given to the guest, its calls are served by the emulator.
+ */
+
+#ifndef VDSO_H
+#define VDSO_H
+
+#include <stdint.h>
+
+#include "../types.h"
+#include "cpu.h"
+#include "x86-mmu.h"
+
+// the interrupt the vDSO entry points trap into the emulator with
+#define VDSO_VECTOR 0x81
+
+// map the vDSO image. Returns its address, or 0 with the MMU error set. The
+// address of __kernel_vsyscall, for AT_SYSINFO, is stored in the last argument.
+moffset32_t x86_vdso_map(x86MMU *, moffset32_t *);
+
+// an entry point of the vDSO was called, the system call it stands for is in
+// EAX and its arguments are on the stack
+void x86_vdso_call(x86CPU *);
+
+#endif /* VDSO_H */
@@ -21,9 +21,11 @@
  * DESCRIPTION:
  *  simulate memory management.
  */
+#define _GNU_SOURCE         // mremap()
 #include <stdio.h>
 #include <stdarg.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
@@ -38,7 +40,9 @@ static _Bool mmu_isreadable(x86MMU *, moffset32_t);
 static _Bool mmu_isexecutable(x86MMU *, moffset32_t);
 
 enum x86MMUMmapFlags {
-    MF_STACK = 1
+    MF_STACK = 1,
+    MF_ANON = 2,        // private anonymous memory, merged with its neighbours
+    MF_SHARED = 4       // shared memory, it can't be copied somewhere else
 };
 
 enum x86MMUQueries {
@@ -49,17 +53,89 @@ enum x86MMUQueries {
 
 uint64_t mmu_query(const x86MMU *, moffset32_t, int);
 
-static void *mmu_mmap(x86MMU *, moffset32_t, size_t, int, int, int, off_t, size_t);
-
+static segment_t *map_segment(x86MMU *, moffset32_t, size_t, int, int, off_t, size_t);
+static segment_t *new_segment(void *, moffset32_t, moffset32_t, int, int);
+static void add_segment(x86MMU *, segment_t *);
+static segment_t *split_segment(x86MMU *, segment_t *, moffset32_t);
+static segment_t *merge_segment(x86MMU *, segment_t *);
+static _Bool grow_segment(x86MMU *, segment_t *, size_t);
+static moffset32_t move_segment(x86MMU *, segment_t *, moffset32_t, size_t, moffset32_t, size_t);
+static void release_host(x86MMU *, segment_t *, moffset32_t, moffset32_t);
+static void apply_backing(x86MMU *, const segment_t *, moffset32_t, moffset32_t);
+static void unmap_range(x86MMU *, moffset32_t, moffset32_t, _Bool);
+static _Bool grow_stack(x86MMU *, moffset32_t);
+static _Bool commit_stack(x86MMU *, moffset32_t);
+static void shrink_stack(x86MMU *, moffset32_t);
+static void protect_pages(x86MMU *, moffset32_t, size_t, int);
+static moffset32_t map_range(x86MMU *, moffset32_t, size_t, int, int, int, off_t);
+static moffset32_t remap_range(x86MMU *, moffset32_t, size_t, size_t, int, moffset32_t);
+static moffset32_t move_brk(x86MMU *, moffset32_t);
+
+static segment_t *tree_update(segment_t *);
+static segment_t *rotate_left(segment_t *);
+static segment_t *rotate_right(segment_t *);
+static segment_t *tree_balance(segment_t *);
+static segment_t *tree_insert(segment_t *, segment_t *);
+static segment_t *tree_unlink_min(segment_t *, segment_t **);
+static segment_t *tree_remove(segment_t *, segment_t *);
+static segment_t *tree_floor(segment_t *, moffset32_t);
+static segment_t *tree_overlap(segment_t *, moffset32_t, moffset32_t);
+static moffset32_t tree_fit(segment_t *, moffset32_t, size_t);
+static void tree_unload(x86MMU *, segment_t *);
+static void free_take(x86MMU *, moffset32_t, moffset32_t);
+static void free_give(x86MMU *, moffset32_t, moffset32_t);
+
+static const segment_t *find_segment(const x86MMU *, moffset32_t);
 static void *translate(x86MMU *, moffset32_t);
-static uint64_t readx(x86MMU *, moffset32_t, int);
+static page_entry_t *page_alloc(x86MMU *, uint64_t);
+static void set_pages(x86MMU *, const segment_t *, moffset32_t, moffset32_t);
+
+static uint8_t *page_access(x86MMU *, moffset32_t, int);
+static void page_dirty(x86MMU *, moffset32_t);
+static const snapshot_page_t *snapshot_find(const x86MMUSnapshot *, uint64_t);
+static void snapshot_track(x86MMU *, x86MMUSnapshot *, _Bool);
+static void unmap_unsaved(x86MMU *, const x86MMUSnapshot *);
+static void restore_dirty(x86MMU *, x86MMUSnapshot *);
+static void restore_pages(x86MMU *, x86MMUSnapshot *);
+
+static void *tlb_lookup(x86MMU *, tlb_entry_t *, moffset32_t, int, int *);
+static void tlb_fill(x86MMU *, tlb_entry_t *, moffset32_t);
+static void tlb_flush_local(x86MMU *);
+static void tlb_drop_write(x86MMU *, moffset32_t);
+
+static uint8_t page_flags(int);
+static int host_prot(uint8_t);
+static void *flat_map(x86MMU *, moffset32_t, size_t);
+static void flat_apply(x86MMU *, moffset32_t, uint64_t);
+static _Bool flat_inuse(x86MMU *, uint64_t);
+static int map_file(uint8_t *, size_t, int, off_t, _Bool, _Bool);
+
+_Thread_local x86MMULocal mmu_local;
 
 static size_t conf_mmu_pagesize = 0;
-static moffset32_t conf_mmu_start_mapping_address = 0x08045000;
+static moffset32_t conf_mmu_start_mapping_address = 0x40000000;   // mappings without an address go from here
+static page_entry_t empty_table[MMU_TABLE_ENTRIES];
+
 static moffset32_t conf_mmu_top_stack_address = 0x7fff0000;
-static size_t conf_mmu_stack_size = 4 * 4096;
+static size_t conf_mmu_stack_size = 4 * 4096;       // committed when the stack is created
+static size_t conf_mmu_stack_reserve = 8 * 1024 * 1024;    // when RLIMIT_STACK is unlimited
+
+#define MMU_FLAT_SIZE 0x100000000ULL
+
+// like vm.mmap_min_addr and the top of the address space Linux gives
+// to 32-bit processes, nothing is mapped out of these
+#define MMU_MIN_ADDRESS 0x10000
+#define MMU_USER_LIMIT 0xffffe000
 
-#define STACK_MASK 0x7f000000
+// the changes to the mappings of a shared MMU are serialized, the lock is
+// recursive as the calls use each other
+#define mmu_lock(b_mmu) do { if ((b_mmu)->mm_shared) pthread_mutex_lock(&(b_mmu)->mm_lock); } while (0)
+#define mmu_unlock(b_mmu) do { if ((b_mmu)->mm_shared) pthread_mutex_unlock(&(b_mmu)->mm_lock); } while (0)
+
+#define host_pagedown(addr) (    (addr) & ~(conf_mmu_pagesize - 1)    )
+#define host_pageup(addr) (    ((addr) + conf_mmu_pagesize - 1) & ~(conf_mmu_pagesize - 1)    )
+#define guest_pagedown(addr) (    (addr) & ~(MMU_PAGE_SIZE - 1)    )
+#define guest_pageup(addr) (    ((addr) + MMU_PAGE_SIZE - 1) & ~(MMU_PAGE_SIZE - 1)    )
 
 
 static void mmu_set_error(x86MMU *mmu, int errnum, const char *fmt, ...)
@@ -69,9 +145,11 @@ static void mmu_set_error(x86MMU *mmu, int errnum, const char *fmt, ...)
     // NOTE: do we isolate any dangerous format specifier? Or is this safe
     // enough as this will only be called in this file anyway
 
-    mmu->err.errnum = errnum;
+    (void)mmu;
+
+    mmu_local.ml_err.errnum = errnum;
     va_start(ap, fmt);
-    vsnprintf(mmu->err.description, ERROR_DESCRIPTION_MAX_SIZE, fmt, ap);
+    vsnprintf(mmu_local.ml_err.description, ERROR_DESCRIPTION_MAX_SIZE, fmt, ap);
     va_end(ap);
 }
 
@@ -79,18 +157,123 @@ static void mmu_set_error(x86MMU *mmu, int errnum, const char *fmt, ...)
 #include "../system.h"
 inline static void *translate(x86MMU *mmu, moffset32_t virtaddr)
 {
-    if ((virtaddr & STACK_MASK) == STACK_MASK) {
-        if (virtaddr >= mmu->mm_stack->s_start && virtaddr < mmu->mm_stack->s_limit)
-            return mmu->mm_stack->buffer_ + (virtaddr - mmu->mm_stack->s_start);
+    page_entry_t *entry = mmu_page(mmu, virtaddr);
+
+    if (entry->pg_host)
+        return entry->pg_host + (virtaddr & (MMU_PAGE_SIZE - 1));
+
+    return NULL;
+}
+
+// the entry of a page number for writing, its table is allocated if needed
+static page_entry_t *page_alloc(x86MMU *mmu, uint64_t page)
+{
+    page_entry_t **table = &mmu->mm_pagedir[page >> MMU_TABLE_SHIFT];
+
+    if (*table == empty_table)
+        *table = xcalloc(MMU_TABLE_ENTRIES, sizeof(**table));
+
+    return &(*table)[page & (MMU_TABLE_ENTRIES - 1)];
+}
+
+// point the pages of [start, end) at the host memory of the segment
+static void set_pages(x86MMU *mmu, const segment_t *segment, moffset32_t start, moffset32_t end)
+{
+    for (uint64_t page = start >> MMU_PAGE_SHIFT; page < (uint64_t)end >> MMU_PAGE_SHIFT; page++)
+        page_alloc(mmu, page)->pg_host = (uint8_t *)segment->buffer_ + ((page << MMU_PAGE_SHIFT) - segment->s_start);
+}
+
+#define page_entry(b_mmu, page) (    mmu_page((b_mmu), (page) << MMU_PAGE_SHIFT)    )
+
+static const segment_t *find_segment(const x86MMU *mmu, moffset32_t virtaddr)
+{
+    const segment_t *segment = tree_floor(mmu->mm_segments, virtaddr);
+
+    if (segment && virtaddr < segment->s_limit)
+        return segment;
+
+    return NULL;
+}
+
+//
+// Soft TLB
+//
+
+// returns the host address of virtaddr if the page is cached and the access
+// doesn't cross into the next page
+inline static void *tlb_lookup(x86MMU *mmu, tlb_entry_t *tlb, moffset32_t virtaddr, int size, int *flags)
+{
+    tlb_entry_t *entry = &tlb[tlb_index(virtaddr)];
+
+    if (entry->tlb_tag != tlb_page(virtaddr) || mmu_local.ml_tlbgen != mmu_tlbgen(mmu))
         return NULL;
-    }
 
-    for (size_t i = 0; i < mmu->mm_segments; i++) {
-        if (virtaddr >= mmu->mm_segment_tbl[i].s_start && virtaddr < mmu->mm_segment_tbl[i].s_limit)
-            return mmu->mm_segment_tbl[i].buffer_ + (virtaddr - mmu->mm_segment_tbl[i].s_start);
+    if (tlb_pageoffset(virtaddr) + size / 8 > MMU_PAGE_SIZE)
+        return NULL;
+
+    if (flags)
+        *flags = entry->tlb_flags;
+
+    return entry->tlb_host + tlb_pageoffset(virtaddr);
+}
+
+// cache the page containing virtaddr. The caller already checked the permissions.
+static void tlb_fill(x86MMU *mmu, tlb_entry_t *tlb, moffset32_t virtaddr)
+{
+    page_entry_t *page = mmu_page(mmu, virtaddr);
+    tlb_entry_t *entry = &tlb[tlb_index(virtaddr)];
+
+    if (!page->pg_host)
+        return;
+
+    // another thread changed the mappings since we last looked
+    if (mmu_local.ml_tlbgen != mmu_tlbgen(mmu))
+        tlb_flush_local(mmu);
+
+    entry->tlb_tag = tlb_page(virtaddr);
+    entry->tlb_host = page->pg_host;
+    entry->tlb_flags = 0;
+
+    if (page->pg_flags & PG_CODE)
+        entry->tlb_flags |= TLB_CODE;
+}
+
+// only the TLBs of the calling thread
+static void tlb_flush_local(x86MMU *mmu)
+{
+    for (size_t i = 0; i < MMU_TLB_ENTRIES; i++) {
+        mmu_local.ml_tlb_read[i].tlb_tag = MMU_TLB_INVALID;
+        mmu_local.ml_tlb_write[i].tlb_tag = MMU_TLB_INVALID;
+        mmu_local.ml_tlb_fetch[i].tlb_tag = MMU_TLB_INVALID;
     }
 
-    return NULL;
+    mmu_local.ml_tlbgen = mmu_tlbgen(mmu);
+}
+
+void mmu_tlb_flush(x86MMU *mmu)
+{
+    if (!mmu)
+        return;
+
+    __atomic_fetch_add(&mmu->mm_tlbgen, 1, __ATOMIC_RELAXED);
+    tlb_flush_local(mmu);
+}
+
+// the next write to the page has to take the slow path, in every thread
+static void tlb_drop_write(x86MMU *mmu, moffset32_t virtaddr)
+{
+    tlb_entry_t *entry = &mmu_local.ml_tlb_write[tlb_index(virtaddr)];
+
+    if (mmu->mm_shared)
+        __atomic_fetch_add(&mmu->mm_tlbgen, 1, __ATOMIC_RELAXED);
+    else if (entry->tlb_tag == tlb_page(virtaddr))
+        entry->tlb_tag = MMU_TLB_INVALID;
+}
+
+void mmu_share(x86MMU *mmu)
+{
+    if (mmu)
+        mmu->mm_shared = 1;
 }
 
 //
@@ -99,15 +282,102 @@ inline static void *translate(x86MMU *mmu, moffset32_t virtaddr)
 
 void mmu_init(x86MMU *mmu)
 {
+    pthread_mutexattr_t attr;
+
     if (!mmu)
         return;
 
     conf_mmu_pagesize = sysconf(_SC_PAGESIZE);
 
-    mmu->mm_segment_tbl = NULL;
+    mmu->mm_segments = NULL;
     mmu->mm_stack = NULL;
-    mmu->mm_segments = 0;
-    mmu_set_error(mmu, 0, NULL);
+    mmu->mm_stack_reserve = mmu->mm_stack_guard = 0;
+    mmu->mm_brk_start = mmu->mm_brk = 0;
+
+    // the whole address space is free
+    mmu->mm_free = NULL;
+    free_give(mmu, MMU_MIN_ADDRESS, MMU_USER_LIMIT);
+    mmu->mm_codegen = 0;
+    mmu->mm_layoutgen = 0;
+    mmu->mm_snapshot = NULL;
+    mmu->mm_dirty = NULL;
+    mmu->mm_ndirty = 0;
+    for (size_t i = 0; i < MMU_TABLE_ENTRIES; i++)
+        mmu->mm_pagedir[i] = empty_table;
+    mmu->mm_flat_base = NULL;
+    for (size_t i = 0; i < MC_NCLASSES; i++)
+        mmu->mm_backing[i] = 0;
+
+    mmu->mm_shared = 0;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mmu->mm_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    mmu->mm_tlbgen = 0;
+    mmu_tlb_flush(mmu);
+    mmu_set_error(mmu, ENONE, "");
+}
+
+static const struct {
+    const char *name;
+    int flag;
+} backing_names[] = {
+    { "hugepage", MB_HUGEPAGE },
+    { "populate", MB_POPULATE },
+    { "lock", MB_LOCK },
+    { "dontneed", MB_DONTNEED }
+};
+
+#define NBACKING_NAMES (sizeof(backing_names) / sizeof(*backing_names))
+
+int mmu_backing_parse(const char *str)
+{
+    int flags = 0;
+
+    if (!str)
+        return -1;
+
+    if (strcmp(str, "default") == 0)
+        return 0;
+
+    while (*str) {
+        size_t len = strcspn(str, ",");
+        size_t i;
+
+        for (i = 0; i < NBACKING_NAMES; i++) {
+            if (strlen(backing_names[i].name) == len && strncmp(str, backing_names[i].name, len) == 0)
+                break;
+        }
+
+        if (i == NBACKING_NAMES)
+            return -1;
+
+        flags |= backing_names[i].flag;
+        str += len;
+        if (*str == ',')
+            str++;
+    }
+
+    return flags;
+}
+
+void mmu_backing_str(int flags, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    if (!buf || !size)
+        return;
+
+    buf[0] = '\0';
+
+    for (size_t i = 0; i < NBACKING_NAMES && len < size; i++) {
+        if (flags & backing_names[i].flag)
+            len += snprintf(buf + len, size - len, "%s%s", len ? "," : "", backing_names[i].name);
+    }
+
+    if (!len)
+        snprintf(buf, size, "default");
 }
 
 void mmu_unloadall(x86MMU *mmu)
@@ -115,12 +385,28 @@ void mmu_unloadall(x86MMU *mmu)
     if (!mmu)
         return;
 
-    for (size_t i = 0; i < mmu->mm_segments; i++) {
-        size_t size = mmu->mm_segment_tbl[i].s_limit - mmu->mm_segment_tbl[i].s_start;
-        munmap(mmu->mm_segment_tbl[i].buffer_, size);
+    tree_unload(mmu, mmu->mm_segments);
+    tree_unload(mmu, mmu->mm_free);
+
+    if (mmu_isflat(mmu)) {
+        munmap(mmu->mm_flat_base, MMU_FLAT_SIZE);
+        mmu->mm_flat_base = NULL;
+    }
+
+    for (size_t i = 0; i < MMU_TABLE_ENTRIES; i++) {
+        if (mmu->mm_pagedir[i] != empty_table)
+            xfree(mmu->mm_pagedir[i]);
+        mmu->mm_pagedir[i] = empty_table;
     }
+    mmu->mm_segments = mmu->mm_free = NULL;
+    mmu->mm_stack = NULL;
 
-    xfree(mmu->mm_segment_tbl);
+    xfree(mmu->mm_dirty);
+    mmu->mm_dirty = NULL;
+    mmu->mm_ndirty = 0;
+    mmu->mm_snapshot = NULL;
+
+    mmu_tlb_flush(mmu);
 }
 
 
@@ -134,12 +420,7 @@ uint64_t mmu_query(const x86MMU *mmu, moffset32_t virtaddr, int query)
     if (!mmu)
         return 0;
 
-    for (size_t i = 0; i < mmu->mm_segments; i++) {
-        if (virtaddr >= mmu->mm_segment_tbl[i].s_start && virtaddr < mmu->mm_segment_tbl[i].s_limit) {
-            segment = &mmu->mm_segment_tbl[i];
-            break;
-        }
-    }
+    segment = find_segment(mmu, virtaddr);
 
     if (!segment)
         return 0;
@@ -155,289 +436,2070 @@ uint64_t mmu_query(const x86MMU *mmu, moffset32_t virtaddr, int query)
 
 inline static _Bool mmu_iswritable(x86MMU *mmu, moffset32_t virtaddr)
 {
-    int type = mmu_query(mmu, virtaddr, SD_TYPE);
-    return type != ST_RODATA && type != ST_XOCODE;
+    return mmu_pageflags(mmu, virtaddr) & PG_WRITE;
 }
 
 inline static _Bool mmu_isreadable(x86MMU *mmu, moffset32_t virtaddr)
 {
-    int type = mmu_query(mmu, virtaddr, SD_TYPE);
-    return type != ST_XOCODE;
+    return mmu_pageflags(mmu, virtaddr) & PG_READ;
 }
 
 inline static _Bool mmu_isexecutable(x86MMU *mmu, moffset32_t virtaddr)
 {
-    int type = mmu_query(mmu, virtaddr, SD_TYPE);
-    return type == ST_XOCODE || type == ST_RXCODE || type == ST_RWXCODE || type == ST_RWXSTACK;
+    return mmu_pageflags(mmu, virtaddr) & PG_EXEC;
 }
 
 //
-//  Segment creation
+// Page protection
 //
 
-
-static void *mmu_mmap(x86MMU *mmu, moffset32_t virtaddr, size_t memsz, int prot, int flags, int fd, off_t offset, size_t filesz)
+// the PG_* flags for the PROT_* flags given. There's no write-only page in
+// x86, writable pages are also readable.
+static uint8_t page_flags(int prot)
 {
-    void *buffer;
-    int type;
+    uint8_t flags = 0;
 
-    if (!mmu || memsz == 0)
-        return 0;
+    if (prot & (PROT_READ | PROT_WRITE))
+        flags |= PG_READ;
+    if (prot & PROT_WRITE)
+        flags |= PG_WRITE;
+    if (prot & PROT_EXEC)
+        flags |= PG_EXEC;
 
-    if (fd != -1) {
-        if (filesz == 0 || filesz > memsz)
-        return 0;
-    }
+    return flags;
+}
 
+void mmu_mprotect(x86MMU *mmu, moffset32_t virtaddr, size_t len, int prot)
+{
+    if (!mmu)
+        return;
 
-    // rounding up the size of the mapping to a multiple of page size
-    // it will be easier for us to keep track of all pages this way
-    memsz = (memsz + conf_mmu_pagesize - 1) & ~(conf_mmu_pagesize - 1);
+    mmu_lock(mmu);
+    protect_pages(mmu, virtaddr, len, prot);
+    mmu_unlock(mmu);
+}
 
-    buffer = mmap(NULL, memsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (buffer == MAP_FAILED) {
-        mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
-        return 0;
-    }
+static void protect_pages(x86MMU *mmu, moffset32_t virtaddr, size_t len, int prot)
+{
+    uint64_t end = (uint64_t)virtaddr + len;
+    uint8_t flags = PG_PRESENT | page_flags(prot);
+    _Bool code_changed = 0;
 
-    // TODO: give a random virtual address here. Prevent the user from acessing
-    // the underlying buffer directly
-    if (virtaddr == 0) {
-        virtaddr = conf_mmu_start_mapping_address;
-        conf_mmu_start_mapping_address += memsz;
-    } else {
-        conf_mmu_start_mapping_address = virtaddr + memsz;
+    if ((virtaddr & (MMU_PAGE_SIZE - 1)) || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
+        mmu_set_error(mmu, EINVAL, "%s: invalid argument", __FUNCTION__);
+        return;
     }
 
+    end = (end + MMU_PAGE_SIZE - 1) & ~(uint64_t)(MMU_PAGE_SIZE - 1);
 
-    if (fd != -1) {
-        if (pread(fd, buffer, filesz, offset) == -1) {
-            mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
-            return 0;
+    if (end > MMU_FLAT_SIZE) {
+        mmu_set_error(mmu, ENOMEM, "%s: 0x%lx is out of the address space", __FUNCTION__, virtaddr);
+        return;
+    }
+
+    // nothing is changed unless the whole range is mapped
+    for (uint64_t page = virtaddr >> MMU_PAGE_SHIFT; page < end >> MMU_PAGE_SHIFT; page++) {
+        if (!(page_entry(mmu, page)->pg_flags & PG_PRESENT)) {
+            mmu_set_error(mmu, ENOMEM, "%s: 0x%lx is not mapped", __FUNCTION__,
+                            (moffset32_t)(page << MMU_PAGE_SHIFT));
+            return;
         }
     }
-    // set the actual protection requested
-    //mprotect(buffer, memsz, prot);
 
-    if ((prot & PROT_READ) && !(prot & PROT_WRITE) && !(prot & PROT_EXEC) && !(flags & MF_STACK))
-        type = ST_RODATA;
-    else if ((prot & PROT_READ) && (prot & PROT_WRITE) && !(prot & PROT_EXEC) && !(flags & MF_STACK))
-        type = ST_RWDATA;
-    else if ((prot & PROT_READ) && !(prot & PROT_WRITE) && (prot & PROT_EXEC) && !(flags & MF_STACK))
-        type = ST_RXCODE;
-    else if ((prot & PROT_READ) && (prot & PROT_WRITE) && (prot & PROT_EXEC) && !(flags & MF_STACK))
-        type = ST_RWXCODE;
-    else if ((prot & PROT_READ) && (prot & PROT_WRITE) && !(prot & PROT_EXEC) && (flags & MF_STACK))
-        type = ST_RWSTACK;
-    else
-        type = ST_RWXSTACK;
+    for (uint64_t page = virtaddr >> MMU_PAGE_SHIFT; page < end >> MMU_PAGE_SHIFT; page++) {
+        page_entry_t *entry = page_entry(mmu, page);
 
-    mmu->mm_segment_tbl = xreallocarray(mmu->mm_segment_tbl, ++mmu->mm_segments, sizeof(*mmu->mm_segment_tbl));
+        // code that can't be executed anymore might still be cached
+        if ((entry->pg_flags & PG_CODE) && !(flags & PG_EXEC)) {
+            entry->pg_codegen = mmu_codegen(mmu) + 1;
+            code_changed = 1;
+        }
+
+        entry->pg_flags = flags | (entry->pg_flags & PG_CODE);
+    }
 
-    mmu->mm_segment_tbl[mmu->mm_segments-1].buffer_ = buffer;
-    mmu->mm_segment_tbl[mmu->mm_segments-1].s_limit = virtaddr + memsz;
-    mmu->mm_segment_tbl[mmu->mm_segments-1].s_start = virtaddr;
-    mmu->mm_segment_tbl[mmu->mm_segments-1].s_type = type;
+    if (mmu_isflat(mmu))
+        flat_apply(mmu, virtaddr, end);
 
-    if (flags & MF_STACK)
-        mmu->mm_stack = &mmu->mm_segment_tbl[mmu->mm_segments-1];
+    mmu_tlb_flush(mmu);
+    mmu->mm_layoutgen++;
 
-    return buffer;
+    if (code_changed)
+        mmu_codegen_next(mmu);
 }
 
+//
+// Flat mode
+//
 
-void mmu_mmap_loadable(x86MMU *mmu, GenericELF *elf)
+#define flat_isexec(b_mmu, addr) (    mmu_pageflags((b_mmu), (addr)) & PG_EXEC    )
+
+void mmu_flat_reserve(x86MMU *mmu)
 {
-    pt_load_segment_t *segment;
-    int prot = 0;
+    void *base;
 
-    if (!mmu || !elf)
+    if (!mmu)
         return;
 
-    for (size_t i = 0; i < elf_nloadable(elf); i++, prot = 0) {
-        segment = &elf_loadable(elf)[i];
-
-        if (segment->pt_flags & PF_R)
-            prot |= PROT_READ;
-        if (segment->pt_flags & PF_W)
-            prot |= PROT_WRITE;
-        if (segment->pt_flags & PF_X)
-            prot |= PROT_EXEC;
-
-        mmu_mmap(mmu, segment->pt_vaddr, segment->pt_memsz, prot, 0,
-                    elf_underlfd(elf), segment->pt_offset, segment->pt_filesz);
+    if (mmu->mm_segments) {
+        mmu_set_error(mmu, EINVAL, "%s: segments were already mapped", __FUNCTION__);
+        return;
+    }
 
-        if (mmu_error(mmu))
-            return;
+#if UINTPTR_MAX > 0xffffffff
+    base = mmap(NULL, MMU_FLAT_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+        return;
     }
+
+    mmu->mm_flat_base = base;
+#else
+    (void)base;
+    mmu_set_error(mmu, ENOMEM, "%s: the host address space is too small", __FUNCTION__);
+#endif
 }
 
-moffset32_t mmu_create_stack(x86MMU *mmu, int flags)
+_Bool mmu_flat_fault(x86MMU *mmu, const void *hostaddr, moffset32_t *virtaddr)
 {
-    moffset32_t addr;
-    int prot = PROT_READ | PROT_WRITE;
+    const uint8_t *addr = hostaddr;
 
-    if (!mmu)
+    if (!mmu || !mmu_isflat(mmu))
         return 0;
 
-    if (flags & B_STACKEXEC)
-        prot |= PROT_EXEC;
+    if (addr < mmu->mm_flat_base || addr >= mmu->mm_flat_base + MMU_FLAT_SIZE)
+        return 0;
 
-    mmu_mmap(mmu, conf_mmu_top_stack_address, conf_mmu_stack_size, prot, MF_STACK, -1, 0, 0);
+    *virtaddr = addr - mmu->mm_flat_base;
 
-    addr = conf_mmu_top_stack_address + conf_mmu_stack_size;
+    // the first write to the page since the snapshot
+    if ((mmu_pageflags(mmu, *virtaddr) & (PG_WRITE | PG_CLEAN)) == (PG_WRITE | PG_CLEAN)) {
+        page_dirty(mmu, *virtaddr);
+        return 1;
+    }
 
-    if (mmu_error(mmu))
-        return 0;
+    // a writable page that isn't clean can't fault, another thread dirtied
+    // it or grew the stack over it after we faulted
+    if ((mmu_pageflags(mmu, *virtaddr) & (PG_WRITE | PG_CLEAN)) == PG_WRITE)
+        return 1;
 
-    return addr;
-}
+    if (grow_stack(mmu, *virtaddr))
+        return 1;
 
+    if (mmu_pageflags(mmu, *virtaddr) & PG_PRESENT)
+        mmu_set_error(mmu, EPROT, "attempted access violating the segment protection at 0x%lx", *virtaddr);
+    else
+        mmu_set_error(mmu, ESEGFAULT, "Segmentation Fault at 0x%lx", *virtaddr);
 
-//
-// Read/Write functions
-//
+    return 1;
+}
 
-uint8_t mmu_fetch(x86MMU *mmu, moffset32_t virtaddr)
+// the host protection for a guest page. Code is fetched through the host
+// pointer, so executable pages must stay readable. Clean pages are read-only
+// until the first write, so it faults and gets tracked.
+static int host_prot(uint8_t flags)
 {
-    void *buffer;
+    if ((flags & PG_WRITE) && !(flags & PG_CLEAN))
+        return PROT_READ | PROT_WRITE;
+    if (flags & (PG_READ | PG_EXEC))
+        return PROT_READ;
+    return PROT_NONE;
+}
 
-    if (!mmu)
-        return 0;
+// make the pages covering the range writable so the caller can fill them
+static void *flat_map(x86MMU *mmu, moffset32_t virtaddr, size_t memsz)
+{
+    uint64_t start = virtaddr & ~(conf_mmu_pagesize - 1);
+    uint64_t end = ((uint64_t)virtaddr + memsz + conf_mmu_pagesize - 1) & ~(conf_mmu_pagesize - 1);
 
-    buffer = translate(mmu, virtaddr);
-    if (!buffer) {
-        mmu_set_error(mmu, ESEGFAULT, "Segmentation Fault at 0x%lx", virtaddr);
-        return 0;
+    if (end > MMU_FLAT_SIZE) {
+        mmu_set_error(mmu, ENOMEM, "%s: mapping at 0x%lx does not fit in 32 bits", __FUNCTION__, virtaddr);
+        return NULL;
     }
 
-    if (!mmu_isexecutable(mmu, virtaddr)) {
-        mmu_set_error(mmu, EPROT, "attempted to execute code from a non-executable segment at 0x%lx", virtaddr);
-        return 0;
+    if (mprotect(mmu->mm_flat_base + start, end - start, PROT_READ | PROT_WRITE) == -1) {
+        mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+        return NULL;
     }
 
-
-    return *(uint8_t *)buffer;
+    return mmu->mm_flat_base + virtaddr;
 }
 
-
-uint64_t readx(x86MMU *mmu, moffset32_t virtaddr, int size)
+// apply the guest protection of [virtaddr, end) to the host. A host page
+// bigger than a guest page gets the union of the protections in it.
+static void flat_apply(x86MMU *mmu, moffset32_t virtaddr, uint64_t end)
 {
-    void *buffer;
-    u_int64_t bytes = 0;
+    uint64_t start = virtaddr & ~(conf_mmu_pagesize - 1);
+    uint64_t run_start = start;
+    int run_prot = -1;
 
-    if (!mmu)
-        return 0;
+    end = (end + conf_mmu_pagesize - 1) & ~(conf_mmu_pagesize - 1);
 
-    buffer = translate(mmu, virtaddr);
+    // one mprotect for every run of host pages with the same protection
+    for (uint64_t host = start; host <= end; host += conf_mmu_pagesize) {
+        int prot = PROT_NONE;
 
-    if (!buffer) {
-        mmu_set_error(mmu, ESEGFAULT, "Segmentation Fault at 0x%lx", virtaddr);
-        return 0;
-    }
+        if (host < end) {
+            for (uint64_t page = host >> MMU_PAGE_SHIFT; page < (host + conf_mmu_pagesize) >> MMU_PAGE_SHIFT; page++)
+                prot |= host_prot(page_entry(mmu, page)->pg_flags);
+        }
 
-    if (!mmu_isreadable(mmu, virtaddr)) {
-        mmu_set_error(mmu, EPROT, "attempted read at non-readable segment at 0x%lx", virtaddr);
-        return 0;
-    }
+        if (host == end || (run_prot != -1 && prot != run_prot)) {
+            if (run_prot != -1)
+                mprotect(mmu->mm_flat_base + run_start, host - run_start, run_prot);
+            run_start = host;
+        }
 
-    switch (size) {
-        case 8:
-            bytes = *((uint8_t *)buffer);
-            break;
-        case 16:
-            bytes = *((uint16_t *)buffer);
-            break;
-        case 32:
-            bytes = *((uint32_t *)buffer);
-            break;
-        case 64:
-            bytes = *((uint64_t *)buffer);
-            break;
-        default:
-            break;
+        run_prot = prot;
     }
-
-    return bytes;
 }
 
-uint8_t mmu_read8(x86MMU *mmu, moffset32_t virtaddr)
+// returns 1 if the host page at hostaddr (a guest address) already holds a
+// guest page
+static _Bool flat_inuse(x86MMU *mmu, uint64_t hostaddr)
 {
-    return readx(mmu, virtaddr, 8);
+    for (uint64_t page = hostaddr >> MMU_PAGE_SHIFT; page < (hostaddr + conf_mmu_pagesize) >> MMU_PAGE_SHIFT; page++) {
+        if (page_entry(mmu, page)->pg_flags & PG_PRESENT)
+            return 1;
+    }
+
+    return 0;
 }
 
-uint16_t mmu_read16(x86MMU *mmu, moffset32_t virtaddr)
+//
+// Segment trees
+//
+
+#define tree_height(node) (    (node) ? (node)->s_height : 0    )
+#define tree_maxlen(node) (    (node) ? (node)->s_maxlen : 0    )
+
+static segment_t *tree_update(segment_t *node)
 {
-    return  readx(mmu, virtaddr, 16);
+    int left = tree_height(node->s_left);
+    int right = tree_height(node->s_right);
+
+    node->s_height = (left > right ? left : right) + 1;
+    node->s_maxlen = node->s_limit - node->s_start;
+
+    if (tree_maxlen(node->s_left) > node->s_maxlen)
+        node->s_maxlen = tree_maxlen(node->s_left);
+    if (tree_maxlen(node->s_right) > node->s_maxlen)
+        node->s_maxlen = tree_maxlen(node->s_right);
+
+    return node;
 }
 
-uint32_t mmu_read32(x86MMU *mmu, moffset32_t virtaddr)
+static segment_t *rotate_left(segment_t *node)
 {
-    return  readx(mmu, virtaddr, 32);
+    segment_t *right = node->s_right;
+
+    node->s_right = right->s_left;
+    right->s_left = tree_update(node);
+
+    return tree_update(right);
 }
 
-uint64_t mmu_read64(x86MMU *mmu, moffset32_t virtaddr)
+static segment_t *rotate_right(segment_t *node)
 {
-    return  readx(mmu, virtaddr, 64);
-}
+    segment_t *left = node->s_left;
 
+    node->s_left = left->s_right;
+    left->s_right = tree_update(node);
 
-// write
+    return tree_update(left);
+}
 
-void writex(x86MMU *mmu, uint64_t bytes, moffset32_t virtaddr, int size)
+static segment_t *tree_balance(segment_t *node)
 {
-    void *buffer = NULL;
-
-    if (!mmu)
-        return;
+    int balance;
 
-    buffer = translate(mmu, virtaddr);
+    tree_update(node);
+    balance = tree_height(node->s_left) - tree_height(node->s_right);
 
-    if (!buffer) {
-        mmu_set_error(mmu, ESEGFAULT, "Segmentation Fault at 0x%lx", virtaddr);
-        return;
-    }
-    if (!mmu_iswritable(mmu, virtaddr)) {
-        mmu_set_error(mmu, EPROT, "attempted write at non-writable segment at 0x%lx", virtaddr);
-        return;
+    if (balance > 1) {
+        if (tree_height(node->s_left->s_left) < tree_height(node->s_left->s_right))
+            node->s_left = rotate_left(node->s_left);
+        return rotate_right(node);
     }
 
-    switch (size) {
-        case 8:
-            *((uint8_t *)buffer) = bytes;
-            break;
-        case 16:
-            *((uint16_t *)buffer) = bytes;
-            break;
-        case 32:
-            *((uint32_t *)buffer) = bytes;
-            break;
-        case 64:
-            *((uint64_t *)buffer) = bytes;
-            break;
-        default:
-            break;
+    if (balance < -1) {
+        if (tree_height(node->s_right->s_right) < tree_height(node->s_right->s_left))
+            node->s_right = rotate_right(node->s_right);
+        return rotate_left(node);
     }
+
+    return node;
 }
 
-void mmu_write8(x86MMU *mmu, uint8_t byte, moffset32_t virtaddr)
+// the ranges in a tree never overlap, so s_start is a unique key
+static segment_t *tree_insert(segment_t *root, segment_t *node)
 {
-    writex(mmu, byte, virtaddr, 8);
+    if (!root) {
+        node->s_left = node->s_right = NULL;
+        return tree_update(node);
+    }
+
+    if (node->s_start < root->s_start)
+        root->s_left = tree_insert(root->s_left, node);
+    else
+        root->s_right = tree_insert(root->s_right, node);
+
+    return tree_balance(root);
 }
 
-void mmu_write16(x86MMU *mmu, uint16_t byte, moffset32_t virtaddr)
+static segment_t *tree_unlink_min(segment_t *root, segment_t **min)
 {
-    writex(mmu, byte, virtaddr, 16);
+    if (!root->s_left) {
+        *min = root;
+        return root->s_right;
+    }
+
+    root->s_left = tree_unlink_min(root->s_left, min);
+
+    return tree_balance(root);
 }
 
-void mmu_write32(x86MMU *mmu, uint32_t byte, moffset32_t virtaddr)
+// the node is only unlinked, s_start must not have changed since it was inserted
+static segment_t *tree_remove(segment_t *root, segment_t *node)
 {
-    writex(mmu, byte, virtaddr, 32);
+    segment_t *min;
+
+    if (!root)
+        return NULL;
+
+    if (node->s_start < root->s_start) {
+        root->s_left = tree_remove(root->s_left, node);
+    } else if (node->s_start > root->s_start) {
+        root->s_right = tree_remove(root->s_right, node);
+    } else {
+        if (!root->s_right)
+            return root->s_left;
+
+        root->s_right = tree_unlink_min(root->s_right, &min);
+        min->s_left = root->s_left;
+        min->s_right = root->s_right;
+        root = min;
+    }
+
+    return tree_balance(root);
 }
 
-void mmu_write64(x86MMU *mmu, uint64_t byte, moffset32_t virtaddr)
+// the last range starting at or before virtaddr
+static segment_t *tree_floor(segment_t *root, moffset32_t virtaddr)
 {
-    writex(mmu, byte, virtaddr, 64);
+    segment_t *floor = NULL;
+
+    while (root) {
+        if (root->s_start <= virtaddr) {
+            floor = root;
+            root = root->s_right;
+        } else {
+            root = root->s_left;
+        }
+    }
+
+    return floor;
+}
+
+// the first range overlapping [start, end)
+static segment_t *tree_overlap(segment_t *root, moffset32_t start, moffset32_t end)
+{
+    segment_t *node = tree_floor(root, start);
+
+    if (node && node->s_limit > start)
+        return node;
+
+    for (node = NULL; root; ) {
+        if (root->s_start > start) {
+            node = root;
+            root = root->s_left;
+        } else {
+            root = root->s_right;
+        }
+    }
+
+    return node && node->s_start < end ? node : NULL;
+}
+
+// the lowest address from virtaddr up where len bytes fit in a range of the
+// tree, 0 if there's none. Subtrees without a range that long are skipped.
+static moffset32_t tree_fit(segment_t *root, moffset32_t virtaddr, size_t len)
+{
+    moffset32_t start, found;
+
+    if (!root || root->s_maxlen < len)
+        return 0;
+
+    if (root->s_start > virtaddr && (found = tree_fit(root->s_left, virtaddr, len)))
+        return found;
+
+    start = root->s_start > virtaddr ? root->s_start : virtaddr;
+    if (root->s_limit > start && root->s_limit - start >= len)
+        return start;
+
+    return tree_fit(root->s_right, virtaddr, len);
+}
+
+// free every node, the host memory of the segments is unmapped too
+static void tree_unload(x86MMU *mmu, segment_t *root)
+{
+    uintptr_t buffer;
+    size_t size;
+
+    if (!root)
+        return;
+
+    tree_unload(mmu, root->s_left);
+    tree_unload(mmu, root->s_right);
+
+    if (root->buffer_ && !mmu_isflat(mmu)) {
+        buffer = (uintptr_t)root->buffer_;
+        size = root->s_limit - root->s_start;
+
+        // the part of the stack that was never committed is unmapped too
+        if (root == mmu->mm_stack) {
+            buffer -= root->s_start - mmu->mm_stack_reserve;
+            size += root->s_start - mmu->mm_stack_reserve;
+        }
+
+        // file-backed segments don't start at a host page boundary
+        munmap((void *)host_pagedown(buffer), size + (buffer - host_pagedown(buffer)));
+    }
+
+    xfree(root);
+}
+
+//
+// Free ranges
+//
+
+// take [start, end) out of the free ranges, parts of it might not be free
+static void free_take(x86MMU *mmu, moffset32_t start, moffset32_t end)
+{
+    segment_t *range, *upper;
+
+    while ((range = tree_overlap(mmu->mm_free, start, end))) {
+        mmu->mm_free = tree_remove(mmu->mm_free, range);
+
+        // keep what is left on either side
+        if (range->s_limit > end) {
+            upper = xcalloc(1, sizeof(*upper));
+            upper->s_start = end;
+            upper->s_limit = range->s_limit;
+            mmu->mm_free = tree_insert(mmu->mm_free, upper);
+        }
+
+        if (range->s_start < start) {
+            range->s_limit = start;
+            mmu->mm_free = tree_insert(mmu->mm_free, range);
+        } else {
+            xfree(range);
+        }
+    }
+}
+
+// [start, end) is free again, it's merged with the ranges next to it
+static void free_give(x86MMU *mmu, moffset32_t start, moffset32_t end)
+{
+    segment_t *range;
+
+    range = tree_floor(mmu->mm_free, start);
+    if (range && range->s_limit == start) {
+        mmu->mm_free = tree_remove(mmu->mm_free, range);
+        start = range->s_start;
+        xfree(range);
+    }
+
+    range = tree_floor(mmu->mm_free, end);
+    if (range && range->s_start == end) {
+        mmu->mm_free = tree_remove(mmu->mm_free, range);
+        end = range->s_limit;
+        xfree(range);
+    }
+
+    range = xcalloc(1, sizeof(*range));
+    range->s_start = start;
+    range->s_limit = end;
+    mmu->mm_free = tree_insert(mmu->mm_free, range);
+}
+
+//
+//  Segment creation
+//
+
+// put filesz bytes of the file at offset into buffer. The host pages are
+// mapped from the file copy-on-write, so nothing is read before it's touched,
+// except for the first and last pages when they are shared with something
+// else (head_shared and tail_shared), those are read. The rest of the last
+// page is zeroed, it is the start of the bss.
+static int map_file(uint8_t *buffer, size_t filesz, int fd, off_t offset, _Bool head_shared, _Bool tail_shared)
+{
+    uintptr_t file_start = (uintptr_t)buffer;
+    uintptr_t file_end = file_start + filesz;
+    uintptr_t map_start = host_pagedown(file_start);
+    uintptr_t map_end = host_pageup(file_end);
+
+    // the file can only be mapped at the same offset within a page
+    if (file_start - map_start != (offset & (conf_mmu_pagesize - 1)))
+        return pread(fd, buffer, filesz, offset) == -1 ? -1 : 0;
+
+    if (head_shared && map_start != file_start)
+        map_start += conf_mmu_pagesize;
+    if (tail_shared && map_end != file_end)
+        map_end -= conf_mmu_pagesize;
+
+    if (map_start < map_end) {
+        if (mmap((void *)map_start, map_end - map_start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                    fd, offset - (file_start - map_start)) == MAP_FAILED)
+            return -1;
+
+        if (map_end > file_end)
+            memset((void *)file_end, 0, map_end - file_end);
+    }
+
+    if (map_start > file_start) {
+        uintptr_t end = map_start < file_end ? map_start : file_end;
+
+        if (pread(fd, buffer, end - file_start, offset) == -1)
+            return -1;
+    }
+
+    if (map_end < file_end && map_end >= map_start) {
+        uintptr_t start = map_end > file_start ? map_end : file_start;
+
+        if (pread(fd, (void *)start, file_end - start, offset + (start - file_start)) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+// a page of a PT_LOAD segment is mapped from the file, the rest up to memsz
+// is zeroed. Like MAP_FIXED anything in the way is unmapped, except the first
+// page when the previous segment ends in it (binaries not linked with page
+// alignment), it keeps the contents and permissions of both.
+static segment_t *map_segment(x86MMU *mmu, moffset32_t virtaddr, size_t memsz, int prot, int fd, off_t offset, size_t filesz)
+{
+    segment_t *prev, *segment;
+    moffset32_t start, limit;
+    size_t headlen = 0;
+    uint8_t *buffer = NULL;
+    _Bool head_shared, tail_shared;
+
+    if (!mmu || memsz == 0 || filesz > memsz)
+        return NULL;
+
+    // TODO: give a random virtual address here. Prevent the user from acessing
+    // the underlying buffer directly
+    if (virtaddr == 0)
+        virtaddr = tree_fit(mmu->mm_free, conf_mmu_start_mapping_address, guest_pageup(memsz));
+
+    if (virtaddr == 0 || (uint64_t)virtaddr + memsz > MMU_USER_LIMIT) {
+        mmu_set_error(mmu, ENOMEM, "%s: no room for a mapping of 0x%lx bytes at 0x%lx", __FUNCTION__, memsz, virtaddr);
+        return NULL;
+    }
+
+    // keep track of whole pages, it will be easier for us this way
+    start = guest_pagedown(virtaddr);
+    limit = guest_pageup((uint64_t)virtaddr + memsz);
+
+    prev = tree_floor(mmu->mm_segments, start);
+    if (prev && prev->s_limit > start && virtaddr > start)
+        headlen = (prev->s_limit < virtaddr ? prev->s_limit : virtaddr) - start;
+
+    if (!mmu_isflat(mmu)) {
+        // keep the file offset within the page so the file can be mapped,
+        // the bss after it is left as anonymous memory
+        size_t delta = fd != -1 ? (offset - (virtaddr - start)) & (conf_mmu_pagesize - 1) : 0;
+
+        buffer = mmap(NULL, host_pageup(delta + limit - start), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+            return NULL;
+        }
+
+        buffer += delta;
+
+        if (filesz && map_file(buffer + (virtaddr - start), filesz, fd, offset, 0, 0) == -1) {
+            mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+            munmap(buffer - delta, host_pageup(delta + limit - start));
+            return NULL;
+        }
+
+        if (headlen)
+            memcpy(buffer, (uint8_t *)prev->buffer_ + (start - prev->s_start), headlen);
+    }
+
+    if (headlen) {
+        unmap_range(mmu, start, start + MMU_PAGE_SIZE, 1);
+        unmap_range(mmu, start + MMU_PAGE_SIZE, limit, 0);
+    } else {
+        unmap_range(mmu, start, limit, 0);
+    }
+
+    if (mmu_isflat(mmu)) {
+        if (!flat_map(mmu, start, limit - start))
+            return NULL;
+
+        buffer = mmu->mm_flat_base + start;
+        head_shared = flat_inuse(mmu, host_pagedown((uint64_t)virtaddr));
+        tail_shared = flat_inuse(mmu, host_pagedown((uint64_t)virtaddr + filesz));
+
+        if (filesz && map_file(buffer + (virtaddr - start), filesz, fd, offset, head_shared, tail_shared) == -1) {
+            mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+            return NULL;
+        }
+    }
+
+    segment = new_segment(buffer, start, limit, prot, 0);
+    add_segment(mmu, segment);
+
+    return segment;
+}
+
+static segment_t *new_segment(void *buffer, moffset32_t start, moffset32_t limit, int prot, int flags)
+{
+    segment_t *segment = xcalloc(1, sizeof(*segment));
+    int type;
+
+    if (!(prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) && !(flags & MF_STACK))
+        type = ST_NONE;
+    else if (!(prot & PROT_READ) && !(prot & PROT_WRITE) && (prot & PROT_EXEC) && !(flags & MF_STACK))
+        type = ST_XOCODE;
+    else if ((prot & PROT_READ) && !(prot & PROT_WRITE) && !(prot & PROT_EXEC) && !(flags & MF_STACK))
+        type = ST_RODATA;
+    else if ((prot & PROT_READ) && (prot & PROT_WRITE) && !(prot & PROT_EXEC) && !(flags & MF_STACK))
+        type = ST_RWDATA;
+    else if ((prot & PROT_READ) && !(prot & PROT_WRITE) && (prot & PROT_EXEC) && !(flags & MF_STACK))
+        type = ST_RXCODE;
+    else if ((prot & PROT_READ) && (prot & PROT_WRITE) && (prot & PROT_EXEC) && !(flags & MF_STACK))
+        type = ST_RWXCODE;
+    else if ((prot & PROT_READ) && (prot & PROT_WRITE) && !(prot & PROT_EXEC) && (flags & MF_STACK))
+        type = ST_RWSTACK;
+    else
+        type = ST_RWXSTACK;
+
+    segment->buffer_ = buffer;
+    segment->s_start = start;
+    segment->s_limit = limit;
+    segment->s_type = type;
+    segment->s_prot = prot;
+    segment->s_flags = flags;
+
+    if (flags & MF_STACK)
+        segment->s_class = MC_STACK;
+    else if (flags & MF_ANON)
+        segment->s_class = MC_HEAP;
+    else if (prot & PROT_EXEC)
+        segment->s_class = MC_TEXT;
+    else
+        segment->s_class = MC_DATA;
+
+    return segment;
+}
+
+// put the segment in the tree and its pages in the page table. A page shared
+// with another segment keeps the permissions of both.
+static void add_segment(x86MMU *mmu, segment_t *segment)
+{
+    mmu->mm_segments = tree_insert(mmu->mm_segments, segment);
+    free_take(mmu, segment->s_start, segment->s_limit);
+
+    if (segment->s_flags & MF_STACK)
+        mmu->mm_stack = segment;
+
+    // the contents changed, the page isn't the one in the snapshot anymore
+    for (uint64_t page = segment->s_start >> MMU_PAGE_SHIFT; page < (uint64_t)segment->s_limit >> MMU_PAGE_SHIFT; page++) {
+        page_entry_t *entry = page_alloc(mmu, page);
+        entry->pg_flags = (entry->pg_flags & ~PG_CLEAN) | PG_PRESENT | page_flags(segment->s_prot);
+    }
+
+    set_pages(mmu, segment, segment->s_start, segment->s_limit);
+
+    if (mmu_isflat(mmu))
+        flat_apply(mmu, segment->s_start, segment->s_limit);
+
+    apply_backing(mmu, segment, segment->s_start, segment->s_limit);
+
+    mmu_tlb_flush(mmu);
+    mmu->mm_layoutgen++;
+}
+
+// cut the segment in two at virtaddr, returns the upper half. The segment
+// itself is returned if virtaddr isn't inside it.
+static segment_t *split_segment(x86MMU *mmu, segment_t *segment, moffset32_t virtaddr)
+{
+    segment_t *upper;
+
+    if (virtaddr <= segment->s_start || virtaddr >= segment->s_limit)
+        return segment;
+
+    upper = xmalloc(sizeof(*upper));
+    *upper = *segment;
+    upper->buffer_ = (uint8_t *)segment->buffer_ + (virtaddr - segment->s_start);
+    upper->s_start = virtaddr;
+    segment->s_limit = virtaddr;
+
+    mmu->mm_segments = tree_insert(mmu->mm_segments, upper);
+
+    return upper;
+}
+
+// private anonymous segments next to each other are merged when they're also
+// contiguous in the host
+#define can_merge(a, b) (    (a)->s_limit == (b)->s_start && (a)->s_prot == (b)->s_prot  \
+                            && (a)->s_flags == (b)->s_flags && ((a)->s_flags & MF_ANON)     \
+                            && (uint8_t *)(a)->buffer_ + ((a)->s_limit - (a)->s_start) == (b)->buffer_  )
+
+static segment_t *merge_segment(x86MMU *mmu, segment_t *segment)
+{
+    segment_t *prev = segment->s_start ? tree_floor(mmu->mm_segments, segment->s_start - 1) : NULL;
+    segment_t *next = tree_floor(mmu->mm_segments, segment->s_limit);
+
+    if (prev && can_merge(prev, segment)) {
+        mmu->mm_segments = tree_remove(mmu->mm_segments, segment);
+        prev->s_limit = segment->s_limit;
+        xfree(segment);
+        segment = prev;
+    }
+
+    if (next && next != segment && can_merge(segment, next)) {
+        mmu->mm_segments = tree_remove(mmu->mm_segments, next);
+        segment->s_limit = next->s_limit;
+        xfree(next);
+    }
+
+    return segment;
+}
+
+// extend the segment by len bytes, the range after it must be free. In the
+// segmented mode the host memory is free to move.
+static _Bool grow_segment(x86MMU *mmu, segment_t *segment, size_t len)
+{
+    size_t size = segment->s_limit - segment->s_start;
+    uint8_t *end = (uint8_t *)segment->buffer_ + size;
+    void *buffer;
+
+    if (segment->s_flags & MF_STACK)
+        return 0;
+
+    if (mmu_isflat(mmu)) {
+        if (segment->s_flags & MF_ANON) {
+            buffer = mmap(end, len, host_prot(page_flags(segment->s_prot)),
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        } else {
+            // the reservation is in the way of the host mremap
+            munmap(end, len);
+            buffer = mremap(segment->buffer_, size, size + len, 0);
+            if (buffer == MAP_FAILED)
+                mmap(end, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        }
+    } else {
+        if (conf_mmu_pagesize != MMU_PAGE_SIZE || ((uintptr_t)segment->buffer_ & (conf_mmu_pagesize - 1)))
+            return 0;
+
+        buffer = mremap(segment->buffer_, size, size + len, MREMAP_MAYMOVE);
+    }
+
+    if (buffer == MAP_FAILED)
+        return 0;
+
+    for (uint64_t page = segment->s_limit >> MMU_PAGE_SHIFT; page < ((uint64_t)segment->s_limit + len) >> MMU_PAGE_SHIFT; page++)
+        page_alloc(mmu, page)->pg_flags = PG_PRESENT | page_flags(segment->s_prot);
+
+    free_take(mmu, segment->s_limit, segment->s_limit + len);
+
+    // all of the pages have to be updated if the host memory moved
+    if (buffer != segment->buffer_ && !mmu_isflat(mmu)) {
+        segment->buffer_ = buffer;
+        segment->s_limit += len;
+        set_pages(mmu, segment, segment->s_start, segment->s_limit);
+    } else {
+        segment->s_limit += len;
+        set_pages(mmu, segment, segment->s_limit - len, segment->s_limit);
+    }
+
+    if (mmu_isflat(mmu))
+        flat_apply(mmu, segment->s_limit - len, segment->s_limit);
+
+    apply_backing(mmu, segment, segment->s_limit - len, segment->s_limit);
+
+    mmu_tlb_flush(mmu);
+    mmu->mm_layoutgen++;
+
+    return 1;
+}
+
+// move [oldaddr, oldaddr + oldlen) of the segment to newaddr, resized to
+// newlen bytes. The new range was already checked to be free.
+static moffset32_t move_segment(x86MMU *mmu, segment_t *segment, moffset32_t oldaddr, size_t oldlen, moffset32_t newaddr, size_t newlen)
+{
+    uint64_t oldpage = oldaddr >> MMU_PAGE_SHIFT;
+    uint64_t newpage = newaddr >> MMU_PAGE_SHIFT;
+    size_t oldpages = oldlen >> MMU_PAGE_SHIFT;
+    void *buffer = MAP_FAILED;
+    _Bool code = 0;
+
+    if (segment->s_flags & MF_STACK) {
+        mmu_set_error(mmu, EINVAL, "%s: the stack can't be moved", __FUNCTION__);
+        return 0;
+    }
+
+    segment = split_segment(mmu, segment, oldaddr);
+    split_segment(mmu, segment, oldaddr + oldlen);
+
+    if (mmu_isflat(mmu)) {
+        buffer = mremap(segment->buffer_, oldlen, newlen, MREMAP_MAYMOVE | MREMAP_FIXED, mmu->mm_flat_base + newaddr);
+    } else if (conf_mmu_pagesize == MMU_PAGE_SIZE && !((uintptr_t)segment->buffer_ & (conf_mmu_pagesize - 1))) {
+        buffer = mremap(segment->buffer_, oldlen, newlen, MREMAP_MAYMOVE);
+    }
+
+    // segments loaded from the file are made of more than one host mapping,
+    // those are copied
+    if (buffer == MAP_FAILED && !mmu_isflat(mmu) && !(segment->s_flags & MF_SHARED)) {
+        buffer = mmap(NULL, newlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer != MAP_FAILED) {
+            memcpy(buffer, segment->buffer_, oldlen < newlen ? oldlen : newlen);
+            release_host(mmu, segment, oldaddr, oldaddr + oldlen);
+        }
+    }
+
+    if (buffer == MAP_FAILED) {
+        mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+        return 0;
+    }
+
+    // flat mode keeps the address space reserved
+    if (mmu_isflat(mmu))
+        mmap(segment->buffer_, oldlen, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+    mmu->mm_segments = tree_remove(mmu->mm_segments, segment);
+    free_give(mmu, oldaddr, oldaddr + oldlen);
+
+    // the pages keep their protection, what is added gets the one of the last
+    for (size_t i = 0; i < newlen >> MMU_PAGE_SHIFT; i++)
+        page_alloc(mmu, newpage + i)->pg_flags = page_entry(mmu, oldpage + (i < oldpages ? i : oldpages - 1))->pg_flags & ~(PG_CODE | PG_CLEAN);
+
+    for (size_t i = 0; i < oldpages; i++) {
+        page_entry_t *entry = page_entry(mmu, oldpage + i);
+
+        if (entry->pg_flags & PG_CODE) {
+            entry->pg_codegen = mmu_codegen(mmu) + 1;
+            code = 1;
+        }
+
+        entry->pg_flags = 0;
+        entry->pg_host = NULL;
+    }
+
+    segment->buffer_ = buffer;
+    segment->s_start = newaddr;
+    segment->s_limit = newaddr + newlen;
+    mmu->mm_segments = tree_insert(mmu->mm_segments, segment);
+    free_take(mmu, segment->s_start, segment->s_limit);
+    set_pages(mmu, segment, segment->s_start, segment->s_limit);
+
+    if (mmu_isflat(mmu)) {
+        flat_apply(mmu, oldaddr, (uint64_t)oldaddr + oldlen);
+        flat_apply(mmu, newaddr, (uint64_t)newaddr + newlen);
+    }
+
+    apply_backing(mmu, segment, segment->s_start, segment->s_limit);
+
+    mmu_tlb_flush(mmu);
+    mmu->mm_layoutgen++;
+
+    if (code)
+        mmu_codegen_next(mmu);
+
+    return newaddr;
+}
+
+// give the host memory behind [start, end) of the segment back, only the host
+// pages completely inside the range can go
+static void release_host(x86MMU *mmu, segment_t *segment, moffset32_t start, moffset32_t end)
+{
+    uintptr_t host = (uintptr_t)segment->buffer_ + (start - segment->s_start);
+    uintptr_t host_start = host_pageup(host);
+    uintptr_t host_end = host_pagedown(host + (end - start));
+
+    if (host_start >= host_end)
+        return;
+
+    if (mmu->mm_backing[segment->s_class] & MB_LOCK)
+        munlock((void *)host_start, host_end - host_start);
+
+    // flat mode keeps the address space reserved. Anonymous memory reads back
+    // as zeros once dropped, so it can keep its host mapping too.
+    if (mmu_isflat(mmu) && (mmu->mm_backing[segment->s_class] & MB_DONTNEED)
+            && (segment->s_flags & (MF_ANON | MF_STACK))) {
+        madvise((void *)host_start, host_end - host_start, MADV_DONTNEED);
+        mprotect((void *)host_start, host_end - host_start, PROT_NONE);
+    } else if (mmu_isflat(mmu)) {
+        mmap((void *)host_start, host_end - host_start, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    } else {
+        munmap((void *)host_start, host_end - host_start);
+    }
+}
+
+// apply the host backing policy of the segment to [start, end) of it. The
+// host saying no isn't an error, the memory is there either way.
+static void apply_backing(x86MMU *mmu, const segment_t *segment, moffset32_t start, moffset32_t end)
+{
+    int policy = mmu->mm_backing[segment->s_class];
+    uintptr_t host_start = host_pagedown((uintptr_t)segment->buffer_ + (start - segment->s_start));
+    uintptr_t host_end = host_pageup((uintptr_t)segment->buffer_ + (end - segment->s_start));
+    int prot = host_prot(page_flags(segment->s_prot));
+
+    if (!policy || host_start >= host_end)
+        return;
+
+    // private memory is always writable in the segmented mode
+    if (!mmu_isflat(mmu) && !(segment->s_flags & MF_SHARED))
+        prot = PROT_READ | PROT_WRITE;
+
+#ifdef MADV_HUGEPAGE
+    if (policy & MB_HUGEPAGE)
+        madvise((void *)host_start, host_end - host_start, MADV_HUGEPAGE);
+#endif
+
+    if (policy & MB_LOCK)
+        mlock((void *)host_start, host_end - host_start);
+
+    if (!(policy & MB_POPULATE) || prot == PROT_NONE)
+        return;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise((void *)host_start, host_end - host_start, (prot & PROT_WRITE) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0)
+        return;
+#endif
+
+    // older kernels, touch every page instead. A read only maps the zero page
+    // of anonymous memory, so writable memory is written to.
+    for (uintptr_t host = host_start; host < host_end; host += conf_mmu_pagesize) {
+        volatile uint8_t *byte = (volatile uint8_t *)host;
+
+        if (prot & PROT_WRITE)
+            *byte = *byte;
+        else
+            (void)*byte;
+    }
+}
+
+// remove [start, end) from the segments, splitting the ones crossing the
+// edges. Unless keep is set the host memory is released and the pages are
+// unmapped, otherwise only the segment that owns them changes.
+static void unmap_range(x86MMU *mmu, moffset32_t start, moffset32_t end, _Bool keep)
+{
+    segment_t *segment;
+    _Bool code = 0;
+
+    while ((segment = tree_overlap(mmu->mm_segments, start, end))) {
+        segment = split_segment(mmu, segment, start);
+        split_segment(mmu, segment, end);
+
+        mmu->mm_segments = tree_remove(mmu->mm_segments, segment);
+        if (!keep)
+            release_host(mmu, segment, segment->s_start, segment->s_limit);
+        free_give(mmu, segment->s_start, segment->s_limit);
+
+        if (mmu->mm_stack == segment)
+            mmu->mm_stack = NULL;
+
+        xfree(segment);
+    }
+
+    if (!keep) {
+        for (uint64_t page = start >> MMU_PAGE_SHIFT; page < (uint64_t)end >> MMU_PAGE_SHIFT; page++) {
+            page_entry_t *entry = page_entry(mmu, page);
+
+            // the empty table is never written to
+            if (!entry->pg_flags && !entry->pg_host)
+                continue;
+
+            // whatever is mapped here next is different code
+            if (entry->pg_flags & PG_CODE) {
+                entry->pg_codegen = mmu_codegen(mmu) + 1;
+                code = 1;
+            }
+
+            entry->pg_flags = 0;
+            entry->pg_host = NULL;
+        }
+
+        if (mmu_isflat(mmu))
+            flat_apply(mmu, start, end);
+    }
+
+    mmu_tlb_flush(mmu);
+    mmu->mm_layoutgen++;
+
+    if (code)
+        mmu_codegen_next(mmu);
+}
+
+
+void mmu_mmap_loadable(x86MMU *mmu, GenericELF *elf)
+{
+    pt_load_segment_t *segment;
+    uint64_t brk = 0;
+    int prot = 0;
+
+    if (!mmu || !elf)
+        return;
+
+    for (size_t i = 0; i < elf_nloadable(elf); i++, prot = 0) {
+        segment = &elf_loadable(elf)[i];
+
+        if (segment->pt_flags & PF_R)
+            prot |= PROT_READ;
+        if (segment->pt_flags & PF_W)
+            prot |= PROT_WRITE;
+        if (segment->pt_flags & PF_X)
+            prot |= PROT_EXEC;
+
+        map_segment(mmu, segment->pt_vaddr, segment->pt_memsz, prot,
+                    elf_underlfd(elf), segment->pt_offset, segment->pt_filesz);
+
+        if (mmu_error(mmu))
+            return;
+
+        if ((uint64_t)segment->pt_vaddr + segment->pt_memsz > brk)
+            brk = (uint64_t)segment->pt_vaddr + segment->pt_memsz;
+    }
+
+    // the heap starts at the page after the bss
+    mmu->mm_brk_start = mmu->mm_brk = guest_pageup(brk);
+}
+
+//
+// Memory management calls
+//
+
+moffset32_t mmu_mmap(x86MMU *mmu, moffset32_t virtaddr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    moffset32_t start;
+
+    if (!mmu)
+        return 0;
+
+    mmu_lock(mmu);
+    start = map_range(mmu, virtaddr, len, prot, flags, fd, offset);
+    mmu_unlock(mmu);
+
+    return start;
+}
+
+static moffset32_t map_range(x86MMU *mmu, moffset32_t virtaddr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    segment_t *segment;
+    moffset32_t start = 0;
+    void *buffer;
+    int sharing = flags & (MAP_PRIVATE | MAP_SHARED | MAP_ANONYMOUS);
+    int mf = 0;
+
+    if (len == 0 || (offset & (MMU_PAGE_SIZE - 1)) || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))
+            || !(flags & (MAP_PRIVATE | MAP_SHARED)) || ((flags & MAP_FIXED) && (virtaddr & (MMU_PAGE_SIZE - 1)))) {
+        mmu_set_error(mmu, EINVAL, "%s: invalid argument", __FUNCTION__);
+        return 0;
+    }
+
+    if (len > MMU_USER_LIMIT) {
+        mmu_set_error(mmu, ENOMEM, "%s: 0x%lx bytes don't fit in the address space", __FUNCTION__, len);
+        return 0;
+    }
+
+    len = guest_pageup(len);
+
+    if (flags & MAP_SHARED)
+        mf = MF_SHARED;
+    else if (flags & MAP_ANONYMOUS)
+        mf = MF_ANON;
+
+    if (flags & MAP_ANONYMOUS)
+        fd = -1;
+
+    if (flags & MAP_FIXED) {
+        if (virtaddr < MMU_MIN_ADDRESS || (uint64_t)virtaddr + len > MMU_USER_LIMIT) {
+            mmu_set_error(mmu, ENOMEM, "%s: 0x%lx is out of the address space", __FUNCTION__, virtaddr);
+            return 0;
+        }
+
+        start = virtaddr;
+        unmap_range(mmu, start, start + len, 0);
+    } else {
+        // the address given is only a hint, it's taken if it's free
+        if (virtaddr && tree_fit(mmu->mm_free, guest_pagedown(virtaddr), len) == guest_pagedown(virtaddr))
+            start = guest_pagedown(virtaddr);
+        if (!start)
+            start = tree_fit(mmu->mm_free, conf_mmu_start_mapping_address, len);
+        if (!start)
+            start = tree_fit(mmu->mm_free, MMU_MIN_ADDRESS, len);
+
+        if (!start) {
+            mmu_set_error(mmu, ENOMEM, "%s: no room for a mapping of 0x%lx bytes", __FUNCTION__, len);
+            return 0;
+        }
+    }
+
+    // anonymous memory right after another anonymous segment grows it, that's
+    // how the heap grows too
+    segment = tree_floor(mmu->mm_segments, start - 1);
+    if (mf == MF_ANON && segment && segment->s_limit == start && segment->s_prot == prot
+            && segment->s_flags == mf && grow_segment(mmu, segment, len))
+        return start;
+
+    if (mmu_isflat(mmu)) {
+        buffer = mmap(mmu->mm_flat_base + start, len, host_prot(page_flags(prot)), sharing | MAP_FIXED, fd, offset);
+    } else {
+        // private memory is always writable in the host, shared memory has to
+        // follow the guest protection
+        buffer = mmap(NULL, len, (mf & MF_SHARED) ? host_prot(page_flags(prot)) : PROT_READ | PROT_WRITE,
+                        sharing, fd, offset);
+    }
+
+    if (buffer == MAP_FAILED) {
+        if (mmu_isflat(mmu))
+            mmap(mmu->mm_flat_base + start, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+        mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+        return 0;
+    }
+
+    segment = new_segment(buffer, start, start + len, prot, mf);
+    add_segment(mmu, segment);
+    merge_segment(mmu, segment);
+
+    return start;
+}
+
+void mmu_munmap(x86MMU *mmu, moffset32_t virtaddr, size_t len)
+{
+    if (!mmu)
+        return;
+
+    if (len == 0 || (virtaddr & (MMU_PAGE_SIZE - 1)) || (uint64_t)virtaddr + len > MMU_USER_LIMIT) {
+        mmu_set_error(mmu, EINVAL, "%s: invalid argument", __FUNCTION__);
+        return;
+    }
+
+    mmu_lock(mmu);
+    unmap_range(mmu, virtaddr, guest_pageup((uint64_t)virtaddr + len), 0);
+    mmu_unlock(mmu);
+}
+
+moffset32_t mmu_mremap(x86MMU *mmu, moffset32_t oldaddr, size_t oldlen, size_t newlen, int flags, moffset32_t newaddr)
+{
+    if (!mmu)
+        return 0;
+
+    mmu_lock(mmu);
+    newaddr = remap_range(mmu, oldaddr, oldlen, newlen, flags, newaddr);
+    mmu_unlock(mmu);
+
+    return newaddr;
+}
+
+static moffset32_t remap_range(x86MMU *mmu, moffset32_t oldaddr, size_t oldlen, size_t newlen, int flags, moffset32_t newaddr)
+{
+    segment_t *segment;
+    uint64_t oldend;
+
+    if ((oldaddr & (MMU_PAGE_SIZE - 1)) || oldlen == 0 || newlen == 0 || (flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED))
+            || ((flags & MREMAP_FIXED) && (!(flags & MREMAP_MAYMOVE) || (newaddr & (MMU_PAGE_SIZE - 1))))) {
+        mmu_set_error(mmu, EINVAL, "%s: invalid argument", __FUNCTION__);
+        return 0;
+    }
+
+    if (oldlen > MMU_USER_LIMIT || newlen > MMU_USER_LIMIT) {
+        mmu_set_error(mmu, ENOMEM, "%s: 0x%lx bytes don't fit in the address space", __FUNCTION__, newlen);
+        return 0;
+    }
+
+    oldlen = guest_pageup(oldlen);
+    newlen = guest_pageup(newlen);
+    oldend = (uint64_t)oldaddr + oldlen;
+
+    // the old range has to be in a single segment
+    segment = tree_floor(mmu->mm_segments, oldaddr);
+    if (!segment || oldend > segment->s_limit) {
+        mmu_set_error(mmu, EFAULT, "%s: 0x%lx is not mapped", __FUNCTION__, oldaddr);
+        return 0;
+    }
+
+    if (flags & MREMAP_FIXED) {
+        if (newaddr < MMU_MIN_ADDRESS || (uint64_t)newaddr + newlen > MMU_USER_LIMIT
+                || (newaddr < oldend && newaddr + newlen > oldaddr)) {
+            mmu_set_error(mmu, EINVAL, "%s: can't move to 0x%lx", __FUNCTION__, newaddr);
+            return 0;
+        }
+
+        unmap_range(mmu, newaddr, newaddr + newlen, 0);
+
+        // the unmap could have split the segment, look for what is left of it
+        segment = tree_floor(mmu->mm_segments, oldaddr);
+        if (!segment || oldend > segment->s_limit) {
+            mmu_set_error(mmu, EFAULT, "%s: 0x%lx is not mapped", __FUNCTION__, oldaddr);
+            return 0;
+        }
+
+        return move_segment(mmu, segment, oldaddr, oldlen, newaddr, newlen);
+    }
+
+    if (newlen <= oldlen) {
+        unmap_range(mmu, oldaddr + newlen, oldend, 0);
+        return oldaddr;
+    }
+
+    if (oldend == segment->s_limit && tree_fit(mmu->mm_free, oldend, newlen - oldlen) == oldend
+            && grow_segment(mmu, segment, newlen - oldlen))
+        return oldaddr;
+
+    if (!(flags & MREMAP_MAYMOVE)) {
+        mmu_set_error(mmu, ENOMEM, "%s: 0x%lx can't grow in place", __FUNCTION__, oldaddr);
+        return 0;
+    }
+
+    newaddr = tree_fit(mmu->mm_free, conf_mmu_start_mapping_address, newlen);
+    if (!newaddr)
+        newaddr = tree_fit(mmu->mm_free, MMU_MIN_ADDRESS, newlen);
+
+    if (!newaddr) {
+        mmu_set_error(mmu, ENOMEM, "%s: no room for a mapping of 0x%lx bytes", __FUNCTION__, newlen);
+        return 0;
+    }
+
+    return move_segment(mmu, segment, oldaddr, oldlen, newaddr, newlen);
+}
+
+// the heap is anonymous memory from mm_brk_start up to the break, it's grown
+// like any other anonymous mapping but never over another mapping
+moffset32_t mmu_brk(x86MMU *mmu, moffset32_t brk)
+{
+    if (!mmu)
+        return 0;
+
+    mmu_lock(mmu);
+    brk = move_brk(mmu, brk);
+    mmu_unlock(mmu);
+
+    return brk;
+}
+
+static moffset32_t move_brk(x86MMU *mmu, moffset32_t brk)
+{
+    moffset32_t old_end, new_end;
+
+    if (!mmu->mm_brk_start || brk < mmu->mm_brk_start || brk > MMU_USER_LIMIT)
+        return mmu->mm_brk;
+
+    old_end = guest_pageup(mmu->mm_brk);
+    new_end = guest_pageup(brk);
+
+    if (new_end > old_end) {
+        if (tree_fit(mmu->mm_free, old_end, new_end - old_end) != old_end)
+            return mmu->mm_brk;
+
+        mmu_mmap(mmu, old_end, new_end - old_end, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (mmu_error(mmu)) {
+            mmu_clrerror(mmu);
+            return mmu->mm_brk;
+        }
+    } else if (new_end < old_end) {
+        unmap_range(mmu, new_end, old_end, 0);
+    }
+
+    mmu->mm_brk = brk;
+
+    return brk;
+}
+
+// Only the top conf_mmu_stack_size bytes of the stack are committed, the
+// rest of RLIMIT_STACK is reserved and committed by grow_stack() when an
+// access below the stack faults. The lowest page of the reservation is never
+// committed so running out of stack is a segmentation fault.
+moffset32_t mmu_create_stack(x86MMU *mmu, int flags)
+{
+    moffset32_t top = conf_mmu_top_stack_address + conf_mmu_stack_size;
+    size_t reserve = conf_mmu_stack_reserve;
+    struct rlimit limit;
+    uint8_t *buffer;
+    int prot = PROT_READ | PROT_WRITE;
+
+    if (!mmu)
+        return 0;
+
+    if (flags & B_STACKEXEC)
+        prot |= PROT_EXEC;
+
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        reserve = limit.rlim_cur;
+
+    // leave the room where the mappings without an address go
+    if (reserve > top - conf_mmu_start_mapping_address)
+        reserve = top - conf_mmu_start_mapping_address;
+
+    reserve = host_pageup(reserve);
+    if (reserve < conf_mmu_stack_size + conf_mmu_pagesize)
+        reserve = conf_mmu_stack_size + conf_mmu_pagesize;
+
+    if (mmu_isflat(mmu)) {
+        buffer = flat_map(mmu, top - conf_mmu_stack_size, conf_mmu_stack_size);
+        if (!buffer)
+            return 0;
+    } else {
+        buffer = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (buffer == MAP_FAILED) {
+            mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+            return 0;
+        }
+
+        buffer += reserve - conf_mmu_stack_size;
+
+        if (mprotect(buffer, conf_mmu_stack_size, PROT_READ | PROT_WRITE) == -1) {
+            mmu_set_error(mmu, errno, "%s: %s", __FUNCTION__, strerror(errno));
+            return 0;
+        }
+    }
+
+    add_segment(mmu, new_segment(buffer, top - conf_mmu_stack_size, top, prot, MF_STACK));
+
+    // nothing else is placed where the stack can grow
+    free_take(mmu, top - reserve, top);
+
+    mmu->mm_stack_reserve = top - reserve;
+    mmu->mm_stack_guard = top - reserve + conf_mmu_pagesize;
+
+    return top;
+}
+
+// commit the stack down to the page of virtaddr, returns 0 if it isn't in the
+// reserved part above the guard page or something was mapped in the way
+static _Bool grow_stack(x86MMU *mmu, moffset32_t virtaddr)
+{
+    _Bool grown;
+
+    mmu_lock(mmu);
+    grown = commit_stack(mmu, virtaddr);
+    mmu_unlock(mmu);
+
+    return grown;
+}
+
+static _Bool commit_stack(x86MMU *mmu, moffset32_t virtaddr)
+{
+    segment_t *stack = mmu->mm_stack;
+    moffset32_t start = host_pagedown(virtaddr);
+    size_t committed;
+    uint8_t flags;
+    uint8_t *buffer;
+
+    if (!stack || virtaddr >= stack->s_start || virtaddr < mmu->mm_stack_guard)
+        return 0;
+
+    if (tree_overlap(mmu->mm_segments, start, stack->s_start))
+        return 0;
+
+    committed = stack->s_start - start;
+    buffer = (uint8_t *)stack->buffer_ - committed;
+    flags = mmu_pageflags(mmu, stack->s_start) & ~(PG_CODE | PG_CLEAN);
+
+    if (!mmu_isflat(mmu) && mprotect(buffer, committed, PROT_READ | PROT_WRITE) == -1)
+        return 0;
+
+    for (uint64_t page = start >> MMU_PAGE_SHIFT; page < stack->s_start >> MMU_PAGE_SHIFT; page++)
+        page_alloc(mmu, page)->pg_flags = flags;
+
+    if (mmu_isflat(mmu))
+        flat_apply(mmu, start, stack->s_start);
+
+    // nothing else is mapped down to start, the tree stays ordered
+    stack->buffer_ = buffer;
+    stack->s_start = start;
+    set_pages(mmu, stack, start, start + committed);
+    apply_backing(mmu, stack, start, start + committed);
+    mmu->mm_layoutgen++;
+
+    return 1;
+}
+
+// give the stack below start back to the reservation, the opposite of
+// grow_stack()
+static void shrink_stack(x86MMU *mmu, moffset32_t start)
+{
+    segment_t *stack = mmu->mm_stack;
+    size_t released = start - stack->s_start;
+    _Bool code = 0;
+
+    // the contents go too, the stack grows again zero-filled
+    mmap(stack->buffer_, released, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+    for (uint64_t page = stack->s_start >> MMU_PAGE_SHIFT; page < start >> MMU_PAGE_SHIFT; page++) {
+        page_entry_t *entry = page_entry(mmu, page);
+
+        if (entry->pg_flags & PG_CODE) {
+            entry->pg_codegen = mmu_codegen(mmu) + 1;
+            code = 1;
+        }
+
+        entry->pg_flags = 0;
+        entry->pg_host = NULL;
+    }
+
+    stack->buffer_ = (uint8_t *)stack->buffer_ + released;
+    stack->s_start = start;
+
+    mmu_tlb_flush(mmu);
+    mmu->mm_layoutgen++;
+
+    if (code)
+        mmu_codegen_next(mmu);
+}
+
+
+//
+// Snapshots
+//
+
+// the saved page, NULL if it wasn't mapped when the snapshot was taken
+static const snapshot_page_t *snapshot_find(const x86MMUSnapshot *snap, uint64_t page)
+{
+    size_t low = 0, high = snap->ms_npages;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (snap->ms_pages[mid].sp_page == page)
+            return &snap->ms_pages[mid];
+
+        if (snap->ms_pages[mid].sp_page < page)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return NULL;
+}
+
+// the page is written to for the first time since the snapshot. In flat mode
+// the host page is unprotected as a whole, so all of its pages become dirty.
+static void page_dirty(x86MMU *mmu, moffset32_t virtaddr)
+{
+    uint64_t start = guest_pagedown(virtaddr);
+    uint64_t end = start + MMU_PAGE_SIZE;
+
+    if (mmu_isflat(mmu)) {
+        start = host_pagedown(start);
+        end = host_pageup(end);
+    }
+
+    mmu_lock(mmu);
+
+    // another thread may have got here first
+    for (uint64_t page = start >> MMU_PAGE_SHIFT; page < end >> MMU_PAGE_SHIFT; page++) {
+        page_entry_t *entry = page_entry(mmu, page);
+
+        if (!(entry->pg_flags & PG_CLEAN))
+            continue;
+
+        entry->pg_flags &= ~PG_CLEAN;
+        mmu->mm_dirty[mmu->mm_ndirty++] = page;
+    }
+
+    if (mmu_isflat(mmu))
+        flat_apply(mmu, start, end);
+
+    mmu_unlock(mmu);
+}
+
+// start tracking the writes to the saved pages, or stop if clean isn't set.
+// In flat mode the host protection follows.
+static void snapshot_track(x86MMU *mmu, x86MMUSnapshot *snap, _Bool clean)
+{
+    size_t run = 0;
+
+    // a page is only dirtied once, there's room for every saved page
+    if (clean)
+        mmu->mm_dirty = xreallocarray(mmu->mm_dirty, snap->ms_npages + 1, sizeof(*mmu->mm_dirty));
+
+    for (size_t i = 0; i < snap->ms_npages; i++) {
+        const snapshot_page_t *saved = &snap->ms_pages[i];
+        page_entry_t *entry = page_entry(mmu, saved->sp_page);
+
+        if (saved->sp_data != SNAP_NODATA && (entry->pg_flags & PG_PRESENT)) {
+            if (clean)
+                entry->pg_flags |= PG_CLEAN;
+            else
+                entry->pg_flags &= ~PG_CLEAN;
+        }
+
+        // one host call for every run of contiguous pages
+        if (mmu_isflat(mmu) && (i + 1 == snap->ms_npages || snap->ms_pages[i + 1].sp_page != saved->sp_page + 1)) {
+            flat_apply(mmu, snap->ms_pages[run].sp_page << MMU_PAGE_SHIFT, ((uint64_t)saved->sp_page + 1) << MMU_PAGE_SHIFT);
+            run = i + 1;
+        }
+    }
+
+    mmu->mm_ndirty = 0;
+    mmu->mm_snapshot = clean ? snap : NULL;
+    mmu_tlb_flush(mmu);
+}
+
+void mmu_snapshot(x86MMU *mmu, x86MMUSnapshot *snap)
+{
+    size_t npages = 0, ndata = 0;
+
+    if (!mmu || !snap)
+        return;
+
+    mmu_lock(mmu);
+
+    for (size_t i = 0; i < MMU_TABLE_ENTRIES; i++) {
+        if (mmu->mm_pagedir[i] == empty_table)
+            continue;
+
+        for (size_t j = 0; j < MMU_TABLE_ENTRIES; j++) {
+            if (mmu->mm_pagedir[i][j].pg_flags & PG_PRESENT)
+                npages++;
+        }
+    }
+
+    snap->ms_pages = xcalloc(npages + 1, sizeof(*snap->ms_pages));
+    snap->ms_npages = 0;
+
+    for (size_t i = 0; i < MMU_TABLE_ENTRIES; i++) {
+        if (mmu->mm_pagedir[i] == empty_table)
+            continue;
+
+        for (size_t j = 0; j < MMU_TABLE_ENTRIES; j++) {
+            page_entry_t *entry = &mmu->mm_pagedir[i][j];
+            snapshot_page_t *saved = &snap->ms_pages[snap->ms_npages];
+            const segment_t *segment;
+
+            if (!(entry->pg_flags & PG_PRESENT))
+                continue;
+
+            saved->sp_page = (i << MMU_TABLE_SHIFT) | j;
+            saved->sp_flags = entry->pg_flags & ~(PG_CODE | PG_CLEAN);
+            saved->sp_data = SNAP_NODATA;
+
+            segment = find_segment(mmu, saved->sp_page << MMU_PAGE_SHIFT);
+            if (!segment || !(segment->s_flags & MF_SHARED))
+                saved->sp_data = ndata++;
+
+            snap->ms_npages++;
+        }
+    }
+
+    snap->ms_data = xmalloc((ndata + 1) * MMU_PAGE_SIZE);
+
+    for (size_t i = 0; i < snap->ms_npages; i++) {
+        const snapshot_page_t *saved = &snap->ms_pages[i];
+        page_entry_t *entry = page_entry(mmu, saved->sp_page);
+
+        if (saved->sp_data == SNAP_NODATA)
+            continue;
+
+        // the host can't read it, snapshot_track() puts the protection back
+        if (mmu_isflat(mmu) && host_prot(entry->pg_flags) == PROT_NONE)
+            flat_map(mmu, saved->sp_page << MMU_PAGE_SHIFT, MMU_PAGE_SIZE);
+
+        memcpy(snap->ms_data + (size_t)saved->sp_data * MMU_PAGE_SIZE, entry->pg_host, MMU_PAGE_SIZE);
+    }
+
+    snap->ms_brk = mmu->mm_brk;
+    snap->ms_stack_start = mmu->mm_stack ? mmu->mm_stack->s_start : 0;
+    snap->ms_layoutgen = mmu->mm_layoutgen;
+    snap->ms_copied = 0;
+
+    snapshot_track(mmu, snap, 1);
+    mmu_unlock(mmu);
+}
+
+// unmap the pages that weren't mapped when the snapshot was taken
+static void unmap_unsaved(x86MMU *mmu, const x86MMUSnapshot *snap)
+{
+    uint64_t start = 0, end = 0;    // the run of pages to unmap, page 0 is never mapped
+
+    for (size_t i = 0; i < MMU_TABLE_ENTRIES; i++) {
+        if (mmu->mm_pagedir[i] == empty_table)
+            continue;
+
+        for (size_t j = 0; j < MMU_TABLE_ENTRIES; j++) {
+            uint64_t page = (i << MMU_TABLE_SHIFT) | j;
+
+            if (!(mmu->mm_pagedir[i][j].pg_flags & PG_PRESENT) || snapshot_find(snap, page))
+                continue;
+
+            // only the pages already walked are changed
+            if (page != end && end)
+                unmap_range(mmu, start << MMU_PAGE_SHIFT, end << MMU_PAGE_SHIFT, 0);
+            if (page != end)
+                start = page;
+
+            end = page + 1;
+        }
+    }
+
+    if (end)
+        unmap_range(mmu, start << MMU_PAGE_SHIFT, end << MMU_PAGE_SHIFT, 0);
+}
+
+// put back the pages written to since the snapshot, everything else is as it was
+static void restore_dirty(x86MMU *mmu, x86MMUSnapshot *snap)
+{
+    for (size_t i = 0; i < mmu->mm_ndirty; i++) {
+        uint64_t page = mmu->mm_dirty[i];
+        const snapshot_page_t *saved = snapshot_find(snap, page);
+        page_entry_t *entry = page_entry(mmu, page);
+
+        memcpy(entry->pg_host, snap->ms_data + (size_t)saved->sp_data * MMU_PAGE_SIZE, MMU_PAGE_SIZE);
+        entry->pg_flags |= PG_CLEAN;
+
+        if (entry->pg_flags & PG_CODE)
+            mmu_code_written(mmu, page << MMU_PAGE_SHIFT);
+
+        // the next write has to be seen again
+        tlb_drop_write(mmu, page << MMU_PAGE_SHIFT);
+
+        if (mmu_isflat(mmu))
+            flat_apply(mmu, page << MMU_PAGE_SHIFT, (page + 1) << MMU_PAGE_SHIFT);
+    }
+
+    snap->ms_copied = mmu->mm_ndirty;
+    mmu->mm_ndirty = 0;
+}
+
+void mmu_restore(x86MMU *mmu, x86MMUSnapshot *snap)
+{
+    if (!mmu || !snap)
+        return;
+
+    mmu_lock(mmu);
+    restore_pages(mmu, snap);
+    mmu_unlock(mmu);
+}
+
+static void restore_pages(x86MMU *mmu, x86MMUSnapshot *snap)
+{
+    _Bool tracked;
+    size_t run = 0;
+
+    tracked = mmu->mm_snapshot == snap;
+    mmu->mm_brk = snap->ms_brk;
+    snap->ms_copied = 0;
+
+    if (tracked && mmu->mm_layoutgen == snap->ms_layoutgen) {
+        restore_dirty(mmu, snap);
+        return;
+    }
+
+    // the stack only grows, give back what it grew since
+    if (mmu->mm_stack && snap->ms_stack_start > mmu->mm_stack->s_start)
+        shrink_stack(mmu, snap->ms_stack_start);
+
+    unmap_unsaved(mmu, snap);
+
+    // map again what was unmapped, a run of pages at a time. The contents and
+    // protection are the ones of the snapshot, shared memory comes back as
+    // private anonymous memory.
+    for (size_t i = 0; i < snap->ms_npages; i++) {
+        const snapshot_page_t *saved = &snap->ms_pages[i];
+
+        if (page_entry(mmu, saved->sp_page)->pg_flags & PG_PRESENT) {
+            run = i + 1;
+            continue;
+        }
+
+        if (i + 1 == snap->ms_npages || snap->ms_pages[i + 1].sp_page != saved->sp_page + 1
+                || (page_entry(mmu, snap->ms_pages[i + 1].sp_page)->pg_flags & PG_PRESENT)) {
+            moffset32_t start = snap->ms_pages[run].sp_page << MMU_PAGE_SHIFT;
+
+            mmu_mmap(mmu, start, (saved->sp_page + 1 - snap->ms_pages[run].sp_page) << MMU_PAGE_SHIFT,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            if (mmu_error(mmu))
+                return;
+
+            run = i + 1;
+        }
+    }
+
+    for (size_t i = 0; i < snap->ms_npages; i++) {
+        const snapshot_page_t *saved = &snap->ms_pages[i];
+        page_entry_t *entry = page_entry(mmu, saved->sp_page);
+        uint8_t flags = saved->sp_flags | (entry->pg_flags & (PG_CODE | PG_CLEAN));
+        _Bool copy = saved->sp_data != SNAP_NODATA && (!tracked || !(entry->pg_flags & PG_CLEAN));
+
+        // snapshot_track() puts the protection back
+        if (copy && mmu_isflat(mmu) && host_prot(entry->pg_flags) != (PROT_READ | PROT_WRITE))
+            flat_map(mmu, saved->sp_page << MMU_PAGE_SHIFT, MMU_PAGE_SIZE);
+
+        if (copy) {
+            memcpy(entry->pg_host, snap->ms_data + (size_t)saved->sp_data * MMU_PAGE_SIZE, MMU_PAGE_SIZE);
+            snap->ms_copied++;
+        }
+
+        if ((entry->pg_flags & PG_CODE) && (copy || flags != entry->pg_flags))
+            mmu_code_written(mmu, saved->sp_page << MMU_PAGE_SHIFT);
+
+        entry->pg_flags = flags;
+    }
+
+    mmu->mm_layoutgen++;
+    snap->ms_layoutgen = mmu->mm_layoutgen;
+
+    snapshot_track(mmu, snap, 1);
+}
+
+void mmu_snapshot_free(x86MMU *mmu, x86MMUSnapshot *snap)
+{
+    if (!snap)
+        return;
+
+    if (mmu && mmu->mm_snapshot == snap) {
+        mmu_lock(mmu);
+        snapshot_track(mmu, snap, 0);
+        mmu_unlock(mmu);
+    }
+
+    xfree(snap->ms_pages);
+    xfree(snap->ms_data);
+    snap->ms_pages = NULL;
+    snap->ms_data = NULL;
+    snap->ms_npages = 0;
+}
+
+//
+// Read/Write functions
+//
+
+uint8_t mmu_fetch(x86MMU *mmu, moffset32_t virtaddr)
+{
+    void *buffer;
+
+    if (!mmu)
+        return 0;
+
+    buffer = tlb_lookup(mmu, mmu_local.ml_tlb_fetch, virtaddr, 8, NULL);
+    if (buffer)
+        return *(uint8_t *)buffer;
+
+    buffer = translate(mmu, virtaddr);
+    if (!buffer && grow_stack(mmu, virtaddr))
+        buffer = translate(mmu, virtaddr);
+
+    if (!buffer) {
+        mmu_set_error(mmu, ESEGFAULT, "Segmentation Fault at 0x%lx", virtaddr);
+        return 0;
+    }
+
+    if (!mmu_isexecutable(mmu, virtaddr)) {
+        mmu_set_error(mmu, EPROT, "attempted to execute code from a non-executable segment at 0x%lx", virtaddr);
+        return 0;
+    }
+
+    mmu_mark_code(mmu, virtaddr);
+    tlb_fill(mmu, mmu_local.ml_tlb_fetch, virtaddr);
+
+    return *(uint8_t *)buffer;
+}
+
+void mmu_mark_code(x86MMU *mmu, moffset32_t virtaddr)
+{
+    page_entry_t *entry;
+
+    if (!mmu)
+        return;
+
+    entry = mmu_page(mmu, virtaddr);
+
+    // the empty table is never written to
+    if ((entry->pg_flags & PG_CODE) || !(entry->pg_flags & PG_PRESENT))
+        return;
+
+    mmu_lock(mmu);
+
+    if ((entry->pg_flags & (PG_CODE | PG_PRESENT)) == PG_PRESENT) {
+        entry->pg_flags |= PG_CODE;
+
+        // from now on writes to the page have to be seen, including the ones
+        // that would hit a TLB entry filled before
+        tlb_drop_write(mmu, virtaddr);
+    }
+
+    mmu_unlock(mmu);
+}
+
+
+// the accesses the inline functions in x86-mmu.h can't do: TLB misses,
+// faults and accesses crossing into the next page. Those are split in bytes,
+// both pages are checked before anything is done.
+uint64_t mmu_read_slow(x86MMU *mmu, moffset32_t virtaddr, int size)
+{
+    uint64_t bytes = 0;
+    uint8_t *host;
+
+    if (!mmu)
+        return 0;
+
+    if (tlb_pageoffset(virtaddr) + size / 8 > MMU_PAGE_SIZE) {
+        if (!page_access(mmu, virtaddr, PG_READ) || !page_access(mmu, virtaddr + size / 8 - 1, PG_READ))
+            return 0;
+
+        for (int i = 0; i < size / 8; i++)
+            bytes |= (uint64_t)*page_access(mmu, virtaddr + i, PG_READ) << (i * 8);
+
+        return bytes;
+    }
+
+    host = page_access(mmu, virtaddr, PG_READ);
+    if (!host)
+        return 0;
+
+    if (!mmu_isflat(mmu))
+        tlb_fill(mmu, mmu_local.ml_tlb_read, virtaddr);
+
+    memcpy(&bytes, host, size / 8);
+
+    return bytes;
+}
+
+void mmu_write_slow(x86MMU *mmu, uint64_t bytes, moffset32_t virtaddr, int size)
+{
+    uint8_t *host;
+
+    if (!mmu)
+        return;
+
+    if (tlb_pageoffset(virtaddr) + size / 8 > MMU_PAGE_SIZE) {
+        if (!page_access(mmu, virtaddr, PG_WRITE) || !page_access(mmu, virtaddr + size / 8 - 1, PG_WRITE))
+            return;
+
+        for (int i = 0; i < size / 8; i++)
+            *page_access(mmu, virtaddr + i, PG_WRITE) = bytes >> (i * 8);
+
+        // anything decoded from these pages may be stale now
+        if (mmu_pageflags(mmu, virtaddr) & PG_CODE)
+            mmu_code_written(mmu, virtaddr);
+        if (mmu_pageflags(mmu, virtaddr + size / 8 - 1) & PG_CODE)
+            mmu_code_written(mmu, virtaddr + size / 8 - 1);
+
+        return;
+    }
+
+    host = page_access(mmu, virtaddr, PG_WRITE);
+    if (!host)
+        return;
+
+    if (!mmu_isflat(mmu))
+        tlb_fill(mmu, mmu_local.ml_tlb_write, virtaddr);
+
+    memcpy(host, &bytes, size / 8);
+
+    if (mmu_pageflags(mmu, virtaddr) & PG_CODE)
+        mmu_code_written(mmu, virtaddr);
+}
+
+//
+// Bulk access
+//
+
+// the bytes from virtaddr up to the end of its page, at most len
+#define page_chunk(addr, len) (    MMU_PAGE_SIZE - tlb_pageoffset(addr) < (len) ? MMU_PAGE_SIZE - tlb_pageoffset(addr) : (len)    )
+
+// returns the host address of virtaddr if its page allows the access (PG_READ
+// or PG_WRITE), otherwise the error is set
+static uint8_t *page_access(x86MMU *mmu, moffset32_t virtaddr, int access)
+{
+    page_entry_t *entry = mmu_page(mmu, virtaddr);
+
+    if (!entry->pg_host && grow_stack(mmu, virtaddr))
+        entry = mmu_page(mmu, virtaddr);
+
+    if (!entry->pg_host) {
+        mmu_set_error(mmu, ESEGFAULT, "Segmentation Fault at 0x%lx", virtaddr);
+        return NULL;
+    }
+
+    if (!(entry->pg_flags & access)) {
+        if (access == PG_WRITE)
+            mmu_set_error(mmu, EPROT, "attempted write at non-writable segment at 0x%lx", virtaddr);
+        else
+            mmu_set_error(mmu, EPROT, "attempted read at non-readable segment at 0x%lx", virtaddr);
+        return NULL;
+    }
+
+    // writes only get a TLB entry through here, so this sees the first one
+    if (access == PG_WRITE && (entry->pg_flags & PG_CLEAN))
+        page_dirty(mmu, virtaddr);
+
+    return entry->pg_host + tlb_pageoffset(virtaddr);
+}
+
+size_t mmu_read(x86MMU *mmu, moffset32_t virtaddr, void *dest, size_t len)
+{
+    size_t done = 0;
+    size_t chunk;
+    uint8_t *host;
+
+    if (!mmu)
+        return 0;
+
+    for (; done < len; done += chunk, virtaddr += chunk) {
+        if (!(host = page_access(mmu, virtaddr, PG_READ)))
+            break;
+
+        chunk = page_chunk(virtaddr, len - done);
+        memcpy((uint8_t *)dest + done, host, chunk);
+    }
+
+    return done;
+}
+
+size_t mmu_write(x86MMU *mmu, moffset32_t virtaddr, const void *src, size_t len)
+{
+    size_t done = 0;
+    size_t chunk;
+    uint8_t *host;
+
+    if (!mmu)
+        return 0;
+
+    for (; done < len; done += chunk, virtaddr += chunk) {
+        if (!(host = page_access(mmu, virtaddr, PG_WRITE)))
+            break;
+
+        chunk = page_chunk(virtaddr, len - done);
+        memcpy(host, (const uint8_t *)src + done, chunk);
+
+        if (mmu_pageflags(mmu, virtaddr) & PG_CODE)
+            mmu_code_written(mmu, virtaddr);
+    }
+
+    return done;
+}
+
+size_t mmu_fill(x86MMU *mmu, moffset32_t virtaddr, uint8_t byte, size_t len)
+{
+    size_t done = 0;
+    size_t chunk;
+    uint8_t *host;
+
+    if (!mmu)
+        return 0;
+
+    for (; done < len; done += chunk, virtaddr += chunk) {
+        if (!(host = page_access(mmu, virtaddr, PG_WRITE)))
+            break;
+
+        chunk = page_chunk(virtaddr, len - done);
+        memset(host, byte, chunk);
+
+        if (mmu_pageflags(mmu, virtaddr) & PG_CODE)
+            mmu_code_written(mmu, virtaddr);
+    }
+
+    return done;
+}
+
+size_t mmu_read_until(x86MMU *mmu, moffset32_t virtaddr, void *dest, size_t len, uint8_t stop)
+{
+    size_t done = 0;
+    size_t chunk;
+    uint8_t *host;
+    uint8_t *found;
+
+    if (!mmu)
+        return 0;
+
+    for (; done < len; done += chunk, virtaddr += chunk) {
+        if (!(host = page_access(mmu, virtaddr, PG_READ)))
+            break;
+
+        chunk = page_chunk(virtaddr, len - done);
+        if ((found = memchr(host, stop, chunk)))
+            chunk = found - host + 1;
+
+        memcpy((uint8_t *)dest + done, host, chunk);
+
+        if (found)
+            return done + chunk;
+    }
+
+    return done;
+}
+
+size_t mmu_strnlen(x86MMU *mmu, moffset32_t virtaddr, size_t maxlen)
+{
+    size_t done = 0;
+    size_t chunk;
+    uint8_t *host;
+    uint8_t *found;
+
+    if (!mmu)
+        return 0;
+
+    for (; done < maxlen; done += chunk, virtaddr += chunk) {
+        if (!(host = page_access(mmu, virtaddr, PG_READ)))
+            break;
+
+        chunk = page_chunk(virtaddr, maxlen - done);
+        if ((found = memchr(host, '\0', chunk)))
+            return done + (found - host);
+    }
+
+    return done;
+}
+
+uint8_t *mmu_hostrange(x86MMU *mmu, moffset32_t virtaddr, size_t len, int access)
+{
+    uint8_t *start;
+    uint8_t *host;
+    size_t done;
+    size_t chunk;
+
+    if (!mmu || !len)
+        return NULL;
+
+    if (len - 1 > UINT32_MAX - virtaddr) {
+        mmu_set_error(mmu, ESEGFAULT, "Segmentation Fault at 0x%lx", virtaddr);
+        return NULL;
+    }
+
+    if (!(start = page_access(mmu, virtaddr, access)))
+        return NULL;
+
+    chunk = page_chunk(virtaddr, len);
+    for (done = chunk, virtaddr += chunk; done < len; done += chunk, virtaddr += chunk) {
+        if (!(host = page_access(mmu, virtaddr, access)))
+            return NULL;
+
+        // keep checking the access, the caller falls back to a copy
+        if (host != start + done)
+            start = NULL;
+
+        chunk = page_chunk(virtaddr, len - done);
+    }
+
+    return start;
+}
+
+void mmu_host_written(x86MMU *mmu, moffset32_t virtaddr, size_t len)
+{
+    moffset32_t page;
+    moffset32_t last;
+
+    if (!mmu || !len)
+        return;
+
+    last = tlb_page(virtaddr + (len - 1));
+    for (page = tlb_page(virtaddr); ; page++) {
+        if (mmu_pageflags(mmu, page << MMU_PAGE_SHIFT) & PG_CODE)
+            mmu_code_written(mmu, page << MMU_PAGE_SHIFT);
+        if (page == last)
+            break;
+    }
 }
 
 inline const uint8_t *mmu_getptr(x86MMU *mmu, moffset32_t virtaddr)
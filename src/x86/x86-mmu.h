@@ -27,6 +27,8 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "../types.h"
 #include "../generic-elf.h"
@@ -42,26 +44,190 @@ enum SegmentTypes {
     ST_RWXSTACK
 };
 
-typedef struct {
+typedef struct segment {
     void *buffer_;
     moffset32_t s_start;
     moffset32_t s_limit;
 
+    // what the segment was created for, the protection of each page is kept
+    // in the page table and can change later
     int s_type;
+    int s_prot;         // PROT_* flags it was mapped with
+    int s_flags;        // MF_* flags, see x86-mmu.c
+    int s_class;        // MC_* class, the host backing policy comes from it
+
+    // both the segments and the free ranges of the address space are kept in
+    // AVL trees ordered by s_start
+    struct segment *s_left;
+    struct segment *s_right;
+    int s_height;
+    moffset32_t s_maxlen;   // the longest range in this subtree
 } segment_t;
 
+// guest page size used by the soft TLB and the page protection table
+#define MMU_PAGE_SHIFT 12
+#define MMU_PAGE_SIZE (1 << MMU_PAGE_SHIFT)
+#define MMU_PAGES (1 << (32 - MMU_PAGE_SHIFT))
+
+// the page table has two levels, a page directory with MMU_TABLE_ENTRIES
+// tables of MMU_TABLE_ENTRIES pages each
+#define MMU_TABLE_SHIFT 10
+#define MMU_TABLE_ENTRIES (1 << MMU_TABLE_SHIFT)
+
+// the kinds of mapping that can have their own host backing policy
+enum x86MMUMappingClasses {
+    MC_TEXT,        // executable file mappings
+    MC_DATA,        // every other file mapping and shared memory
+    MC_HEAP,        // private anonymous memory, including the brk heap
+    MC_STACK,
+    MC_NCLASSES
+};
+
+// the host backing policy of a class of mappings. The host may refuse any of
+// them (no THP, RLIMIT_MEMLOCK), the mapping is still made.
+enum x86MMUBackingFlags {
+    MB_HUGEPAGE = 1,    // madvise(MADV_HUGEPAGE), transparent huge pages
+    MB_POPULATE = 2,    // fault the host pages in when they're mapped
+    MB_LOCK = 4,        // mlock(2) the host pages
+    MB_DONTNEED = 8     // flat mode: unmapped anonymous memory is dropped with
+                        // MADV_DONTNEED, keeping the host mapping
+};
+
+enum x86MMUPageFlags {
+    PG_PRESENT = 1,
+    PG_READ = 2,
+    PG_WRITE = 4,
+    PG_EXEC = 8,
+    PG_CODE = 16,   // code was fetched from the page, writes bump its generation
+    PG_CLEAN = 32   // not written since the snapshot, the first write marks it dirty
+};
+
+typedef struct {
+    uint8_t *pg_host;   // host address of the guest page, NULL if not mapped
+    int pg_flags;       // PG_* flags
+
+    // the value of mm_codegen when the code in the page last changed. Anything
+    // decoded from the page is stale once this is different.
+    uint32_t pg_codegen;
+} page_entry_t;
+
+#define MMU_TLB_ENTRIES 256
+
+#define MMU_TLB_INVALID 0xffffffff
+
+enum x86MMUTLBFlags {
+    TLB_CODE = 1    // code was fetched from the page, writes must call mmu_code_written()
+};
+
+// a direct-mapped cache of guest page -> host page translations. There's one
+// table for each kind of access so a hit also means the access is allowed.
+typedef struct {
+    moffset32_t tlb_tag;    // guest page number, MMU_TLB_INVALID if empty
+    int tlb_flags;
+    uint8_t *tlb_host;      // host address of the start of the guest page
+} tlb_entry_t;
+
+// a page saved by mmu_snapshot()
+typedef struct {
+    uint32_t sp_page;       // guest page number
+    uint8_t sp_flags;       // PG_* flags, without PG_CODE and PG_CLEAN
+    uint32_t sp_data;       // index of the contents in ms_data, SNAP_NODATA if not saved
+} snapshot_page_t;
+
+#define SNAP_NODATA 0xffffffff
+
+// the mappings and contents of the whole address space. Shared mappings are
+// recorded but their contents aren't, they're not only ours to roll back.
+typedef struct {
+    snapshot_page_t *ms_pages;  // ordered by sp_page
+    size_t ms_npages;
+    uint8_t *ms_data;           // the saved pages, MMU_PAGE_SIZE bytes each
+
+    moffset32_t ms_brk;
+    moffset32_t ms_stack_start;
+
+    // mm_layoutgen when the pages were last made to match the snapshot
+    uint32_t ms_layoutgen;
+
+    size_t ms_copied;           // pages copied back by the last restore
+} x86MMUSnapshot;
+
 typedef struct {
     segment_t *mm_stack;
-    segment_t *mm_segment_tbl;
-    size_t mm_segments;
+    moffset32_t mm_stack_reserve;   // lowest address reserved for the stack
+    moffset32_t mm_stack_guard;     // the stack can grow down to here
+    segment_t *mm_segments;         // tree of the mapped segments
+    segment_t *mm_free;             // tree of the unmapped ranges
+    moffset32_t mm_brk_start;       // the heap starts after the last PT_LOAD segment
+    moffset32_t mm_brk;             // current program break
+
+    // incremented every time a page code was fetched from is written to,
+    // unmapped or made non-executable
+    uint32_t mm_codegen;
+
+    // incremented every time a page is mapped, unmapped or has its protection
+    // changed
+    uint32_t mm_layoutgen;
+
+    // the pages written since mm_snapshot was taken or restored (the ones
+    // that lost PG_CLEAN), only those have to be copied back
+    x86MMUSnapshot *mm_snapshot;
+    uint32_t *mm_dirty;
+    size_t mm_ndirty;
+
+    // incremented every time the translations cached in the TLBs of every
+    // thread have to be dropped, see x86MMULocal
+    uint32_t mm_tlbgen;
+
+    // the tables without any page mapped all point to the same empty table,
+    // so a lookup never has to check for a missing table
+    page_entry_t *mm_pagedir[MMU_TABLE_ENTRIES];
+
+    // flat mode: the whole guest address space is reserved at mm_flat_base and
+    // protected with the host mprotect, accesses need no translation at all
+    uint8_t *mm_flat_base;
 
-    struct error_description err;
+    int mm_backing[MC_NCLASSES];    // MB_* flags of every class
+
+    // set by mmu_share() once guest threads run on more than one host
+    // thread, from then on the mappings are only changed under mm_lock
+    _Bool mm_shared;
+    pthread_mutex_t mm_lock;
 } x86MMU;
 
+// what every host thread using the MMU keeps to itself: the TLBs, so a hit
+// never needs a lock, and the error of the last call
+typedef struct {
+    tlb_entry_t ml_tlb_read[MMU_TLB_ENTRIES];
+    tlb_entry_t ml_tlb_write[MMU_TLB_ENTRIES];
+    tlb_entry_t ml_tlb_fetch[MMU_TLB_ENTRIES];
+
+    // mm_tlbgen when the TLBs were last flushed, nothing in them can be used
+    // once they differ
+    uint32_t ml_tlbgen;
+
+    struct error_description ml_err;
+} x86MMULocal;
+
+extern _Thread_local x86MMULocal mmu_local;
+
+
+#define mmu_error(b_mmu) ((void)(b_mmu), mmu_local.ml_err.errnum)
+#define mmu_errstr(b_mmu) ((void)(b_mmu), mmu_local.ml_err.description)
+#define mmu_clrerror(b_mmu) ((void)(b_mmu), mmu_local.ml_err.errnum = 0)
+
+// both are changed by any thread without a lock, only the value is atomic
+#define mmu_codegen(b_mmu) __atomic_load_n(&(b_mmu)->mm_codegen, __ATOMIC_RELAXED)
+#define mmu_tlbgen(b_mmu) __atomic_load_n(&(b_mmu)->mm_tlbgen, __ATOMIC_RELAXED)
+// move to a new code generation, other threads may be doing the same
+#define mmu_codegen_next(b_mmu) __atomic_add_fetch(&(b_mmu)->mm_codegen, 1, __ATOMIC_RELAXED)
+#define mmu_page_codegen(b_mmu, addr) (mmu_page(b_mmu, addr)->pg_codegen)
 
-#define mmu_error(b_mmu) ((b_mmu)->err.errnum)
-#define mmu_errstr(b_mmu) ((b_mmu)->err.description)
-#define mmu_clrerror(b_mmu) ((b_mmu)->err.errnum = 0)
+#define mmu_isflat(b_mmu) ((b_mmu)->mm_flat_base != NULL)
+
+#define mmu_page(b_mmu, addr) (&(b_mmu)->mm_pagedir[(moffset32_t)(addr) >> (MMU_PAGE_SHIFT + MMU_TABLE_SHIFT)] \
+                                                [((moffset32_t)(addr) >> MMU_PAGE_SHIFT) & (MMU_TABLE_ENTRIES - 1)])
+#define mmu_pageflags(b_mmu, addr) (mmu_page(b_mmu, addr)->pg_flags)
 
 
 enum x86MMUErrors {
@@ -72,8 +238,30 @@ enum x86MMUErrors {
 
 // initialize the data structures needed.
 void mmu_init(x86MMU *);
+
+// the MB_* flags for a comma separated list of "hugepage", "populate", "lock"
+// and "dontneed", or "default" for none. Returns -1 if it isn't valid.
+int mmu_backing_parse(const char *);
+// the opposite, written to the buffer
+void mmu_backing_str(int, char *, size_t);
 void mmu_unloadall(x86MMU *);
 
+// drop every cached translation, call it whenever the segment table changes.
+// The other threads drop theirs on their next access.
+void mmu_tlb_flush(x86MMU *);
+
+// the MMU is about to be used by another host thread, from now on the
+// changes to the mappings are serialized
+void mmu_share(x86MMU *);
+
+// reserve 4GiB of host address space and switch to flat mode. Must be called
+// before anything is mapped.
+void mmu_flat_reserve(x86MMU *);
+// returns 1 if the host address belongs to the guest, the guest address is
+// stored in the last argument and the error is set accordingly. No error is
+// set if the fault was on the stack and it was grown, retry the access.
+_Bool mmu_flat_fault(x86MMU *, const void *, moffset32_t *);
+
 moffset32_t mmu_create_stack(x86MMU *, int);
 
 enum x86MMUStackFlags {
@@ -83,17 +271,146 @@ enum x86MMUStackFlags {
 // map the loadable segments from the file detailed by the GenericELF struct
 void mmu_mmap_loadable(x86MMU *, GenericELF *);
 
+// the memory management calls, they take the same arguments as the Linux
+// calls with the PROT_*, MAP_* and MREMAP_* flags of the host. mmu_mmap() and
+// mmu_mremap() return the guest address of the mapping, the error is set to
+// an errno value on failure.
+moffset32_t mmu_mmap(x86MMU *, moffset32_t, size_t, int, int, int, off_t);
+void mmu_munmap(x86MMU *, moffset32_t, size_t);
+moffset32_t mmu_mremap(x86MMU *, moffset32_t, size_t, size_t, int, moffset32_t);
+// like brk(2) returns the new break, or the current one if it can't be moved
+moffset32_t mmu_brk(x86MMU *, moffset32_t);
+
+// change the protection (PROT_* flags) of the pages in [addr, addr + len),
+// like mprotect(2). The error is set to EINVAL or ENOMEM on failure.
+void mmu_mprotect(x86MMU *, moffset32_t, size_t, int);
+
+// save every mapping and its contents. From now on the pages written to are
+// tracked until another snapshot is taken or restored.
+void mmu_snapshot(x86MMU *, x86MMUSnapshot *);
+// go back to the mappings and contents of the snapshot. Only the pages written
+// to are copied if the snapshot is the last one taken or restored and nothing
+// was mapped, unmapped or protected since. The error is set on failure.
+void mmu_restore(x86MMU *, x86MMUSnapshot *);
+void mmu_snapshot_free(x86MMU *, x86MMUSnapshot *);
+
+// read a byte of code, the page is marked with PG_CODE
 uint8_t mmu_fetch(x86MMU *, moffset32_t);
+// mark the page as holding code that was decoded, from now on writes to it
+// change its generation. Does nothing if the page isn't mapped.
+void mmu_mark_code(x86MMU *, moffset32_t);
+
+// returns 1 if code in [start, end) changed after the generation 'since'
+static inline _Bool mmu_code_changed(x86MMU *mmu, moffset32_t start, moffset32_t end, uint32_t since)
+{
+    for (uint64_t page = start >> MMU_PAGE_SHIFT; page <= (uint64_t)(end - 1) >> MMU_PAGE_SHIFT; page++) {
+        if ((int32_t)(mmu_page_codegen(mmu, page << MMU_PAGE_SHIFT) - since) > 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+//
+// Memory access
+//
+// The accesses inside a page the TLB already allows are done inline, in flat
+// mode it's any access inside a page. Everything else goes to the slow path,
+// which also sets the error.
+//
+
+#define tlb_page(addr) (    (addr) >> MMU_PAGE_SHIFT    )
+#define tlb_pageoffset(addr) (    (addr) & (MMU_PAGE_SIZE - 1)    )
+#define tlb_index(addr) (    tlb_page(addr) & (MMU_TLB_ENTRIES - 1)    )
+
+uint64_t mmu_read_slow(x86MMU *, moffset32_t, int);
+void mmu_write_slow(x86MMU *, uint64_t, moffset32_t, int);
+
+// the host address for an access of size bits, NULL if it needs the slow
+// path. The TLB_* flags of the page are stored in the last argument.
+static inline uint8_t *mmu_fastptr(x86MMU *mmu, tlb_entry_t *tlb, moffset32_t virtaddr, int size, int *flags)
+{
+    tlb_entry_t *entry = &tlb[tlb_index(virtaddr)];
+
+    if (tlb_pageoffset(virtaddr) > (moffset32_t)(MMU_PAGE_SIZE - size / 8))
+        return NULL;
+
+    if (mmu_isflat(mmu)) {
+        *flags = mmu_pageflags(mmu, virtaddr) & PG_CODE ? TLB_CODE : 0;
+        return mmu->mm_flat_base + virtaddr;
+    }
+
+    if (entry->tlb_tag != tlb_page(virtaddr) || mmu_local.ml_tlbgen != mmu_tlbgen(mmu))
+        return NULL;
+
+    *flags = entry->tlb_flags;
+
+    return entry->tlb_host + tlb_pageoffset(virtaddr);
+}
+
+#define MMU_READ_FAST(b_bits)                                                       \
+    static inline uint##b_bits##_t mmu_read##b_bits(x86MMU *mmu, moffset32_t virtaddr) \
+    {                                                                               \
+        uint##b_bits##_t value;                                                     \
+        int flags;                                                                  \
+        uint8_t *host = mmu_fastptr(mmu, mmu_local.ml_tlb_read, virtaddr, b_bits, &flags); \
+                                                                                    \
+        if (!host)                                                                  \
+            return mmu_read_slow(mmu, virtaddr, b_bits);                            \
+                                                                                    \
+        memcpy(&value, host, sizeof(value));                                        \
+        return value;                                                               \
+    }
+
+// the page at virtaddr has code that was just written to
+static inline void mmu_code_written(x86MMU *mmu, moffset32_t virtaddr)
+{
+    mmu_page(mmu, virtaddr)->pg_codegen = mmu_codegen_next(mmu);
+}
+
+#define MMU_WRITE_FAST(b_bits)                                                      \
+    static inline void mmu_write##b_bits(x86MMU *mmu, uint##b_bits##_t value, moffset32_t virtaddr) \
+    {                                                                               \
+        int flags;                                                                  \
+        uint8_t *host = mmu_fastptr(mmu, mmu_local.ml_tlb_write, virtaddr, b_bits, &flags); \
+                                                                                    \
+        if (!host) {                                                                \
+            mmu_write_slow(mmu, value, virtaddr, b_bits);                           \
+            return;                                                                 \
+        }                                                                           \
+                                                                                    \
+        memcpy(host, &value, sizeof(value));                                        \
+        if (flags & TLB_CODE)                                                       \
+            mmu_code_written(mmu, virtaddr);                                        \
+    }
+
+MMU_READ_FAST(8)
+MMU_READ_FAST(16)
+MMU_READ_FAST(32)
+MMU_READ_FAST(64)
+
+MMU_WRITE_FAST(8)
+MMU_WRITE_FAST(16)
+MMU_WRITE_FAST(32)
+MMU_WRITE_FAST(64)
 
-uint8_t mmu_read8(x86MMU *, moffset32_t);
-uint16_t mmu_read16(x86MMU *, moffset32_t);
-uint32_t mmu_read32(x86MMU *, moffset32_t);
-uint64_t mmu_read64(x86MMU *, moffset32_t);
+// copy between the guest and the host a page at a time. They return how many
+// bytes were done, the error is set if it was short of len.
+size_t mmu_read(x86MMU *, moffset32_t, void *, size_t);
+size_t mmu_write(x86MMU *, moffset32_t, const void *, size_t);
+size_t mmu_fill(x86MMU *, moffset32_t, uint8_t, size_t);
+// same as mmu_read() but stops after the stop byte is copied
+size_t mmu_read_until(x86MMU *, moffset32_t, void *, size_t, uint8_t);
+// the length of the string at the address, at most the size given
+size_t mmu_strnlen(x86MMU *, moffset32_t, size_t);
 
-void mmu_write8(x86MMU *, uint8_t, moffset32_t);
-void mmu_write16(x86MMU *, uint16_t, moffset32_t);
-void mmu_write32(x86MMU *, uint32_t, moffset32_t);
-void mmu_write64(x86MMU *, uint64_t, moffset32_t);
+// the host address of the whole range when it is contiguous in the host, so it
+// can be handed to a host call. Each page is checked for the access like
+// mmu_read()/mmu_write() would, the error is only set if one fails, otherwise
+// NULL just means the range has to be copied.
+uint8_t *mmu_hostrange(x86MMU *, moffset32_t, size_t, int);
+// the host wrote to a range got from mmu_hostrange()
+void mmu_host_written(x86MMU *, moffset32_t, size_t);
 
 // returns a read-only ptr
 const uint8_t *mmu_getptr(x86MMU *, moffset32_t);
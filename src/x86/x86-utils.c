@@ -107,7 +107,7 @@ uint8_t displacement16(uint8_t modrm)
     return sz;
 }
 
-uint8_t displacement32(uint8_t modrm)
+uint8_t displacement32(uint8_t modrm, uint8_t sib)
 {
     uint8_t mod = mod(modrm);
     uint8_t rm = rm(modrm);
@@ -117,6 +117,8 @@ uint8_t displacement32(uint8_t modrm)
         sz = 8;
     else if (mod == 2 || (mod == 0 && rm == 0b101))
         sz = 32;
+    else if (mod == 0 && rm == 0b100 && sibbase(sib) == 0b101)    // SIB without a base
+        sz = 32;
 
     return sz;
 }
@@ -227,7 +229,7 @@ inline const char *stringfyregister(uint8_t regstr, uint8_t size)
 }
 
 // translate a Mod/RM byte + optional immediate into an effective address
-moffset32_t x86_effectiveaddress16(void *cpu, uint8_t modrm, uint32_t imm)
+moffset32_t x86_effectiveaddress16(void *cpu, uint8_t modrm, uint32_t imm, uint8_t segovr)
 {
     uint8_t mod = mod(modrm);
     uint8_t rm = rm(modrm);
@@ -260,11 +262,14 @@ moffset32_t x86_effectiveaddress16(void *cpu, uint8_t modrm, uint32_t imm)
         }
     } // mod == 3 are registers, so we return zero
 
-    return vaddr;
+    if (mod == 3)
+        return 0;
+
+    return vaddr + x86_segbase(cpu, segovr);
 }
 
 // translate a Mod/RM byte + optional immediate/SIB into an effective address
-moffset32_t x86_effectiveaddress32(void *cpu, uint8_t modrm, uint8_t sib, uint32_t imm)
+moffset32_t x86_effectiveaddress32(void *cpu, uint8_t modrm, uint8_t sib, uint32_t imm, uint8_t segovr)
 {
     uint8_t mod = mod(modrm);
     uint8_t rm = rm(modrm);
@@ -277,6 +282,10 @@ moffset32_t x86_effectiveaddress32(void *cpu, uint8_t modrm, uint8_t sib, uint32
     if (!cpu)
         return 0;
 
+    // the decoder zero-extends disp8, sign-extend it here
+    if (mod == 1)
+        imm = (int8_t)lsb(imm);
+
     if (mod == 0) {
         switch (rm) {
             case 0b000: vaddr = x86_readR32(cpu, EAX); break;
@@ -284,7 +293,8 @@ moffset32_t x86_effectiveaddress32(void *cpu, uint8_t modrm, uint8_t sib, uint32
             case 0b010: vaddr = x86_readR32(cpu, EDX); break;
             case 0b011: vaddr = x86_readR32(cpu, EBX); break;
             case 0b100: use_sib = 1; break;
-            case 0b101: vaddr = x86_readR32(cpu, EIP) + imm; break;
+            // only x86-64 makes this relative to the instruction
+            case 0b101: vaddr = imm; break;
             case 0b110: vaddr = x86_readR32(cpu, ESI); break;
             case 0b111: vaddr = x86_readR32(cpu, EDI); break;
         }
@@ -308,25 +318,20 @@ moffset32_t x86_effectiveaddress32(void *cpu, uint8_t modrm, uint8_t sib, uint32
             ss_factor = 2;
         else if (ss_factor == 0b10)
             ss_factor = 4;
-        else if (ss_factor == 0b10)
-            ss_factor = 4;
+        else
+            ss_factor = 8;
 
         if (base == EBP) {
             if (index != 0b100)
-                vaddr = x86_readM32(cpu, x86_readR32(cpu, index) * ss_factor);
+                vaddr = x86_readR32(cpu, index) * ss_factor;
 
-            if (mod == 1)
-                vaddr += lsb(imm);
-            else
-                vaddr += imm;
+            vaddr += imm;
 
             if (mod)
                 vaddr += x86_readR32(cpu, EBP);
         } else {
             vaddr = x86_readR32(cpu, base);
-            if (mod == 1)
-                vaddr += lsb(imm);
-            else if (mod == 2)
+            if (mod)
                 vaddr += imm;
 
             if (index != 0b100)
@@ -336,5 +341,28 @@ moffset32_t x86_effectiveaddress32(void *cpu, uint8_t modrm, uint8_t sib, uint32
 
     }
 
-    return vaddr;
+    // the base would make a register look like memory
+    if (mod == 3)
+        return 0;
+
+    return vaddr + x86_segbase(cpu, segovr);
+}
+
+// the selectors of FS and GS point to a TLS entry set with set_thread_area(2)
+moffset32_t x86_segbase(void *cpu, uint8_t segovr)
+{
+    uint16_t selector;
+    uint16_t entry;
+
+    if (segovr != SEG_FS && segovr != SEG_GS)
+        return 0;
+
+    selector = x86_rdsreg(cpu, segovr == SEG_FS ? FS : GS);
+    entry = selector >> 3;
+
+    // the LDT (bit 2) is never used, neither are the other entries of the GDT
+    if ((selector & 4) || entry < X86_TLS_FIRST || entry >= X86_TLS_FIRST + X86_TLS_ENTRIES)
+        return 0;
+
+    return ((x86CPU *)cpu)->tls[entry - X86_TLS_FIRST].te_base;
 }
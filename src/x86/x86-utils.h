@@ -112,14 +112,16 @@ const char *stringfyregister(uint8_t, uint8_t);
 _Bool parity_even(uint32_t);
 
 // the size of the displacement added to the base register according to the encoding
-// of the Mod/RM byte
+// of the Mod/RM and SIB bytes
 uint8_t displacement16(uint8_t);
-uint8_t displacement32(uint8_t);
+uint8_t displacement32(uint8_t, uint8_t);
 
-// calculates the effective address
+// calculates the effective address, plus the base of the segment (a SEG_*)
 // example:
-//      x86_effectiveaddressX(cpu, modrm, sib, imm1)
-moffset32_t x86_effectiveaddress16(void *, uint8_t, uint32_t);
-moffset32_t x86_effectiveaddress32(void *, uint8_t, uint8_t, uint32_t);
+//      x86_effectiveaddressX(cpu, modrm, sib, imm1, segovr)
+moffset32_t x86_effectiveaddress16(void *, uint8_t, uint32_t, uint8_t);
+moffset32_t x86_effectiveaddress32(void *, uint8_t, uint8_t, uint32_t, uint8_t);
+// the base of the segment (a SEG_*), only FS and GS have one
+moffset32_t x86_segbase(void *, uint8_t);
 
 #endif /* X86_UTILS_H */